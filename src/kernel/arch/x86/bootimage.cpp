@@ -19,46 +19,60 @@ void bootimage_t::namespace_t::set(address_t b, void* loc)
 {
     ASSERT(loc);
     base = b;
-    n_entries = *static_cast<uint32_t*>(loc);
-    entries = reinterpret_cast<namespace_entry_t*>(static_cast<char*>(loc)+sizeof(uint32_t));
+    uint32_t* header = static_cast<uint32_t*>(loc);
+    n_entries = header[0];
+    n_buckets = header[1];
+    entries = reinterpret_cast<namespace_entry_t*>(static_cast<char*>(loc) + SIZEOF_ONDISK_NAMESPACE_HEADER);
+    buckets = reinterpret_cast<uint32_t*>(entries + n_entries);
+}
+
+/**
+ * Probe the key hash table, buildboot keeps it at most half full.
+ */
+namespace_entry_t* bootimage_t::namespace_t::find(cstring_t key)
+{
+    if (n_buckets == 0)
+        return 0;
+
+    for (uint32_t bucket = name_hash(key.c_str()) & (n_buckets - 1); buckets[bucket]; bucket = (bucket + 1) & (n_buckets - 1))
+    {
+        namespace_entry_t* entry = &entries[buckets[bucket] - 1];
+        if (key == (entry->name+base))
+            return entry;
+    }
+    return 0;
 }
 
 // find an entry in the namespace with key key and return it's int value
 bool bootimage_t::namespace_t::get_int(cstring_t key, int& value)
 {
-    for (size_t i = 0; i < n_entries; ++i)
+    namespace_entry_t* entry = find(key);
+    if (entry && entry->tag == namespace_entry_t::integer)
     {
-        if (key == (entries[i].name+base) && entries[i].tag == namespace_entry_t::integer)
-        {
-            value = entries[i].value_int;
-            return true;
-        }
+        value = entry->value_int;
+        return true;
     }
     return false;
 }
 
 bool bootimage_t::namespace_t::get_string(cstring_t key, cstring_t& value)
 {
-    for (size_t i = 0; i < n_entries; ++i)
+    namespace_entry_t* entry = find(key);
+    if (entry && entry->tag == namespace_entry_t::string)
     {
-        if (key == (entries[i].name+base) && entries[i].tag == namespace_entry_t::string)
-        {
-            value = static_cast<const char*>(entries[i].value) + base;
-            return true;
-        }
+        value = static_cast<const char*>(entry->value) + base;
+        return true;
     }
     return false;
 }
 
 bool bootimage_t::namespace_t::get_symbol(cstring_t key, void*& value)
 {
-    for (size_t i = 0; i < n_entries; ++i)
+    namespace_entry_t* entry = find(key);
+    if (entry && entry->tag == namespace_entry_t::symbol)
     {
-        if (key == (entries[i].name+base) && entries[i].tag == namespace_entry_t::symbol)
-        {
-            value = entries[i].value;
-            return true;
-        }
+        value = entry->value;
+        return true;
     }
     return false;
 }
@@ -93,7 +107,7 @@ bootimage_t::bootimage_t(const char* name, address_t start, address_t _end)
 bool bootimage_t::valid()
 {
     header_t* header = reinterpret_cast<header_t*>(location);
-    return header->magic == four_cc<'B','I','M','G'>::value and header->version == 1;
+    return header->magic == four_cc<'B','I','M','G'>::value and header->version == FORMAT_VERSION;
 }
 
 #if BOOTIMAGE_DEBUG
@@ -166,9 +180,43 @@ bootimage_t::modinfo_t bootimage_t::find_root_domain(namespace_t* namesp)
     return modinfo_t(location + info.rootdom->address, info.rootdom->size);
 }
 
+/**
+ * Binary search the module index for records whose name hashes like @a name.
+ */
+static info_t find_indexed_entry(address_t location, address_t end, kind_e kind, const char* name)
+{
+    info_t info;
+    info.generic = reinterpret_cast<char*>(location + sizeof(header_t));
+    if (info.generic >= (char*)end || info.rec->tag != kind_index)
+        return find_entry(location, end, kind, name);
+
+    uint32_t count = *reinterpret_cast<uint32_t*>(info.generic + sizeof(rec_t));
+    index_entry_t* index = reinterpret_cast<index_entry_t*>(info.generic + SIZEOF_ONDISK_INDEX_HEADER);
+    uint32_t hash = name_hash(name);
+
+    // Find first entry with matching hash, then check names of all colliding entries.
+    size_t lo = 0, hi = count;
+    while (lo < hi)
+    {
+        size_t mid = lo + (hi - lo) / 2;
+        if (index[mid].hash < hash)
+            lo = mid + 1;
+        else
+            hi = mid;
+    }
+    for (; lo < count && index[lo].hash == hash; ++lo)
+    {
+        info.generic = reinterpret_cast<char*>(location + index[lo].offset);
+        if (info.rec->tag == kind && memutils::is_string_equal(info.module->name + location, name))
+            return info;
+    }
+    info.generic = 0;
+    return info;
+}
+
 bootimage_t::modinfo_t bootimage_t::find_module(const char* name)
 {
-    info_t info = find_entry(location, end, kind_module, name);
+    info_t info = find_indexed_entry(location, end, kind_module, name);
     if (!info.generic)
         return modinfo_t(0,0);
     return modinfo_t(location + info.module->address, info.module->size);
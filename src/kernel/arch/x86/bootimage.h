@@ -41,7 +41,12 @@ public:
     {
         address_t base;
         uint32_t n_entries;
+        uint32_t n_buckets;
         bootimage_n::namespace_entry_t* entries;
+        uint32_t* buckets;
+
+        bootimage_n::namespace_entry_t* find(cstring_t key);
+
     public:
         namespace_t() {}
         namespace_t(address_t b, void* ptr) { set(b, ptr); }
@@ -17,14 +17,34 @@
 namespace bootimage_n
 {
 
+/**
+ * Version 2 adds the module index record and hashed namespaces, see below.
+ */
+const uint32_t FORMAT_VERSION = 2;
+
 enum kind_e
 {
     kind_root_domain,
     kind_glue_code,
     kind_module,
-    kind_namespace
+    kind_namespace,
+    kind_index
 };
 
+/**
+ * FNV-1a hash of module names and namespace keys, computed by buildboot and by the kernel alike.
+ */
+inline uint32_t name_hash(const char* s)
+{
+    uint32_t h = 2166136261u;
+    while (*s)
+    {
+        h ^= uint8_t(*s++);
+        h *= 16777619u;
+    }
+    return h;
+}
+
 struct header_t
 {
     uint32_t magic;        //!< contains header magic value 'BIMG'
@@ -32,7 +52,7 @@ struct header_t
 
     header_t()
         : magic(four_cc<'B','I','M','G'>::value)
-        , version(1)
+        , version(FORMAT_VERSION)
     {}
 };
 
@@ -42,6 +62,19 @@ struct rec_t
     uint32_t length; // length of the whole entry
 };
 
+/**
+ * Module index: rec_t, uint32_t count, then count index_entry_t sorted by hash.
+ * Always the first record in the image when present, lets find_module() binary search instead of walking all records.
+ */
+struct index_entry_t
+{
+    uint32_t hash;   // name_hash() of the module name
+    uint32_t offset; // record offset from start of bootimage
+};
+
+#define SIZEOF_ONDISK_INDEX_HEADER 12
+#define SIZEOF_ONDISK_INDEX_ENTRY 8
+
 struct glue_code_t : public rec_t
 {
     address_t text, data, bss;
@@ -84,6 +117,16 @@ struct namespace_entry_t
 
 #define SIZEOF_ONDISK_NAMESPACE_ENTRY 12
 
+/**
+ * Module namespace layout:
+ *   uint32_t n_entries
+ *   uint32_t n_buckets                  power of two, 0 if n_entries is 0
+ *   namespace_entry_t entries[n_entries] sorted by key
+ *   uint32_t buckets[n_buckets]         open addressing by name_hash(), entry index + 1, 0 is empty
+ *   deduplicated string table
+ */
+#define SIZEOF_ONDISK_NAMESPACE_HEADER 8
+
 union info_t
 {
     rec_t*         rec;
@@ -10,6 +10,8 @@
 #include "logger.h"
 #include "default_console.h"
 #include "registers.h"
+#include "bootinfo.h"
+#include "module_loader.h"
 
 namespace logger {
 
@@ -113,16 +115,20 @@ void debugger_t::print_backtrace(address_t base_pointer, address_t eip, int n)
     else
         kconsole << n;
     kconsole << " stack frames:" << endl;
+    // Modules are symbolised through their sorted address indices, see module_loader_t::find_symbol().
+    bootinfo_t* bi = new(bootinfo_t::ADDRESS) bootinfo_t;
     int i = 0;
     while (base_pointer && eip && ((n && i<n) || !n))
     {
         // Start printing from EIP if we've been passed a valid one.
         if (eip > 1)
         {
-//         unsigned int offset;
-//         char *symbol = kernel_elf_parser.find_symbol(eip, &offset);
-//         offset = eip - offset;
-            kconsole << "| " << (unsigned)eip << endl; //" <" << (symbol ? symbol : "UNRESOLVED") << "+0x" << offset << ">" << endl;
+            address_t symbol_start = 0;
+            const char* symbol = bi->is_valid() ? bi->modules().find_symbol(eip, &symbol_start).c_str() : NULL;
+            kconsole << "| " << (unsigned)eip;
+            if (symbol)
+                kconsole << " <" << symbol << "+" << (unsigned)(eip - symbol_start) << ">";
+            kconsole << endl;
         }
         base_pointer = backtrace(base_pointer, eip);
         i++;
@@ -36,6 +36,7 @@ static const size_t    PAGE_SIZE = 0x1000;
 static const address_t PAGE_MASK = 0xFFFFF000;
 static const size_t    PAGE_WIDTH = 12; // replace this with page_t::width
 static const size_t    FRAME_WIDTH = 12;
+static const size_t    LARGE_PAGE_WIDTH = 22; // 4MB pages with PSE
 
 // Page attributes
 #define IA32_PAGE_PRESENT        (1<<0)
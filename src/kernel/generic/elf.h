@@ -279,6 +279,20 @@ struct program_header_t
 #define PF_MASKPROC 0xf0000000
 
 
+/**
+ * Note entry header, followed by name and descriptor each padded to 4 bytes.
+ */
+struct note_t
+{
+    word_t  namesz;         /**< Size of name including terminating NUL */
+    word_t  descsz;         /**< Size of descriptor */
+    word_t  type;           /**< Note type, meaning depends on name */
+};
+
+/* note.type for name "GNU" */
+#define NT_GNU_BUILD_ID 3
+
+
 /**
  * Dynamic linking info
  */
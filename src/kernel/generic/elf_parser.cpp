@@ -201,6 +201,33 @@ section_header_t* elf_parser_t::section_header(cstring_t name) const
     return 0;
 }
 
+const uint8_t* elf_parser_t::build_id(size_t* size) const
+{
+    for (int i = 0; i < header->shnum; i++)
+    {
+        section_header_t* s = section_header(i);
+        if (s->type != SHT_NOTE)
+            continue;
+
+        address_t note = reinterpret_cast<address_t>(header) + s->offset;
+        address_t end = note + s->size;
+        while (note + sizeof(note_t) <= end)
+        {
+            note_t* n = reinterpret_cast<note_t*>(note);
+            const char* name = reinterpret_cast<const char*>(note + sizeof(note_t));
+            address_t desc = note + sizeof(note_t) + ((n->namesz + 3) & ~3);
+            if (n->type == NT_GNU_BUILD_ID && n->namesz == 4 && memutils::is_memory_equal(name, "GNU", 4) && desc + n->descsz <= end)
+            {
+                if (size)
+                    *size = n->descsz;
+                return reinterpret_cast<const uint8_t*>(desc);
+            }
+            note = desc + ((n->descsz + 3) & ~3);
+        }
+    }
+    return 0;
+}
+
 const char* elf_parser_t::strtab_pointer(section_header_t* _strtab, elf32::word_t name_offset) const
 {
     if (!_strtab)
@@ -351,13 +378,17 @@ cstring_t elf_parser_t::find_symbol(address_t addr, address_t* symbol_start)
 }
 
 // Find symbol str in symbol table and return its absolute address.
+// Uses the image's SHT_HASH section if there is one covering the symbol table.
 address_t elf_parser_t::find_symbol(cstring_t str)
 {
-    return symbol_table_finder_t(start(), symtab, strtab).find_symbol(str);
+    const uint32_t* hash = 0;
+    section_header_t* hash_section = section_header_by_type(SHT_HASH);
+    if (hash_section && (section_header(hash_section->link) == section_symbol_table()))
+        hash = reinterpret_cast<const uint32_t*>(start() + hash_section->offset);
+
+    return symbol_table_finder_t(start(), section_symbol_table(), section_string_table(), hash).find_symbol(str);
 }
 
 //TODO:
 // symbol_table_t
 // iterator for searching the symbols by name
-// non-linear lookups
-// support elf .so hash tables?
@@ -83,6 +83,9 @@ public:
     inline const char* string_table() const { return strtab_pointer(section_string_table(), 0); }
     elf32::section_header_t* section_symbol_table() const;
 
+    /** Returns the GNU build id note contents and its size, or NULL if the file has none. */
+    const uint8_t* build_id(size_t* size) const;
+
     /** Returns the entry point of the executable. */
     inline address_t get_entry_point() { return (address_t)header->entry; }
 
@@ -0,0 +1,127 @@
+//
+// Part of Metta OS. Check https://atta-metta.net for latest version.
+//
+// Copyright 2010 - 2017, Stanislav Karchebnyy <berkus@atta-metta.net>
+//
+// Distributed under the Boost Software License, Version 1.0.
+// (See file LICENSE_1_0.txt or a copy at http://www.boost.org/LICENSE_1_0.txt)
+//
+#pragma once
+
+#include "types.h"
+#include "fourcc.h"
+
+/**
+ * Line cache is a precomputed address to source location table, written by parsedwarf
+ * from DWARF debug information and used as-is from a memory mapping or a boot module.
+ *
+ * Layout: header_t, then entry_count entry_t sorted by low address, then a block of
+ * NUL-terminated strings. All references are offsets from the start of the cache, so
+ * it needs no relocation and no allocations to be used - this makes it suitable for
+ * the kernel panic path as well as for host tools.
+ */
+namespace line_cache
+{
+
+static const uint32_t MAGIC = four_cc<'L','N','C','H'>::value;
+static const uint32_t VERSION = 1;
+static const uint32_t MAX_KEY_SIZE = 20; // Fits GNU build-id SHA1, shorter keys are zero-padded.
+
+struct header_t
+{
+    uint32_t magic;
+    uint32_t version;
+    uint32_t key_size;               /**< Bytes used in key. */
+    uint8_t  key[MAX_KEY_SIZE];      /**< ELF build id, or a content hash if the ELF has none. */
+    uint32_t entry_count;
+    uint32_t entries_offset;
+    uint32_t strings_size;
+    uint32_t strings_offset;
+};
+
+/** Addresses [low, high) come from source line @c line of file @c file inside function @c function. */
+struct entry_t
+{
+    uint32_t low;
+    uint32_t high;
+    uint32_t file;     /**< String offset. */
+    uint32_t function; /**< String offset, 0 (empty string) if unknown. */
+    uint32_t line;
+};
+
+} // namespace line_cache
+
+/**
+ * Read-only view of a line cache image in memory.
+ */
+class line_cache_t
+{
+    const char* base;
+    size_t size;
+
+    inline const line_cache::header_t* header() const { return reinterpret_cast<const line_cache::header_t*>(base); }
+    inline const line_cache::entry_t* entries() const
+    {
+        return reinterpret_cast<const line_cache::entry_t*>(base + header()->entries_offset);
+    }
+
+public:
+    line_cache_t(const void* data, size_t size_) : base(reinterpret_cast<const char*>(data)), size(size_) {}
+
+    /** Returns true if the image has a known version and all tables lie inside it. */
+    bool is_valid() const
+    {
+        if (!base || size < sizeof(line_cache::header_t))
+            return false;
+        const line_cache::header_t* h = header();
+        return h->magic == line_cache::MAGIC
+            and h->version == line_cache::VERSION
+            and h->key_size <= line_cache::MAX_KEY_SIZE
+            and h->entries_offset <= size
+            and h->entry_count <= (size - h->entries_offset) / sizeof(line_cache::entry_t)
+            and h->strings_size > 0
+            and h->strings_offset <= size
+            and h->strings_size <= size - h->strings_offset
+            and base[h->strings_offset + h->strings_size - 1] == 0;
+    }
+
+    /** Returns true if the cache was produced for an ELF file with the given key. */
+    bool matches(const uint8_t* key, size_t key_size) const
+    {
+        const line_cache::header_t* h = header();
+        if (h->key_size != key_size)
+            return false;
+        for (size_t i = 0; i < key_size; ++i)
+            if (h->key[i] != key[i])
+                return false;
+        return true;
+    }
+
+    inline size_t entry_count() const { return header()->entry_count; }
+
+    /** Returns the entry covering @a addr, or NULL. */
+    const line_cache::entry_t* find(address_t addr) const
+    {
+        const line_cache::entry_t* e = entries();
+        size_t lo = 0, hi = header()->entry_count;
+        // Find first entry with low > addr.
+        while (lo < hi)
+        {
+            size_t mid = lo + (hi - lo) / 2;
+            if (addr < e[mid].low)
+                hi = mid;
+            else
+                lo = mid + 1;
+        }
+        if (lo == 0 || addr >= e[lo - 1].high)
+            return 0;
+        return &e[lo - 1];
+    }
+
+    const char* string(uint32_t offset) const
+    {
+        if (offset >= header()->strings_size)
+            return "";
+        return base + header()->strings_offset + offset;
+    }
+};
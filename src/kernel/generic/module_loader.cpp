@@ -109,7 +109,7 @@ void print_module_map()
             break;
         }
 
-        kconsole << "*** " << module->name << " @ " << module->entry.load_base << ".." << module->entry.load_base + module->entry.loaded_size << ", size " << int(module->entry.loaded_size) << " bytes. Entry " << module->entry.entry_point << ", symtab " << module->entry.symtab_start << ", strtab " << module->entry.strtab_start << endl;
+        kconsole << "*** " << module->name << " @ " << module->entry.load_base << ".." << module->entry.load_base + module->entry.loaded_size << ", size " << int(module->entry.loaded_size) << " bytes. Entry " << module->entry.entry_point << ", symtab " << module->entry.symtab_start << ", strtab " << module->entry.strtab_start << ", symhash " << module->entry.symhash_start << endl;
         module = module->previous;
     }
     kconsole << "**********************************" << endl;
@@ -237,6 +237,27 @@ module_loader_t::symtab_for(const char* name, const char* suffix)
     return t;
 }
 
+cstring_t
+module_loader_t::find_symbol(address_t addr, address_t* symbol_start)
+{
+    module_descriptor_t* module = reinterpret_cast<module_descriptor_t*>(*d_last_available_address - sizeof(module_descriptor_t));
+    while (module && (module->magic == four_cc<'M','D','U','L'>::value))
+    {
+        module_entry& entry = module->entry;
+        if ((addr >= entry.load_base) && (addr < entry.load_base + entry.loaded_size)
+            && entry.symtab_start && entry.strtab_start)
+        {
+            symbol_table_finder_t finder(entry);
+            return finder.find_symbol(addr, symbol_start);
+        }
+        module = module->previous;
+    }
+
+    if (symbol_start)
+        *symbol_start = 0;
+    return NULL;
+}
+
 module_symbols_t::symmap
 module_symbols_t::starting_with(const char* prefix)
 {
@@ -288,9 +309,7 @@ void* module_loader_t::load_module(const char* name, elf_parser_t& module, const
             PANIC("UNSUPPORTED");
         }
 
-        symbol_table_finder_t finder(out_mod->entry.load_base,
-            reinterpret_cast<elf32::section_header_t*>(out_mod->entry.symtab_start),
-            reinterpret_cast<elf32::section_header_t*>(out_mod->entry.strtab_start));
+        symbol_table_finder_t finder(out_mod->entry);
 
         address_t symbol = finder.find_symbol(closure_name);
         address_t entry = reinterpret_cast<address_t>(*(void**)(symbol));
@@ -470,6 +489,20 @@ void* module_loader_t::load_module(const char* name, elf_parser_t& module, const
 
             *d_last_available_address += string_table->size;
         }
+        if (this_loaded_module.entry.symtab_start && this_loaded_module.entry.strtab_start)
+        {
+            // Index symbol names once, so that closure lookups do not scan the whole symbol table.
+            symbol_table_finder_t finder(this_loaded_module.entry);
+            *d_last_available_address = align_up(*d_last_available_address, sizeof(uint32_t));
+            this_loaded_module.entry.symhash_start = *d_last_available_address;
+            finder.build_hash_table(reinterpret_cast<uint32_t*>(*d_last_available_address));
+            logger::debug() << "### symbol hash table built at " << *d_last_available_address;
+            *d_last_available_address += finder.hash_table_size();
+
+            this_loaded_module.entry.symaddr_start = *d_last_available_address;
+            finder.reserve_address_index(reinterpret_cast<uint32_t*>(*d_last_available_address));
+            *d_last_available_address += finder.address_index_size();
+        }
     }
     else
         PANIC("Do not know how to load ELF file!");
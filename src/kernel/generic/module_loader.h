@@ -50,6 +50,8 @@ public:
         address_t entry_point;  // main() entry point address.
         address_t symtab_start; // address of symbol table for lookups
         address_t strtab_start; // address of string table for name lookups
+        address_t symhash_start; // address of symbol name hash table built at load time, or 0
+        address_t symaddr_start; // address of symbol address index sorted on first use, or 0
     } PACKED;
 
     /** Iterator for going over available modules. */
@@ -81,6 +83,13 @@ public:
     void* load_module(const char* name, elf_parser_t& module, const char* closure_name);
 
     module_symbols_t symtab_for(const char* name, const char* suffix);
+
+    /**
+     * Find the symbol covering @a addr in whichever loaded module contains it, for backtraces.
+     * Also returns the start address of that symbol in symbol_start if symbol_start is non-NULL.
+     */
+    cstring_t find_symbol(address_t addr, address_t* symbol_start = NULL);
+
     strvec loaded_module_names();
 
     // These two methods allow iterating instantiated modules in a standard fashion.
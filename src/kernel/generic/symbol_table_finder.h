@@ -9,6 +9,7 @@
 #pragma once
 
 #include <unordered_map>
+#include "algorithm"
 #include "elf.h"
 #include "panic.h"
 #include "default_console.h"
@@ -16,18 +17,41 @@
 
 /**
  * Given only two ELF sections - a symbol table and a string table (plus a base for section offsets) find symbol by either name or value.
+ * Lookups by name use a hash table in ELF SHT_HASH layout if one is given, otherwise scan the whole symbol table.
+ * Lookups by address use a sorted address index if one is given, otherwise scan the whole symbol table.
  */
 class symbol_table_finder_t
 {
     address_t base;
     elf32::section_header_t* symbol_table;
     elf32::section_header_t* string_table;
+    const uint32_t* hash_table; // nbucket, nchain, bucket[nbucket], chain[nchain]
+    uint32_t* address_index;    // count, symbol indices sorted by value; count is UNSORTED until first use
+
+    static const uint32_t UNSORTED = ~0U;
+
+    inline elf32::symbol_t* symbol(size_t i) const
+    {
+        return reinterpret_cast<elf32::symbol_t*>(base + symbol_table->offset + i * symbol_table->entsize);
+    }
+
+    inline const char* symbol_name(elf32::symbol_t* symbol) const
+    {
+        return reinterpret_cast<const char*>(base + string_table->offset + symbol->name);
+    }
+
+    inline size_t hash_buckets() const
+    {
+        return (symbol_table->size / symbol_table->entsize) | 1;
+    }
 
 public:
-    symbol_table_finder_t(address_t base_, elf32::section_header_t* symtab_, elf32::section_header_t* strtab_)
+    symbol_table_finder_t(address_t base_, elf32::section_header_t* symtab_, elf32::section_header_t* strtab_, const uint32_t* hashtab_ = 0)
         : base(base_)
         , symbol_table(symtab_)
         , string_table(strtab_)
+        , hash_table(hashtab_)
+        , address_index(0)
     {
         ASSERT(symbol_table);
         ASSERT(string_table);
@@ -38,6 +62,8 @@ public:
         : base(mod.load_base)
         , symbol_table(reinterpret_cast<elf32::section_header_t*>(mod.symtab_start))
         , string_table(reinterpret_cast<elf32::section_header_t*>(mod.strtab_start))
+        , hash_table(reinterpret_cast<const uint32_t*>(mod.symhash_start))
+        , address_index(reinterpret_cast<uint32_t*>(mod.symaddr_start))
     {
         ASSERT(symbol_table);
         ASSERT(string_table);
@@ -47,6 +73,9 @@ public:
     // TODO: use debugging info if present
     cstring_t find_symbol(address_t addr, address_t* symbol_start)
     {
+        if (address_index)
+            return find_symbol_indexed(addr, symbol_start);
+
         address_t max = 0;
         elf32::symbol_t* fallback_symbol = 0;
         size_t n_entries = symbol_table->size / symbol_table->entsize;
@@ -91,34 +120,163 @@ public:
     address_t find_symbol(cstring_t str)
     {
         size_t n_entries = symbol_table->size / symbol_table->entsize;
+
+        if (hash_table)
+        {
+            uint32_t nbucket = hash_table[0];
+            const uint32_t* bucket = hash_table + 2;
+            const uint32_t* chain = bucket + nbucket;
+
+            for (uint32_t i = bucket[elf32::elf_hash(str.c_str()) % nbucket]; i != STN_UNDEF; i = chain[i])
+            {
+                if (str == symbol_name(symbol(i)))
+                    return symbol_value(symbol(i));
+            }
+            return 0;
+        }
+
         logger::trace() << int(n_entries) << " symbols to consider.";
         logger::trace() << "Symbol table @ " << base + symbol_table->offset;
         logger::trace() << "String table @ " << base + string_table->offset;
 
         for (size_t i = 0; i < n_entries; i++)
         {
-            elf32::symbol_t* symbol = reinterpret_cast<elf32::symbol_t*>(base + symbol_table->offset + i * symbol_table->entsize);
-            const char* c = reinterpret_cast<const char*>(base + string_table->offset + symbol->name);
+            if (str == symbol_name(symbol(i)))
+                return symbol_value(symbol(i));
+        }
+
+        return 0;
+    }
+
+    /**
+     * Size in bytes of the hash table build_hash_table() makes for this symbol table.
+     */
+    size_t hash_table_size() const
+    {
+        return (2 + hash_buckets() + symbol_table->size / symbol_table->entsize) * sizeof(uint32_t);
+    }
+
+    /**
+     * Build a name lookup hash table for this symbol table at @a table, in the layout of an ELF SHT_HASH section,
+     * and use it for following lookups. Chains are built so that the first of several equally named symbols wins,
+     * same as with the linear scan.
+     */
+    void build_hash_table(uint32_t* table)
+    {
+        uint32_t n_entries = symbol_table->size / symbol_table->entsize;
+        uint32_t nbucket = hash_buckets();
+        uint32_t* bucket = table + 2;
+        uint32_t* chain = bucket + nbucket;
+
+        table[0] = nbucket;
+        table[1] = n_entries;
+        for (uint32_t i = 0; i < nbucket; ++i)
+            bucket[i] = STN_UNDEF;
+
+        for (uint32_t i = n_entries; i-- > STN_UNDEF + 1; )
+        {
+            uint32_t h = elf32::elf_hash(symbol_name(symbol(i))) % nbucket;
+            chain[i] = bucket[h];
+            bucket[h] = i;
+        }
+        if (n_entries > 0)
+            chain[STN_UNDEF] = STN_UNDEF;
+
+        hash_table = table;
+    }
 
-            logger::trace() << "Looking at symbol " << c << " @ " << symbol;
-            if (str == c)
+    /**
+     * Size in bytes of the address index for this symbol table, see reserve_address_index().
+     */
+    size_t address_index_size() const
+    {
+        return (1 + symbol_table->size / symbol_table->entsize) * sizeof(uint32_t);
+    }
+
+    /**
+     * Set up @a index as an address index for this symbol table. The index is only sorted by the first
+     * lookup by address, so that symbol values may still be relocated after this call and modules
+     * which never appear in a backtrace cost nothing.
+     */
+    void reserve_address_index(uint32_t* index)
+    {
+        index[0] = UNSORTED;
+        address_index = index;
+    }
+
+private:
+    /**
+     * Sort indices of all code and data symbols by their value. Runs in place without allocating,
+     * so it is safe to do from the panic path.
+     */
+    void sort_address_index()
+    {
+        uint32_t n_entries = symbol_table->size / symbol_table->entsize;
+        uint32_t* first = address_index + 1;
+        uint32_t count = 0;
+
+        for (uint32_t i = STN_UNDEF + 1; i < n_entries; ++i)
+        {
+            if ((ELF32_ST_TYPE(symbol(i)->info) < STT_SECTION) && (symbol(i)->value != 0))
+                first[count++] = i;
+        }
+
+        std::sort(first, first + count, [this](uint32_t a, uint32_t b) {
+            return symbol(a)->value < symbol(b)->value;
+        });
+
+        address_index[0] = count;
+    }
+
+    /**
+     * Binary search for the symbol with the biggest value not above @a addr. Of several symbols at that value
+     * prefer one whose size covers @a addr.
+     */
+    cstring_t find_symbol_indexed(address_t addr, address_t* symbol_start)
+    {
+        if (address_index[0] == UNSORTED)
+            sort_address_index();
+
+        uint32_t* first = address_index + 1;
+        uint32_t* last = first + address_index[0];
+        uint32_t* pos = std::upper_bound(first, last, addr, [this](address_t a, uint32_t i) {
+            return a < symbol(i)->value;
+        });
+
+        if (pos == first)
+        {
+            if (symbol_start)
+                *symbol_start = 0;
+            return NULL;
+        }
+
+        elf32::symbol_t* found = symbol(*--pos);
+        for (uint32_t* p = pos; (p >= first) && (symbol(*p)->value == found->value); --p)
+        {
+            if (addr < symbol(*p)->value + symbol(*p)->size)
             {
-                if (ELF32_ST_TYPE(symbol->info) == STT_SECTION)
-                {
-                    PANIC("FINDING SECTION NAMES UNSUPPORTED!");
-                    return 0;
-                    // return section_header(symbol->shndx)->vaddr; //offset + start();
-                }
-                else
-                {
-                    return symbol->value;
-                }
+                found = symbol(*p);
+                break;
             }
         }
 
-        return 0;
+        if (symbol_start)
+            *symbol_start = found->value;
+        return symbol_name(found);
     }
 
+    inline address_t symbol_value(elf32::symbol_t* symbol)
+    {
+        if (ELF32_ST_TYPE(symbol->info) == STT_SECTION)
+        {
+            PANIC("FINDING SECTION NAMES UNSUPPORTED!");
+            return 0;
+            // return section_header(symbol->shndx)->vaddr; //offset + start();
+        }
+        return symbol->value;
+    }
+
+public:
     /**
      * Return all symbols in a module with a given suffix.
      */
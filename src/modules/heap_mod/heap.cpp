@@ -8,6 +8,9 @@
 //
 #include "heap.h"
 #include "memory.h"
+#include "memutils.h"
+#include "cpu.h"
+#include "atomic.h"
 #include "debugger.h"
 #include "logger.h"
 #include "default_console.h"
@@ -24,30 +27,34 @@
 #define HEAP_MAGIC        0xfa11dead
 #define MIN_HEAP_OVERHEAD (sizeof(heap_rec_t)*3)
 
-#define OTHER_INDEX (COUNT-1)
-
 #define WORD_SIZE (sizeof(uint64_t))
 static inline size_t BLOCK_ALIGN(size_t _x) { return ((_x)+WORD_SIZE) & -(WORD_SIZE); }
-#define _S(_x) (_x * WORD_SIZE)
 
-/* Size of minimum fragment: this should be sizeof(heap_rec_t) + all_sizes[0] */
-#define MIN_FRAG (sizeof(heap_rec_t) + _S(1))
+/* Size of minimum fragment: this should be sizeof(heap_rec_t) + smallest block size */
+#define MIN_FRAG (sizeof(heap_rec_t) + WORD_SIZE)
+
+/*
+ * Free lists are indexed TLSF style. Sizes below LINEAR_LIMIT map linearly onto WORD_SIZE steps,
+ * above it every power of two range is split into SL_COUNT equally spaced lists.
+ * Size to list mapping is a count-leading-zeros and a couple of shifts.
+ */
+#define LINEAR_SHIFT (SL_BITS + 3) /* 3 is log2(WORD_SIZE) */
+#define LINEAR_LIMIT (1U << LINEAR_SHIFT)
 
-#define SMALL_LIMIT _S(16)
-#define LARGE_LIMIT _S(1296)
-#define SMALL_INDEX(x) ((x-1) / WORD_SIZE)
+/* Number of blocks visited by one incremental coalescing step done on the allocation path. */
+#define DEFAULT_COALESCE_BUDGET 8
+/* In deferred mode, once less than 1/COALESCE_LOW_WATER of the heap is free every allocation visits
+   COALESCE_LOW_WATER_BUDGET more blocks, to work off fragmentation before a whole heap coalesce() is needed. */
+#define COALESCE_LOW_WATER 8
+#define COALESCE_LOW_WATER_BUDGET 64
 
-const memory_v1::size heap_t::all_sizes[heap_t::COUNT] =
+/**
+ * Index of the most significant bit set in non-zero @a x.
+ */
+static inline int msb(size_t x)
 {
-    _S(1),   _S(2),   _S(3),   _S(4),   _S(5),   _S(6),   _S(7),    _S(8),
-    _S(9),   _S(10),  _S(11),  _S(12),  _S(13),  _S(14),  _S(15),   _S(16),
-    
-    _S(19),  _S(23),  _S(28),  _S(34),  _S(41),  _S(49),  _S(59),   _S(71),
-    _S(85),  _S(102), _S(122), _S(146), _S(175), _S(210), _S(252),  _S(302),
-    _S(362), _S(434), _S(521), _S(625), _S(750), _S(900), _S(1080), _S(1296),
-    
-    ~0U
-};
+    return int(sizeof(unsigned long) * 8) - 1 - __builtin_clzl(static_cast<unsigned long>(x));
+}
 
 inline heap_t::heap_rec_t* heap_t::prev_block(heap_rec_t* rec)
 {
@@ -59,6 +66,15 @@ inline heap_t::heap_rec_t* heap_t::next_block(heap_rec_t* rec)
     return reinterpret_cast<heap_rec_t*>(reinterpret_cast<char*>(rec + 1) + rec->size);
 }
 
+/**
+ * Free lists are doubly linked: the forward link is heap_rec_t::next and the back link lives
+ * in the first word of the unused block body, which is always at least WORD_SIZE bytes.
+ */
+inline heap_t::heap_rec_t*& heap_t::free_back_link(heap_rec_t* rec)
+{
+    return *reinterpret_cast<heap_rec_t**>(rec + 1);
+}
+
 void heap_t::init(address_t start, address_t end)//, heap_v1_closure* heap_closure)
 {
     start_address = start;
@@ -69,6 +85,45 @@ void heap_t::init(address_t start, address_t end)//, heap_v1_closure* heap_closu
     for (int i = 0; i < COUNT; ++i)
         blocks[i] = NULL;
 
+    fl_bitmap = 0;
+    for (int i = 0; i < FL_COUNT; ++i)
+        sl_bitmap[i] = 0;
+
+    coalesce_mode = COALESCE_IMMEDIATE;
+    coalesce_budget = DEFAULT_COALESCE_BUDGET;
+    coalesce_cursor = NULL;
+    coalesce_stats.merges = 0;
+    coalesce_stats.steps = 0;
+    coalesce_stats.full_passes = 0;
+    coalesce_stats.cycles = 0;
+
+    used_bytes = 0;
+    high_water_mark = 0;
+    for (int i = 0; i < COUNT; ++i)
+    {
+        bin_used[i] = 0;
+        bin_allocations[i] = 0;
+    }
+
+    sample_period = 0;
+    sample_count = 0;
+    for (int i = 0; i < CALL_SITES; ++i)
+    {
+        call_sites[i].site = 0;
+        call_sites[i].samples = 0;
+        call_sites[i].bytes = 0;
+    }
+
+    for (uint32_t slot = 0; slot < MAGAZINE_VCPUS; ++slot)
+    {
+        for (int i = 0; i < SMALL_BLOCKS; ++i)
+        {
+            magazines[slot].magazine[i].head = NULL;
+            magazines[slot].magazine[i].rounds = 0;
+            magazines[slot].magazine[i].allocations = 0;
+        }
+    }
+
     // First entry is null_malloc marker.
     heap_rec_t* null_m = reinterpret_cast<heap_rec_t*>(start);
     null_m->prev = HEAP_MAGIC;
@@ -82,10 +137,8 @@ void heap_t::init(address_t start, address_t end)//, heap_v1_closure* heap_closu
     heap_rec_t* rec = null_m + 1;
     rec->prev = HEAP_MAGIC;
     rec->size = (end - start) - MIN_HEAP_OVERHEAD;
-    rec->index = OTHER_INDEX;
-    rec->next = NULL;
-    
-    blocks[OTHER_INDEX] = rec;
+    rec->index = free_index(rec->size);
+    push_free_block(rec);
     
     // Third entry is end marker.
     heap_rec_t* end_rec = next_block(rec);
@@ -103,76 +156,248 @@ void heap_t::init(address_t start, address_t end)//, heap_v1_closure* heap_closu
     //Print leak summary.
 // }
 
+/**
+ * Size class for an allocation of @a size bytes: the first list whose blocks are all large enough.
+ * @return class index, or COUNT if the size is beyond any class.
+ */
 int heap_t::find_index(size_t size)
 {
-    if (size <= SMALL_LIMIT)
+    if (size >= LINEAR_LIMIT)
+    {
+        size_t rounded = size + (size_t(1) << (msb(size) - SL_BITS)) - 1;
+        if (rounded < size)
+            return COUNT;
+        size = rounded;
+    }
+    return free_index(size);
+}
+
+/**
+ * Free list for a free block of @a size bytes: the list whose size range contains it.
+ */
+int heap_t::free_index(size_t size)
+{
+    if (size < LINEAR_LIMIT)
+        return size / WORD_SIZE;
+
+    int fl = msb(size);
+    return ((fl - LINEAR_SHIFT + 1) << SL_BITS) + ((size >> (fl - SL_BITS)) & (SL_COUNT - 1));
+}
+
+/**
+ * Smallest block size held in list @a index, which is also the allocation size of that class.
+ */
+size_t heap_t::class_size(int index)
+{
+    if (index < SL_COUNT)
+        return index * WORD_SIZE;
+
+    int fl = (index >> SL_BITS) + LINEAR_SHIFT - 1;
+    return size_t(SL_COUNT + (index & (SL_COUNT - 1))) << (fl - SL_BITS);
+}
+
+/**
+ * Find a non-empty free list at or above @a index using the bitmaps.
+ * @return first block of that list or NULL if there is none.
+ */
+heap_t::heap_rec_t* heap_t::find_free_block(int index)
+{
+    int fl = index >> SL_BITS;
+    uint32_t sl_map = sl_bitmap[fl] & (~0U << (index & (SL_COUNT - 1)));
+
+    if (!sl_map)
+    {
+        uint32_t fl_map = fl_bitmap & (~0U << (fl + 1));
+        if (!fl_map)
+            return NULL;
+
+        fl = __builtin_ctz(fl_map);
+        sl_map = sl_bitmap[fl];
+    }
+
+    return blocks[(fl << SL_BITS) + __builtin_ctz(sl_map)];
+}
+
+void heap_t::push_free_block(heap_rec_t* rec)
+{
+    heap_rec_t* head = blocks[rec->index];
+
+    rec->next = head;
+    free_back_link(rec) = NULL;
+    if (head)
+        free_back_link(head) = rec;
+    blocks[rec->index] = rec;
+
+    sl_bitmap[rec->index >> SL_BITS] |= 1U << (rec->index & (SL_COUNT - 1));
+    fl_bitmap |= 1U << (rec->index >> SL_BITS);
+}
+
+void heap_t::unlink_free_block(heap_rec_t* rec)
+{
+    heap_rec_t* before = free_back_link(rec);
+
+    if (before)
+        before->next = rec->next;
+    else
+        blocks[rec->index] = rec->next;
+
+    if (rec->next)
+        free_back_link(rec->next) = before;
+
+    if (!blocks[rec->index])
+    {
+        sl_bitmap[rec->index >> SL_BITS] &= ~(1U << (rec->index & (SL_COUNT - 1)));
+        if (!sl_bitmap[rec->index >> SL_BITS])
+            fl_bitmap &= ~(1U << (rec->index >> SL_BITS));
+    }
+}
+
+/**
+ * Check whether @a rec is the end marker.
+ */
+inline bool heap_t::is_end_block(heap_rec_t* rec)
+{
+    return reinterpret_cast<address_t>(rec + 1) >= end_address;
+}
+
+/**
+ * Check whether @a rec is a free block, i.e. sits on some free list. The end marker is never free.
+ */
+bool heap_t::is_free_block(heap_rec_t* rec)
+{
+    if (is_end_block(rec))
+        return false;
+    return next_block(rec)->prev != HEAP_MAGIC;
+}
+
+/**
+ * Grow @a rec over the block that follows it. The following block must already be off any free list.
+ * The back link of the block after that is left for the caller to set.
+ */
+void heap_t::absorb_next_block(heap_rec_t* rec)
+{
+    heap_rec_t* next = next_block(rec);
+
+    rec->size += sizeof(heap_rec_t) + next->size;
+    if (coalesce_cursor == next)
+        coalesce_cursor = rec;
+    ++coalesce_stats.merges;
+}
+
+/**
+ * Boundary tag coalescing of a block being freed with its free neighbours, O(1).
+ * @a rec must not be on a free list.
+ * @return the resulting block, not on a free list.
+ */
+heap_t::heap_rec_t* heap_t::merge_free_neighbours(heap_rec_t* rec)
+{
+    heap_rec_t* next = next_block(rec);
+    if (is_free_block(next))
     {
-        return SMALL_INDEX(size);
+        unlink_free_block(next);
+        absorb_next_block(rec);
     }
-    else if (size <= LARGE_LIMIT)
+
+    if (rec->prev != HEAP_MAGIC) // previous block is free
+    {
+        heap_rec_t* before = prev_block(rec);
+        unlink_free_block(before);
+        absorb_next_block(before);
+        rec = before;
+    }
+
+    return rec;
+}
+
+void heap_t::set_coalesce_mode(coalesce_mode_t mode, size_t budget)
+{
+    ASSERT(has_lock());
+
+    // Switching to immediate mode requires a clean heap, as free() only looks at direct neighbours.
+    if ((mode == COALESCE_IMMEDIATE) && (coalesce_mode != COALESCE_IMMEDIATE))
+        coalesce();
+
+    coalesce_mode = mode;
+    coalesce_budget = budget;
+    coalesce_cursor = NULL;
+}
+
+size_t heap_t::coalesce_step(size_t budget)
+{
+    ASSERT(has_lock());
+
+    uint64_t start = x86_cpu_t::read_tsc();
+    size_t work;
+
+    if (!coalesce_cursor)
+        coalesce_cursor = null_malloc;
+
+    for (work = 0; work < budget; ++work)
     {
-        int mi;
-        int lo = SMALL_BLOCKS;
-        int hi = OTHER_INDEX-1;
+        heap_rec_t* rec = coalesce_cursor;
+        heap_rec_t* next = next_block(rec);
 
-        for (; lo + 4 < hi;)
+        if (is_end_block(next))
         {
-            mi = (lo + hi) / 2;
-            if (size == all_sizes[mi])
-            {
-                return mi;
-            }
-            else if (size < all_sizes[mi])
-                hi = mi;
-            else
-                lo = mi;
+            coalesce_cursor = null_malloc;
+            continue;
         }
-        for(mi = lo; mi <= hi; mi++)
+
+        if (is_free_block(rec) && is_free_block(next))
         {
-            if (size <= all_sizes[mi])
-            {
-                return mi;
-            }
+            // Stay on rec, there may be more free blocks following.
+            unlink_free_block(rec);
+            unlink_free_block(next);
+            absorb_next_block(rec);
+            rec->index = free_index(rec->size);
+            push_free_block(rec);
+            next_block(rec)->prev = rec->size;
+        }
+        else
+        {
+            coalesce_cursor = next;
         }
     }
-    return OTHER_INDEX;
+
+    ++coalesce_stats.steps;
+    coalesce_stats.cycles += x86_cpu_t::read_tsc() - start;
+    return work;
 }
 
 void heap_t::coalesce()
 {
+    uint64_t start = x86_cpu_t::read_tsc();
     int32_t index;
 
-    for (index = 0; index <= OTHER_INDEX; ++index)
+    for (index = 0; index < COUNT; ++index)
         coalesce_merge_blocks(index);
 
-    for (index = 0; index <= OTHER_INDEX; ++index)
+    for (index = 0; index < COUNT; ++index)
         coalesce_move_blocks(index);
+
+    ++coalesce_stats.full_passes;
+    coalesce_stats.cycles += x86_cpu_t::read_tsc() - start;
 }
 
 void heap_t::coalesce_merge_blocks(int32_t index)
 {
     heap_rec_t* before_block;
-    heap_rec_t* after_block;
     heap_rec_t* free_block;
-    heap_rec_t** ptr;
+    heap_rec_t* next;
 
-    for (ptr = &blocks[index]; (free_block = *ptr); )
+    for (free_block = blocks[index]; free_block; free_block = next)
     {
+        next = free_block->next;
+
         if (free_block->prev != HEAP_MAGIC) // previous block is unallocated indeed!
         {
             before_block = prev_block(free_block);
             if (next_block(before_block) != free_block)
                 PANIC("Out of sanity!");
-                
-            before_block->size += free_block->size + sizeof(heap_rec_t);
-            after_block = next_block(free_block);
-            after_block->prev = before_block->size;
-            
-            *ptr = free_block->next;
-        }
-        else
-        {
-            ptr = &(free_block->next);
+
+            unlink_free_block(free_block);
+            absorb_next_block(before_block);
+            next_block(before_block)->prev = before_block->size;
         }
     }
 }
@@ -180,23 +405,18 @@ void heap_t::coalesce_merge_blocks(int32_t index)
 void heap_t::coalesce_move_blocks(int32_t index)
 {
     heap_rec_t* free_block;
-    heap_rec_t** ptr;
+    heap_rec_t* next;
 
-    for (ptr = &blocks[index]; (free_block = *ptr); )
+    for (free_block = blocks[index]; free_block; free_block = next)
     {
-        int new_index = find_index(free_block->size);
+        next = free_block->next;
+
+        int new_index = free_index(free_block->size);
         if (new_index != free_block->index)
         {
-            *ptr = free_block->next;
-            new_index = OTHER_INDEX; // FIXME: hack to make get_new_block_internal find this block even if it's in
-            // a smaller free list than "all sizes"... redo this properly
-            free_block->next = blocks[new_index];
-            blocks[new_index] = free_block;
+            unlink_free_block(free_block);
             free_block->index = new_index;
-        }
-        else
-        {
-            ptr = &(free_block->next);
+            push_free_block(free_block);
         }
     }
 }
@@ -205,57 +425,98 @@ heap_t::heap_rec_t* heap_t::get_new_block_internal(size_t size, int index)
 {
     heap_rec_t* free_block;
     heap_rec_t* allocated_block;
-    heap_rec_t** ptr;
 
-    for (ptr = &blocks[OTHER_INDEX]; (free_block = *ptr); ptr = &(free_block->next))
+    if (!(free_block = find_free_block(index)))
+        return NULL;
+
+    unlink_free_block(free_block);
+
+    if (free_block->size - size >= MIN_FRAG)
     {
-        if (free_block->size >= size)
-        {
-            if (free_block->size - size >= MIN_FRAG)
-            {
-                // Allocate from the end of free_block
-                allocated_block = reinterpret_cast<heap_rec_t*>(reinterpret_cast<char*>(free_block) + free_block->size - size);
-                allocated_block->size = size;
-                allocated_block->index = index;
-                
-                free_block->size -= size + sizeof(heap_rec_t);
-                allocated_block->prev = free_block->size;
-                
-                return allocated_block;
-            }
-            
-            // Too small to split - take all.
-            free_block->index = index;
-            *ptr = free_block->next;
-
-            return free_block;
-        }
+        // Allocate from the end of free_block, the remainder goes to the list matching its new size.
+        allocated_block = reinterpret_cast<heap_rec_t*>(reinterpret_cast<char*>(free_block) + free_block->size - size);
+        allocated_block->size = size;
+        allocated_block->index = index;
+
+        free_block->size -= size + sizeof(heap_rec_t);
+        allocated_block->prev = free_block->size;
+
+        free_block->index = free_index(free_block->size);
+        push_free_block(free_block);
+
+        return allocated_block;
     }
-    
-    return NULL;
+
+    // Too small to split - take all.
+    free_block->index = index;
+
+    return free_block;
 }
 
-heap_t::heap_rec_t* heap_t::get_new_block(size_t size, int index)
+heap_t::heap_rec_t* heap_t::get_new_block(int index)
 {
     heap_rec_t* new_free_block;
-
-    if (index != OTHER_INDEX)
-        size = all_sizes[index];
+    size_t size = class_size(index);
 
     if ((new_free_block = get_new_block_internal(size, index)))
         return new_free_block;
 
-    // coalesce some blocks to free up unfragmented space.
-    coalesce();
+    // In deferred mode free blocks may still have free neighbours, coalesce to free up unfragmented space.
+    // Immediate mode never leaves two free blocks adjacent, so there is nothing to gain from a whole heap walk.
+    if (coalesce_mode == COALESCE_DEFERRED)
+    {
+        coalesce();
 
-    if ((new_free_block = get_new_block_internal(size, index)))
-        return new_free_block;
+        if ((new_free_block = get_new_block_internal(size, index)))
+            return new_free_block;
+    }
+
+    // Idle magazines may be hoarding blocks that could be merged, give them back and retry.
+    if (drain_magazines())
+    {
+        if (coalesce_mode == COALESCE_DEFERRED)
+            coalesce();
+
+        if ((new_free_block = get_new_block_internal(size, index)))
+            return new_free_block;
+    }
 
     // TODO: grow heap if still no space (by approx size + half the current size: flesh out the right numbers)
 
     return 0;
 }
 
+heap_t::heap_rec_t* heap_t::take_block(int index)
+{
+    heap_rec_t* free_block;
+
+    if (index >= COUNT)
+        return NULL;
+
+    if (!(free_block = get_new_block(index)))
+        return NULL;
+
+    free_block->heap = this;
+    next_block(free_block)->prev = HEAP_MAGIC;
+    account_busy(free_block);
+
+    return free_block;
+}
+
+void heap_t::release_block(heap_rec_t* to_free)
+{
+    if (coalesce_mode == COALESCE_IMMEDIATE)
+    {
+        uint64_t start = x86_cpu_t::read_tsc();
+        to_free = merge_free_neighbours(to_free);
+        coalesce_stats.cycles += x86_cpu_t::read_tsc() - start;
+    }
+
+    to_free->index = free_index(to_free->size);
+    push_free_block(to_free);
+    next_block(to_free)->prev = to_free->size;
+}
+
 void *heap_t::allocate(size_t size)
 {
 #if HEAP_DEBUG
@@ -267,29 +528,26 @@ void *heap_t::allocate(size_t size)
     kconsole << "Heap check before allocate(" << size << ")" << endl;
     check_integrity();
 #endif
-    int index;
     heap_rec_t* free_block;
 
     if (size == 0)
         return null_malloc;
 
-    size = BLOCK_ALIGN(size);
-    index = find_index(size);
-    free_block = blocks[index];
-    
-    if ((!free_block) || (index == OTHER_INDEX))
-    {
-        free_block = get_new_block(size, index);
-        if (!free_block)
-            return NULL;
-    }
-    else
+    if (coalesce_mode == COALESCE_DEFERRED)
     {
-        blocks[index] = free_block->next;
+        size_t budget = coalesce_budget;
+        size_t heap_size = end_address - start_address;
+        if (heap_size - used_bytes < heap_size / COALESCE_LOW_WATER)
+            budget += COALESCE_LOW_WATER_BUDGET;
+        if (budget)
+            coalesce_step(budget);
     }
-    
-    free_block->heap = this;
-    next_block(free_block)->prev = HEAP_MAGIC;
+
+    size = BLOCK_ALIGN(size);
+    free_block = take_block(find_index(size));
+    if (!free_block)
+        return NULL;
+    ++bin_allocations[free_block->index];
 
 #if HEAP_DEBUG
     kconsole << "Heap check after allocate(" << size << ")" << endl;
@@ -308,7 +566,6 @@ void heap_t::free(void *p)
     check_integrity();
 #endif
     heap_rec_t* to_free;
-    heap_rec_t* nextblock;
 
     // Exit gracefully for null pointers.
     if ((p == NULL) || (p == null_malloc))
@@ -318,27 +575,396 @@ void heap_t::free(void *p)
     
     to_free = reinterpret_cast<heap_rec_t*>(p) - 1;
     logger::trace() << "heap_t::free(" << p << ") freeing " << to_free;
-    nextblock = next_block(to_free);
-    
-    to_free->next = blocks[to_free->index];
-    blocks[to_free->index] = to_free;
+    account_idle(to_free);
+    release_block(to_free);
 
-    nextblock->prev = to_free->size;
-    
 #if HEAP_DEBUG
     kconsole << "Heap check after free(" << p << ")" << endl;
     check_integrity();
 #endif
 }
 
+//======================================================================================================================
+// Per-VCPU magazines
+//======================================================================================================================
+
+/**
+ * Magazines of VCPU @a vcpu_id, or NULL if it has none.
+ */
+inline heap_t::magazine_set_t* heap_t::magazine_slot(uint32_t vcpu_id)
+{
+    return (vcpu_id < MAGAZINE_VCPUS) ? &magazines[vcpu_id] : NULL;
+}
+
+/**
+ * Fill an empty magazine up to half of its capacity, so that both a following allocation
+ * and a following free will hit the magazine. Heap lock must be held.
+ */
+void heap_t::refill_magazine(magazine_t& mag, int index)
+{
+    ASSERT(has_lock());
+
+    for (; mag.rounds < MAGAZINE_ROUNDS / 2; ++mag.rounds)
+    {
+        heap_rec_t* rec = take_block(index);
+        if (!rec)
+            break;
+        rec->next = mag.head;
+        mag.head = rec;
+    }
+}
+
+/**
+ * Return blocks from the magazine to the shared free lists until only @a keep remain.
+ * Heap lock must be held.
+ */
+void heap_t::flush_magazine(magazine_t& mag, int keep)
+{
+    ASSERT(has_lock());
+
+    while (mag.rounds > keep)
+    {
+        heap_rec_t* rec = mag.head;
+        mag.head = rec->next;
+        --mag.rounds;
+        account_idle(rec);
+        release_block(rec);
+    }
+}
+
+/**
+ * Flush all idle magazines back into the shared heap, so that get_new_block() can coalesce
+ * the blocks they were hoarding. Slots in use by somebody else are skipped.
+ * Heap lock must be held.
+ * @return true if any block was returned to the heap.
+ */
+bool heap_t::drain_magazines()
+{
+    bool drained = false;
+
+    for (uint32_t slot = 0; slot < MAGAZINE_VCPUS; ++slot)
+    {
+        if (!magazines[slot].try_lock())
+            continue;
+
+        for (int index = 0; index < SMALL_BLOCKS; ++index)
+        {
+            magazine_t& mag = magazines[slot].magazine[index];
+            drained = drained || (mag.rounds > 0);
+            flush_magazine(mag, 0);
+        }
+
+        magazines[slot].unlock();
+    }
+
+    return drained;
+}
+
+void* heap_t::cached_allocate(size_t size, uint32_t vcpu_id)
+{
+    if (size == 0)
+        return NULL;
+
+    int index = find_index(BLOCK_ALIGN(size));
+    if (index >= SMALL_BLOCKS)
+        return NULL;
+
+    magazine_set_t* slot = magazine_slot(vcpu_id);
+
+    if (!slot || !slot->try_lock())
+        return NULL;
+
+    magazine_t& mag = slot->magazine[index];
+    if (!mag.head)
+    {
+        lockable_scope_lock_t lock(*this);
+        refill_magazine(mag, index);
+    }
+
+    heap_rec_t* rec = mag.head;
+    if (rec)
+    {
+        mag.head = rec->next;
+        --mag.rounds;
+        ++mag.allocations;
+        rec->heap = this;
+    }
+
+    slot->unlock();
+
+    return rec ? rec + 1 : NULL;
+}
+
+bool heap_t::cached_free(void* p, uint32_t vcpu_id)
+{
+    if ((p == NULL) || (p == null_malloc))
+        return true;
+
+    heap_rec_t* rec = reinterpret_cast<heap_rec_t*>(p) - 1;
+
+    // Only small busy blocks of this heap go into magazines, leave the rest to free().
+    if ((rec->index < 0) || (rec->index >= SMALL_BLOCKS) || (rec->heap != this))
+        return false;
+
+    magazine_set_t* slot = magazine_slot(vcpu_id);
+
+    if (!slot || !slot->try_lock())
+        return false;
+
+    magazine_t& mag = slot->magazine[rec->index];
+    if (mag.rounds >= MAGAZINE_ROUNDS)
+    {
+        lockable_scope_lock_t lock(*this);
+        flush_magazine(mag, MAGAZINE_ROUNDS / 2);
+    }
+
+    rec->next = mag.head;
+    mag.head = rec;
+    ++mag.rounds;
+
+    slot->unlock();
+
+    return true;
+}
+
+/**
+ * Cut busy block @a rec down to @a size bytes and give the tail back to the heap.
+ * The tail must be at least MIN_FRAG bytes.
+ */
+void heap_t::split_block(heap_rec_t* rec, size_t size)
+{
+    size_t tail_size = rec->size - size - sizeof(heap_rec_t);
+
+    rec->size = size;
+
+    heap_rec_t* tail = next_block(rec);
+    tail->prev = HEAP_MAGIC;
+    tail->size = tail_size;
+
+    release_block(tail);
+}
+
 void* heap_t::realloc(void *ptr, size_t size)
 {
-    debugger_t::checkpoint("heap_t::realloc");
-    UNUSED(size);
-    return ptr;
+    ASSERT(has_lock());
+
+    if ((ptr == NULL) || (ptr == null_malloc))
+        return allocate(size);
+
+    if (size == 0)
+    {
+        free(ptr);
+        return null_malloc;
+    }
+
+    heap_rec_t* rec = reinterpret_cast<heap_rec_t*>(ptr) - 1;
+    size_t new_size = BLOCK_ALIGN(size);
+    int new_index = find_index(new_size);
+
+    if (new_index >= COUNT)
+        return NULL;
+    new_size = class_size(new_index);
+
+    // Shrink in place, returning the tail if it is big enough to be useful.
+    if (new_size <= rec->size)
+    {
+        account_idle(rec);
+        if (rec->size - new_size >= MIN_FRAG)
+        {
+            split_block(rec, new_size);
+            rec->index = new_index;
+        }
+        account_busy(rec);
+        ++bin_allocations[new_index];
+        logger::trace() << "heap_t::realloc(" << ptr << ", " << size << ") shrunk in place";
+        return ptr;
+    }
+
+    // Grow in place by absorbing the following free block.
+    heap_rec_t* next = next_block(rec);
+    if (is_free_block(next) && (rec->size + sizeof(heap_rec_t) + next->size >= new_size))
+    {
+        account_idle(rec);
+        unlink_free_block(next);
+        absorb_next_block(rec);
+        next_block(rec)->prev = HEAP_MAGIC;
+
+        // Without a split the block keeps all of the neighbour and may be past the requested class.
+        if (rec->size - new_size >= MIN_FRAG)
+            split_block(rec, new_size);
+        rec->index = free_index(rec->size);
+        account_busy(rec);
+        ++bin_allocations[new_index];
+
+        logger::trace() << "heap_t::realloc(" << ptr << ", " << size << ") grown in place";
+        return ptr;
+    }
+
+    // No room here, move.
+    void* new_ptr = allocate(size);
+    if (!new_ptr)
+        return NULL;
+
+    memutils::copy_memory(new_ptr, ptr, rec->size);
+    free(ptr);
+
+    logger::trace() << "heap_t::realloc(" << ptr << ", " << size << ") moved to " << new_ptr;
+    return new_ptr;
+}
+
+//======================================================================================================================
+// Statistics and allocation profiling
+//======================================================================================================================
+
+/**
+ * Count busy block @a rec, including its header, in its size class.
+ */
+inline void heap_t::account_busy(heap_rec_t* rec)
+{
+    size_t bytes = rec->size + sizeof(heap_rec_t);
+
+    bin_used[rec->index] += bytes;
+    used_bytes += bytes;
+    if (used_bytes > high_water_mark)
+        high_water_mark = used_bytes;
+}
+
+/**
+ * Stop counting busy block @a rec, which is about to be freed or resized.
+ */
+inline void heap_t::account_idle(heap_rec_t* rec)
+{
+    size_t bytes = rec->size + sizeof(heap_rec_t);
+
+    bin_used[rec->index] -= bytes;
+    used_bytes -= bytes;
+}
+
+void heap_t::statistics(heap_v1::stats* stats)
+{
+    ASSERT(has_lock());
+
+    stats->heap_size = size();
+    stats->used_bytes = used_bytes;
+    stats->free_bytes = 0;
+    stats->cached_bytes = 0;
+    stats->high_water_mark = high_water_mark;
+    stats->allocations = 0;
+    stats->merges = coalesce_stats.merges;
+    stats->coalesce_cycles = coalesce_stats.cycles;
+    stats->bins = COUNT;
+
+    for (uint32_t bin = 0; bin < COUNT; ++bin)
+    {
+        size_t bin_busy, bin_free;
+        uint32_t allocations;
+
+        bin_statistics(bin, &bin_busy, &bin_free, &allocations);
+        stats->free_bytes += bin_free;
+        stats->allocations += allocations;
+    }
+
+    // Magazines are not locked here, so this is only a snapshot estimate.
+    for (uint32_t slot = 0; slot < MAGAZINE_VCPUS; ++slot)
+    {
+        for (int index = 0; index < SMALL_BLOCKS; ++index)
+            stats->cached_bytes += magazines[slot].magazine[index].rounds * (class_size(index) + sizeof(heap_rec_t));
+    }
+}
+
+size_t heap_t::bin_statistics(uint32_t bin, size_t* used, size_t* free, uint32_t* allocations)
+{
+    ASSERT(has_lock());
+
+    if (bin >= COUNT)
+    {
+        *used = *free = 0;
+        *allocations = 0;
+        return 0;
+    }
+
+    *used = bin_used[bin];
+
+    *free = 0;
+    for (heap_rec_t* rec = blocks[bin]; rec; rec = rec->next)
+        *free += rec->size + sizeof(heap_rec_t);
+
+    *allocations = bin_allocations[bin];
+    if (bin < SMALL_BLOCKS)
+    {
+        for (uint32_t slot = 0; slot < MAGAZINE_VCPUS; ++slot)
+            *allocations += magazines[slot].magazine[bin].allocations;
+    }
+
+    return class_size(bin);
+}
+
+void heap_t::set_sampling(uint32_t period)
+{
+    ASSERT(has_lock());
+
+    for (int i = 0; i < CALL_SITES; ++i)
+    {
+        call_sites[i].site = 0;
+        call_sites[i].samples = 0;
+        call_sites[i].bytes = 0;
+    }
+
+    sample_count = 0;
+    sample_period = period;
+}
+
+/**
+ * The only cost when sampling is off is the test of sample_period, when it is on every allocation pays
+ * an atomic increment and only sampled ones take the heap lock.
+ */
+void heap_t::sample_allocation(size_t size, address_t site)
+{
+    uint32_t period = sample_period;
+
+    if (!period)
+        return;
+
+    if (atomic_ops::aaf(&sample_count, 1) % period)
+        return;
+
+    lockable_scope_lock_t lock(*this);
+
+    call_site_t* victim = &call_sites[0];
+    for (int i = 0; i < CALL_SITES; ++i)
+    {
+        if (call_sites[i].site == site)
+        {
+            ++call_sites[i].samples;
+            call_sites[i].bytes += size;
+            return;
+        }
+        if (call_sites[i].samples < victim->samples)
+            victim = &call_sites[i];
+    }
+
+    victim->site = site;
+    victim->samples = 1;
+    victim->bytes = size;
+}
+
+address_t heap_t::call_site(uint32_t n, uint32_t* samples, size_t* bytes)
+{
+    ASSERT(has_lock());
+
+    if (n >= CALL_SITES)
+    {
+        *samples = 0;
+        *bytes = 0;
+        return 0;
+    }
+
+    *samples = call_sites[n].samples;
+    *bytes = call_sites[n].bytes;
+    return call_sites[n].site;
 }
 
-void heap_t::expand(size_t new_size)
+void heap_t::expand(size_t /*new_size*/)
 {
 /*
 #if HEAP_DEBUG
@@ -432,7 +1058,7 @@ void heap_t::check_integrity()
     while (this_header)
     {
         kconsole << "Heap: checking block " << this_header << endl;
-        if (this_header->index > OTHER_INDEX)
+        if (this_header->index >= COUNT)
         {
             kconsole << LIGHTRED << "Heap integrity check: free list index " << this_header->index << " in block " << this_header << " is invalid." << endl;
             PANIC("Heap corruption!");
@@ -25,6 +25,31 @@
 class heap_t : public lockable_t
 {
 public:
+    /**
+     * How free blocks are merged with their neighbours.
+     * Immediate mode merges on every free() using the boundary tags, so allocation never has to
+     * walk the whole heap. Deferred mode keeps free() minimal and instead merges a bounded number
+     * of blocks per allocation (and per explicit coalesce_step() call, e.g. from an idle thread),
+     * a larger number once free space falls below a low water mark, and falls back to a whole
+     * heap coalesce only when out of space.
+     */
+    enum coalesce_mode_t
+    {
+        COALESCE_IMMEDIATE,
+        COALESCE_DEFERRED
+    };
+
+    /**
+     * Coalescing counters.
+     */
+    struct coalesce_stats_t
+    {
+        uint32_t merges;      //!< Blocks merged into their neighbours.
+        uint32_t steps;       //!< Incremental coalesce_step() calls.
+        uint32_t full_passes; //!< Whole heap coalesce() walks.
+        uint64_t cycles;      //!< Time spent merging blocks in either mode, in timestamp counter cycles.
+    };
+
     inline heap_t() : lockable_t() {}
 
     /**
@@ -51,12 +76,87 @@ public:
      */
     void free(void* p);
 
+    /**
+     * Per-VCPU front end to allocate(). Small blocks are popped from the magazines of VCPU
+     * @a vcpu_id without taking the heap lock, which is only taken to refill an empty magazine.
+     * Must be called without the heap lock held.
+     * @return start address of the allocated block or NULL if the request is not eligible
+     * for the magazine path (large size, VCPU id without magazines, slot busy, out of memory);
+     * caller should then fall back to allocate().
+     */
+    void* cached_allocate(size_t size, uint32_t vcpu_id);
+
+    /**
+     * Per-VCPU front end to free(). Small blocks are pushed onto the magazine of VCPU
+     * @a vcpu_id; when the magazine overflows half of it is flushed back under the heap lock.
+     * Must be called without the heap lock held.
+     * @return true if the block was consumed, false if caller should fall back to free().
+     */
+    bool cached_free(void* p, uint32_t vcpu_id);
+
+    /**
+     * VCPU ids from 0 up to this limit get magazines of their own, others always use the shared heap.
+     */
+    static const uint32_t MAGAZINE_VCPUS = 32;
+
     /**
      * Reallocate memory block starting at @a ptr to be of size @a size.
-     * @return start address of the memory block.
+     * Shrinks in place, grows in place if the following block is free and large enough,
+     * otherwise moves the contents to a newly allocated block.
+     * @return start address of the memory block or NULL if there is not enough memory,
+     * in which case the original block is left intact.
      */
     void* realloc(void* ptr, size_t size);
 
+    /**
+     * Select coalescing mode. In deferred mode every allocation performs a coalesce_step(@a budget),
+     * a zero @a budget leaves incremental work to explicit coalesce_step() calls until free space
+     * falls below the low water mark.
+     */
+    void set_coalesce_mode(coalesce_mode_t mode, size_t budget);
+
+    /**
+     * Perform a bounded amount of deferred coalescing: visit at most @a budget blocks,
+     * resuming from where the previous step stopped. Heap lock must be held.
+     * @return amount of work done.
+     */
+    size_t coalesce_step(size_t budget);
+
+    inline const coalesce_stats_t& coalescing_statistics() const
+    {
+        return coalesce_stats;
+    }
+
+    /**
+     * Fill in heap usage counters, see heap_v1::stats. Walks the free lists, heap lock must be held.
+     */
+    void statistics(heap_v1::stats* stats);
+
+    /**
+     * Usage of size class @a bin: bytes in busy and in free blocks and the number of allocations
+     * requested in that class so far. Heap lock must be held.
+     * @return allocation size of the class, or 0 if @a bin is out of range.
+     */
+    size_t bin_statistics(uint32_t bin, size_t* used, size_t* free, uint32_t* allocations);
+
+    /**
+     * Record the caller of every @a period-th allocation, 0 disables sampling.
+     * Clears previously collected samples.
+     */
+    void set_sampling(uint32_t period);
+
+    /**
+     * Account an allocation of @a size bytes requested from @a call_site if it falls on the sampling
+     * period. Must be called without the heap lock held.
+     */
+    void sample_allocation(size_t size, address_t site);
+
+    /**
+     * Entry @a n of the call site sample table.
+     * @return sampled code address or 0 if the entry is unused.
+     */
+    address_t call_site(uint32_t n, uint32_t* samples, size_t* bytes);
+
     /**
      * Tries to detect buffer overruns by walking the heap and checking magic numbers.
      */
@@ -85,7 +185,9 @@ private:
      */
     size_t contract(size_t new_size);
 
-    int find_index(size_t size);
+    static int find_index(size_t size);
+    static int free_index(size_t size);
+    static size_t class_size(int index);
 
 private:
     struct heap_rec_t
@@ -101,20 +203,105 @@ private:
 
     static heap_rec_t* prev_block(heap_rec_t* rec);
     static heap_rec_t* next_block(heap_rec_t* rec);
-    heap_rec_t* get_new_block(size_t size, int index);
+    static heap_rec_t*& free_back_link(heap_rec_t* rec);
+    heap_rec_t* find_free_block(int index);
+    heap_rec_t* get_new_block(int index);
     heap_rec_t* get_new_block_internal(size_t size, int index);
 
+    heap_rec_t* take_block(int index);
+    void release_block(heap_rec_t* rec);
+    void push_free_block(heap_rec_t* rec);
+    void unlink_free_block(heap_rec_t* rec);
+    bool is_end_block(heap_rec_t* rec);
+    bool is_free_block(heap_rec_t* rec);
+    void absorb_next_block(heap_rec_t* rec);
+    heap_rec_t* merge_free_neighbours(heap_rec_t* rec);
+    void split_block(heap_rec_t* rec, size_t size);
+    void account_busy(heap_rec_t* rec);
+    void account_idle(heap_rec_t* rec);
+
     void coalesce();
     void coalesce_merge_blocks(int32_t index);
     void coalesce_move_blocks(int32_t index);
 
+    /**
+     * Two-level segregated free lists: SL_COUNT second level lists per power of two first level,
+     * FL_COUNT first levels cover the whole 32 bit size range. Bitmaps record non-empty lists.
+     */
+    static const int SL_BITS = 3;
+    static const int SL_COUNT = (1 << SL_BITS);
+    static const int FL_COUNT = 32 - (SL_BITS + 3) + 1;
+    static const int COUNT = (FL_COUNT * SL_COUNT);
+    /**
+     * Size classes below this index (up to 120 bytes) are served by magazines.
+     */
     static const int SMALL_BLOCKS = 16;
-    static const int LARGE_BLOCKS = 24;
-    static const int COUNT = (SMALL_BLOCKS + LARGE_BLOCKS + 1);
-    static const memory_v1::size all_sizes[COUNT];
+
+    /**
+     * A magazine is a short list of ready-to-use blocks of a single small size class.
+     * Blocks in a magazine look allocated to the rest of the heap, so coalescing never touches them.
+     * They are chained through heap_rec_t::next.
+     */
+    struct magazine_t
+    {
+        heap_rec_t* head;
+        int32_t     rounds;
+        uint32_t    allocations; //!< Requests served from this magazine, for bin_statistics().
+    };
+
+    /**
+     * One set of magazines per VCPU. Only its own VCPU uses a set, so the lock is uncontended on the
+     * fast path; it is there for drain_magazines() and for re-entry from an activation handler. The lock
+     * is only ever try_lock()ed, a busy set sends the caller to the shared heap.
+     */
+    struct magazine_set_t : public lockable_t
+    {
+        magazine_t magazine[SMALL_BLOCKS];
+    };
+
+    static const int MAGAZINE_ROUNDS = 8;
+
+    magazine_set_t* magazine_slot(uint32_t vcpu_id);
+    void refill_magazine(magazine_t& mag, int index);
+    void flush_magazine(magazine_t& mag, int keep);
+    bool drain_magazines();
 
     heap_rec_t* blocks[COUNT];
+    uint32_t    fl_bitmap;
+    uint32_t    sl_bitmap[FL_COUNT];
     heap_rec_t* null_malloc;
+    magazine_set_t magazines[MAGAZINE_VCPUS];
+
+    coalesce_mode_t  coalesce_mode;
+    size_t           coalesce_budget;
+    heap_rec_t*      coalesce_cursor; //!< Where the next coalesce_step() resumes its walk.
+    coalesce_stats_t coalesce_stats;
+
+    /**
+     * Usage accounting. Busy bytes per class are kept up to date on every block state change,
+     * blocks sitting in magazines count as busy. Free bytes are collected on demand.
+     */
+    size_t   used_bytes;
+    size_t   high_water_mark;
+    size_t   bin_used[COUNT];
+    uint32_t bin_allocations[COUNT];
+
+    /**
+     * Sampled allocation call sites. When the table is full a new site replaces the entry
+     * with the fewest samples, so frequent callers stay in.
+     */
+    struct call_site_t
+    {
+        address_t site;
+        uint32_t  samples;
+        size_t    bytes;
+    };
+
+    static const int CALL_SITES = 16;
+
+    call_site_t call_sites[CALL_SITES];
+    uint32_t    sample_period;
+    address_t   sample_count;
 
     /**
      * The start of our allocated space.
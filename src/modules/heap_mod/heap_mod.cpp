@@ -11,11 +11,13 @@
 #include "heap_factory_v1_impl.h"
 #include "heap_v1_interface.h"
 #include "heap_v1_impl.h"
+#include "vcpu_v1_interface.h"
 #include "heap.h"
 #include "memory.h"
 #include "default_console.h"
 #include "exceptions.h"
 #include "panic.h"
+#include "infopage.h"
 
 //======================================================================================================================
 // heap_v1 implementation
@@ -27,11 +29,31 @@ struct heap_v1::state_t
     heap_t* heap;
 };
 
+/**
+ * Select heap magazines by the current VCPU. There is one VCPU per domain, so the domain id identifies it;
+ * domain id 0 is never handed out and is used by boot code running before the first VCPU exists.
+ */
+static inline uint32_t current_vcpu_id()
+{
+    if (!INFO_PAGE.pervasives || !PVS(vcpu))
+        return 0;
+
+    domain_v1::id id = PVS(vcpu)->domain_id();
+    return (id < heap_t::MAGAZINE_VCPUS) ? uint32_t(id) : ~0u;
+}
+
 static memory_v1::address heap_v1_allocate(heap_v1::closure_t* self, memory_v1::size size)
 {
 #if !SMP
     ASSERT(!self->d_state->heap->has_lock());
 #endif
+    self->d_state->heap->sample_allocation(size, reinterpret_cast<address_t>(__builtin_return_address(0)));
+
+    // Fast path: small blocks come from the per-VCPU magazine without the heap lock.
+    void* cached = self->d_state->heap->cached_allocate(size, current_vcpu_id());
+    if (cached)
+        return reinterpret_cast<memory_v1::address>(cached);
+
     lockable_scope_lock_t lock(*self->d_state->heap);
     void* res = 0;
 
@@ -63,20 +85,102 @@ static void heap_v1_free(heap_v1::closure_t* self, memory_v1::address ptr)
 #if !SMP
     ASSERT(!self->d_state->heap->has_lock());
 #endif
+    if (self->d_state->heap->cached_free(reinterpret_cast<void*>(ptr), current_vcpu_id()))
+        return;
+
     lockable_scope_lock_t lock(*self->d_state->heap);
     self->d_state->heap->free(reinterpret_cast<void*>(ptr));
 }
 
+static memory_v1::address heap_v1_realloc(heap_v1::closure_t* self, memory_v1::address ptr, memory_v1::size size)
+{
+#if !SMP
+    ASSERT(!self->d_state->heap->has_lock());
+#endif
+    lockable_scope_lock_t lock(*self->d_state->heap);
+    void* res = 0;
+
+    if (PVS(exceptions))
+    {
+        OS_TRY {
+            res = self->d_state->heap->realloc(reinterpret_cast<void*>(ptr), size);
+        }
+        OS_FINALLY {
+            lock.unlock();
+        }
+        OS_ENDTRY
+
+        if (!res)
+            OS_RAISE((exception_support_v1::id)"heap_v1.no_memory", NULL);
+    }
+    else
+    {
+        res = self->d_state->heap->realloc(reinterpret_cast<void*>(ptr), size);
+    }
+
+    return reinterpret_cast<memory_v1::address>(res);
+}
+
 static void heap_v1_check(heap_v1::closure_t* self, bool /*check_free_blocks*/)
 {
     lockable_scope_lock_t lock(*self->d_state->heap);
     self->d_state->heap->check_integrity();
 }
 
+static void heap_v1_statistics(heap_v1::closure_t* self, heap_v1::stats* counters)
+{
+    lockable_scope_lock_t lock(*self->d_state->heap);
+    self->d_state->heap->statistics(counters);
+}
+
+static memory_v1::size heap_v1_bin_statistics(heap_v1::closure_t* self, uint32_t bin, memory_v1::size* used_bytes, memory_v1::size* free_bytes, uint32_t* allocations)
+{
+    lockable_scope_lock_t lock(*self->d_state->heap);
+    size_t used, free;
+    size_t class_size = self->d_state->heap->bin_statistics(bin, &used, &free, allocations);
+    *used_bytes = used;
+    *free_bytes = free;
+    return class_size;
+}
+
+static void heap_v1_set_sampling(heap_v1::closure_t* self, uint32_t period)
+{
+    lockable_scope_lock_t lock(*self->d_state->heap);
+    self->d_state->heap->set_sampling(period);
+}
+
+static memory_v1::address heap_v1_call_site(heap_v1::closure_t* self, uint32_t n, uint32_t* samples, memory_v1::size* bytes)
+{
+    lockable_scope_lock_t lock(*self->d_state->heap);
+    size_t sampled_bytes;
+    address_t site = self->d_state->heap->call_site(n, samples, &sampled_bytes);
+    *bytes = sampled_bytes;
+    return site;
+}
+
+static void heap_v1_set_coalescing(heap_v1::closure_t* self, heap_v1::coalescing mode, uint32_t budget)
+{
+    lockable_scope_lock_t lock(*self->d_state->heap);
+    self->d_state->heap->set_coalesce_mode((mode == heap_v1::coalescing_deferred) ? heap_t::COALESCE_DEFERRED : heap_t::COALESCE_IMMEDIATE, budget);
+}
+
+static uint32_t heap_v1_coalesce(heap_v1::closure_t* self, uint32_t budget)
+{
+    lockable_scope_lock_t lock(*self->d_state->heap);
+    return self->d_state->heap->coalesce_step(budget);
+}
+
 static const heap_v1::ops_t heap_v1_methods =
 {
     heap_v1_allocate,
     heap_v1_free,
+    heap_v1_realloc,
+    heap_v1_statistics,
+    heap_v1_bin_statistics,
+    heap_v1_set_sampling,
+    heap_v1_call_site,
+    heap_v1_set_coalescing,
+    heap_v1_coalesce,
     heap_v1_check
 };
 
@@ -0,0 +1,267 @@
+//
+// Part of Metta OS. Check https://atta-metta.net for latest version.
+//
+// Copyright 2007 - 2017, Stanislav Karchebnyy <berkus@atta-metta.net>
+//
+// Distributed under the Boost Software License, Version 1.0.
+// (See file LICENSE_1_0.txt or a copy at http://www.boost.org/LICENSE_1_0.txt)
+//
+#include "frame_buddy.h"
+#include "memutils.h"
+
+static inline uint32_t ctz(uint32_t x)
+{
+    return __builtin_ctz(x);
+}
+
+/**
+ * Index of the most significant set bit, x must not be 0.
+ */
+static inline uint32_t msb(uint32_t x)
+{
+    return 31 - __builtin_clz(x);
+}
+
+//======================================================================================================================
+// level_bitmap_t
+//======================================================================================================================
+
+void frame_buddy_t::level_bitmap_t::set(uint32_t block)
+{
+    uint32_t bit = block - offset;
+    for (uint32_t l = 0; l < depth; ++l)
+    {
+        uint32_t word = bit / 32;
+        uint32_t was = levels[l][word];
+        levels[l][word] = was | (1u << (bit % 32));
+        if (was)
+            break;
+        bit = word;
+    }
+}
+
+void frame_buddy_t::level_bitmap_t::clear(uint32_t block)
+{
+    uint32_t bit = block - offset;
+    for (uint32_t l = 0; l < depth; ++l)
+    {
+        uint32_t word = bit / 32;
+        levels[l][word] &= ~(1u << (bit % 32));
+        if (levels[l][word])
+            break;
+        bit = word;
+    }
+}
+
+uint32_t frame_buddy_t::level_bitmap_t::find_first() const
+{
+    if (!levels[depth - 1][0])
+        return ~0u;
+    uint32_t index = 0;
+    for (uint32_t l = depth; l > 0; --l)
+        index = index * 32 + ctz(levels[l - 1][index]);
+    return index + offset;
+}
+
+//======================================================================================================================
+// frame_buddy_t
+//======================================================================================================================
+
+/**
+ * Words in all levels of a bitmap of bits bits.
+ */
+size_t frame_buddy_t::bitmap_words(uint32_t bits, uint32_t* per_level, uint32_t* depth)
+{
+    size_t total = 0;
+    uint32_t d = 0;
+    do {
+        bits = (bits + 31) / 32;
+        if (per_level)
+            per_level[d] = bits;
+        total += bits;
+        ++d;
+    } while (bits > 1);
+    if (depth)
+        *depth = d;
+    return total;
+}
+
+/**
+ * Orders up to the smallest aligned block containing the whole region.
+ */
+uint32_t frame_buddy_t::order_count(uint32_t first_frame, uint32_t n_frames)
+{
+    uint32_t last = first_frame + n_frames - 1;
+    return (first_frame == last) ? 1 : msb(first_frame ^ last) + 2;
+}
+
+size_t frame_buddy_t::required_size(uint32_t first_frame, uint32_t n_frames)
+{
+    if (!n_frames)
+        return 0;
+    uint32_t orders = order_count(first_frame, n_frames);
+    uint32_t bias = first_frame & ((1ull << (orders - 1)) - 1);
+    size_t words = 0;
+    for (uint32_t k = 0; k < orders; ++k)
+        words += bitmap_words(((bias + n_frames - 1) >> k) - (bias >> k) + 1, 0, 0);
+    return (words * sizeof(uint32_t) + 7) & ~7;
+}
+
+void frame_buddy_t::init(void* memory, uint32_t first_frame, uint32_t n_frames_)
+{
+    n_frames = n_frames_;
+    n_free = 0;
+    orders = 0;
+    if (!n_frames)
+        return;
+
+    orders = order_count(first_frame, n_frames);
+    bias = first_frame & ((1ull << (orders - 1)) - 1);
+    memutils::fill_memory(memory, 0, required_size(first_frame, n_frames));
+
+    uint32_t* words = reinterpret_cast<uint32_t*>(memory);
+    for (uint32_t k = 0; k < orders; ++k)
+    {
+        level_bitmap_t& bitmap = free_blocks[k];
+        bitmap.offset = bias >> k;
+        bitmap.size = ((bias + n_frames - 1) >> k) - bitmap.offset + 1;
+        uint32_t per_level[MAX_LEVELS];
+        bitmap_words(bitmap.size, per_level, &bitmap.depth);
+        for (uint32_t l = 0; l < bitmap.depth; ++l)
+        {
+            bitmap.levels[l] = words;
+            words += per_level[l];
+        }
+    }
+
+    free(0, n_frames);
+}
+
+/**
+ * Order of the free block containing frame index, or -1 if the frame is in use.
+ */
+int frame_buddy_t::free_order(uint32_t index)
+{
+    for (uint32_t k = 0; k < orders; ++k)
+        if (free_blocks[k].test(index >> k))
+            return k;
+    return -1;
+}
+
+/**
+ * Put back one block, merging it with its buddy for as long as the buddy is free.
+ */
+void frame_buddy_t::free_block(uint32_t block, uint32_t order)
+{
+    for (; order + 1 < orders; ++order, block >>= 1)
+    {
+        uint32_t buddy = block ^ 1;
+        if (!free_blocks[order].contains(buddy) || !free_blocks[order].test(buddy))
+            break;
+        free_blocks[order].clear(buddy);
+    }
+    free_blocks[order].set(block);
+}
+
+/**
+ * Put back frame indices [first, end) as the largest aligned blocks that fit.
+ */
+void frame_buddy_t::free_indices(uint32_t first, uint32_t end)
+{
+    while (first < end)
+    {
+        uint32_t order = msb(end - first);
+        if (first)
+            order = order < ctz(first) ? order : ctz(first);
+        if (order >= orders)
+            order = orders - 1;
+        free_block(first >> order, order);
+        first += 1u << order;
+    }
+}
+
+uint32_t frame_buddy_t::allocate(uint32_t n, uint32_t align_order)
+{
+    if (!n || n > n_free)
+        return ~0u;
+
+    uint32_t order = (n == 1) ? 0 : msb(n - 1) + 1;
+    if (order < align_order)
+        order = align_order;
+
+    for (uint32_t k = order; k < orders; ++k)
+    {
+        uint32_t block = free_blocks[k].find_first();
+        if (block == ~0u)
+            continue;
+
+        // Split down to the requested order, the upper halves stay free.
+        free_blocks[k].clear(block);
+        for (; k > order; --k)
+        {
+            block <<= 1;
+            free_blocks[k - 1].set(block + 1);
+        }
+
+        uint32_t first = block << order;
+        free_indices(first + n, first + (1u << order));
+        n_free -= n;
+        return first - bias;
+    }
+    return ~0u;
+}
+
+void frame_buddy_t::allocate_at(uint32_t frame, uint32_t n)
+{
+    uint32_t index = frame + bias, end = index + n;
+    while (index < end)
+    {
+        int order = free_order(index);
+        if (order < 0)
+            break;
+
+        // Take the whole block out and give back the parts outside of the range.
+        uint32_t block_start = (index >> order) << order;
+        uint64_t block_end = uint64_t(block_start) + (1ull << order);
+        free_blocks[order].clear(index >> order);
+        free_indices(block_start, index);
+        if (block_end > end)
+            free_indices(end, block_end);
+        n_free -= (block_end > end ? end : block_end) - index;
+        index = block_end;
+    }
+}
+
+void frame_buddy_t::free(uint32_t frame, uint32_t n)
+{
+    free_indices(frame + bias, frame + bias + n);
+    n_free += n;
+}
+
+uint32_t frame_buddy_t::free_run(uint32_t frame, uint32_t limit)
+{
+    uint64_t index = frame + bias, end = bias + n_frames;
+    uint64_t count = 0;
+    while (count < limit && index < end)
+    {
+        int order = free_order(index);
+        if (order < 0)
+            break;
+        uint64_t block_end = ((index >> order) + 1) << order;
+        count += block_end - index;
+        index = block_end;
+    }
+    return count < limit ? count : limit;
+}
+
+uint32_t frame_buddy_t::lowest_free()
+{
+    uint32_t lowest = ~0u;
+    for (uint32_t k = 0; k < orders; ++k)
+    {
+        uint32_t block = free_blocks[k].find_first();
+        if ((block != ~0u) && ((block << k) < lowest))
+            lowest = block << k;
+    }
+    return (lowest == ~0u) ? lowest : lowest - bias;
+}
@@ -0,0 +1,112 @@
+//
+// Part of Metta OS. Check https://atta-metta.net for latest version.
+//
+// Copyright 2007 - 2017, Stanislav Karchebnyy <berkus@atta-metta.net>
+//
+// Distributed under the Boost Software License, Version 1.0.
+// (See file LICENSE_1_0.txt or a copy at http://www.boost.org/LICENSE_1_0.txt)
+//
+#pragma once
+
+#include "types.h"
+
+/**
+ * Buddy index of free frames in one frames_mod region.
+ *
+ * Free frames are kept as naturally aligned power of two blocks, merged with their buddy on free. For every block
+ * order there is a bitmap of free blocks with summary levels above it (a bit per non-empty word of the level below),
+ * so finding the lowest free block of an order, taking one out or putting one back are all O(log n) and nothing
+ * is ever scanned frame by frame.
+ *
+ * Block indices count frames from the aligned-down physical frame number of the region start, so a block of order k
+ * is also aligned to 2^k frames in physical memory. Frames in front of the region start stay permanently used.
+ *
+ * The index lives in memory supplied by the caller, required_size() bytes of it.
+ */
+class frame_buddy_t
+{
+public:
+    static const uint32_t MAX_ORDERS = 32;
+    static const uint32_t MAX_LEVELS = 7; //!< Summary levels for up to 2^32 bits.
+
+    /**
+     * Memory needed for a region of n_frames starting at physical frame number first_frame.
+     */
+    static size_t required_size(uint32_t first_frame, uint32_t n_frames);
+
+    /**
+     * Set up the index in memory, with all frames free.
+     */
+    void init(void* memory, uint32_t first_frame, uint32_t n_frames);
+
+    /**
+     * Allocate n_frames contiguous frames aligned to 2^align_order frames.
+     * Block is taken from the smallest order that fits, unused tail frames are returned to the index.
+     * @return index of the first frame in the region or -1 if no such block is free.
+     */
+    uint32_t allocate(uint32_t n_frames, uint32_t align_order);
+
+    /**
+     * Allocate frames at a fixed position, all of them must be free.
+     */
+    void allocate_at(uint32_t frame, uint32_t n_frames);
+
+    /**
+     * Return frames to the index, merging them with free buddies.
+     */
+    void free(uint32_t frame, uint32_t n_frames);
+
+    /**
+     * Number of contiguous free frames starting at frame, up to limit.
+     * Same value as the run length the frame table used to keep for every frame, 0 for a used frame.
+     */
+    uint32_t free_run(uint32_t frame, uint32_t limit = ~0u);
+
+    /**
+     * Lowest free frame in the region, the lowest free block of every order is a candidate.
+     * @return frame index or -1 if the region is full.
+     */
+    uint32_t lowest_free();
+
+    bool is_free(uint32_t frame) { return free_order(frame + bias) >= 0; }
+    uint32_t free_frames() const { return n_free; }
+
+private:
+    /**
+     * Bitmap of free blocks of one order, covering blocks [offset, offset + size).
+     * levels[0] holds a bit per block, each next level a bit per non-zero word of the level below.
+     */
+    struct level_bitmap_t
+    {
+        uint32_t* levels[MAX_LEVELS];
+        uint32_t depth;
+        uint32_t offset;
+        uint32_t size;
+
+        bool contains(uint32_t block) const { return block - offset < size; }
+        bool test(uint32_t block) const
+        {
+            uint32_t bit = block - offset;
+            return levels[0][bit / 32] & (1u << (bit % 32));
+        }
+        void set(uint32_t block);
+        void clear(uint32_t block);
+        /**
+         * @return lowest free block or -1.
+         */
+        uint32_t find_first() const;
+    };
+
+    uint32_t bias;     //!< Region start frame within its top order block.
+    uint32_t n_frames; //!< Frames in the region.
+    uint32_t n_free;
+    uint32_t orders;   //!< Block orders in use, the top one is a single block covering the whole region.
+    level_bitmap_t free_blocks[MAX_ORDERS];
+
+    static size_t bitmap_words(uint32_t bits, uint32_t* per_level, uint32_t* depth);
+    static uint32_t order_count(uint32_t first_frame, uint32_t n_frames);
+
+    int free_order(uint32_t index);
+    void free_block(uint32_t index, uint32_t order);
+    void free_indices(uint32_t first, uint32_t end);
+};
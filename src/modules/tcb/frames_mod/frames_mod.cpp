@@ -9,6 +9,7 @@
 #include "frames_module_v1_interface.h"
 #include "frames_module_v1_impl.h"
 #include "ramtab_v1_interface.h"
+#include "vcpu_v1_interface.h"
 #include "heap_v1_interface.h"
 #include "frame_allocator_v1_interface.h"
 #include "frame_allocator_v1_impl.h"
@@ -22,6 +23,50 @@
 #include "domain.h"
 #include "algorithm"
 #include "logger.h"
+#include "lockable.h"
+#include "memutils.h"
+#include "infopage.h"
+#include "frame_buddy.h"
+
+/**
+ * Per-VCPU hot list of free single frames.
+ * Frames on a hot list are out of their region index already, but have no owner in the ramtab.
+ */
+struct frame_cache_slot_t : public lockable_t
+{
+    static const size_t CAPACITY = 64;
+    static const size_t BATCH = CAPACITY / 2; //!< Frames moved between a hot list and the region indices at once.
+
+    size_t count;
+    address_t frames[CAPACITY];
+};
+
+/**
+ * Frames cleared ahead of time by scrub(), for allocations with the zeroed attribute.
+ * Like hot-listed frames, they are out of their region index and have no owner.
+ */
+struct frame_zero_pool_t : public lockable_t
+{
+    static const size_t CAPACITY = 64;
+
+    size_t count;
+    address_t frames[CAPACITY];
+};
+
+/**
+ * Hot lists and the zeroed pool, shared by the system allocator and all its clients. Slot and pool locks are only
+ * ever try_lock()ed, a busy slot sends the request down the region walk.
+ */
+struct frame_cache_t
+{
+    static const uint32_t SLOTS = 32;      //!< VCPUs with an id past this have no hot list.
+
+    ramtab_v1::closure_t* ramtab;
+    address_t direct_end;                  //<! Frames below this are mapped 1:1 and can be cleared in place.
+    lockable_t index_lock;                 //<! Guards the region indices, hot lists refill and drain from any VCPU.
+    frame_cache_slot_t slots[SLOTS];
+    frame_zero_pool_t zeroed;
+};
 
 /**
  * Frame allocator client record.
@@ -41,11 +86,7 @@ struct frame_allocator_v1::state_t
 
     heap_v1::closure_t* heap;
     frames_module_v1::state_t* module_state;  //<! Back pointer to shared state.
-};
-
-struct frame_st
-{
-    uint32_t free;
+    frame_cache_t* cache;                     //<! Single frame hot lists, shared by all clients.
 };
 
 /**
@@ -59,7 +100,7 @@ struct frames_module_v1::state_t
     memory_v1::attrs attrs;
     ramtab_v1::closure_t* ramtab;
     frames_module_v1::state_t* next;
-    frame_st* frames;
+    frame_buddy_t frames;                  //<! Free frames index, its bitmaps follow this record.
 };
 
 //======================================================================================================================
@@ -72,6 +113,8 @@ static memory_v1::address system_frame_allocator_v1_allocate(frame_allocator_v1:
 static memory_v1::address system_frame_allocator_v1_allocate_range(frame_allocator_v1::closure_t* self, memory_v1::size bytes, uint32_t frame_width, memory_v1::address start, memory_v1::attrs attr);
 static uint32_t system_frame_allocator_v1_query(frame_allocator_v1::closure_t* self, memory_v1::address addr, memory_v1::attrs* attr);
 static void system_frame_allocator_v1_free(frame_allocator_v1::closure_t* self, memory_v1::address addr, memory_v1::size bytes);
+static uint32_t system_frame_allocator_v1_allocate_many(frame_allocator_v1::closure_t* self, uint32_t n_frames, uint32_t frame_width, frame_allocator_v1::address_seq* frames);
+static void system_frame_allocator_v1_free_many(frame_allocator_v1::closure_t* self, frame_allocator_v1::address_seq frames, uint32_t frame_width);
 static void system_frame_allocator_v1_destroy(frame_allocator_v1::closure_t* self);
 
 static memory_v1::address frame_allocator_v1_allocate(frame_allocator_v1::closure_t* self, memory_v1::size bytes, uint32_t frame_width)
@@ -94,6 +137,16 @@ static void frame_allocator_v1_free(frame_allocator_v1::closure_t* self, memory_
     system_frame_allocator_v1_free(self, addr, bytes);
 }
 
+static uint32_t frame_allocator_v1_allocate_many(frame_allocator_v1::closure_t* self, uint32_t n_frames, uint32_t frame_width, frame_allocator_v1::address_seq* frames)
+{
+    return system_frame_allocator_v1_allocate_many(self, n_frames, frame_width, frames);
+}
+
+static void frame_allocator_v1_free_many(frame_allocator_v1::closure_t* self, frame_allocator_v1::address_seq frames, uint32_t frame_width)
+{
+    system_frame_allocator_v1_free_many(self, frames, frame_width);
+}
+
 static void frame_allocator_v1_destroy(frame_allocator_v1::closure_t* self)
 {
     system_frame_allocator_v1_destroy(self);
@@ -105,6 +158,8 @@ static const frame_allocator_v1::ops_t frame_allocator_v1_methods =
     frame_allocator_v1_allocate_range,
     frame_allocator_v1_query,
     frame_allocator_v1_free,
+    frame_allocator_v1_allocate_many,
+    frame_allocator_v1_free_many,
     frame_allocator_v1_destroy
 };
 
@@ -112,11 +167,11 @@ static const frame_allocator_v1::ops_t frame_allocator_v1_methods =
 // implementation helper functions
 //======================================================================================================================
 
+/**
+ * Record the owner of frames already taken out of the region index.
+ */
 static void mark_frames_used(frame_allocator_v1::state_t* client_state, frames_module_v1::state_t* state, address_t first_frame, size_t n_frames)
 {
-    for (size_t j = first_frame; j < (first_frame + n_frames); ++j)
-        state->frames[j].free = 0;
-
     if (state->ramtab)
     {
         uint32_t ridx = state->start >> FRAME_WIDTH;
@@ -132,21 +187,6 @@ static void mark_frames_used(frame_allocator_v1::state_t* client_state, frames_m
     }
 }
 
-/**
- * After allocation, update predecessors free frames info.
- */
-static void alloc_update_free_predecessors(frames_module_v1::state_t* cur_state, address_t first_frame)
-{
-    uint32_t start_free = cur_state->frames[first_frame].free;
-    for (address_t i = first_frame; i != 0; )
-    {
-        --i;
-        if (cur_state->frames[i].free == 0)
-            break;
-        cur_state->frames[i].free -= start_free;
-    }
-}
-
 // FIXME: Lots of reinterpret casts suck, do something about it!
 
 static bool add_range_element(frame_allocator_v1::state_t* client_state, address_t start, size_t n_phys_frames, size_t frame_width)
@@ -238,11 +278,270 @@ inline address_t frame_address(frames_module_v1::state_t* cur_state, address_t f
     return cur_state->start + (frame_index << cur_state->frame_width);
 }
 
+/**
+ * Update number of allocated frames (protect from wrapping).
+ */
+static void release_quota(frame_allocator_v1::state_t* client_state, size_t n_phys_frames)
+{
+    size_t new_phys_frames = client_state->n_allocated_phys_frames - n_phys_frames;
+    if (new_phys_frames > client_state->n_allocated_phys_frames)
+    {
+        logger::warning() << __FUNCTION__ << ": freeing more frames than I own (ignored)";
+        new_phys_frames = 0;
+    }
+    client_state->n_allocated_phys_frames = new_phys_frames;
+}
+
+//======================================================================================================================
+// single frame hot lists
+//======================================================================================================================
+
+/**
+ * Select the hot list by the current VCPU. There is one VCPU per domain, so the domain id identifies it;
+ * domain id 0 is never handed out and is used by boot code running before the first VCPU exists.
+ * @return NULL if the VCPU id is past the hot lists, the request takes the regular path then.
+ */
+static inline frame_cache_slot_t* frame_cache_slot(frame_cache_t* cache)
+{
+    if (!INFO_PAGE.pervasives || !PVS(vcpu))
+        return &cache->slots[0];
+
+    domain_v1::id id = PVS(vcpu)->domain_id();
+    return (id < frame_cache_t::SLOTS) ? &cache->slots[id] : NULL;
+}
+
+/**
+ * Take up to n single frames out of the RAM region indices, in as few blocks as the indices allow.
+ * @return number of frames taken.
+ */
+static size_t take_frames(frame_allocator_v1::state_t* client_state, address_t* frames, size_t n)
+{
+    lockable_scope_lock_t lock(client_state->cache->index_lock);
+    frames_module_v1::state_t* state = client_state->module_state;
+    size_t got = 0;
+    for (; state && got < n; state = state->next)
+    {
+        if (state->attrs || !state->ramtab || (state->frame_width != FRAME_WIDTH))
+            continue;
+
+        while (got < n)
+        {
+            // Halve the block on failure, a fragmented region gives out what it has frame by frame.
+            uint32_t count = n - got, first;
+            while (((first = state->frames.allocate(count, 0)) == ~0u) && (count > 1))
+                count /= 2;
+            if (first == ~0u)
+                break;
+
+            for (uint32_t i = 0; i < count; ++i)
+                frames[got++] = frame_address(state, first + i);
+        }
+    }
+    return got;
+}
+
+/**
+ * Return single frames to the indices of the regions they came from.
+ */
+static void give_back_frames(frame_allocator_v1::state_t* client_state, const address_t* frames, size_t n)
+{
+    lockable_scope_lock_t lock(client_state->cache->index_lock);
+    frames_module_v1::state_t* state = client_state->module_state;
+    for (size_t i = 0; i < n; ++i)
+    {
+        frames_module_v1::state_t* cur_state = get_region(state, frames[i]);
+        cur_state->frames.free(bytes_to_log_frames(frames[i] - cur_state->start, cur_state->frame_width), 1);
+    }
+}
+
+/**
+ * Record the owner of single frames taken from a hot list or straight from the region indices.
+ */
+static void set_frames_owner(frame_allocator_v1::state_t* client_state, const address_t* frames, size_t n)
+{
+    for (size_t i = 0; i < n; ++i)
+        client_state->cache->ramtab->put(phys_frame_number(frames[i]), client_state->owner, FRAME_WIDTH, ramtab_v1::state_unused);
+}
+
+/**
+ * Pop up to n (at most BATCH) frames off the current VCPU hot list, refilling it from the region indices
+ * when it runs short.
+ * @return number of frames taken, 0 if the slot is busy or there is no free memory left.
+ */
+static size_t cache_allocate(frame_allocator_v1::state_t* client_state, address_t* frames, size_t n)
+{
+    frame_cache_slot_t* slot = frame_cache_slot(client_state->cache);
+    if (!slot || !slot->try_lock())
+        return 0;
+
+    if (slot->count < n)
+        slot->count += take_frames(client_state, slot->frames + slot->count, frame_cache_slot_t::BATCH);
+
+    size_t got = std::min(n, slot->count);
+    slot->count -= got;
+    memutils::copy_memory(frames, slot->frames + slot->count, got * sizeof(address_t));
+
+    slot->unlock();
+    return got;
+}
+
+/**
+ * Push a freed frame onto the current VCPU hot list. When the list is full, half of it goes back to the
+ * region indices first.
+ * @return false if the slot is busy and the frame has to be freed the regular way.
+ */
+static bool cache_free(frame_allocator_v1::state_t* client_state, address_t frame)
+{
+    frame_cache_slot_t* slot = frame_cache_slot(client_state->cache);
+    if (!slot || !slot->try_lock())
+        return false;
+
+    if (slot->count == frame_cache_slot_t::CAPACITY)
+    {
+        slot->count -= frame_cache_slot_t::BATCH;
+        give_back_frames(client_state, slot->frames + slot->count, frame_cache_slot_t::BATCH);
+    }
+    slot->frames[slot->count++] = frame;
+
+    slot->unlock();
+    return true;
+}
+
+/**
+ * Return every hot-listed and pre-zeroed frame to the region indices, for requests the indices alone cannot satisfy.
+ * @return true if any frames were returned.
+ */
+static bool drain_frame_cache(frame_allocator_v1::state_t* client_state)
+{
+    bool drained = false;
+    for (size_t i = 0; i < frame_cache_t::SLOTS; ++i)
+    {
+        frame_cache_slot_t& slot = client_state->cache->slots[i];
+        if (!slot.try_lock())
+            continue;
+        if (slot.count)
+        {
+            give_back_frames(client_state, slot.frames, slot.count);
+            slot.count = 0;
+            drained = true;
+        }
+        slot.unlock();
+    }
+
+    frame_zero_pool_t& pool = client_state->cache->zeroed;
+    if (pool.try_lock())
+    {
+        if (pool.count)
+        {
+            give_back_frames(client_state, pool.frames, pool.count);
+            pool.count = 0;
+            drained = true;
+        }
+        pool.unlock();
+    }
+    return drained;
+}
+
+//======================================================================================================================
+// pre-zeroed frames
+//======================================================================================================================
+
+/**
+ * Take the lowest free frame of the RAM regions if it lies in the directly mapped window, where it can be cleared.
+ */
+static bool take_direct_frame(frame_allocator_v1::state_t* client_state, address_t* frame)
+{
+    lockable_scope_lock_t lock(client_state->cache->index_lock);
+    address_t direct_end = client_state->cache->direct_end;
+    for (frames_module_v1::state_t* state = client_state->module_state; state; state = state->next)
+    {
+        if (state->attrs || !state->ramtab || (state->frame_width != FRAME_WIDTH) || (state->start >= direct_end))
+            continue;
+
+        uint32_t first = state->frames.lowest_free();
+        if ((first == ~0u) || (frame_address(state, first) >= direct_end))
+            continue;
+
+        state->frames.allocate_at(first, 1);
+        *frame = frame_address(state, first);
+        return true;
+    }
+    return false;
+}
+
+/**
+ * Clear up to budget frames into the zeroed pool, stopping when it is full.
+ * @return number of frames added.
+ */
+static size_t scrub_frames(frame_allocator_v1::state_t* client_state, size_t budget)
+{
+    frame_zero_pool_t& pool = client_state->cache->zeroed;
+    size_t cleared = 0;
+
+    while ((cleared < budget) && (pool.count < frame_zero_pool_t::CAPACITY))
+    {
+        address_t frame;
+        if (!take_direct_frame(client_state, &frame))
+            break;
+
+        // Clear outside of the pool lock, allocations only ever try it.
+        memutils::clear_memory(reinterpret_cast<void*>(frame), PAGE_SIZE);
+
+        bool added = false;
+        if (pool.try_lock())
+        {
+            if (pool.count < frame_zero_pool_t::CAPACITY)
+            {
+                pool.frames[pool.count++] = frame;
+                added = true;
+            }
+            pool.unlock();
+        }
+        if (!added)
+        {
+            give_back_frames(client_state, &frame, 1);
+            break;
+        }
+        ++cleared;
+    }
+
+    logger::trace() << __FUNCTION__ << ": cleared " << cleared << " frames, " << pool.count << " in the pool";
+    return cleared;
+}
+
+/**
+ * Get a zeroed single frame from the pool, or clear one in place when the pool is empty or busy.
+ * @return false if there are no free frames in the directly mapped window.
+ */
+static bool zeroed_allocate(frame_allocator_v1::state_t* client_state, address_t* frame)
+{
+    frame_zero_pool_t& pool = client_state->cache->zeroed;
+    if (pool.try_lock())
+    {
+        bool pooled = pool.count;
+        if (pooled)
+            *frame = pool.frames[--pool.count];
+        pool.unlock();
+        if (pooled)
+            return true;
+    }
+
+    if (!take_direct_frame(client_state, frame))
+        return false;
+    memutils::clear_memory(reinterpret_cast<void*>(*frame), PAGE_SIZE);
+    return true;
+}
+
+//======================================================================================================================
+// region walk
+//======================================================================================================================
+
 static frames_module_v1::state_t* alloc_any(frame_allocator_v1::closure_t* self, size_t n_physical_frames, uint32_t align, address_t* first_log_frame, size_t* n_log_frames)
 {
     frame_allocator_v1::state_t* client_state = self->d_state;
     frames_module_v1::state_t* state = client_state->module_state;
     frames_module_v1::state_t* cur_state = state;
+    lockable_scope_lock_t lock(client_state->cache->index_lock);
 
     logger::debug() << __FUNCTION__ << ": requested " << n_physical_frames << " frames.";
 
@@ -258,11 +557,10 @@ static frames_module_v1::state_t* alloc_any(frame_allocator_v1::closure_t* self,
             }
 
             // We need at least n_physical_frames contiguous frames starting aligned to "align"
-            for (*first_log_frame = 0; *first_log_frame < cur_state->n_logical_frames; ++(*first_log_frame))
-            {
-                if (cur_state->frames[*first_log_frame].free >= *n_log_frames && is_aligned_to_frame_width(frame_address(cur_state, *first_log_frame), align))
-                    return cur_state;
-            }
+            uint32_t align_order = (align > cur_state->frame_width) ? align - cur_state->frame_width : 0;
+            *first_log_frame = cur_state->frames.allocate(*n_log_frames, align_order);
+            if (*first_log_frame != address_t(~0u))
+                return cur_state;
         }
         cur_state = cur_state->next;
     }
@@ -275,6 +573,52 @@ static frames_module_v1::state_t* alloc_any(system_frame_allocator_v1::closure_t
     return alloc_any(reinterpret_cast<frame_allocator_v1::closure_t*>(self), n_physical_frames, align, first_log_frame, n_log_frames);
 }
 
+/**
+ * Like alloc_any(), but only from the directly mapped window, where frames can be cleared in place.
+ * When the block the index picks ends past the window, the window is scanned for a free run; that is only
+ * done for frame aligned requests.
+ */
+static frames_module_v1::state_t* alloc_direct(frame_allocator_v1::closure_t* self, size_t n_physical_frames, uint32_t align, address_t* first_log_frame, size_t* n_log_frames)
+{
+    frame_allocator_v1::state_t* client_state = self->d_state;
+    address_t direct_end = client_state->cache->direct_end;
+    lockable_scope_lock_t lock(client_state->cache->index_lock);
+
+    for (frames_module_v1::state_t* cur_state = client_state->module_state; cur_state; cur_state = cur_state->next)
+    {
+        if (cur_state->attrs || (cur_state->frame_width != FRAME_WIDTH) || (cur_state->start >= direct_end))
+            continue;
+
+        *n_log_frames = n_physical_frames;
+        uint32_t align_order = (align > FRAME_WIDTH) ? align - FRAME_WIDTH : 0;
+        uint32_t first = cur_state->frames.allocate(*n_log_frames, align_order);
+        if (first == ~0u)
+            continue;
+        if (frame_address(cur_state, first + *n_log_frames) <= direct_end)
+        {
+            *first_log_frame = first;
+            return cur_state;
+        }
+        cur_state->frames.free(first, *n_log_frames);
+        if (align_order)
+            continue;
+
+        for (first = 0; (first + *n_log_frames <= cur_state->n_logical_frames) && (frame_address(cur_state, first + *n_log_frames) <= direct_end); )
+        {
+            uint32_t run = cur_state->frames.free_run(first, *n_log_frames);
+            if (run >= *n_log_frames)
+            {
+                cur_state->frames.allocate_at(first, *n_log_frames);
+                *first_log_frame = first;
+                return cur_state;
+            }
+            first += run + 1;
+        }
+    }
+
+    return NULL; // no room in the directly mapped window
+}
+
 static frames_module_v1::state_t* alloc_range(frame_allocator_v1::closure_t* self, size_t n_physical_frames, address_t start, address_t* first_log_frame, size_t* n_log_frames)
 {
     frame_allocator_v1::state_t* client_state = self->d_state;
@@ -294,18 +638,22 @@ static frames_module_v1::state_t* alloc_range(frame_allocator_v1::closure_t* sel
      */
     // FIXME: on ARM, the allocation frame width may be smaller than FRAME_WIDTH (e.g. with 1K pages)
     fshift = cur_state->frame_width - FRAME_WIDTH; /* >= 0 */
+    lockable_scope_lock_t lock(client_state->cache->index_lock);
     *n_log_frames = align_to_frame_width(n_physical_frames, fshift) >> fshift; //bytes_to_log_frames, actually, too?
     *first_log_frame = bytes_to_log_frames(start - cur_state->start, cur_state->frame_width);
 
-    if (cur_state->frames[*first_log_frame].free < *n_log_frames)
+    size_t available = cur_state->frames.free_run(*first_log_frame, *n_log_frames);
+    if (available < *n_log_frames)
     {
         /* not enough space at requested address: give as much as possible */
         kconsole << "alloc_range: less than " << int(*n_log_frames << cur_state->frame_width) << " bytes free at requested address " << start;
-        *n_log_frames = cur_state->frames[*first_log_frame].free;
+        *n_log_frames = available;
         kconsole << ", returning as much as available - " << int(*n_log_frames << cur_state->frame_width) << endl;
+        cur_state->frames.allocate_at(*first_log_frame, *n_log_frames);
         return cur_state;
     }
 
+    cur_state->frames.allocate_at(*first_log_frame, *n_log_frames);
     int bytes = int(*n_log_frames << cur_state->frame_width);
     logger::debug() << "alloc_range: allocated " << bytes << " bytes at requested address " << start << "->" << start + bytes;
     return cur_state;
@@ -342,9 +690,45 @@ static memory_v1::address system_frame_allocator_v1_allocate_range(frame_allocat
         return NO_ADDRESS;
     }
 
+    // Zeroed single frames come from the pool that scrub() keeps, the clear is off the allocation path.
+    if ((attr == memory_v1::attrs_zeroed) && unaligned(start) && (n_phys_frames == 1))
+    {
+        address_t frame;
+        if (zeroed_allocate(client_state, &frame))
+        {
+            set_frames_owner(client_state, &frame, 1);
+            client_state->n_allocated_phys_frames += 1;
+            logger::debug() << __FUNCTION__ << ": allocated zeroed " << frame;
+            return frame;
+        }
+    }
+
+    /*
+     * Single frames anywhere come off the per-VCPU hot list without walking the regions.
+     * Like the frames allocate_many() hands out, they are accounted in the ramtab only, not in the region list.
+     */
+    if (unaligned(start) && (n_phys_frames == 1) && (attr == memory_v1::attrs_regular))
+    {
+        address_t frame;
+        if (cache_allocate(client_state, &frame, 1))
+        {
+            set_frames_owner(client_state, &frame, 1);
+            client_state->n_allocated_phys_frames += 1;
+            logger::debug() << __FUNCTION__ << ": allocated " << frame << " from the hot list";
+            return frame;
+        }
+    }
+
     if (unaligned(start))
     {
-        cur_state = alloc_any(self, n_phys_frames, frame_width, &first_frame, &n_frames);
+        // Frames to be zeroed are cleared through the 1:1 mapping, so they come from the directly mapped window.
+        bool direct = (attr == memory_v1::attrs_zeroed);
+        cur_state = direct ? alloc_direct(self, n_phys_frames, frame_width, &first_frame, &n_frames)
+                           : alloc_any(self, n_phys_frames, frame_width, &first_frame, &n_frames);
+        // Frames sitting on the hot lists may be what is missing.
+        if (!cur_state && drain_frame_cache(client_state))
+            cur_state = direct ? alloc_direct(self, n_phys_frames, frame_width, &first_frame, &n_frames)
+                               : alloc_any(self, n_phys_frames, frame_width, &first_frame, &n_frames);
         if (!cur_state)
         {
             logger::warning() << __FUNCTION__ << ": failed to allocate " << bytes << " bytes.";
@@ -359,6 +743,13 @@ static memory_v1::address system_frame_allocator_v1_allocate_range(frame_allocat
             logger::warning() << __FUNCTION__ << ": start " << start << " not aligned to width " << frame_width;
             return NO_ADDRESS;
         }
+        if ((attr == memory_v1::attrs_zeroed) && (start + (n_phys_frames << FRAME_WIDTH) > client_state->cache->direct_end))
+        {
+            logger::warning() << __FUNCTION__ << ": cannot clear frames at " << start << " outside of the directly mapped window";
+            return NO_ADDRESS;
+        }
+        // Hot-listed frames would look used to the region index.
+        drain_frame_cache(client_state);
         cur_state = alloc_range(self, n_phys_frames, start, &first_frame, &n_frames);
         if (!cur_state)
         {
@@ -381,7 +772,6 @@ static memory_v1::address system_frame_allocator_v1_allocate_range(frame_allocat
 
     start = frame_address(cur_state, first_frame);
 
-    alloc_update_free_predecessors(cur_state, first_frame);
     mark_frames_used(client_state, cur_state, first_frame, n_frames);
 
     client_state->n_allocated_phys_frames += n_phys_frames;
@@ -392,6 +782,10 @@ static memory_v1::address system_frame_allocator_v1_allocate_range(frame_allocat
         PANIC("Something's wrong.");
     }
 
+    // Anything not served by the zeroed pool is cleared here, through the 1:1 mapping of the frames.
+    if (attr == memory_v1::attrs_zeroed)
+        memutils::clear_memory(reinterpret_cast<void*>(start), n_phys_frames << FRAME_WIDTH);
+
     logger::debug() << __FUNCTION__ << ": allocated " << start;
     return start;
 }
@@ -486,6 +880,18 @@ static void system_frame_allocator_v1_free(frame_allocator_v1::closure_t* self,
         }
     }
 
+    // Single frames go onto the per-VCPU hot list, the region index only sees them when the list overflows.
+    if ((n_phys_frames == 1) && cur_state->ramtab && (region_frame_width == FRAME_WIDTH) && (allocation_frame_width == FRAME_WIDTH))
+    {
+        // Disown the frame first, once on the list it may be handed out again right away.
+        cur_state->ramtab->put(phys_frame_number(addr), OWNER_NONE, FRAME_WIDTH, ramtab_v1::state_unused);
+        if (cache_free(client_state, addr))
+        {
+            release_quota(client_state, 1);
+            return;
+        }
+    }
+
     // Now get the frame indices in the region (i.e. logical frames of width region_frame_width).
     address_t start_log_frame = bytes_to_log_frames(addr - cur_state->start, region_frame_width);
     address_t end_log_frame = bytes_to_log_frames(end - cur_state->start, region_frame_width);
@@ -496,30 +902,11 @@ static void system_frame_allocator_v1_free(frame_allocator_v1::closure_t* self,
         PANIC("Frame allocator misuse.");
     }
 
-    /*
-     * First sort out the frames we're freeing.
-     * We do this from the back so can keep "free" counts consistent.
-     */
-    address_t i;
-    size_t end_free = (end_log_frame == cur_state->n_logical_frames) ? 0 : cur_state->frames[end_log_frame].free;
-
-    for (i = end_log_frame; i >= start_log_frame; --i)
-    {
-        cur_state->frames[i].free = ++end_free;
-        logger::trace() << "1. Log frame " << i << " free set to " << cur_state->frames[i].free;
-    }
-
-    /*
-     * Now need to update all empty frames immediately before the first
-     * frame we've freed; hopefully this will not be too many since we
-     * alloc first fit.
-     * [Note: i points to frame before start_log_frame already]
-     */
-    for (; /*wrap protect:*/(i < start_log_frame) && (cur_state->frames[i].free != 0); --i)
-    {
-        cur_state->frames[i].free = ++end_free;
-        logger::trace() << "2. Log frame " << i << " free set to " << cur_state->frames[i].free;
-    }
+    /* First sort out the frames we're freeing, they merge with free neighbours in the index. */
+    client_state->cache->index_lock.lock();
+    cur_state->frames.free(start_log_frame, end_log_frame - start_log_frame);
+    client_state->cache->index_lock.unlock();
+    logger::trace() << __FUNCTION__ << ": freed log frames " << start_log_frame << ".." << end_log_frame;
 
     /* Now update the ramtab (if appropriate) */
     if(cur_state->ramtab)
@@ -534,14 +921,8 @@ static void system_frame_allocator_v1_free(frame_allocator_v1::closure_t* self,
         }
     }
 
-    /* Finally, update number of allocated frames (protect from wrapping), and our linked list of regions */
-    size_t new_phys_frames = client_state->n_allocated_phys_frames - n_phys_frames;
-    if (new_phys_frames > client_state->n_allocated_phys_frames)
-    {
-        logger::warning() << __FUNCTION__ << ": freeing more frames than I own (ignored)";
-        new_phys_frames = 0;
-    }
-    client_state->n_allocated_phys_frames = new_phys_frames;
+    /* Finally, update number of allocated frames, and our linked list of regions */
+    release_quota(client_state, n_phys_frames);
 
 /*  if(!del_range(cst, base, npf, alfw)) {
         eprintf("Frames$Free: something's wrong.\n");
@@ -549,6 +930,66 @@ static void system_frame_allocator_v1_free(frame_allocator_v1::closure_t* self,
     }*/
 }
 
+/**
+ * Single frames are taken from the region indices in blocks of up to BATCH frames, one region walk per block,
+ * and owned in the ramtab only. The hot lists are only touched when the indices run dry.
+ */
+static uint32_t system_frame_allocator_v1_allocate_many(frame_allocator_v1::closure_t* self, uint32_t n_frames, uint32_t frame_width, frame_allocator_v1::address_seq* frames)
+{
+    frame_allocator_v1::state_t* client_state = reinterpret_cast<frame_allocator_v1::state_t*>(self->d_state);
+    uint32_t allocated = 0;
+
+    // Wider logical frames are not hot-listed, allocate them one by one.
+    if (frame_width > FRAME_WIDTH)
+    {
+        for (; allocated < n_frames; ++allocated)
+        {
+            memory_v1::address frame = system_frame_allocator_v1_allocate(self, 1UL << frame_width, frame_width);
+            if (frame == NO_ADDRESS)
+                break;
+            frames->push_back(frame);
+        }
+        return allocated;
+    }
+
+    size_t quota = (client_state->n_allocated_phys_frames < client_state->guaranteed_frames) ? client_state->guaranteed_frames - client_state->n_allocated_phys_frames : 0;
+    if (n_frames > quota)
+    {
+        logger::warning() << __FUNCTION__ << ": client quota allows only " << quota << " of " << n_frames << " frames";
+        n_frames = quota;
+    }
+
+    address_t batch[frame_cache_slot_t::BATCH];
+    while (allocated < n_frames)
+    {
+        size_t want = std::min<size_t>(n_frames - allocated, frame_cache_slot_t::BATCH);
+        size_t got = take_frames(client_state, batch, want);
+        if (!got && drain_frame_cache(client_state))
+            got = take_frames(client_state, batch, want);
+        if (!got)
+        {
+            logger::warning() << __FUNCTION__ << ": out of physical memory after " << allocated << " frames";
+            break;
+        }
+
+        set_frames_owner(client_state, batch, got);
+        for (size_t i = 0; i < got; ++i)
+            frames->push_back(batch[i]);
+        allocated += got;
+        client_state->n_allocated_phys_frames += got;
+    }
+
+    logger::debug() << __FUNCTION__ << ": allocated " << allocated << " frames";
+    return allocated;
+}
+
+static void system_frame_allocator_v1_free_many(frame_allocator_v1::closure_t* self, frame_allocator_v1::address_seq frames, uint32_t frame_width)
+{
+    // Every frame gets the ownership checks of free(), single frames end up on the hot list.
+    for (auto frame : frames)
+        system_frame_allocator_v1_free(self, frame, 1UL << frame_width);
+}
+
 static void system_frame_allocator_v1_destroy(frame_allocator_v1::closure_t* self)
 {
     PANIC("frames_mod: destroy is not implemented!");
@@ -598,6 +1039,7 @@ static frame_allocator_v1::closure_t* system_frame_allocator_v1_create_client(sy
     new_client_state->extra_frames = extra_frames;
     new_client_state->heap = client_state->heap;
     new_client_state->module_state = client_state->module_state;
+    new_client_state->cache = client_state->cache;
 
     // Allocate init_alloc_frames.
     address_t first_frame;
@@ -620,7 +1062,6 @@ static frame_allocator_v1::closure_t* system_frame_allocator_v1_create_client(sy
     address_t start = frame_address(cur_state, first_frame);
     logger::debug() << __FUNCTION__ << ": allocated " << init_alloc_frames << " physical frames at " << start;
 
-    alloc_update_free_predecessors(cur_state, first_frame);
     mark_frames_used(new_client_state, cur_state, first_frame, n_frames);
 
     /* Update the number of frames we've allocated on this interface */
@@ -644,15 +1085,23 @@ static bool system_frame_allocator_v1_add_frames(system_frame_allocator_v1::clos
     return false;
 }
 
+static uint32_t system_frame_allocator_v1_scrub(system_frame_allocator_v1::closure_t* self, uint32_t budget)
+{
+    return scrub_frames(reinterpret_cast<frame_allocator_v1::state_t*>(self->d_state), budget);
+}
+
 static const system_frame_allocator_v1::ops_t system_frame_allocator_v1_methods =
 {
     system_frame_allocator_v1_allocate,
     system_frame_allocator_v1_allocate_range,
     system_frame_allocator_v1_query,
     system_frame_allocator_v1_free,
+    system_frame_allocator_v1_allocate_many,
+    system_frame_allocator_v1_free_many,
     system_frame_allocator_v1_destroy,
     system_frame_allocator_v1_create_client,
     system_frame_allocator_v1_add_frames,
+    system_frame_allocator_v1_scrub,
 };
 
 //======================================================================================================================
@@ -662,20 +1111,20 @@ static const system_frame_allocator_v1::ops_t system_frame_allocator_v1_methods
 static memory_v1::size frames_module_v1_required_size(frames_module_v1::closure_t* self)
 {
     UNUSED(self);
-    size_t n_regions = 0, n_frames = 0, res = 0;
+    size_t n_regions = 0, index_size = 0, res = 0;
     bootinfo_t* bi = new(bootinfo_t::ADDRESS) bootinfo_t; // simplify memory map operations
 
-    // Scan through the set of mem desc and count the number of logical frames they contain in total.
-    std::for_each(bi->mmap_begin(), bi->mmap_end(), [&n_regions, &n_frames](const multiboot_t::mmap_entry_t* e)
+    // Scan through the set of mem desc and count the size of free frame indices for the frames they contain.
+    std::for_each(bi->mmap_begin(), bi->mmap_end(), [&n_regions, &index_size](const multiboot_t::mmap_entry_t* e)
     {
         if (e->type() == multiboot_t::mmap_entry_t::non_free)
             return;
 
-        n_frames += e->size() >> FRAME_WIDTH;
+        index_size += frame_buddy_t::required_size(phys_frame_number(e->address()), phys_frame_number(e->size()));
         ++n_regions;
     });
 
-    res = sizeof(frame_allocator_v1::closure_t) + sizeof(frame_allocator_v1::state_t) + n_regions * sizeof(frames_module_v1::state_t) + n_frames * sizeof(frame_st);
+    res = sizeof(frame_allocator_v1::closure_t) + sizeof(frame_allocator_v1::state_t) + sizeof(frame_cache_t) + n_regions * sizeof(frames_module_v1::state_t) + index_size;
     res = page_align_up(res);
 
     logger::debug() << "frames_mod: required_size counted " << int(n_regions) << " memory regions";
@@ -694,7 +1143,22 @@ static system_frame_allocator_v1::closure_t* frames_module_v1_create(frames_modu
     system_frame_allocator_v1::closure_t* ret = reinterpret_cast<system_frame_allocator_v1::closure_t*>(&client_state->closure);
     closure_init(ret, &system_frame_allocator_v1_methods, reinterpret_cast<system_frame_allocator_v1::state_t*>(client_state));
 
-    frames_module_v1::state_t* frames_state = reinterpret_cast<frames_module_v1::state_t*>(where_to_start + sizeof(frame_allocator_v1::state_t));
+    // Hot lists follow the system client record, region records follow the hot lists.
+    frame_cache_t* cache = reinterpret_cast<frame_cache_t*>(where_to_start + sizeof(frame_allocator_v1::state_t));
+    memutils::fill_memory(cache, 0, sizeof(*cache));
+    cache->ramtab = rtab;
+
+    bootinfo_t* bi = new(bootinfo_t::ADDRESS) bootinfo_t;
+
+    // Physical memory mapped 1:1 from address zero up, frames there can be cleared without mapping them.
+    std::for_each(bi->vmap_begin(), bi->vmap_end(), [cache](const memory_v1::mapping* e)
+    {
+        if ((e->virt == e->phys) && (e->phys <= cache->direct_end))
+            cache->direct_end = std::max(cache->direct_end, address_t(e->phys + (e->nframes << FRAME_WIDTH)));
+    });
+    logger::debug() << "frames_mod: frames below " << cache->direct_end << " are directly mapped";
+
+    frames_module_v1::state_t* frames_state = reinterpret_cast<frames_module_v1::state_t*>(cache + 1);
 
     client_state->owner = OWNER_SYSTEM;
     client_state->n_allocated_phys_frames = 0;
@@ -702,12 +1166,12 @@ static system_frame_allocator_v1::closure_t* frames_module_v1_create(frames_modu
     client_state->extra_frames = -1;
     client_state->heap = 0;
     client_state->module_state = frames_state;
+    client_state->cache = cache;
 
     frames_module_v1::state_t* running_state = frames_state;
     frames_module_v1::state_t* last_state = running_state;
     size_t n_regions = 0;
 
-    bootinfo_t* bi = new(bootinfo_t::ADDRESS) bootinfo_t;
     std::for_each(bi->mmap_begin(), bi->mmap_end(), [&running_state, &last_state, &n_regions, rtab](const multiboot_t::mmap_entry_t* e)
     {
         if (e->type() == multiboot_t::mmap_entry_t::non_free)
@@ -728,12 +1192,10 @@ static system_frame_allocator_v1::closure_t* frames_module_v1_create(frames_modu
             running_state->ramtab = 0;
             logger::debug() << "Adding non-RAM at " << e->address() << " is " << e->size() << " bytes of type " << e->type();
         }
-        running_state->frames = reinterpret_cast<frame_st*>(running_state + 1);
+        running_state->frames.init(running_state + 1, phys_frame_number(e->address()), running_state->n_logical_frames);
 
-        for(size_t j = 0; j < running_state->n_logical_frames; ++j)
-            running_state->frames[j].free = running_state->n_logical_frames - j;
-
-        running_state->next = reinterpret_cast<frames_module_v1::state_t*>(&running_state->frames[running_state->n_logical_frames]);
+        size_t index_size = frame_buddy_t::required_size(phys_frame_number(e->address()), running_state->n_logical_frames);
+        running_state->next = reinterpret_cast<frames_module_v1::state_t*>(reinterpret_cast<address_t>(running_state + 1) + index_size);
         last_state = running_state;
         running_state = running_state->next;
         ++n_regions;
@@ -741,7 +1203,7 @@ static system_frame_allocator_v1::closure_t* frames_module_v1_create(frames_modu
     last_state->next = 0;
 
     logger::debug() << "frames_mod: counted " << int(n_regions) << " memory regions again";
-    logger::debug() << "frames_mod: and finished at address " << page_align_up(reinterpret_cast<address_t>(&last_state->frames[last_state->n_logical_frames]));
+    logger::debug() << "frames_mod: and finished at address " << page_align_up(reinterpret_cast<address_t>(running_state));
 
     /*
      * Mark already used frames allocated.
@@ -759,7 +1221,6 @@ static system_frame_allocator_v1::closure_t* frames_module_v1_create(frames_modu
         if (n_frames == 0)
             PANIC("Already allocated range deemed unavailable!");
 
-        alloc_update_free_predecessors(running_state, first_frame);
         mark_frames_used(client_state, running_state, first_frame, n_frames);
         
         client_state->n_allocated_phys_frames += n_frames;
@@ -779,6 +1240,10 @@ static void frames_module_v1_finish_init(frames_module_v1::closure_t* self, syst
     }
 
     state->heap = heap;
+
+    // Start out with a full zeroed pool, so domain creation at boot does not pay for clearing frames.
+    // There is no idle loop to call scrub() from, the pool is not refilled after that.
+    scrub_frames(state, frame_zero_pool_t::CAPACITY);
 }
 
 static const frames_module_v1::ops_t frames_module_v1_methods =
@@ -96,11 +96,76 @@ static gatekeeper_v1::ops_t simple_gatekeeper_ops =
 // Gatekeeper heap.
 //=====================================================================================================================
 
+/**
+ * Heap the gatekeeper heap closure hands its calls over to.
+ */
+static inline heap_v1::closure_t* wrapped_heap(heap_v1::closure_t* self)
+{
+    return reinterpret_cast<gatekeeper_heap_state_t*>(self->d_state)->heap;
+}
+
+static memory_v1::address gatekeeper_heap_allocate(heap_v1::closure_t* self, memory_v1::size size)
+{
+    return wrapped_heap(self)->allocate(size);
+}
+
+static void gatekeeper_heap_free(heap_v1::closure_t* self, memory_v1::address ptr)
+{
+    wrapped_heap(self)->free(ptr);
+}
+
+static memory_v1::address gatekeeper_heap_realloc(heap_v1::closure_t* self, memory_v1::address ptr, memory_v1::size size)
+{
+    return wrapped_heap(self)->realloc(ptr, size);
+}
+
+static void gatekeeper_heap_statistics(heap_v1::closure_t* self, heap_v1::stats* counters)
+{
+    wrapped_heap(self)->statistics(counters);
+}
+
+static memory_v1::size gatekeeper_heap_bin_statistics(heap_v1::closure_t* self, uint32_t bin, memory_v1::size* used_bytes, memory_v1::size* free_bytes, uint32_t* allocations)
+{
+    return wrapped_heap(self)->bin_statistics(bin, used_bytes, free_bytes, allocations);
+}
+
+static void gatekeeper_heap_set_sampling(heap_v1::closure_t* self, uint32_t period)
+{
+    wrapped_heap(self)->set_sampling(period);
+}
+
+static memory_v1::address gatekeeper_heap_call_site(heap_v1::closure_t* self, uint32_t n, uint32_t* samples, memory_v1::size* bytes)
+{
+    return wrapped_heap(self)->call_site(n, samples, bytes);
+}
+
+static void gatekeeper_heap_set_coalescing(heap_v1::closure_t* self, heap_v1::coalescing mode, uint32_t budget)
+{
+    wrapped_heap(self)->set_coalescing(mode, budget);
+}
+
+static uint32_t gatekeeper_heap_coalesce(heap_v1::closure_t* self, uint32_t budget)
+{
+    return wrapped_heap(self)->coalesce(budget);
+}
+
+static void gatekeeper_heap_check(heap_v1::closure_t* self, bool check_free_blocks)
+{
+    wrapped_heap(self)->check(check_free_blocks);
+}
+
 static heap_v1::ops_t gatekeeper_heap_ops =
 {
-    NULL,
-    NULL,
-    NULL
+    gatekeeper_heap_allocate,
+    gatekeeper_heap_free,
+    gatekeeper_heap_realloc,
+    gatekeeper_heap_statistics,
+    gatekeeper_heap_bin_statistics,
+    gatekeeper_heap_set_sampling,
+    gatekeeper_heap_call_site,
+    gatekeeper_heap_set_coalescing,
+    gatekeeper_heap_coalesce,
+    gatekeeper_heap_check
 };
 
 //=====================================================================================================================
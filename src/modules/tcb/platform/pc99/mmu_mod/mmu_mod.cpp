@@ -61,6 +61,7 @@ struct shadow_t
 
 typedef uint8_t     l2_info;    /* free or used info for 1K L2 page tables */
 #define L2FREE      (l2_info)0x12
+#define L2CLEAN     (l2_info)0x34   /* free and already cleared */
 #define L2USED      (l2_info)0x99
 
 #define PDIDX(_pdid)   ((_pdid) & 0xffff)
@@ -80,6 +81,7 @@ struct mmu_v1::state_t
     pdom_st               pdominfo[PDIDX_MAX]; /* Map pdom idx to pdom_st's */
 
     bool                  use_global_pages;    /* Set iff we can use PGE    */
+    bool                  use_large_pages;     /* Set iff we can use PSE    */
 
     /*system_*/frame_allocator_v1::closure_t*  system_frame_allocator;
     heap_v1::closure_t*                        heap;
@@ -108,13 +110,14 @@ struct mmu_v1::state_t
 //======================================================================================================================
 
 #define L2SIZE          (8*KiB)                // 4K for L2 pagetable + 4K for shadow(?)
+#define L2_CLEAR_AHEAD  16                     // L2 tables cleared in advance by finish_init
 
 inline bool alloc_l2table(mmu_v1::state_t* state, address_t *l2va, address_t *l2pa)
 {
     size_t i;
 
     for (i = state->l2_next; i < state->l2_max; i++)
-        if (state->info[i] == L2FREE)
+        if ((state->info[i] == L2FREE) || (state->info[i] == L2CLEAN))
             break;
 
     if (i == state->l2_max)
@@ -124,18 +127,136 @@ inline bool alloc_l2table(mmu_v1::state_t* state, address_t *l2va, address_t *l2
         return false;
     }
 
+    bool clean = (state->info[i] == L2CLEAN);
     state->info[i] = L2USED;
     state->l2_next = i+1;
 
     *l2va = state->l2_virt + (L2SIZE * i);
-    memutils::clear_memory(reinterpret_cast<void*>(*l2va), L2SIZE);
+    if (!clean)
+        memutils::clear_memory(reinterpret_cast<void*>(*l2va), L2SIZE);
     *l2pa = state->l2_phys + (L2SIZE * i);
 
     logger::debug() << "alloc_l2table: new L2 table at va=" << *l2va << ", pa=" << *l2pa << ", shadow va=" << SHADOW(*l2va);
     return true;
 }
 
-static bool add4k_page(mmu_v1::state_t* state, address_t va, page_t pte, sid_t sid)
+/**
+ * Clear up to n free L2 tables ahead of use, so that alloc_l2table() can hand them out without clearing.
+ */
+static size_t clear_l2tables(mmu_v1::state_t* state, size_t n)
+{
+    size_t cleared = 0;
+    for (size_t i = state->l2_next; (i < state->l2_max) && (cleared < n); i++)
+    {
+        if (state->info[i] == L2FREE)
+        {
+            memutils::clear_memory(reinterpret_cast<void*>(state->l2_virt + (L2SIZE * i)), L2SIZE);
+            state->info[i] = L2CLEAN;
+            ++cleared;
+        }
+    }
+    return cleared;
+}
+
+/**
+ * Return an L2 table to the pool, after a 4MB page has replaced it.
+ */
+static void free_l2table(mmu_v1::state_t* state, address_t l2va)
+{
+    size_t i = (l2va - state->l2_virt) / L2SIZE;
+    state->info[i] = L2FREE;
+    if (i < state->l2_next)
+        state->l2_next = i;
+}
+
+/**
+ * Drop the TLB entries for the 4MB range of a page directory entry, which may be cached as a 4MB page or as 4K pages.
+ */
+inline void flush_4mb_range(int l1idx)
+{
+    nucleus::flush_tlb(address_t(l1idx) << page_t::width_4mib, N_L2_ENTRIES);
+}
+
+/**
+ * Replace a 4MB page by an L2 table mapping the same frames with 4K pages, so that part of it can change.
+ */
+static bool demote4m_page(mmu_v1::state_t* state, int l1idx)
+{
+    address_t l2va, l2pa;
+
+    if (!alloc_l2table(state, &l2va, &l2pa))
+    {
+        logger::warning() << __FUNCTION__ << ": cannot alloc l2 table.";
+        return false;
+    }
+
+    page_t pde = state->l1_mapping[l1idx];
+    page_t pte;
+    pte = 0;
+    pte.set_flags(pde.flags());
+    for (size_t i = 0; i < N_L2_ENTRIES; ++i)
+    {
+        pte.set_frame(pde.frame() + (i << PAGE_WIDTH));
+        reinterpret_cast<page_t*>(l2va)[i] = pte;
+        SHADOW(l2va)[i] = state->l1_shadows[l1idx];
+    }
+
+    // set_flags() drops the 4MB bit, this is the same entry add4k_page() makes for a new table.
+    state->l1_mapping[l1idx].set_frame(l2pa);
+    state->l1_mapping[l1idx].set_flags(page_t::writable|page_t::write_through);
+    state->l1_virt[l1idx].set_frame(l2va);
+    flush_4mb_range(l1idx);
+
+    logger::debug() << __FUNCTION__ << ": split 4MB page at va=" << (address_t(l1idx) << page_t::width_4mib);
+    return true;
+}
+
+/**
+ * Replace an L2 table by a 4MB page if its entries map one naturally aligned 4MB chunk of frames
+ * with the same flags for the same stretch.
+ */
+static bool promote_l2table(mmu_v1::state_t* state, int l1idx)
+{
+    if (!state->use_large_pages || !state->l1_mapping[l1idx].is_present() || state->l1_mapping[l1idx].is_4mb())
+        return false;
+
+    address_t l2va = state->l2_virt + (state->l1_mapping[l1idx].frame() - state->l2_phys);
+    page_t* ptes = reinterpret_cast<page_t*>(l2va);
+    shadow_t* shadows = SHADOW(l2va);
+
+    address_t base = ptes[0].frame();
+    if (!ptes[0].is_present() || !is_aligned_to_frame_width(base, page_t::width_4mib))
+        return false;
+
+    flags_t flags = ptes[0].flags();
+    for (size_t i = 1; i < N_L2_ENTRIES; ++i)
+    {
+        if ((ptes[i].frame() != base + (i << PAGE_WIDTH)) || !ptes[i].is_present() || (ptes[i].flags() != flags)
+            || (shadows[i].sid != shadows[0].sid) || (shadows[i].flags != shadows[0].flags))
+            return false;
+    }
+
+    page_t pde = ptes[0];
+    pde.set_4mb(true);
+    state->l1_mapping[l1idx] = pde;
+    state->l1_virt[l1idx] = 0;
+    state->l1_shadows[l1idx] = shadows[0];
+    free_l2table(state, l2va);
+    flush_4mb_range(l1idx);
+
+    logger::debug() << __FUNCTION__ << ": merged va=" << (address_t(l1idx) << page_t::width_4mib) << " into a 4MB page";
+    return true;
+}
+
+/*
+** add4k_pages maps a run of up to n_pages consecutive pages
+** starting at va, walking the page directory once. The run stops
+** at the end of the L2 table. Each next page maps the frame
+** "frame_step" bytes after the previous one (zero maps them all
+** the same). It returns the number of pages mapped, or zero on
+** failure.
+*/
+static size_t add4k_pages(mmu_v1::state_t* state, address_t va, size_t n_pages, page_t pte, size_t frame_step, sid_t sid)
 {
     int l1idx, l2idx;
     address_t  l2va, l2pa;
@@ -146,18 +267,19 @@ static bool add4k_page(mmu_v1::state_t* state, address_t va, page_t pte, sid_t s
     {
         logger::debug() << "mapping va=" << va << " requires new L2 table";
         if (!alloc_l2table(state, &l2va, &l2pa)) {
-            logger::warning() << "!!! intel_mmu:add4k_page - cannot alloc l2 table.";
-            return false;
+            logger::warning() << "!!! intel_mmu:add4k_pages - cannot alloc l2 table.";
+            return 0;
         }
         state->l1_mapping[l1idx].set_frame(l2pa);
         state->l1_mapping[l1idx].set_flags(page_t::writable|page_t::write_through);
         state->l1_virt[l1idx].set_frame(l2va);
     }
 
-    if (state->l1_mapping[l1idx].is_4mb())
+    // A 4K page inside a large page splits it.
+    if (state->l1_mapping[l1idx].is_4mb() && !demote4m_page(state, l1idx))
     {
-        logger::warning() << "URK! mapping va=" << va << " would use a 4MB page!";
-        return false;
+        logger::warning() << "!!! intel_mmu:add4k_pages - cannot split 4MB page at va=" << va;
+        return 0;
     }
 
     l2pa = state->l1_mapping[l1idx].frame();
@@ -168,14 +290,28 @@ static bool add4k_page(mmu_v1::state_t* state, address_t va, page_t pte, sid_t s
 
     // Ok, once here, we have a pointer to our l2 table in "l2va"
     l2idx = pte_entry(va);
+    size_t count = std::min<size_t>(n_pages, N_L2_ENTRIES - l2idx);
+
+    // Set ptes into real ptab in a batched store loop over consecutive words.
+    uint32_t* ptes = reinterpret_cast<uint32_t*>(l2va) + l2idx;
+    uint32_t entry = pte;
+    for (size_t i = 0; i < count; ++i)
+        ptes[i] = entry + i * frame_step;
+
+    // Setup shadow ptes (hold sid + original global rights), the same for the whole run.
+    shadow_t shadow;
+    shadow.sid = sid;
+    shadow.flags = pte.flags();
+    shadow_t* shadows = SHADOW(l2va) + l2idx;
+    for (size_t i = 0; i < count; ++i)
+        shadows[i] = shadow;
+
+    return count;
+}
 
-    // Set pte into real ptab
-    reinterpret_cast<page_t*>(l2va)[l2idx] = pte;
-
-    // Setup shadow pte (holds sid + original global rights)
-    SHADOW(l2va)[l2idx].sid = sid;  // store sid in shadow
-    SHADOW(l2va)[l2idx].flags = pte.flags();
-    return true;
+static bool add4k_page(mmu_v1::state_t* state, address_t va, page_t pte, sid_t sid)
+{
+    return add4k_pages(state, va, 1, pte, 0, sid) == 1;
 }
 
 /*
@@ -199,8 +335,24 @@ static size_t update4k_pages(mmu_v1::state_t* state, address_t va, size_t n_page
 
     if (state->l1_mapping[l1idx].is_4mb())
     {
-        logger::warning() << __FUNCTION__ << ": address " << va << " is mapped using a 4MB page!";
-        return 0;
+        // All of the large page changes: update the directory entry in place.
+        if (is_aligned_to_frame_width(va, page_t::width_4mib) && (n_pages >= N_L2_ENTRIES))
+        {
+            flags_t flags = pte.flags();
+            state->l1_mapping[l1idx].set_flags(flags);
+            state->l1_mapping[l1idx].set_4mb(true);
+            state->l1_shadows[l1idx].sid = sid;
+            state->l1_shadows[l1idx].flags = flags;
+            flush_4mb_range(l1idx);
+            return N_L2_ENTRIES;
+        }
+
+        // Part of it changes: split it into 4K pages first.
+        if (!demote4m_page(state, l1idx))
+        {
+            logger::warning() << __FUNCTION__ << ": cannot split 4MB page at " << va;
+            return 0;
+        }
     }
 
     l2pa = state->l1_mapping[l1idx].frame();
@@ -213,20 +365,126 @@ static size_t update4k_pages(mmu_v1::state_t* state, address_t va, size_t n_page
     // Ok, once here, we have a pointer to our l2 table in "l2va"
     l2idx = pte_entry(va);
 
-    // Update only flags and sid.
+    // Update only flags and sid, up to the end of this L2 table.
     flags_t flags = pte.flags();
+    size_t i, count = std::min<size_t>(n_pages, N_L2_ENTRIES - l2idx);
+
+    page_t* ptes = reinterpret_cast<page_t*>(l2va) + l2idx;
+    for (i = 0; i < count; ++i)
+        ptes[i].set_flags(flags);
+
+    // Setup shadow ptes (hold sid + original global rights)
+    shadow_t shadow;
+    shadow.sid = sid;
+    shadow.flags = flags;
+    shadow_t* shadows = SHADOW(l2va) + l2idx;
+    for (i = 0; i < count; ++i)
+        shadows[i] = shadow;
+
+    // The update may have made a split large page uniform again.
+    promote_l2table(state, l1idx);
+
+    return i;
+}
+
+/**
+ * Map a naturally aligned 4MB chunk with a single PSE page directory entry, its shadow is kept in l1_shadows.
+ * Without PSE the chunk is mapped with 4K pages.
+ */
+static bool add4m_page(mmu_v1::state_t* state, address_t va, page_t pte, sid_t sid)
+{
+    int l1idx = pde_entry(va);
+
+    if (!state->use_large_pages)
+        return add4k_pages(state, va, N_L2_ENTRIES, pte, PAGE_SIZE, sid) == N_L2_ENTRIES;
+
+    if (state->l1_mapping[l1idx].is_present() && !state->l1_mapping[l1idx].is_4mb())
+    {
+        logger::warning() << __FUNCTION__ << ": va=" << va << " is already mapped with 4K pages";
+        return false;
+    }
+
+    pte.set_4mb(true);
+    state->l1_mapping[l1idx] = pte;
+    state->l1_virt[l1idx] = 0;
+
+    // Setup shadow pde (holds sid + original global rights)
+    state->l1_shadows[l1idx].sid = sid;
+    state->l1_shadows[l1idx].flags = pte.flags();
+    return true;
+}
+
+/**
+ * Update a run of n_pages whole 4MB pages; pages which have been split are updated through their L2 table.
+ * Returns the number of 4MB pages updated, zero on failure.
+ */
+static size_t update4m_pages(mmu_v1::state_t* state, address_t va, size_t n_pages, page_t pte, sid_t sid)
+{
     size_t i;
+    for (i = 0; i < n_pages; ++i)
+    {
+        if (update4k_pages(state, va + (i << page_t::width_4mib), N_L2_ENTRIES, pte, sid) != N_L2_ENTRIES)
+            break;
+    }
+    return i;
+}
+
+/**
+ * Whether the next n_pages pages of page_width at va, backed by frames at pa, can go into a single 4MB page.
+ */
+inline bool large_page_fits(mmu_v1::state_t* state, size_t page_width, address_t va, address_t pa, size_t n_pages)
+{
+    return state->use_large_pages && (page_width < page_t::width_4mib)
+        && (n_pages >= (1UL << (page_t::width_4mib - page_width)))
+        && is_aligned_to_frame_width(va, page_t::width_4mib) && is_aligned_to_frame_width(pa, page_t::width_4mib)
+        && (!state->l1_mapping[pde_entry(va)].is_present() || state->l1_mapping[pde_entry(va)].is_4mb());
+}
 
-    for (i = 0; (i < n_pages) && ((i + l2idx) < N_L2_ENTRIES); ++i)
+/**
+ * Check the ramtab entries of the first frame of each of n_pages pages of page_width at phys before they get mapped.
+ * Frames past the end of the ramtab (e.g. device memory) are not tracked.
+ */
+static void check_ramtab(mmu_v1::state_t* state, address_t phys, size_t n_pages, size_t page_width)
+{
+    for (size_t j = 0; j < n_pages; ++j)
     {
-        reinterpret_cast<page_t*>(l2va)[l2idx + i].set_flags(flags);
+        address_t pa = phys + (j << page_width);
+        size_t frame = pa >> FRAME_WIDTH;
+        if (frame >= state->ramtab_size)
+            break;
 
-        // Setup shadow pte (holds sid + original global rights)
-        SHADOW(l2va)[l2idx + i].sid = sid;  // store sid in shadow
-        SHADOW(l2va)[l2idx + i].flags = flags; //??
+        size_t frame_width;
+        ramtab_v1::state frame_state;
+        if (state->ramtab_closure.get(frame, &frame_width, &frame_state) == OWNER_NONE)
+        {
+            logger::warning() << __FUNCTION__ << ": physical address " << pa << " not owned!";
+            nucleus::debug_stop();
+        }
+
+        if (frame_state == ramtab_v1::state_nailed)
+        {
+            logger::warning() << __FUNCTION__ << ": physical address " << pa << " is nailed!";
+            nucleus::debug_stop();
+        }
     }
+}
 
-    return i;
+/**
+ * Mark the first frame of each of n_pages pages of page_width at phys as mapped, owner and frame width stay.
+ */
+static void mark_ramtab_mapped(mmu_v1::state_t* state, address_t phys, size_t n_pages, size_t page_width)
+{
+    for (size_t j = 0; j < n_pages; ++j)
+    {
+        size_t frame = (phys + (j << page_width)) >> FRAME_WIDTH;
+        if (frame >= state->ramtab_size)
+            break;
+
+        size_t frame_width;
+        ramtab_v1::state frame_state;
+        uint32_t owner = state->ramtab_closure.get(frame, &frame_width, &frame_state);
+        state->ramtab_closure.put(frame, owner, frame_width, ramtab_v1::state_mapped);
+    }
 }
 
 /**
@@ -244,7 +502,7 @@ static bool add_page(mmu_v1::state_t* state, size_t page_width, address_t va, pa
             result = add4k_page(state, va, pte, sid);
             break;
         case page_t::width_4mib:
-            // result = add4m_page(state, va, pte, sid);
+            result = add4m_page(state, va, pte, sid);
             break;
         default:
             logger::warning() << __FUNCTION__ << ": unsupported page width " << page_width;
@@ -261,7 +519,7 @@ static size_t update_pages(mmu_v1::state_t* state, size_t page_width, address_t
             result = update4k_pages(state, va, n_pages, pte, sid);
             break;
         case page_t::width_4mib:
-            // result = update4m_pages(state, va, n_pages, pte, sid);
+            result = update4m_pages(state, va, n_pages, pte, sid);
             break;
         default:
             logger::warning() << __FUNCTION__ << ": unsupported page width " << page_width;
@@ -337,7 +595,7 @@ inline bool valid_width(uint32_t width)
 
 static void mmu_v1_start(mmu_v1::closure_t* self, protection_domain_v1::id root_domain)
 {
-    // nucleus::flush_tlb();
+    nucleus::flush_tlb();
     // nucleus::wrpdom(base);
 }
 
@@ -358,14 +616,21 @@ static void mmu_v1_add_range(mmu_v1::closure_t* self, stretch_v1::closure_t* str
     address_t virt = mem_range.start_addr;
     size_t page_size = 1UL << page_width;
 
-    for (size_t n_pages = 0; n_pages < mem_range.n_pages; ++n_pages)
+    size_t n_pages = mem_range.n_pages;
+
+    while (n_pages > 0)
     {
-        if (!add_page(self->d_state, page_width, virt, pte, str->d_state->sid))
+        // 4K pages go in one run per L2 table, all pointing at no frame.
+        size_t added = (page_width == page_t::width_4kib)
+            ? add4k_pages(self->d_state, virt, n_pages, pte, 0, str->d_state->sid)
+            : (add_page(self->d_state, page_width, virt, pte, str->d_state->sid) ? 1 : 0);
+        if (added == 0)
         {
             logger::warning() << __FUNCTION__ << ": failed to add page at " << virt;
             return;
         }
-        virt += page_size;
+        virt += added * page_size;
+        n_pages -= added;
     }
 
     logger::debug() << __FUNCTION__ << ": added range [" << mem_range.start_addr << ".." << mem_range.start_addr + (mem_range.n_pages << page_width) << "), sid=" << str->d_state->sid;
@@ -427,49 +692,50 @@ static void mmu_v1_add_mapped_range(mmu_v1::closure_t* self, stretch_v1::closure
     page_t pte;
     pte.set_flags(flags);
 
-    while (n_pages--)
-    {
-        size_t frame = phys >> FRAME_WIDTH;
-        pte.set_frame(phys);
-
-        uint32_t owner = OWNER_NONE;
+    size_t n_tables = 0;
 
-        // Sanity check the ramtab
-        if (frame < self->d_state->ramtab_size)
+    while (n_pages > 0)
+    {
+        // Naturally aligned 4MB chunks of smaller pages go into a single large page where the MMU allows,
+        // 4K pages go in one run up to the end of their L2 table.
+        size_t map_width, map_pages;
+        if (large_page_fits(self->d_state, page_width, virt, phys, n_pages))
         {
-            ramtab_v1::state state;
-
-            owner = self->d_state->ramtab_closure.get(frame, &frame_width, &state);
-            if (owner == OWNER_NONE)
-            {
-                logger::warning() << __FUNCTION__ << ": physical address " << phys << " not owned!";
-                nucleus::debug_stop();
-            }
-
-            if (state == ramtab_v1::state_nailed)
-            {
-                logger::warning() << __FUNCTION__ << ": physical address " << phys << " is nailed!";
-                nucleus::debug_stop();
-            }
+            map_width = page_t::width_4mib;
+            map_pages = 1UL << (map_width - page_width);
         }
+        else if (page_width == page_t::width_4kib)
+        {
+            map_width = page_width;
+            map_pages = std::min<size_t>(n_pages, N_L2_ENTRIES - pte_entry(virt));
+        }
+        else
+        {
+            map_width = page_width;
+            map_pages = 1;
+        }
+
+        check_ramtab(self->d_state, phys, map_pages, page_width);
 
-        if (!add_page(self->d_state, page_width, virt, pte, str->d_state->sid))
+        pte.set_frame(phys);
+        bool added = (map_width == page_t::width_4kib)
+            ? (add4k_pages(self->d_state, virt, map_pages, pte, page_size, str->d_state->sid) == map_pages)
+            : add_page(self->d_state, map_width, virt, pte, str->d_state->sid);
+        if (!added)
         {
             logger::warning() << __FUNCTION__ << ": failed to add page at " << virt;
             return;
         }
 
-        // Update the ramtab
-        if (frame < self->d_state->ramtab_size)
-        {
-            self->d_state->ramtab_closure.put(frame, owner, frame_width, ramtab_v1::state_mapped);
-        }
+        mark_ramtab_mapped(self->d_state, phys, map_pages, page_width);
 
-        virt += page_size;
-        phys += page_size;
+        virt += map_pages * page_size;
+        phys += map_pages * page_size;
+        n_pages -= map_pages;
+        ++n_tables;
     }
 
-    logger::debug() << __FUNCTION__ << ": added mapped range [" << mem_range.start_addr << ".." << mem_range.start_addr + (mem_range.n_pages << mem_range.page_width) << ")=>[" << pmem.start_addr << ".." << pmem.start_addr + (pmem.n_frames << pmem.frame_width) << "), sid=" << str->d_state->sid;
+    logger::debug() << __FUNCTION__ << ": added mapped range [" << mem_range.start_addr << ".." << mem_range.start_addr + (mem_range.n_pages << mem_range.page_width) << ")=>[" << pmem.start_addr << ".." << pmem.start_addr + (pmem.n_frames << pmem.frame_width) << "), sid=" << str->d_state->sid << ", " << n_tables << " page table runs";
 }
 
 /**
@@ -598,7 +864,7 @@ static void mmu_v1_set_rights(mmu_v1::closure_t* self, protection_domain_v1::id
 
     // Want to invalidate all non-global TB entries, but we can't
     // do that on Intel so just blow away the whole thing.
-    // nucleus::flush_tlb();
+    nucleus::flush_tlb();
 }
 
 static stretch_v1::rights mmu_v1_query_rights(mmu_v1::closure_t* self, protection_domain_v1::id dom_id, stretch_v1::closure_t* str)
@@ -921,6 +1187,7 @@ mmu_module_v1_create(mmu_module_v1::closure_t* self, uint32_t initial_reservatio
     INFO_PAGE.protection_domains = &(state->pdom_tbl);
 
     state->use_global_pages = (INFO_PAGE.cpu_features & X86_32_FEAT_PGE) != 0;
+    state->use_large_pages = (INFO_PAGE.cpu_features & X86_32_FEAT_PSE) != 0;
 
     // Intialise our closures, etc to NULL for now  // will be fixed by $Done later
     state->system_frame_allocator = NULL;
@@ -965,6 +1232,10 @@ static void mmu_module_v1_finish_init(mmu_module_v1::closure_t* self, mmu_v1::cl
     mmu->d_state->system_frame_allocator = frames;
     mmu->d_state->heap = heap;
     mmu->d_state->stretch_allocator = sysalloc;
+
+    // Boot mappings are in place, clear the next few L2 tables now rather than while creating domains.
+    size_t cleared = clear_l2tables(mmu->d_state, L2_CLEAR_AHEAD);
+    logger::debug() << "mmu_module_v1: cleared " << int(cleared) << " L2 tables ahead of use";
 }
 
 static const mmu_module_v1::ops_t mmu_module_v1_methods =
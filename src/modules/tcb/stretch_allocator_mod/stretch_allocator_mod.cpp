@@ -138,6 +138,21 @@ inline console_t& operator << (console_t& con, virtual_address_space_region* reg
     return con;
 }
 
+/**
+ * Find a large page aligned start address followed by n_pages free pages, or ANY_ADDRESS if there is none.
+ */
+static memory_v1::address large_page_start(server_state_t* state, size_t n_pages)
+{
+    for (auto region = state->regions->next(); region != state->regions; region = region->next())
+    {
+        address_t region_start = (*region)->desc.start_addr;
+        address_t start = align_up(region_start, 1UL << LARGE_PAGE_WIDTH);
+        if ((start >= region_start) && (((start - region_start) >> PAGE_WIDTH) + n_pages <= (*region)->desc.n_pages))
+            return start;
+    }
+    return ANY_ADDRESS;
+}
+
 static bool vm_alloc(server_state_t* state, memory_v1::size size, memory_v1::address start, memory_v1::address* virt_addr, size_t* n_pages, size_t* page_width)
 {
     kconsole << __FUNCTION__ << " size " << size << ", start " << start << endl;
@@ -145,6 +160,10 @@ static bool vm_alloc(server_state_t* state, memory_v1::size size, memory_v1::add
     size_t npages = (size + PAGE_SIZE - 1) >> PAGE_WIDTH;
     dl_link_t<virtual_address_space_region>* region;
 
+    // Stretches of a large page or more start on a large page boundary, so the MMU can map them with large pages.
+    if (unaligned(start) && (size >= (1UL << LARGE_PAGE_WIDTH)))
+        start = large_page_start(state, npages);
+
     if (unaligned(start))
     {
         // no start address requested, allocate at start of any suitable region.
@@ -354,7 +373,9 @@ static stretch_v1::closure_t* stretch_allocator_v1_nailed_create(stretch_allocat
     auto state = reinterpret_cast<system_stretch_allocator_v1::state_t*>(self->d_state);
     server_state_t* ss = state->shared_state;
     
-    phys.start_addr = ss->frames->allocate(size, FRAME_WIDTH);
+    // Whole large pages of frames come large page aligned, so that the stretch can be mapped with large pages.
+    size_t frame_width = (size && is_aligned_to_frame_width(size, LARGE_PAGE_WIDTH)) ? LARGE_PAGE_WIDTH : FRAME_WIDTH;
+    phys.start_addr = ss->frames->allocate(size, frame_width);
     if (phys.start_addr == NO_ADDRESS)
     {
         kconsole << __FUNCTION__ << ": Failed to get physmem" << endl;
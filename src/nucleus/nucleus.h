@@ -41,6 +41,22 @@ namespace nucleus
         return 0;
     }
 
+    /**
+     * Drop all non-global TLB entries.
+     */
+    inline void flush_tlb()
+    {
+        asm volatile ("int $99" :: "a"(4));
+    }
+
+    /**
+     * Drop the TLB entries for n_pages 4K pages starting at start_page, whatever page size they were cached with.
+     */
+    inline void flush_tlb(address_t start_page, size_t n_pages)
+    {
+        asm volatile ("int $99" :: "a"(5), "b"(start_page), "c"(n_pages));
+    }
+
     inline void debug_stop()
     {
         debugger_t::breakpoint();
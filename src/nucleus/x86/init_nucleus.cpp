@@ -98,6 +98,17 @@ public:
             interrupt_descriptor_table().set_irq_handler(regs->ebx, reinterpret_cast<interrupt_service_routine_t*>(regs->ecx));
         }
         else
+        if (regs->eax == 4)
+        {
+            ia32_mmu_t::flush_page_directory();
+        }
+        else
+        if (regs->eax == 5)
+        {
+            for (size_t i = 0; i < regs->ecx; ++i)
+                ia32_mmu_t::flush_page_directory_entry(regs->ebx + (i << PAGE_WIDTH));
+        }
+        else
         {
             kconsole << "unknown syscall " << regs->eax << endl;            
         }
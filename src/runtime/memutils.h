@@ -29,7 +29,9 @@ namespace memutils {
 inline void*
 fill_memory(void* dest, int value, size_t count)
 {
-    asm volatile ("cld; rep stosb" :: "c"(count), "a"(value), "D"(dest) : "memory");
+    void* d = dest;
+    // rep stosb advances edi and ecx, so they must be in/out operands.
+    asm volatile ("cld; rep stosb" : "+c"(count), "+D"(d) : "a"(value) : "memory");
     return dest;
 }
 
@@ -61,7 +63,9 @@ clear_memory(void* dest, size_t count)
 inline void*
 copy_memory(void* dest, const void* src, size_t count)
 {
-    asm volatile ("cld; rep movsb" :: "c"(count), "S"(src), "D"(dest) : "memory");
+    void* d = dest;
+    // rep movsb advances esi, edi and ecx, so they must be in/out operands.
+    asm volatile ("cld; rep movsb" : "+c"(count), "+S"(src), "+D"(d) :: "memory");
     return dest;
 }
 
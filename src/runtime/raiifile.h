@@ -12,6 +12,10 @@
 #include <iostream>
 #include <fstream>
 #include <string>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <fcntl.h>
+#include <unistd.h>
 #include "types.h"
 
 namespace raii_wrapper {
@@ -113,6 +117,60 @@ private:
     file& operator= (const file&);
 };
 
+/**
+ * Read-only memory mapping of a whole file. Pages are brought in on demand,
+ * so large files cost only the parts actually touched.
+ */
+class mapped_file
+{
+public:
+    mapped_file(const char* fname)
+        : data_(0)
+        , size_(0)
+    {
+        int fd = ::open(fname, O_RDONLY);
+        if (fd < 0)
+            throw file_error("file open failure");
+
+        struct stat st;
+        if (fstat(fd, &st) < 0)
+        {
+            ::close(fd);
+            throw file_error("file stat failure");
+        }
+        size_ = st.st_size;
+
+        if (size_ > 0)
+        {
+            void* p = mmap(0, size_, PROT_READ, MAP_PRIVATE, fd, 0);
+            if (p == MAP_FAILED)
+            {
+                ::close(fd);
+                throw file_error("file mmap failure");
+            }
+            data_ = static_cast<const char*>(p);
+        }
+        ::close(fd); // the mapping keeps the file referenced
+    }
+
+    ~mapped_file()
+    {
+        if (data_)
+            munmap(const_cast<char*>(data_), size_);
+    }
+
+    const char* data() const { return data_; }
+    size_t size() const { return size_; }
+
+private:
+    const char* data_;
+    size_t size_;
+
+    // prevent copying and assignment; only declarations
+    mapped_file(const mapped_file&);
+    mapped_file& operator= (const mapped_file&);
+};
+
 class filebinio
 {
 public:
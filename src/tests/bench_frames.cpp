@@ -0,0 +1,239 @@
+//
+// Part of Metta OS. Check https://atta-metta.net for latest version.
+//
+// Copyright 2007 - 2017, Stanislav Karchebnyy <berkus@atta-metta.net>
+//
+// Distributed under the Boost Software License, Version 1.0.
+// (See file LICENSE_1_0.txt or a copy at http://www.boost.org/LICENSE_1_0.txt)
+//
+/**
+ * @brief Physical frame allocator churn benchmark.
+ *
+ * Simulates a 4 GB physical memory map (3 GB below the PCI hole and 1 GB above 4 GB) and runs
+ * allocate/free churn through the frames_mod buddy index and through the per-frame run length
+ * table with first fit linear scan that frames_mod used before. The live set holds mostly single
+ * frames, some small runs and a few 4 MB aligned superpage-sized blocks, after every other frame
+ * in the low three quarters of memory has been taken.
+ *
+ * Build on host with:
+ * c++ -std=c++11 -O2 -Itests/host_shims -Ikernel/generic -Ikernel/arch/shared -Ikernel/arch/x86 -Iruntime
+ *     tests/bench_frames.cpp tests/host_shims/host_support.cpp -o bench_frames
+ */
+#include <stdio.h>
+#include <stdlib.h>
+#include <vector>
+#include <chrono>
+
+#include "../modules/tcb/frames_mod/frame_buddy.cpp"
+
+static const uint32_t FRAME_BITS = 12;
+static const int LIVE_OBJECTS = 8192;
+static const int BUDDY_OPS = 2000000;
+static const int LINEAR_OPS = 20000;
+
+struct region_t
+{
+    uint32_t first_frame;
+    uint32_t n_frames;
+};
+
+// 1 MB .. 3 GB and 4 GB .. 5 GB.
+static const region_t regions[] = { { 0x100, 0xc0000 - 0x100 }, { 0x100000, 0x40000 } };
+
+static uint32_t seed;
+
+static uint32_t next_random()
+{
+    seed ^= seed << 13; seed ^= seed >> 17; seed ^= seed << 5;
+    return seed;
+}
+
+struct request_t
+{
+    uint32_t n_frames;
+    uint32_t align_order;
+};
+
+/**
+ * 90% single frames, 9% 2..16 frames, 1% 4 MB aligned 4 MB blocks.
+ */
+static request_t random_request()
+{
+    uint32_t r = next_random();
+    switch (r % 100)
+    {
+        case 99:
+            return { 1024, 10 };
+        case 90 ... 98:
+            return { 2 + (r >> 8) % 15, 0 };
+        default:
+            return { 1, 0 };
+    }
+}
+
+/**
+ * Buddy index over all regions, first region that can satisfy the request wins.
+ */
+struct buddy_allocator_t
+{
+    std::vector<frame_buddy_t> index;
+    std::vector<std::vector<uint64_t>> memory;
+
+    buddy_allocator_t()
+        : index(2)
+        , memory(2)
+    {
+        for (int r = 0; r < 2; ++r)
+        {
+            memory[r].resize(frame_buddy_t::required_size(regions[r].first_frame, regions[r].n_frames) / 8);
+            index[r].init(memory[r].data(), regions[r].first_frame, regions[r].n_frames);
+        }
+    }
+
+    uint64_t allocate(request_t req)
+    {
+        for (int r = 0; r < 2; ++r)
+        {
+            uint32_t frame = index[r].allocate(req.n_frames, req.align_order);
+            if (frame != ~0u)
+                return uint64_t(regions[r].first_frame + frame) << FRAME_BITS;
+        }
+        return ~0ull;
+    }
+
+    void allocate_at(uint64_t address)
+    {
+        uint32_t frame = address >> FRAME_BITS;
+        int r = frame >= regions[1].first_frame;
+        index[r].allocate_at(frame - regions[r].first_frame, 1);
+    }
+
+    void free(uint64_t address, uint32_t n_frames)
+    {
+        uint32_t frame = address >> FRAME_BITS;
+        int r = frame >= regions[1].first_frame;
+        index[r].free(frame - regions[r].first_frame, n_frames);
+    }
+};
+
+/**
+ * Per-frame free run lengths, allocation scans from the region start, as frames_mod used to do.
+ */
+struct linear_allocator_t
+{
+    std::vector<std::vector<uint32_t>> frames;
+
+    linear_allocator_t()
+        : frames(2)
+    {
+        for (int r = 0; r < 2; ++r)
+        {
+            frames[r].resize(regions[r].n_frames);
+            for (uint32_t j = 0; j < regions[r].n_frames; ++j)
+                frames[r][j] = regions[r].n_frames - j;
+        }
+    }
+
+    uint64_t allocate(request_t req)
+    {
+        for (int r = 0; r < 2; ++r)
+        {
+            std::vector<uint32_t>& f = frames[r];
+            for (uint32_t first = 0; first < f.size(); ++first)
+            {
+                if (f[first] < req.n_frames || ((regions[r].first_frame + first) & ((1u << req.align_order) - 1)))
+                    continue;
+                take(f, first, req.n_frames);
+                return uint64_t(regions[r].first_frame + first) << FRAME_BITS;
+            }
+        }
+        return ~0ull;
+    }
+
+    /**
+     * Update predecessor run lengths and mark frames used, frames after the allocation keep their counts.
+     */
+    static void take(std::vector<uint32_t>& f, uint32_t first, uint32_t n_frames)
+    {
+        uint32_t start_free = f[first];
+        for (uint32_t i = first; i != 0; )
+        {
+            --i;
+            if (f[i] == 0)
+                break;
+            f[i] -= start_free;
+        }
+        for (uint32_t j = first; j < first + n_frames; ++j)
+            f[j] = 0;
+    }
+
+    void allocate_at(uint64_t address)
+    {
+        uint32_t frame = address >> FRAME_BITS;
+        int r = frame >= regions[1].first_frame;
+        take(frames[r], frame - regions[r].first_frame, 1);
+    }
+
+    void free(uint64_t address, uint32_t n_frames)
+    {
+        uint32_t frame = address >> FRAME_BITS;
+        int r = frame >= regions[1].first_frame;
+        std::vector<uint32_t>& f = frames[r];
+        uint32_t start = frame - regions[r].first_frame, end = start + n_frames;
+        uint32_t end_free = (end == f.size()) ? 0 : f[end];
+        uint32_t i = end;
+        while (i > start)
+            f[--i] = ++end_free;
+        while (i > 0 && f[i - 1] != 0)
+            f[--i] = ++end_free;
+    }
+};
+
+template <typename allocator_t>
+static void run(const char* name, int ops)
+{
+    allocator_t allocator;
+    seed = 2463534242u;
+
+    // Every other frame of the low three quarters of memory is in use, as if by long lived single frames.
+    for (int r = 0; r < 2; ++r)
+    {
+        uint32_t used = r ? regions[1].n_frames / 2 : regions[0].n_frames;
+        for (uint32_t i = 1; i < used; i += 2)
+            allocator.allocate_at(uint64_t(regions[r].first_frame + i) << FRAME_BITS);
+    }
+
+    std::vector<uint64_t> live(LIVE_OBJECTS, ~0ull);
+    std::vector<uint32_t> sizes(LIVE_OBJECTS, 0);
+    int allocations = 0, failures = 0;
+
+    auto t0 = std::chrono::steady_clock::now();
+    for (int op = 0; op < ops; ++op)
+    {
+        int slot = next_random() % LIVE_OBJECTS;
+        if (live[slot] != ~0ull)
+        {
+            allocator.free(live[slot], sizes[slot]);
+            live[slot] = ~0ull;
+            continue;
+        }
+
+        request_t req = random_request();
+        live[slot] = allocator.allocate(req);
+        sizes[slot] = req.n_frames;
+        ++allocations;
+        if (live[slot] == ~0ull)
+            ++failures;
+    }
+    double seconds = std::chrono::duration<double>(std::chrono::steady_clock::now() - t0).count();
+
+    printf("%-8s %8d ops  %10.0f ops/s  %8.1f ns/op  %d allocations, %d failed\n",
+        name, ops, ops / seconds, seconds * 1e9 / ops, allocations, failures);
+}
+
+int main()
+{
+    run<buddy_allocator_t>("buddy", BUDDY_OPS);
+    run<linear_allocator_t>("linear", LINEAR_OPS);
+    return 0;
+}
@@ -0,0 +1,119 @@
+//
+// Part of Metta OS. Check https://atta-metta.net for latest version.
+//
+// Copyright 2007 - 2017, Stanislav Karchebnyy <berkus@atta-metta.net>
+//
+// Distributed under the Boost Software License, Version 1.0.
+// (See file LICENSE_1_0.txt or a copy at http://www.boost.org/LICENSE_1_0.txt)
+//
+/**
+ * @brief Multithreaded heap_t allocation benchmark.
+ *
+ * Runs the same small-object churn through the single-lock heap path and through
+ * the per-VCPU magazine front end with 1..8 threads, printing operations per second.
+ * Each thread plays the role of a separate VCPU.
+ *
+ * Build on host with:
+ * c++ -std=c++11 -O2 -pthread -Itests/host_shims -Ikernel/generic -Ikernel/arch/shared -Ikernel/arch/x86 -Iruntime
+ *     tests/bench_heap.cpp tests/host_shims/host_support.cpp -o bench_heap
+ */
+#include <assert.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <vector>
+#include <thread>
+#include <chrono>
+
+#include "../modules/heap_mod/heap.cpp"
+
+static const size_t HEAP_BYTES = 64*MiB;
+static const int OPS_PER_THREAD = 2000000;
+static const int LIVE_OBJECTS = 256;
+
+enum bench_mode_t { single_lock, magazines };
+
+static void* bench_allocate(heap_t& heap, bench_mode_t mode, size_t size, uint32_t vcpu)
+{
+    if (mode == magazines)
+    {
+        void* p = heap.cached_allocate(size, vcpu);
+        if (p)
+            return p;
+    }
+    lockable_scope_lock_t lock(heap);
+    return heap.allocate(size);
+}
+
+static void bench_free(heap_t& heap, bench_mode_t mode, void* p, uint32_t vcpu)
+{
+    if ((mode == magazines) && heap.cached_free(p, vcpu))
+        return;
+    lockable_scope_lock_t lock(heap);
+    heap.free(p);
+}
+
+static void worker(heap_t* heap, bench_mode_t mode, int id)
+{
+    std::vector<void*> live(LIVE_OBJECTS, nullptr);
+    std::vector<size_t> sizes(LIVE_OBJECTS, 0);
+    uint32_t vcpu = id + 1;
+    uint32_t seed = 2463534242u + id;
+
+    for (int op = 0; op < OPS_PER_THREAD; ++op)
+    {
+        seed ^= seed << 13; seed ^= seed >> 17; seed ^= seed << 5;
+        int slot = seed % LIVE_OBJECTS;
+
+        if (live[slot])
+        {
+            if (*reinterpret_cast<uint8_t*>(live[slot]) != uint8_t(slot))
+                panic("heap block clobbered", __FILE__, __LINE__);
+            bench_free(*heap, mode, live[slot], vcpu);
+            live[slot] = nullptr;
+        }
+        else
+        {
+            sizes[slot] = 8 + (seed >> 8) % 112;
+            live[slot] = bench_allocate(*heap, mode, sizes[slot], vcpu);
+            if (!live[slot])
+                panic("heap exhausted", __FILE__, __LINE__);
+            memset(live[slot], uint8_t(slot), sizes[slot]);
+        }
+    }
+
+    for (int slot = 0; slot < LIVE_OBJECTS; ++slot)
+        if (live[slot])
+            bench_free(*heap, mode, live[slot], vcpu);
+}
+
+static double run(bench_mode_t mode, int threads)
+{
+    char* region = static_cast<char*>(aligned_alloc(PAGE_SIZE, HEAP_BYTES));
+    address_t start = reinterpret_cast<address_t>(region) + sizeof(heap_t);
+    heap_t* heap = new(region) heap_t(start, reinterpret_cast<address_t>(region) + HEAP_BYTES);
+
+    auto begin = std::chrono::steady_clock::now();
+    std::vector<std::thread> pool;
+    for (int i = 0; i < threads; ++i)
+        pool.push_back(std::thread(worker, heap, mode, i));
+    for (auto& t : pool)
+        t.join();
+    std::chrono::duration<double> elapsed = std::chrono::steady_clock::now() - begin;
+
+    heap->~heap_t();
+    ::free(region);
+    return double(OPS_PER_THREAD) * threads / elapsed.count();
+}
+
+int main()
+{
+    printf("threads  single-lock Mops/s  magazines Mops/s\n");
+    for (int threads = 1; threads <= 8; threads *= 2)
+    {
+        double locked = run(single_lock, threads);
+        double cached = run(magazines, threads);
+        printf("%7d  %18.2f  %16.2f\n", threads, locked / 1e6, cached / 1e6);
+    }
+    return 0;
+}
@@ -0,0 +1,118 @@
+//
+// Part of Metta OS. Check https://atta-metta.net for latest version.
+//
+// Copyright 2007 - 2017, Stanislav Karchebnyy <berkus@atta-metta.net>
+//
+// Distributed under the Boost Software License, Version 1.0.
+// (See file LICENSE_1_0.txt or a copy at http://www.boost.org/LICENSE_1_0.txt)
+//
+/**
+ * @brief heap_t allocation latency and fragmentation benchmark.
+ *
+ * Churns a live set of mixed-size objects (mostly small, some up to 64KiB) through the
+ * locked heap_t path, recording per-allocation latency in TSC cycles. Then keeps allocating
+ * without freeing until the heap gives up and reports how much of the heap was in use,
+ * which is a measure of fragmentation. Only public heap_t API is used, so the same file
+ * builds against older heap revisions for comparison.
+ *
+ * Build on host with:
+ * c++ -std=c++11 -O2 -Itests/host_shims -Ikernel/generic -Ikernel/arch/shared -Ikernel/arch/x86 -Iruntime
+ *     tests/bench_heap_fragmentation.cpp tests/host_shims/host_support.cpp -o bench_heap_fragmentation
+ */
+#include <assert.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <vector>
+#include <algorithm>
+#include <x86intrin.h>
+
+#include "../modules/heap_mod/heap.cpp"
+
+static const size_t HEAP_BYTES = 16*MiB;
+static const int LIVE_OBJECTS = 4096;
+static const int CHURN_OPS = 2000000;
+
+static uint32_t seed = 2463534242u;
+
+static uint32_t next_random()
+{
+    seed ^= seed << 13; seed ^= seed >> 17; seed ^= seed << 5;
+    return seed;
+}
+
+/**
+ * 90% small objects, 9% medium, 1% large.
+ */
+static size_t random_size()
+{
+    uint32_t r = next_random();
+    switch (r % 100)
+    {
+        case 99:
+            return 4096 + (r >> 8) % (60*KiB);
+        case 90 ... 98:
+            return 128 + (r >> 8) % 3968;
+        default:
+            return 8 + (r >> 8) % 120;
+    }
+}
+
+int main()
+{
+    char* region = static_cast<char*>(aligned_alloc(PAGE_SIZE, HEAP_BYTES));
+    address_t start = reinterpret_cast<address_t>(region) + sizeof(heap_t);
+    heap_t* heap = new(region) heap_t(start, reinterpret_cast<address_t>(region) + HEAP_BYTES);
+    lockable_scope_lock_t lock(*heap);
+
+    std::vector<void*> live(LIVE_OBJECTS, nullptr);
+    std::vector<size_t> sizes(LIVE_OBJECTS, 0);
+    std::vector<uint64_t> latency;
+    latency.reserve(CHURN_OPS);
+
+    for (int op = 0; op < CHURN_OPS; ++op)
+    {
+        int slot = next_random() % LIVE_OBJECTS;
+        if (live[slot])
+        {
+            heap->free(live[slot]);
+            live[slot] = nullptr;
+            continue;
+        }
+
+        sizes[slot] = random_size();
+        uint64_t t0 = __rdtsc();
+        live[slot] = heap->allocate(sizes[slot]);
+        latency.push_back(__rdtsc() - t0);
+        if (!live[slot])
+        {
+            fprintf(stderr, "heap exhausted during churn\n");
+            return 1;
+        }
+    }
+
+    std::sort(latency.begin(), latency.end());
+    size_t n = latency.size();
+    printf("allocate latency, cycles: p50 %llu  p99 %llu  p99.9 %llu  max %llu\n",
+        (unsigned long long)latency[n / 2], (unsigned long long)latency[n * 99 / 100],
+        (unsigned long long)latency[n * 999 / 1000], (unsigned long long)latency[n - 1]);
+
+    // Fill to failure, keeping the fragmented live set in place.
+    size_t live_bytes = 0;
+    for (int slot = 0; slot < LIVE_OBJECTS; ++slot)
+        if (live[slot])
+            live_bytes += sizes[slot];
+
+    std::vector<void*> fill;
+    for (;;)
+    {
+        size_t size = random_size();
+        void* p = heap->allocate(size);
+        if (!p)
+            break;
+        fill.push_back(p);
+        live_bytes += size;
+    }
+
+    printf("heap utilisation at first failure: %.1f%% of %zu bytes\n", 100.0 * live_bytes / HEAP_BYTES, HEAP_BYTES);
+    return 0;
+}
@@ -0,0 +1,21 @@
+//
+// Part of Metta OS. Check https://atta-metta.net for latest version.
+//
+// Copyright 2007 - 2017, Stanislav Karchebnyy <berkus@atta-metta.net>
+//
+// Distributed under the Boost Software License, Version 1.0.
+// (See file LICENSE_1_0.txt or a copy at http://www.boost.org/LICENSE_1_0.txt)
+//
+#pragma once
+
+#include <x86intrin.h>
+#include "types.h"
+
+class x86_cpu_t
+{
+public:
+    static inline uint64_t read_tsc()
+    {
+        return __rdtsc();
+    }
+};
@@ -0,0 +1,25 @@
+//
+// Part of Metta OS. Check https://atta-metta.net for latest version.
+//
+// Copyright 2007 - 2017, Stanislav Karchebnyy <berkus@atta-metta.net>
+//
+// Distributed under the Boost Software License, Version 1.0.
+// (See file LICENSE_1_0.txt or a copy at http://www.boost.org/LICENSE_1_0.txt)
+//
+#pragma once
+
+/**
+ * Console that swallows everything, host benchmarks do not want kernel chatter.
+ */
+class console_t
+{
+public:
+    template <typename T>
+    console_t& operator << (const T&) { return *this; }
+};
+
+enum Color { BLACK, LIGHTRED, GREEN, YELLOW, WHITE };
+
+static const char endl = '\n';
+
+extern console_t kconsole;
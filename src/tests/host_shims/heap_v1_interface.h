@@ -0,0 +1,26 @@
+//
+// Part of Metta OS. Check https://atta-metta.net for latest version.
+//
+// Copyright 2007 - 2017, Stanislav Karchebnyy <berkus@atta-metta.net>
+//
+// Distributed under the Boost Software License, Version 1.0.
+// (See file LICENSE_1_0.txt or a copy at http://www.boost.org/LICENSE_1_0.txt)
+//
+#pragma once
+
+#include "memory_v1_interface.h"
+
+namespace heap_v1 {
+    struct stats
+    {
+        memory_v1::size heap_size;
+        memory_v1::size used_bytes;
+        memory_v1::size free_bytes;
+        memory_v1::size cached_bytes;
+        memory_v1::size high_water_mark;
+        uint32_t allocations;
+        uint32_t merges;
+        uint64_t coalesce_cycles;
+        uint32_t bins;
+    };
+}
@@ -0,0 +1,26 @@
+//
+// Part of Metta OS. Check https://atta-metta.net for latest version.
+//
+// Copyright 2007 - 2017, Stanislav Karchebnyy <berkus@atta-metta.net>
+//
+// Distributed under the Boost Software License, Version 1.0.
+// (See file LICENSE_1_0.txt or a copy at http://www.boost.org/LICENSE_1_0.txt)
+//
+#include <stdio.h>
+#include <stdlib.h>
+#include "default_console.h"
+#include "panic.h"
+
+console_t kconsole;
+
+extern "C" void panic(const char* message, const char* file, uint32_t line)
+{
+    fprintf(stderr, "PANIC: %s at %s:%u\n", message, file, line);
+    abort();
+}
+
+extern "C" void panic_assert(const char* desc, const char* file, uint32_t line)
+{
+    fprintf(stderr, "ASSERT failed: %s at %s:%u\n", desc, file, line);
+    abort();
+}
@@ -0,0 +1,67 @@
+//
+// Part of Metta OS. Check https://atta-metta.net for latest version.
+//
+// Copyright 2007 - 2017, Stanislav Karchebnyy <berkus@atta-metta.net>
+//
+// Distributed under the Boost Software License, Version 1.0.
+// (See file LICENSE_1_0.txt or a copy at http://www.boost.org/LICENSE_1_0.txt)
+//
+#pragma once
+
+#include <atomic>
+#include "types.h"
+
+/**
+ * Host replacement of the kernel spinlock with the same interface.
+ */
+class lockable_t
+{
+public:
+    inline lockable_t() : lock_value(false) {}
+
+    inline void lock()
+    {
+        while (lock_value.exchange(true, std::memory_order_acquire))
+            ;
+    }
+
+    inline bool try_lock()
+    {
+        return !lock_value.exchange(true, std::memory_order_acquire);
+    }
+
+    inline bool has_lock()
+    {
+        return lock_value.load(std::memory_order_relaxed);
+    }
+
+    inline void unlock()
+    {
+        lock_value.store(false, std::memory_order_release);
+    }
+
+private:
+    std::atomic<bool> lock_value;
+};
+
+template <class type_t>
+class scope_lock_t
+{
+    type_t& lockable;
+
+    scope_lock_t();
+    scope_lock_t(const scope_lock_t&);
+    scope_lock_t& operator =(const scope_lock_t&);
+
+public:
+    scope_lock_t(type_t& obj) : lockable(obj)
+    {
+        lockable.lock();
+    }
+    ~scope_lock_t()
+    {
+        lockable.unlock();
+    }
+};
+
+typedef scope_lock_t<lockable_t> lockable_scope_lock_t;
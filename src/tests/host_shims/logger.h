@@ -0,0 +1,21 @@
+//
+// Part of Metta OS. Check https://atta-metta.net for latest version.
+//
+// Copyright 2007 - 2017, Stanislav Karchebnyy <berkus@atta-metta.net>
+//
+// Distributed under the Boost Software License, Version 1.0.
+// (See file LICENSE_1_0.txt or a copy at http://www.boost.org/LICENSE_1_0.txt)
+//
+#pragma once
+
+#include "default_console.h"
+
+namespace logger {
+
+inline console_t& trace() { return kconsole; }
+inline console_t& debug() { return kconsole; }
+inline console_t& info()  { return kconsole; }
+inline console_t& warning() { return kconsole; }
+inline console_t& fatal() { return kconsole; }
+
+} // namespace logger
@@ -0,0 +1,205 @@
+//
+// Part of Metta OS. Check https://atta-metta.net for latest version.
+//
+// Copyright 2007 - 2017, Stanislav Karchebnyy <berkus@atta-metta.net>
+//
+// Distributed under the Boost Software License, Version 1.0.
+// (See file LICENSE_1_0.txt or a copy at http://www.boost.org/LICENSE_1_0.txt)
+//
+/**
+ * @brief Test frame_buddy_t.
+ */
+
+/*============================================================================*/
+
+#include <stdlib.h>
+#include <vector>
+
+#define BOOST_TEST_DYN_LINK
+#include <boost/test/unit_test.hpp>
+
+#include "../modules/tcb/frames_mod/frame_buddy.cpp"
+
+/**
+ * A buddy index over a region of frames, with a plain free map to check it against.
+ */
+struct buddy_fixture
+{
+    uint32_t first_frame;
+    uint32_t n_frames;
+    std::vector<uint64_t> memory;
+    frame_buddy_t buddy;
+    std::vector<bool> free_map;
+
+    buddy_fixture(uint32_t first = 0x123, uint32_t n = 5000)
+        : first_frame(first)
+        , n_frames(n)
+        , memory(frame_buddy_t::required_size(first, n) / 8)
+        , free_map(n, true)
+    {
+        buddy.init(memory.data(), first_frame, n_frames);
+    }
+
+    uint32_t allocate(uint32_t n, uint32_t align_order)
+    {
+        uint32_t frame = buddy.allocate(n, align_order);
+        if (frame == ~0u)
+            return frame;
+        BOOST_CHECK_EQUAL((first_frame + frame) & ((1u << align_order) - 1), 0);
+        for (uint32_t i = frame; i < frame + n; ++i)
+        {
+            BOOST_CHECK(free_map[i]);
+            free_map[i] = false;
+        }
+        return frame;
+    }
+
+    void free(uint32_t frame, uint32_t n)
+    {
+        buddy.free(frame, n);
+        for (uint32_t i = frame; i < frame + n; ++i)
+            free_map[i] = true;
+    }
+
+    uint32_t expected_run(uint32_t frame)
+    {
+        uint32_t run = 0;
+        while (frame + run < n_frames && free_map[frame + run])
+            ++run;
+        return run;
+    }
+
+    void check()
+    {
+        uint32_t free_frames = 0;
+        for (uint32_t i = 0; i < n_frames; ++i)
+        {
+            BOOST_REQUIRE_EQUAL(buddy.is_free(i), free_map[i]);
+            free_frames += free_map[i];
+        }
+        BOOST_CHECK_EQUAL(buddy.free_frames(), free_frames);
+    }
+};
+
+BOOST_AUTO_TEST_SUITE( test_frames )
+
+BOOST_FIXTURE_TEST_CASE(frame_buddy_allocate_free, buddy_fixture)
+{
+    // Lowest free block of the smallest fitting order goes first.
+    uint32_t a = allocate(1, 0);
+    BOOST_CHECK_EQUAL(a, 0);
+    uint32_t b = allocate(3, 0);
+    uint32_t c = allocate(16, 4);
+    // Single frame fills the tail the 3 frame request left in its 4 frame block.
+    uint32_t d = allocate(1, 0);
+    BOOST_CHECK_EQUAL(d, b + 3);
+    check();
+
+    BOOST_CHECK_EQUAL(buddy.free_run(2), expected_run(2));
+    BOOST_CHECK_EQUAL(buddy.free_run(b + 3), expected_run(b + 3));
+    BOOST_CHECK_EQUAL(buddy.free_run(b), 0);
+    BOOST_CHECK_EQUAL(buddy.free_run(c + 16, 5), 5);
+
+    free(b, 3);
+    free(a, 1);
+    free(c, 16);
+    free(d, 1);
+    check();
+    BOOST_CHECK_EQUAL(buddy.free_run(0), n_frames);
+
+    // Everything merged back, so the whole region can be allocated in aligned chunks again.
+    BOOST_CHECK_NE(allocate(2048, 11), ~0u);
+    BOOST_CHECK_EQUAL(allocate(4096, 12), ~0u);
+    BOOST_CHECK_EQUAL(allocate(n_frames, 0), ~0u);
+    check();
+}
+
+BOOST_FIXTURE_TEST_CASE(frame_buddy_allocate_at, buddy_fixture)
+{
+    // Used ranges at fixed addresses, as the boot memory map has them.
+    buddy.allocate_at(100, 1000);
+    buddy.allocate_at(3000, 1);
+    for (uint32_t i = 100; i < 1100; ++i)
+        free_map[i] = false;
+    free_map[3000] = false;
+    check();
+
+    BOOST_CHECK_EQUAL(buddy.free_run(50), 50);
+    BOOST_CHECK_EQUAL(buddy.free_run(1100), 1900);
+    BOOST_CHECK_EQUAL(buddy.free_run(3001), n_frames - 3001);
+
+    free(100, 1000);
+    free(3000, 1);
+    check();
+    BOOST_CHECK_EQUAL(buddy.free_run(0), n_frames);
+}
+
+BOOST_FIXTURE_TEST_CASE(frame_buddy_churn, buddy_fixture)
+{
+    struct allocation_t { uint32_t frame, n; };
+    std::vector<allocation_t> live;
+    srand(1);
+    for (int op = 0; op < 20000; ++op)
+    {
+        if (!live.empty() && rand() % 2)
+        {
+            size_t i = rand() % live.size();
+            free(live[i].frame, live[i].n);
+            live[i] = live.back();
+            live.pop_back();
+            continue;
+        }
+        uint32_t n = (rand() % 10) ? 1 + rand() % 8 : 1 + rand() % 200;
+        uint32_t align = (rand() % 20) ? 0 : rand() % 6;
+        uint32_t frame = allocate(n, align);
+        if (frame != ~0u)
+            live.push_back({ frame, n });
+
+        if (op % 1000 == 0)
+        {
+            check();
+            uint32_t probe = rand() % n_frames;
+            BOOST_CHECK_EQUAL(buddy.free_run(probe), expected_run(probe));
+        }
+    }
+    for (auto& a : live)
+        free(a.frame, a.n);
+    check();
+    BOOST_CHECK_EQUAL(buddy.free_run(0), n_frames);
+}
+
+BOOST_FIXTURE_TEST_CASE(frame_buddy_lowest_free, buddy_fixture)
+{
+    BOOST_CHECK_EQUAL(buddy.lowest_free(), 0);
+
+    // Hole left low in the region by a small block among larger ones.
+    buddy.allocate_at(0, 1000);
+    for (uint32_t i = 0; i < 1000; ++i)
+        free_map[i] = false;
+    BOOST_CHECK_EQUAL(buddy.lowest_free(), 1000);
+    free(500, 1);
+    BOOST_CHECK_EQUAL(buddy.lowest_free(), 500);
+    check();
+
+    buddy.allocate_at(500, 1);
+    buddy.allocate_at(1000, n_frames - 1000);
+    BOOST_CHECK_EQUAL(buddy.lowest_free(), ~0u);
+}
+
+BOOST_AUTO_TEST_CASE(frame_buddy_single_frame_region)
+{
+    buddy_fixture f(0x7ff, 1);
+    BOOST_CHECK_EQUAL(f.allocate(1, 0), 0);
+    BOOST_CHECK_EQUAL(f.allocate(1, 0), ~0u);
+    f.free(0, 1);
+    f.check();
+
+    // Region straddling a large alignment boundary.
+    buddy_fixture g(0xfff, 3);
+    BOOST_CHECK_EQUAL(g.allocate(2, 1), 1);
+    BOOST_CHECK_EQUAL(g.allocate(2, 0), ~0u);
+    BOOST_CHECK_EQUAL(g.allocate(1, 0), 0);
+    g.check();
+}
+
+BOOST_AUTO_TEST_SUITE_END()
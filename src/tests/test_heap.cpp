@@ -0,0 +1,364 @@
+//
+// Part of Metta OS. Check https://atta-metta.net for latest version.
+//
+// Copyright 2007 - 2017, Stanislav Karchebnyy <berkus@atta-metta.net>
+//
+// Distributed under the Boost Software License, Version 1.0.
+// (See file LICENSE_1_0.txt or a copy at http://www.boost.org/LICENSE_1_0.txt)
+//
+/**
+ * @brief Test heap_t.
+ */
+
+/*============================================================================*/
+
+#include <string.h>
+#include <stdlib.h>
+
+#define BOOST_TEST_DYN_LINK
+#include <boost/test/unit_test.hpp>
+
+#include "../modules/heap_mod/heap.cpp"
+
+/**
+ * A heap living in a malloc()ed region, locked for the whole test.
+ */
+struct heap_fixture
+{
+    static const size_t SIZE = 128*KiB;
+    char* region;
+    heap_t* heap;
+
+    heap_fixture()
+    {
+        region = static_cast<char*>(aligned_alloc(PAGE_SIZE, SIZE));
+        address_t start = reinterpret_cast<address_t>(region) + sizeof(heap_t);
+        heap = new(region) heap_t(start, reinterpret_cast<address_t>(region) + SIZE);
+        heap->lock();
+    }
+
+    ~heap_fixture()
+    {
+        heap->unlock();
+        heap->~heap_t();
+        ::free(region);
+    }
+};
+
+BOOST_FIXTURE_TEST_SUITE( test_heap, heap_fixture )
+
+BOOST_AUTO_TEST_CASE(realloc_null_allocates)
+{
+    void* p = heap->realloc(NULL, 32);
+    BOOST_CHECK(p != NULL);
+    heap->free(p);
+}
+
+BOOST_AUTO_TEST_CASE(realloc_shrinks_in_place)
+{
+    char* p = static_cast<char*>(heap->allocate(1000));
+    memset(p, 'a', 1000);
+    BOOST_CHECK_EQUAL(heap->realloc(p, 100), p);
+    BOOST_CHECK_EQUAL(p[99], 'a');
+    heap->free(p);
+}
+
+BOOST_AUTO_TEST_CASE(realloc_grows_into_free_neighbour)
+{
+    // Blocks are carved from the end of free space, so "after" sits right above "p".
+    void* after = heap->allocate(200);
+    char* p = static_cast<char*>(heap->allocate(40));
+    memset(p, 'b', 40);
+    heap->free(after);
+
+    BOOST_CHECK_EQUAL(heap->realloc(p, 180), p);
+    BOOST_CHECK_EQUAL(p[39], 'b');
+    heap->free(p);
+}
+
+BOOST_AUTO_TEST_CASE(realloc_grow_accounts_real_size)
+{
+    // The neighbour is too small to leave a useful tail, so "p" takes all of it and ends up
+    // bigger than the 160 byte class asked for.
+    void* after = heap->allocate(100);
+    void* p = heap->allocate(40);
+    heap->free(after);
+    BOOST_CHECK_EQUAL(heap->realloc(p, 150), p);
+
+    size_t used, free;
+    uint32_t allocations;
+    heap_v1::stats stats;
+    heap->statistics(&stats);
+    for (uint32_t bin = 0; bin < stats.bins; ++bin)
+    {
+        size_t class_size = heap->bin_statistics(bin, &used, &free, &allocations);
+        if (used)
+        {
+            BOOST_CHECK(class_size > 160);
+            BOOST_CHECK(class_size < used);
+        }
+    }
+    heap->free(p);
+}
+
+BOOST_AUTO_TEST_CASE(realloc_moves_when_neighbour_busy)
+{
+    void* after = heap->allocate(40);
+    char* p = static_cast<char*>(heap->allocate(40));
+    memset(p, 'c', 40);
+
+    char* q = static_cast<char*>(heap->realloc(p, 400));
+    BOOST_CHECK(q != p);
+    BOOST_CHECK_EQUAL(q[0], 'c');
+    BOOST_CHECK_EQUAL(q[39], 'c');
+
+    heap->free(q);
+    heap->free(after);
+}
+
+BOOST_AUTO_TEST_CASE(realloc_fails_cleanly)
+{
+    char* p = static_cast<char*>(heap->allocate(40));
+    p[0] = 'd';
+    BOOST_CHECK(heap->realloc(p, 10*SIZE) == NULL);
+    BOOST_CHECK_EQUAL(p[0], 'd');
+    heap->free(p);
+}
+
+BOOST_AUTO_TEST_CASE(allocate_splits_larger_free_block)
+{
+    // "top" is carved from the end of the heap, "guard" keeps it from merging back into free space.
+    char* top = static_cast<char*>(heap->allocate(2000));
+    char* guard = static_cast<char*>(heap->allocate(16));
+    heap->free(top);
+
+    // The only block of at least 500 bytes above guard is the freed one, the bitmap search must find it.
+    char* p = static_cast<char*>(heap->allocate(500));
+    BOOST_CHECK(p > guard);
+    BOOST_CHECK(p < top + 2000);
+
+    heap->free(p);
+    heap->free(guard);
+}
+
+BOOST_AUTO_TEST_CASE(free_coalesces_immediately)
+{
+    void* a = heap->allocate(100);
+    void* b = heap->allocate(100);
+    void* c = heap->allocate(100);
+    heap->free(a);
+    heap->free(c);
+    heap->free(b);
+
+    BOOST_CHECK_EQUAL(heap->coalescing_statistics().merges, 3u);
+    BOOST_CHECK(heap->coalescing_statistics().cycles > 0);
+
+    // Whole heap is one free block again, no whole heap walk needed to get it.
+    void* big = heap->allocate(SIZE / 2 + SIZE / 4);
+    BOOST_CHECK(big != NULL);
+    BOOST_CHECK_EQUAL(heap->coalescing_statistics().full_passes, 0u);
+    heap->free(big);
+}
+
+BOOST_AUTO_TEST_CASE(deferred_coalescing_is_bounded)
+{
+    heap->set_coalesce_mode(heap_t::COALESCE_DEFERRED, 0);
+
+    void* a = heap->allocate(100);
+    void* b = heap->allocate(100);
+    void* c = heap->allocate(100);
+    heap->free(a);
+    heap->free(c);
+    heap->free(b);
+    BOOST_CHECK_EQUAL(heap->coalescing_statistics().merges, 0u);
+
+    // Each step visits at most one block.
+    for (int i = 0; i < 16; ++i)
+        heap->coalesce_step(1);
+    BOOST_CHECK_EQUAL(heap->coalescing_statistics().merges, 3u);
+    BOOST_CHECK_EQUAL(heap->coalescing_statistics().full_passes, 0u);
+}
+
+BOOST_AUTO_TEST_CASE(deferred_coalescing_steps_up_when_low)
+{
+    heap->set_coalesce_mode(heap_t::COALESCE_DEFERRED, 0);
+
+    // With a zero budget allocations leave coalescing alone while there is plenty of free space.
+    void* p[256];
+    int n = 0;
+    heap_v1::stats stats;
+    heap->statistics(&stats);
+    while (stats.free_bytes >= heap->size() / 8)
+    {
+        p[n++] = heap->allocate(1000);
+        heap->statistics(&stats);
+    }
+    BOOST_CHECK_EQUAL(heap->coalescing_statistics().steps, 0u);
+
+    // Below the low water mark they do some coalescing of their own.
+    p[n++] = heap->allocate(16);
+    BOOST_CHECK_EQUAL(heap->coalescing_statistics().steps, 1u);
+
+    for (int i = 0; i < n; ++i)
+        heap->free(p[i]);
+}
+
+BOOST_AUTO_TEST_CASE(magazine_allocate_free)
+{
+    heap->unlock();
+
+    // Each VCPU reuses its own last freed block.
+    void* a = heap->cached_allocate(40, 1);
+    void* b = heap->cached_allocate(40, 2);
+    BOOST_CHECK(a != NULL);
+    BOOST_CHECK(b != NULL);
+    BOOST_CHECK(a != b);
+    BOOST_CHECK(heap->cached_free(a, 1));
+    BOOST_CHECK(heap->cached_free(b, 2));
+    BOOST_CHECK_EQUAL(heap->cached_allocate(40, 1), a);
+    BOOST_CHECK_EQUAL(heap->cached_allocate(40, 2), b);
+
+    // Large blocks and VCPUs without magazines go to the shared heap.
+    BOOST_CHECK(heap->cached_allocate(1000, 1) == NULL);
+    BOOST_CHECK(heap->cached_allocate(40, heap_t::MAGAZINE_VCPUS) == NULL);
+    BOOST_CHECK(!heap->cached_free(a, heap_t::MAGAZINE_VCPUS));
+    BOOST_CHECK(heap->cached_free(a, 1));
+    BOOST_CHECK(heap->cached_free(b, 2));
+
+    heap->lock();
+}
+
+BOOST_AUTO_TEST_CASE(magazine_overflow_flushes_half)
+{
+    void* p[9];
+    for (int i = 0; i < 9; ++i)
+        p[i] = heap->allocate(40);
+
+    heap_v1::stats stats;
+    heap->statistics(&stats);
+    const size_t managed = stats.used_bytes + stats.free_bytes;
+    const size_t block = stats.used_bytes / 9;
+
+    // A magazine holds 8 blocks, the 9th free sends 4 of them back to the heap.
+    heap->unlock();
+    for (int i = 0; i < 9; ++i)
+        BOOST_CHECK(heap->cached_free(p[i], 1));
+    heap->lock();
+
+    heap->statistics(&stats);
+    BOOST_CHECK_EQUAL(stats.cached_bytes, 5 * block);
+    BOOST_CHECK_EQUAL(stats.used_bytes, 5 * block);
+    BOOST_CHECK_EQUAL(stats.used_bytes + stats.free_bytes, managed);
+}
+
+BOOST_AUTO_TEST_CASE(magazines_drained_when_out_of_space)
+{
+    heap_v1::stats stats;
+    heap->statistics(&stats);
+    const size_t managed = stats.free_bytes;
+
+    // A block parked in a magazine splits free space into two halves, neither big enough.
+    void* top = heap->allocate(managed / 2);
+    void* middle = heap->allocate(40);
+    heap->unlock();
+    BOOST_CHECK(heap->cached_free(middle, 1));
+    heap->lock();
+    heap->free(top);
+
+    void* big = heap->allocate(managed * 3 / 4);
+    BOOST_CHECK(big != NULL);
+    heap->statistics(&stats);
+    BOOST_CHECK_EQUAL(stats.cached_bytes, 0u);
+    heap->free(big);
+}
+
+BOOST_AUTO_TEST_CASE(statistics_account_every_byte)
+{
+    heap_v1::stats stats;
+    heap->statistics(&stats);
+    BOOST_CHECK_EQUAL(stats.used_bytes, 0u);
+    BOOST_CHECK(stats.free_bytes < stats.heap_size);
+    // Apart from heap bookkeeping every byte is either used or free.
+    const size_t managed = stats.free_bytes;
+
+    void* a = heap->allocate(100);
+    void* b = heap->allocate(3000);
+    heap->statistics(&stats);
+    BOOST_CHECK_EQUAL(stats.used_bytes + stats.free_bytes, managed);
+    BOOST_CHECK_EQUAL(stats.allocations, 2u);
+
+    size_t peak = stats.used_bytes;
+    heap->free(b);
+    b = heap->realloc(a, 50);
+    heap->statistics(&stats);
+    BOOST_CHECK_EQUAL(stats.used_bytes + stats.free_bytes, managed);
+    BOOST_CHECK_EQUAL(stats.high_water_mark, peak);
+
+    heap->free(b);
+    heap->statistics(&stats);
+    BOOST_CHECK_EQUAL(stats.used_bytes, 0u);
+    BOOST_CHECK_EQUAL(stats.free_bytes, managed);
+}
+
+BOOST_AUTO_TEST_CASE(bin_statistics_histogram)
+{
+    void* p[3];
+    for (int i = 0; i < 3; ++i)
+        p[i] = heap->allocate(1000);
+
+    size_t used, free;
+    uint32_t allocations, hits = 0;
+    heap_v1::stats stats;
+    heap->statistics(&stats);
+
+    for (uint32_t bin = 0; bin < stats.bins; ++bin)
+    {
+        size_t class_size = heap->bin_statistics(bin, &used, &free, &allocations);
+        if (allocations)
+        {
+            BOOST_CHECK_EQUAL(allocations, 3u);
+            BOOST_CHECK(class_size >= 1000);
+            BOOST_CHECK(used > 3 * class_size);
+            BOOST_CHECK_EQUAL(used % 3, 0u);
+            ++hits;
+        }
+    }
+    BOOST_CHECK_EQUAL(hits, 1u);
+
+    for (int i = 0; i < 3; ++i)
+        heap->free(p[i]);
+}
+
+BOOST_AUTO_TEST_CASE(sampling_attributes_call_sites)
+{
+    uint32_t samples;
+    size_t bytes;
+
+    heap->set_sampling(2);
+    heap->unlock();
+    for (int i = 0; i < 10; ++i)
+        heap->sample_allocation(64, 0x1000);
+    for (int i = 0; i < 4; ++i)
+        heap->sample_allocation(8, 0x2000);
+    heap->lock();
+
+    uint32_t counts[2] = { 0, 0 };
+    for (uint32_t n = 0; n < 16; ++n)
+    {
+        address_t site = heap->call_site(n, &samples, &bytes);
+        if (site == 0x1000)
+        {
+            counts[0] = samples;
+            BOOST_CHECK_EQUAL(bytes, samples * 64);
+        }
+        if (site == 0x2000)
+            counts[1] = samples;
+    }
+    BOOST_CHECK_EQUAL(counts[0], 5u);
+    BOOST_CHECK_EQUAL(counts[1], 2u);
+
+    heap->set_sampling(0);
+    BOOST_CHECK_EQUAL(heap->call_site(0, &samples, &bytes), 0u);
+}
+
+BOOST_AUTO_TEST_SUITE_END()
@@ -41,7 +41,6 @@ using namespace std;
 using namespace raii_wrapper;
 using namespace bootimage_n;
 
-const uint32_t version = 1;
 const uint32_t ALIGN = 4;
 
 //======================================================================================================================
@@ -126,6 +125,13 @@ filebinio& operator << (filebinio& io, bootimage_n::root_domain_t& dom)
     return io;
 }
 
+filebinio& operator << (filebinio& io, bootimage_n::index_entry_t& ent)
+{
+    io.write32le(ent.hash);
+    io.write32le(ent.offset);
+    return io;
+}
+
 filebinio& operator << (filebinio& io, bootimage_n::namespace_entry_t& ent)
 {
     io.write32le(LIMIT32(ent.tag));
@@ -149,14 +155,21 @@ public:
 
 private:
     vector<char> table;
+    map<std::string, uint32_t> offsets;
 };
 
 /**
  * Append 0-terminated string to string table, return starting string offset in table.
+ * Strings already in the table are not appended again, their existing offset is returned.
  */
 uint32_t stringtable_t::append(const std::string& addend)
 {
+    auto it = offsets.find(addend);
+    if (it != offsets.end())
+        return it->second;
+
     uint32_t last_offset = table.size();
+    offsets[addend] = last_offset;
     table.resize(table.size() + addend.size() + 1);
     copy(addend.begin(), addend.end(), table.begin() + last_offset);
     table.back() = 0;
@@ -211,6 +224,7 @@ public:
     void override_ns_entry(std::string key, void* val);
 
     void dump();
+    const std::string& module_name() const { return name; }
 
     // Write out module information together with the namespace and file data.
     bool write(file& out, uintptr_t& data_offset);
@@ -238,12 +252,19 @@ public:
     size_t size() const;
 
 private:
-    std::vector<namespace_entry_t> entries;
+    std::vector<namespace_entry_t> entries; // sorted by key, because ns_map is
+    std::vector<uint32_t> buckets;
     stringtable_t string_table;
 };
 
 module_namespace1_t::module_namespace1_t(module_info::ns_map namespace_entries)
 {
+    // Keep hash table at most half full so that probe sequences stay short.
+    size_t n_buckets = namespace_entries.empty() ? 0 : 1;
+    while (n_buckets && n_buckets < 2 * namespace_entries.size())
+        n_buckets <<= 1;
+    buckets.resize(n_buckets, 0);
+
     for(auto entry : namespace_entries)
     {
         namespace_entry_t e;
@@ -262,12 +283,18 @@ module_namespace1_t::module_namespace1_t(module_info::ns_map namespace_entries)
                 break;
         }
         entries.push_back(e);
+
+        size_t bucket = name_hash(entry.first.c_str()) & (n_buckets - 1);
+        while (buckets[bucket])
+            bucket = (bucket + 1) & (n_buckets - 1);
+        buckets[bucket] = entries.size(); // index + 1
     }
 }
 
 size_t module_namespace1_t::size() const
 {
-    return 4 + entries.size() * SIZEOF_ONDISK_NAMESPACE_ENTRY + string_table.size();
+    return SIZEOF_ONDISK_NAMESPACE_HEADER + entries.size() * SIZEOF_ONDISK_NAMESPACE_ENTRY + buckets.size() * 4
+        + string_table.size();
 }
 
 bool module_namespace1_t::write(file& out, uintptr_t& data_offset)
@@ -276,8 +303,9 @@ bool module_namespace1_t::write(file& out, uintptr_t& data_offset)
     filebinio io(out);
 
     io.write32le(LIMIT32(entries.size()));
+    io.write32le(LIMIT32(buckets.size()));
 
-    data_offset += 4 + entries.size() * SIZEOF_ONDISK_NAMESPACE_ENTRY;
+    data_offset += SIZEOF_ONDISK_NAMESPACE_HEADER + entries.size() * SIZEOF_ONDISK_NAMESPACE_ENTRY + buckets.size() * 4;
     for(auto entry : entries)
     {
         entry.name_off += data_offset; // Turn into a global bootimage file position.
@@ -285,6 +313,8 @@ bool module_namespace1_t::write(file& out, uintptr_t& data_offset)
             entry.value_int += data_offset; // Adjust offset for string namespace entries too.
         io << entry;
     }
+    for(auto bucket : buckets)
+        io.write32le(bucket);
     string_table.write(out, data_offset);
     return true;
 }
@@ -377,7 +407,7 @@ bool module_info::write_module_header(file& out, uintptr_t& data_offset, int in_
     mod.address = data_offset + name_s_a + ns_size;
     mod.size = in_size;
     mod.name = (const char*)data_offset;
-    mod.local_namespace_offset = ns_size ? data_offset + name_s_a : 0;
+    mod.local_namespace_offset = namespace_entries.empty() ? 0 : data_offset + name_s_a; // ns_size includes alignment padding
 
     filebinio io(out);
     io << mod << name;
@@ -400,7 +430,7 @@ bool module_info::write_root_domain_header(file& out, uintptr_t& data_offset, in
     rdom.address = data_offset + name_s_a + ns_size;
     rdom.size = in_size;
     rdom.name = (const char*)data_offset;
-    rdom.local_namespace_offset = ns_size ? data_offset + name_s_a : 0;
+    rdom.local_namespace_offset = namespace_entries.empty() ? 0 : data_offset + name_s_a; // ns_size includes alignment padding
     rdom.entry_point = 0xefbeadde;
 
     filebinio io(out);
@@ -588,17 +618,38 @@ int main(int argc, char** argv)
 
         bootimage_n::header_t hdr;
         hdr.magic = four_cc<'B', 'I', 'M', 'G'>::value;
-        hdr.version = version;
+        hdr.version = FORMAT_VERSION;
         io << hdr;
         data_offset += 8; // sizeof(output bootimage_n::header_t)
 
-        for (module_info& mod : modules)
+        // Module index goes first, reserve space now and fill in once record offsets are known.
+        uintptr_t index_offset = data_offset;
+        rec_t index;
+        index.tag = kind_index;
+        index.length = SIZEOF_ONDISK_INDEX_HEADER + modules.size() * SIZEOF_ONDISK_INDEX_ENTRY;
+        io << index;
+        io.write32le(LIMIT32(modules.size()));
+        std::vector<index_entry_t> index_entries(modules.size());
+        for (index_entry_t& entry : index_entries)
+            io << entry;
+        data_offset += index.length;
+
+        for (size_t i = 0; i < modules.size(); ++i)
         {
             printf("Adding...");
-            mod.dump();
+            modules[i].dump();
 
-            mod.write(out, data_offset);
+            index_entries[i].hash = name_hash(modules[i].module_name().c_str());
+            index_entries[i].offset = LIMIT32(data_offset);
+            modules[i].write(out, data_offset);
         }
+
+        sort(index_entries.begin(), index_entries.end(), [](const index_entry_t& a, const index_entry_t& b) {
+            return a.hash < b.hash;
+        });
+        out.write_seek(index_offset + SIZEOF_ONDISK_INDEX_HEADER);
+        for (index_entry_t& entry : index_entries)
+            io << entry;
     } // try
     catch(file_error& e)
     {
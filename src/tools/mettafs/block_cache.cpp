@@ -11,7 +11,9 @@
 #include "memutils.h"
 #include <cstdio>
 #include <cassert>
+#include <algorithm>
 #include <iostream> // debug
+#include <thread>
 
 //=====================================================================================================================
 // System-dependent functions to actually read and write blocks.
@@ -24,12 +26,197 @@ void block_cache_t::set_device_mapper(block_device_mapper_t& mapper)
 
 size_t block_cache_t::read_blocks(deviceno_t device, block_device_t::blockno_t block_n, char* data, size_t nblocks, size_t block_size)
 {
-    return device_mapper->read(device, block_n, data, nblocks * block_size);
+    {
+        shard_t& shard = shard_for(device, block_n);
+        shard_lock_t guard(shard.lock);
+        ++shard.stats.device_reads;
+    }
+    return device_mapper->read(device, block_n, data, nblocks * block_size) / block_size;
+}
+
+bool block_cache_t::is_mapped(deviceno_t device)
+{
+    return device_mapper && device_mapper->mapping(device, 0, 1);
+}
+
+const char* block_cache_t::view(deviceno_t device, block_device_t::blockno_t block_n, size_t nblocks)
+{
+    return device_mapper ? device_mapper->mapping(device, block_n, nblocks) : NULL;
+}
+
+block_cache_t::pending_io_t* block_cache_t::start_io(shard_t& shard, io_request_t::op_e op, const std::vector<cache_block_t*>& run,
+    std::vector<io_request_t*>& batch, io_waiter_t* waiter)
+{
+    assert(!run.empty());
+    pending_io_t* io = new pending_io_t;
+    io->shard = &shard;
+    io->blocks = run;
+    io->readahead = false;
+    io->victim = 0;
+    io->copy_to = 0;
+    io->waiter = waiter;
+    io->request.op = op;
+    io->request.cookie = io;
+    io->request.result = 0;
+
+    for (auto blk : run)
+    {
+        assert(!blk->busy);
+        if (op == io_request_t::write)
+            blk->unlink_from(&shard.dirty);
+        blk->busy = true;
+        ++shard.busy_blocks;
+        io->request.iov.push_back(iovec { blk->data, blk->block_size });
+    }
+
+    device_mapper->prepare(run[0]->device, run[0]->block_num, &io->request);
+    if (op == io_request_t::read)
+        ++shard.stats.device_reads;
+    else
+        ++shard.stats.device_writes;
+    if (waiter)
+        ++waiter->remaining;
+    batch.push_back(&io->request);
+    return io;
+}
+
+void block_cache_t::submit_io(std::vector<io_request_t*>& batch)
+{
+    if (batch.empty())
+        return;
+    io_pending += batch.size();
+    io_lock.lock();
+    device_mapper->submit(&batch[0], batch.size());
+    release_io_lock();
+    batch.clear();
+}
+
+/**
+ * Finished reads put their blocks on the clean list, blocks past the end of device are dropped from the cache.
+ * Finished writes move their blocks to the clean list, blocks that failed to write go back to the dirty list.
+ */
+void block_cache_t::finish_io(pending_io_t* io)
+{
+    shard_t& shard = *io->shard;
+    bool is_read = io->request.op == io_request_t::read;
+    size_t block_size = io->blocks[0]->block_size;
+    size_t transferred = io->request.result > 0 ? io->request.result / block_size : 0;
+    bool failed = io->request.result < 0 || (!is_read && transferred < io->blocks.size());
+
+    shard_lock_t guard(shard.lock);
+    if (failed)
+        ++shard.stats.io_errors;
+
+    for (size_t b = 0; b < io->blocks.size(); ++b)
+    {
+        cache_block_t* blk = io->blocks[b];
+        blk->busy = false;
+        --shard.busy_blocks;
+        if (is_read && b >= transferred)
+        {
+            shard.index.remove(blk);
+            delete blk;
+            --shard.allocated_blocks;
+            continue;
+        }
+        if (is_read)
+        {
+            if (io->copy_to)
+                memutils::copy_memory(io->copy_to + b * block_size, blk->data, block_size);
+            if (io->readahead)
+                ++shard.stats.readahead_blocks;
+        }
+        else if (b < transferred)
+        {
+            blk->dirty = false;
+            ++shard.stats.blocks_written;
+        }
+        if (blk == io->victim && !blk->dirty)
+            blk->link_at_lru(&shard.clean);
+        else
+            blk->link_at_mru(shard.list_of(blk));
+    }
+    guard.unlock();
+
+    --io_pending;
+    if (io_waiter_t* waiter = io->waiter)
+    {
+        waiter->transferred += std::min(transferred, io->blocks.size());
+        if (failed)
+            ++waiter->errors;
+        --waiter->remaining; // Last touch, the waiter may go away right after.
+    }
+    delete io;
+}
+
+size_t block_cache_t::reap_io(size_t min_count)
+{
+    static const size_t REAP_BATCH = 16;
+    io_request_t* done[REAP_BATCH];
+    size_t total = 0;
+
+    while (true)
+    {
+        size_t n = device_mapper->reap(done, REAP_BATCH, min_count > total ? std::min(min_count - total, REAP_BATCH) : 0);
+        for (size_t i = 0; i < n; ++i)
+            finish_io(static_cast<pending_io_t*>(done[i]->cookie));
+        total += n;
+        if (n == 0 || (n < REAP_BATCH && total >= min_count))
+            return total;
+    }
+}
+
+/**
+ * Every release wakes the waiters, those who failed to take io_lock meanwhile get to try again.
+ */
+void block_cache_t::release_io_lock()
+{
+    io_lock.unlock();
+    {
+        std::lock_guard<std::mutex> guard(wait_lock);
+        ++io_generation;
+    }
+    io_done.notify_all();
+}
+
+void block_cache_t::complete_io()
+{
+    if (io_pending && io_lock.try_lock())
+    {
+        reap_io(0);
+        release_io_lock();
+    }
+}
+
+uint64_t block_cache_t::io_round()
+{
+    std::lock_guard<std::mutex> guard(wait_lock);
+    return io_generation;
+}
+
+void block_cache_t::wait_io(uint64_t seen)
+{
+    if (io_lock.try_lock())
+    {
+        size_t n = reap_io(1);
+        release_io_lock();
+        if (!n)
+            std::this_thread::yield(); // What we wait for is not submitted yet.
+        return;
+    }
+    std::unique_lock<std::mutex> guard(wait_lock);
+    io_done.wait(guard, [this, seen] { return io_generation != seen; });
 }
 
-size_t block_cache_t::write_blocks(deviceno_t device, block_device_t::blockno_t block_n, const char* data, size_t nblocks, size_t block_size)
+void block_cache_t::wait_for(io_waiter_t& waiter)
 {
-    return device_mapper->write(device, block_n, data, nblocks * block_size);
+    while (true)
+    {
+        uint64_t seen = io_round();
+        if (!waiter.remaining)
+            return;
+        wait_io(seen);
+    }
 }
 
 //=====================================================================================================================
@@ -51,7 +238,16 @@ cache_block_t::cache_block_t(deviceno_t dev, block_device_t::blockno_t block_n,
 
 cache_block_t::~cache_block_t()
 {
-    delete data;
+    delete [] data;
+}
+
+void cache_block_t::resize(size_t size)
+{
+    if (size == block_size)
+        return;
+    delete [] data;
+    data = new char [size];
+    block_size = size;
 }
 
 // Double-linked list helper functions.
@@ -119,121 +315,439 @@ void cache_block_t::unlink_from(cache_block_list_t* parent)
     prev_lru = next_mru = 0;
 }
 
+//=====================================================================================================================
+// block_index_t
+//=====================================================================================================================
+
+block_index_t::block_index_t(size_t max_entries)
+    : count(0)
+{
+    size_t n_slots = 16;
+    while (n_slots < 2 * max_entries)
+        n_slots <<= 1;
+    slots.resize(n_slots, 0);
+    mask = n_slots - 1;
+}
+
+size_t block_index_t::home_slot(deviceno_t device, block_device_t::blockno_t block_n) const
+{
+    // Fibonacci hashing, sequential block numbers spread over the whole table.
+    uint64_t key = (uint64_t(device) << 48) ^ block_n;
+    return (key * 0x9e3779b97f4a7c15ULL) >> 32 & mask;
+}
+
+cache_block_t* block_index_t::find(deviceno_t device, block_device_t::blockno_t block_n) const
+{
+    for (size_t slot = home_slot(device, block_n); slots[slot]; slot = (slot + 1) & mask)
+    {
+        if (slots[slot]->block_num == block_n && slots[slot]->device == device)
+            return slots[slot];
+    }
+    return NULL;
+}
+
+void block_index_t::insert(cache_block_t* block)
+{
+    assert(count < slots.size() / 2);
+    size_t slot = home_slot(block->device, block->block_num);
+    while (slots[slot])
+    {
+        assert(slots[slot] != block);
+        slot = (slot + 1) & mask;
+    }
+    slots[slot] = block;
+    ++count;
+}
+
+void block_index_t::remove(cache_block_t* block)
+{
+    size_t slot = home_slot(block->device, block->block_num);
+    while (slots[slot] != block)
+    {
+        assert(slots[slot]);
+        slot = (slot + 1) & mask;
+    }
+
+    // Move back any following entries that would no longer be reachable from their home slot across the hole.
+    size_t hole = slot;
+    for (slot = (slot + 1) & mask; slots[slot]; slot = (slot + 1) & mask)
+    {
+        size_t home = home_slot(slots[slot]->device, slots[slot]->block_num);
+        if (((slot - home) & mask) >= ((slot - hole) & mask))
+        {
+            slots[hole] = slots[slot];
+            hole = slot;
+        }
+    }
+    slots[hole] = 0;
+    --count;
+}
+
 //=====================================================================================================================
 // Portable block cache implementation.
 //=====================================================================================================================
 
+const size_t block_cache_t::READAHEAD_MIN;
+const size_t block_cache_t::READAHEAD_MAX;
+const size_t block_cache_t::CLUSTER_MAX;
+const size_t block_cache_t::SHARD_SHIFT;
+const size_t block_cache_t::SHARD_MIN_BLOCKS;
+const size_t block_cache_t::SHARDS_MAX;
+
+block_cache_t::shard_t::shard_t(size_t n_blocks)
+    : index(n_blocks)
+    , max_blocks(n_blocks)
+    , allocated_blocks(0)
+    , busy_blocks(0)
+{
+    clean.lru = clean.mru = NULL;
+    dirty.lru = dirty.mru = NULL;
+    stats = stats_t();
+}
+
+block_cache_t::block_cache_t(size_t n_blocks, size_t n_shards)
+    : max_blocks(n_blocks)
+    , device_mapper(NULL)
+    , io_pending(0)
+    , io_generation(0)
+{
+    if (!n_shards)
+    {
+        n_shards = 1;
+        while (n_shards < SHARDS_MAX && 2 * n_shards * SHARD_MIN_BLOCKS <= n_blocks)
+            n_shards *= 2;
+    }
+    if ((n_shards & (n_shards - 1)) || n_shards > std::max<size_t>(n_blocks, 1))
+        throw std::runtime_error("Number of cache shards must be a power of two not larger than the cache.");
+
+    for (size_t i = 0; i < n_shards; ++i)
+        shards.emplace_back(new shard_t(n_blocks / n_shards + (i < n_blocks % n_shards)));
+}
+
 block_cache_t::~block_cache_t()
 {
+    // Blocks with I/O still in flight are on no list, the device mapper is expected to have drained the queue already.
+    for (auto& shard : shards)
+    {
+        cache_block_list_t* lists[] = { &shard->clean, &shard->dirty };
+        for (auto list : lists)
+        {
+            while (list->lru)
+            {
+                cache_block_t* blk = list->lru;
+                blk->unlink_from(list);
+                delete blk;
+            }
+        }
+        for (auto blk : shard->spare)
+            delete blk;
+    }
+}
+
+block_cache_t::shard_t& block_cache_t::shard_for(deviceno_t device, block_device_t::blockno_t block_n)
+{
+    // Consecutive regions of a device go to consecutive shards, so that a small cache spreads evenly over them.
+    return *shards[((block_n >> SHARD_SHIFT) + device * 0x9e3779b9u) & (shards.size() - 1)];
 }
 
 /**
  * Find the block in the cache.
- * Assumes all necessary locks are held (acts as internal worker function).
- * If block is busy doing I/O will wait a certain amount of time (not implemented for single-threaded test).
+ * Requires shard lock held with guard (acts as internal worker function).
+ * If block is busy doing I/O sleeps on the wait queue, a block dropped by a short read is reported as not found.
  */
-cache_block_t* block_cache_t::block_lookup(deviceno_t device, block_device_t::blockno_t block_n)
+cache_block_t* block_cache_t::block_lookup(shard_t& shard, shard_lock_t& guard, deviceno_t device, block_device_t::blockno_t block_n)
+{
+    cache_block_t* blk;
+    while ((blk = shard.index.find(device, block_n)) && blk->busy)
+    {
+        uint64_t seen = io_round();
+        guard.unlock();
+        wait_io(seen);
+        guard.lock();
+    }
+    return blk;
+}
+
+std::vector<cache_block_t*> block_cache_t::dirty_run(shard_t& shard, cache_block_t* blk)
+{
+    auto clusters_with = [&shard, blk](block_device_t::blockno_t block_n) {
+        cache_block_t* other = shard.index.find(blk->device, block_n);
+        return other && other->dirty && !other->busy && other->block_size == blk->block_size;
+    };
+    block_device_t::blockno_t region_first = region_end(blk->block_num) - (block_device_t::blockno_t(1) << SHARD_SHIFT);
+    block_device_t::blockno_t first = blk->block_num, last = blk->block_num;
+    while (first > region_first && last - first + 1 < CLUSTER_MAX && clusters_with(first - 1))
+        --first;
+    while (last + 1 < region_end(blk->block_num) && last - first + 1 < CLUSTER_MAX && clusters_with(last + 1))
+        ++last;
+
+    std::vector<cache_block_t*> run;
+    for (block_device_t::blockno_t b = first; b <= last; ++b)
+        run.push_back(shard.index.find(blk->device, b));
+    return run;
+}
+
+bool block_cache_t::write_back(shard_t& shard, shard_lock_t& guard, cache_block_t* blk)
+{
+    assert(blk->dirty && !blk->busy);
+
+    io_waiter_t waiter;
+    std::vector<io_request_t*> batch;
+    start_io(shard, io_request_t::write, dirty_run(shard, blk), batch, &waiter)->victim = blk;
+    guard.unlock();
+    submit_io(batch);
+    wait_for(waiter);
+    guard.lock();
+    return !waiter.errors;
+}
+
+bool block_cache_t::has_busy_blocks(shard_t& shard, deviceno_t dev)
 {
-    block_id_t id = std::make_pair(device, block_n);
-    cache_map_t::iterator it;
+    bool busy = false;
+    if (shard.busy_blocks)
+        shard.index.for_each([&busy, dev](cache_block_t* blk) { busy = busy || (blk->busy && blk->device == dev); });
+    return busy;
+}
+
+void block_cache_t::write_back_range(deviceno_t device, block_device_t::blockno_t block_n, size_t nblocks)
+{
+    io_waiter_t waiter;
+    block_device_t::blockno_t end = block_n + nblocks;
 
-    if ((it = cache.find(id)) != cache.end())
+    while (block_n < end)
     {
-        //TODO: check for busy block, and wait if it is busy (shouldn't happen in single threaded test).
-        return (*it).second;
+        shard_t& shard = shard_for(device, block_n);
+        block_device_t::blockno_t first = block_n, last = std::min(end, region_end(block_n));
+        auto in_flight = [&shard, device, first, last] {
+            for (block_device_t::blockno_t b = first; b < last; ++b)
+            {
+                cache_block_t* blk = shard.index.find(device, b);
+                if (blk && blk->busy)
+                    return true;
+            }
+            return false;
+        };
+
+        shard_lock_t guard(shard.lock);
+        while (shard.busy_blocks && in_flight())
+        {
+            uint64_t seen = io_round();
+            guard.unlock();
+            wait_io(seen);
+            guard.lock();
+        }
+
+        std::vector<io_request_t*> batch;
+        for (block_device_t::blockno_t b = first; b < last; ++b)
+        {
+            cache_block_t* blk = shard.index.find(device, b);
+            if (blk && blk->dirty && !blk->busy) // Busy ones are part of an earlier cluster.
+                start_io(shard, io_request_t::write, dirty_run(shard, blk), batch, &waiter);
+        }
+        guard.unlock();
+        submit_io(batch);
+        block_n = last;
     }
-    return NULL;
+    wait_for(waiter);
 }
 
 /**
- * Write out all cached blocks for device dev.
+ * Write out all cached blocks for device dev and drop them from the cache.
+ * Clusters of each shard are submitted at once, so the queue can keep several writes in flight.
  */
 bool block_cache_t::flush(deviceno_t dev)
 {
-    cache_block_t* blk = blocks.lru;
-    cache_block_t* prev_blk = 0;
-    while (blk) {
-        if (blk->is_busy() || (blk->device != dev)) {
-            std::cerr << "NOT flushing block " << blk->block_num << " because busy? " << blk->is_busy() << ", or wrong dev? " << (blk->device != dev) << std::endl;
-            blk = blk->next_mru;
-            continue;
+    io_waiter_t waiter;
+    std::vector<io_request_t*> batch;
+
+    for (auto& s : shards)
+    {
+        shard_t& shard = *s;
+        shard_lock_t guard(shard.lock);
+
+        // Transfers already in flight may be write-backs of this device, let them finish first.
+        while (has_busy_blocks(shard, dev))
+        {
+            uint64_t seen = io_round();
+            guard.unlock();
+            wait_io(seen);
+            guard.lock();
+        }
+
+        std::vector<cache_block_t*> to_write;
+        for (cache_block_t* blk = shard.dirty.lru; blk; blk = blk->next_mru)
+        {
+            if (blk->device == dev)
+                to_write.push_back(blk);
         }
 
-        std::cerr << "Flushing block " << blk->block_num << " of device " << dev << std::endl;
+        // In block order, so that each cluster starts at the first block of its run.
+        std::sort(to_write.begin(), to_write.end(), [](cache_block_t* a, cache_block_t* b) {
+            return a->block_num < b->block_num;
+        });
 
-        if (write_blocks(dev, blk->block_num, blk->data, 1, blk->block_size) != blk->block_size)
-            return false;
+        for (auto blk : to_write)
+        {
+            if (blk->busy)
+                continue; // Part of an earlier cluster.
+
+            std::cerr << "Flushing block " << blk->block_num << " of device " << dev << std::endl;
+            start_io(shard, io_request_t::write, dirty_run(shard, blk), batch, &waiter);
+        }
+        guard.unlock();
+        submit_io(batch);
+    }
+    wait_for(waiter);
 
-        prev_blk = blk;
-        blk = blk->next_mru;
-        prev_blk->unlink_from(&blocks);
-        cache[std::make_pair(dev, prev_blk->block_num)] = 0;
-        delete prev_blk;
+    if (waiter.errors)
+        return false;
+
+    for (auto& s : shards)
+    {
+        shard_t& shard = *s;
+        shard_lock_t guard(shard.lock);
+        cache_block_t* blk = shard.clean.lru;
+        while (blk) {
+            cache_block_t* next_blk = blk->next_mru;
+            if (blk->device == dev) {
+                blk->unlink_from(&shard.clean);
+                shard.index.remove(blk);
+                delete blk;
+                --shard.allocated_blocks;
+            }
+            blk = next_blk;
+        }
     }
-    return true;
+    return device_mapper->sync(dev);
 }
 
 size_t block_cache_t::unwritten_blocks()
 {
     size_t n = 0;
-    cache_block_t* blk = blocks.lru;
-    while (blk) {
-        ++n;
-        blk = blk->next_mru;
+    for (auto& shard : shards)
+    {
+        shard_lock_t guard(shard->lock);
+        for (cache_block_t* blk = shard->dirty.lru; blk; blk = blk->next_mru)
+            ++n;
+    }
+    return n;
+}
+
+size_t block_cache_t::allocated_size() const
+{
+    size_t n = 0;
+    for (auto& shard : shards)
+    {
+        shard_lock_t guard(shard->lock);
+        n += shard->allocated_blocks;
     }
     return n;
 }
 
+block_cache_t::stats_t block_cache_t::statistics() const
+{
+    stats_t total = stats_t();
+    for (auto& shard : shards)
+    {
+        shard_lock_t guard(shard->lock);
+        total.hits += shard->stats.hits;
+        total.misses += shard->stats.misses;
+        total.readahead_blocks += shard->stats.readahead_blocks;
+        total.device_reads += shard->stats.device_reads;
+        total.device_writes += shard->stats.device_writes;
+        total.blocks_written += shard->stats.blocks_written;
+        total.io_errors += shard->stats.io_errors;
+        total.mapped_blocks += shard->stats.mapped_blocks;
+    }
+    return total;
+}
+
+size_t block_cache_t::grab_blocks(shard_t& shard, size_t nblocks, size_t block_size, std::vector<cache_block_t*>& out)
+{
+    while (out.size() < nblocks)
+    {
+        cache_block_t* blk;
+        if (!shard.spare.empty())
+        {
+            blk = shard.spare.back();
+            shard.spare.pop_back();
+        }
+        else if (shard.allocated_blocks < shard.max_blocks)
+        {
+            // If cache is not filled, just allocate new blocks.
+            blk = new cache_block_t(-1, -1, block_size);
+            ++shard.allocated_blocks;
+        }
+        else if ((blk = shard.clean.lru))
+        {
+            // Only usable blocks are on the clean list, so its LRU end is always the block to evict.
+            blk->unlink_from(&shard.clean);
+            shard.index.remove(blk);
+        }
+        else
+            break;
+        blk->resize(block_size);
+        out.push_back(blk);
+    }
+    return out.size();
+}
+
+void block_cache_t::release_blocks(shard_t& shard, const std::vector<cache_block_t*>& blocks)
+{
+    shard.spare.insert(shard.spare.end(), blocks.begin(), blocks.end());
+}
+
 /**
  * Blocks we are trying to get may be either busy, locked or dirty. In either case, we cannot discard them and reuse for anything.
  * We also need to keep track that the blocks we've taken are of correct size, and if not - reallocate them.
  */
-std::vector<cache_block_t*> block_cache_t::get_blocks(size_t nblocks, size_t block_size)
+std::vector<cache_block_t*> block_cache_t::get_blocks(shard_t& shard, shard_lock_t& guard, size_t nblocks, size_t block_size)
 {
-    if (nblocks > max_blocks)
+    if (nblocks > shard.max_blocks)
         throw std::runtime_error("Cannot allocate more blocks than allowed in the cache in total!");
 
     std::vector<cache_block_t*> ret;
-
-    // If cache is not filled, just allocate new blocks.
-    size_t nfree = max_blocks - cache.size();
-    while (nfree && nblocks)
+    while (grab_blocks(shard, nblocks, block_size, ret) < nblocks)
     {
-        cache_block_t* blk = new cache_block_t(-1, -1, block_size);
-        assert(blk); // FIXME: do a real check.
-        ret.push_back(blk);
-        --nblocks;
-        --nfree;
-    }
+        // Hold on to nothing while waiting, so that threads cannot starve each other out of a small shard.
+        release_blocks(shard, ret);
+        ret.clear();
 
-    // We've exhausted the cache free space, now take old entries off the cache and reuse.
-    while (nblocks)
-    {
-        cache_block_t* blk = blocks.lru;
-        while (blk)
+        // Everything left is dirty or busy, make the oldest dirty block clean first or wait for some I/O.
+        if (shard.dirty.lru)
         {
-            if (!blk->is_usable() || (blk->size() != block_size))
-            {
-                blk = blk->next_mru;
-                continue;
-            }
-            blk->unlink_from(&blocks);
-            ret.push_back(blk);
-            --nblocks;
-            break;
+            if (!write_back(shard, guard, shard.dirty.lru))
+                throw std::runtime_error("Write back of evicted block failed.");
+        }
+        else if (shard.busy_blocks)
+        {
+            uint64_t seen = io_round();
+            guard.unlock();
+            wait_io(seen);
+            guard.lock();
         }
+        else
+            throw std::runtime_error("No block cache entries left to evict.");
     }
-
     return ret;
 }
 
+std::vector<cache_block_t*> block_cache_t::get_blocks(deviceno_t device, block_device_t::blockno_t block_n, size_t nblocks, size_t block_size)
+{
+    shard_t& shard = shard_for(device, block_n);
+    shard_lock_t guard(shard.lock);
+    return get_blocks(shard, guard, nblocks, block_size);
+}
+
 void block_cache_t::set_device_block_size(deviceno_t dev, size_t block_size)
 {
+    std::lock_guard<std::mutex> guard(state_lock);
     device_block_sizes[dev] = block_size;
 }
 
 size_t block_cache_t::get_block_size(deviceno_t dev)
 {
+    std::lock_guard<std::mutex> guard(state_lock);
     return device_block_sizes[dev];
 }
 
@@ -254,6 +768,59 @@ size_t block_cache_t::byte_write(deviceno_t device, off_t byte_offset, const cha
     return cached_write(device, byte_offset / block_size, data, nbytes / block_size, block_size);
 }
 
+/**
+ * A read starting where the previous one on this device ended doubles the window, anything else resets it.
+ */
+size_t block_cache_t::readahead_window(deviceno_t device, block_device_t::blockno_t block_n, size_t nblocks)
+{
+    std::lock_guard<std::mutex> guard(state_lock);
+    stream_t& stream = streams[device];
+    if (block_n == stream.next)
+        stream.window = std::min(std::max(stream.window * 2, READAHEAD_MIN), std::min(READAHEAD_MAX, max_blocks / 4));
+    else
+        stream.window = 0;
+    stream.next = block_n + nblocks;
+    return stream.window;
+}
+
+/**
+ * Readahead goes into busy blocks straight from the device and completes in the background. It never waits for
+ * blocks, takes only free and clean ones, and stops at the first block already cached.
+ * Readahead past the end of device is simply cut short on completion.
+ */
+void block_cache_t::readahead(deviceno_t device, block_device_t::blockno_t block_n, size_t nblocks, size_t block_size)
+{
+    std::vector<io_request_t*> batch;
+    while (nblocks)
+    {
+        shard_t& shard = shard_for(device, block_n);
+        size_t piece = std::min<size_t>(nblocks, region_end(block_n) - block_n);
+        shard_lock_t guard(shard.lock);
+
+        size_t n = 0;
+        while (n < std::min(piece, shard.max_blocks / 2) && !shard.index.find(device, block_n + n))
+            ++n;
+        std::vector<cache_block_t*> ents;
+        n = grab_blocks(shard, n, block_size, ents);
+        if (n)
+        {
+            for (size_t b = 0; b < n; ++b)
+            {
+                ents[b]->dirty = false;
+                ents[b]->device = device;
+                ents[b]->block_num = block_n + b;
+                shard.index.insert(ents[b]);
+            }
+            start_io(shard, io_request_t::read, ents, batch)->readahead = true;
+        }
+        if (n < piece)
+            break;
+        block_n += n;
+        nblocks -= n;
+    }
+    submit_io(batch);
+}
+
 /**
  * @returns number of blocks successfully read.
  */
@@ -261,21 +828,41 @@ size_t block_cache_t::cached_read(deviceno_t device, block_device_t::blockno_t b
 {
     cache_block_t* entry(0);
     char* buffer = static_cast<char*>(data);
-    size_t actually_read;
+    size_t actually_read, total_read = 0;
+    size_t window = readahead_window(device, block_n, nblocks);
+
+    complete_io();
+
+    // Mapped devices are read straight from the mapping, page cache already keeps and prefetches their content.
+    if (is_mapped(device))
+    {
+        const char* mapped = device_mapper->mapping(device, block_n, nblocks);
+        if (!mapped)
+            throw std::runtime_error("Read past the end of mapped device.");
+        memutils::copy_memory(buffer, mapped, nblocks * block_size);
+        shard_t& shard = shard_for(device, block_n);
+        shard_lock_t guard(shard.lock);
+        shard.stats.mapped_blocks += nblocks;
+        return nblocks;
+    }
 
     if (nblocks * block_size > 64*1024)
     {
         // Large read: do directly!
+        // Let the device catch up with the cache first: a block whose write-back is in flight would be read stale,
+        // and once written it may be dropped from the cache before the copy below could correct it.
+        write_back_range(device, block_n, nblocks);
         actually_read = read_blocks(device, block_n, buffer, nblocks, block_size);
-        // Update read data with contents of dirty blocks in cache if necessary.
+        // Update read data with contents of cached blocks, which may have been written meanwhile.
         while (nblocks)
         {
-            entry = block_lookup(device, block_n);
+            shard_t& shard = shard_for(device, block_n);
+            shard_lock_t guard(shard.lock);
+            entry = block_lookup(shard, guard, device, block_n);
             if (entry)
             {
                 assert(entry->block_size == block_size);
-                if (entry->dirty)
-                    memutils::copy_memory(entry->data, buffer, block_size); // Update read data with cache data (e.g. dirty blocks).
+                memutils::copy_memory(buffer, entry->data, block_size);
             }
             block_n++;
             nblocks--;
@@ -287,53 +874,83 @@ size_t block_cache_t::cached_read(deviceno_t device, block_device_t::blockno_t b
     // Small reads, do slower block-by-block for now.
     while (nblocks)
     {
-        entry = block_lookup(device, block_n);
+        shard_t& shard = shard_for(device, block_n);
+        shard_lock_t guard(shard.lock);
+        entry = block_lookup(shard, guard, device, block_n);
         if (entry)
         {
             assert(entry->block_size == block_size);
             // Block is found in cache.
-            entry->unlink_from(&blocks); // Remove it from the list it is in, because it's going to be modified.
+            ++shard.stats.hits;
+            entry->unlink_from(shard.list_of(entry)); // Remove it from the list it is in, because it's going to be modified.
             memutils::copy_memory(buffer, entry->data, block_size); // FIXME: replace this with a visitor pattern?
             // Add block back at the start of the MRU list.
-            entry->link_at_mru(&blocks);
+            entry->link_at_mru(shard.list_of(entry));
 
             block_n++;
             nblocks--;
             buffer += block_size;
+            total_read++;
+            continue;
         }
-        else
-        {
-            // Block is not found in the cache, need to perform a read (preferably with a readahead, for at least number of blocks requested)
-            // Check if some blocks in that range are already in the cache anyway?
-            // FIXME: Would it be simpler to read entire stripes regardless and then just discard blocks already in the cache?
-
-            // find how many adjacent blocks from the request are not in the cache, to read them all at once
-            block_device_t::blockno_t block_stripe;
-            for (block_stripe = 1; block_stripe < nblocks; ++block_stripe) // start from 1, since block 0 definitely not found (above).
-            {
-                if (block_lookup(device, block_n + block_stripe))
-                    break;
-            }
-
-            actually_read = read_blocks(device, block_n, buffer, block_stripe, block_size);
-
-            if (actually_read < block_stripe)
-                throw std::runtime_error("Read blocks from physical media failed! [make it nonfatal]");
 
-            // create new blocks for just read data
-            // add new block to the cache, evicting LRU entries as needed
-            auto ents = get_blocks(block_stripe, block_size);
+        // Block is not found in the cache, read the run of adjacent uncached blocks of the request in this shard region at once.
+        // Blocks with I/O in flight count as cached, the lookup above waits for them when it gets there.
+        size_t limit = std::min<size_t>(std::min<size_t>(nblocks, region_end(block_n) - block_n), shard.max_blocks);
+        size_t block_stripe;
+        for (block_stripe = 1; block_stripe < limit; ++block_stripe) // start from 1, since block 0 definitely not found (above).
+        {
+            if (shard.index.find(device, block_n + block_stripe))
+                break;
+        }
 
-            if (ents.size() < block_stripe)
-                throw std::runtime_error("Couldn't get enough block cache entries.");
+        // create new blocks for the data, evicting LRU entries as needed
+        auto ents = get_blocks(shard, guard, block_stripe, block_size);
 
-            // cache the blocks
-            // for (size_t b = 0; b < block_stripe; ++b)
+        // The shard may have been unlocked to make room, somebody else could have cached some of the blocks meanwhile.
+        size_t fresh = 0;
+        while (fresh < block_stripe && !shard.index.find(device, block_n + fresh))
+            ++fresh;
+        if (fresh < block_stripe)
+        {
+            release_blocks(shard, std::vector<cache_block_t*>(ents.begin() + fresh, ents.end()));
+            ents.resize(fresh);
+            block_stripe = fresh;
+            if (!block_stripe)
+                continue;
+        }
 
-            // keep looping
+        // Blocks are cached busy before the read, so that concurrent lookups wait for the data instead of reading it again.
+        for (size_t b = 0; b < block_stripe; ++b)
+        {
+            entry = ents[b];
+            entry->dirty = false;
+            entry->device = device;
+            entry->block_num = block_n + b;
+            shard.index.insert(entry);
         }
+        io_waiter_t waiter;
+        std::vector<io_request_t*> batch;
+        start_io(shard, io_request_t::read, ents, batch, &waiter)->copy_to = buffer;
+        shard.stats.misses += block_stripe;
+        guard.unlock();
+        submit_io(batch);
+
+        // If the stripe runs to the end of a sequential request, follow it with the readahead window,
+        // submitted before waiting so that it overlaps with the requested read.
+        if (block_stripe == nblocks && window)
+            readahead(device, block_n + block_stripe, std::min(window, max_blocks / 2 - std::min<size_t>(block_stripe, max_blocks / 2)), block_size);
+
+        wait_for(waiter);
+        if (waiter.transferred < block_stripe)
+            throw std::runtime_error("Read blocks from physical media failed! [make it nonfatal]");
+
+        block_n += block_stripe;
+        nblocks -= block_stripe;
+        buffer += block_stripe * block_size;
+        total_read += block_stripe;
     }
-    return 0;
+    return total_read;
 }
 
 size_t block_cache_t::cached_write(deviceno_t device, block_device_t::blockno_t block_n, const void* data, size_t nblocks, size_t block_size)
@@ -342,48 +959,59 @@ size_t block_cache_t::cached_write(deviceno_t device, block_device_t::blockno_t
     char* buffer = static_cast<char*>(const_cast<void*>(data));
     size_t written = 0;
 
+    complete_io();
+
     std::cerr << "cached_write(dev " << device << ", block " << block_n << ", nblocks " << nblocks << ", block_size " << block_size << ")" << std::endl;
 
+    // Mapped devices are written straight into the mapping, flush() makes the writes durable.
+    if (is_mapped(device))
+    {
+        if (!device_mapper->mapping(device, block_n, nblocks))
+            throw std::runtime_error("Write past the end of mapped device.");
+        device_mapper->write(device, block_n, buffer, nblocks * block_size);
+        shard_t& shard = shard_for(device, block_n);
+        shard_lock_t guard(shard.lock);
+        shard.stats.mapped_blocks += nblocks;
+        return nblocks * block_size;
+    }
+
     while (nblocks)
     {
-        entry = block_lookup(device, block_n);
+        shard_t& shard = shard_for(device, block_n);
+        shard_lock_t guard(shard.lock);
+        entry = block_lookup(shard, guard, device, block_n);
         if (entry)
         {
             assert(entry->block_size == block_size);
             std::cerr << "Block is found in the cache." << std::endl;
-            entry->unlink_from(&blocks); // Remove it from the list it is in, because it's going to be modified.
-            memutils::copy_memory(entry->data, buffer, block_size); // FIXME: replace this with a visitor pattern?
-
-            entry->set_dirty();
-            entry->device = device;
-            entry->block_num = block_n;
-
-            // Add block back at the start of the MRU list.
-            entry->link_at_mru(&blocks);
-            cache[std::make_pair(device, block_n)] = entry;
+            entry->unlink_from(shard.list_of(entry)); // Remove it from the list it is in, because it's going to be modified.
         }
         else
         {
             // Block is not found in the cache, create a new one (potentially pushing older blocks out of cache).
-            auto ents = get_blocks(1, block_size);
+            auto ents = get_blocks(shard, guard, 1, block_size);
 
-            if (ents.size() < 1)
-                throw std::runtime_error("get_blocks failed");
+            if (shard.index.find(device, block_n))
+            {
+                // Cached by somebody else while the shard was unlocked, write to that one instead.
+                release_blocks(shard, ents);
+                continue;
+            }
 
             std::cerr << "New blocks allocated: " << ents.size() << std::endl;
 
             entry = ents[0];
-            memutils::copy_memory(entry->data, buffer, block_size);
-
-            entry->set_dirty();
             entry->device = device;
             entry->block_num = block_n;
-
-            // Add block back at the start of the MRU list.
-            entry->link_at_mru(&blocks);
-            cache[std::make_pair(device, block_n)] = entry;
+            shard.index.insert(entry);
         }
 
+        memutils::copy_memory(entry->data, buffer, block_size); // FIXME: replace this with a visitor pattern?
+        entry->set_dirty();
+
+        // Add block back at the start of the MRU list.
+        entry->link_at_mru(&shard.dirty);
+
         block_n++;
         nblocks--;
         buffer += block_size;
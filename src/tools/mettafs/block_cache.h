@@ -10,14 +10,37 @@
  * Filesystem block cache.
  *
  * Block cache handles device reads and writes and adds faster access for reading and delayed buffer management for writing.
- * It is very simple - blocks are entered into a map based on block number and origin device, blocks are also entered into a LRU/MRU list,
- * for easy eviction if memory pressure increases.
+ * It is very simple - blocks are entered into a hash index based on block number and origin device, blocks are also entered into
+ * either a clean or a dirty LRU/MRU list. Only clean blocks can be evicted, so eviction simply takes the LRU end of the clean list,
+ * and writes back the oldest dirty block first if there are no clean blocks left.
+ *
+ * Sequential reads on a device grow a readahead window that is prefetched into the cache on a miss, and dirty blocks are
+ * written out in clusters of adjacent blocks with a single device write.
+ *
+ * Readahead and write-back go through the device mapper's asynchronous queue. Blocks with I/O in flight are marked busy,
+ * stay in the index but on neither list, and lookups wait for their I/O to complete.
+ * Devices must be unmapped (which flushes them) before the cache is destroyed.
+ *
+ * The cache is split into shards, each with its own lock, index, lists and share of the blocks. Blocks are assigned to
+ * shards by aligned regions of 1 << SHARD_SHIFT blocks, so clusters and readahead pieces never cross shards, while
+ * threads working on different parts of a device mostly take different locks. Transfers are submitted and reaped under
+ * a single I/O lock; threads waiting for busy blocks either take the I/O lock and reap completions themselves,
+ * or sleep on the cache's wait queue until the current reaper is done.
+ *
+ * Memory mapped devices bypass the cache blocks entirely: reads and writes copy to and from the mapping, view() hands
+ * out pointers into it without any copy, and flush() syncs the mapping.
  */
 #pragma once
 
 #include "block_device.h"
+#include "block_io_queue.h"
+#include <atomic>
+#include <condition_variable>
 #include <map>
+#include <memory>
+#include <mutex>
 #include <vector>
+#include <stdexcept>
 
 class cache_block_t;
 
@@ -44,6 +67,7 @@ class cache_block_t
 	cache_block_t* prev_lru; //!< Points towards LRU end of the list.
 
 	friend class block_cache_t;
+	friend class block_index_t;
 
 public:
 	cache_block_t(deviceno_t device, block_device_t::blockno_t block_n, size_t size);
@@ -53,42 +77,239 @@ public:
 	bool is_usable() { return !dirty && !busy/* && !locked*/; }
         bool is_busy() const { return busy; }
 	size_t size() { return block_size; }
+	void resize(size_t size);
 
 	void link_at_mru(cache_block_list_t* parent);
 	void link_at_lru(cache_block_list_t* parent);
 	void unlink_from(cache_block_list_t* parent);
 };
 
+/**
+ * Open addressing index of cached blocks by device and block number.
+ * Uses linear probing and is sized to stay at most half full, removal shifts following entries back instead of leaving
+ * tombstones, so lookups stay short no matter how many blocks went through the cache.
+ */
+class block_index_t
+{
+	std::vector<cache_block_t*> slots;
+	size_t mask;
+	size_t count;
+
+	size_t home_slot(deviceno_t device, block_device_t::blockno_t block_n) const;
+
+public:
+	/**
+	 * Create an index for at most max_entries blocks.
+	 */
+	block_index_t(size_t max_entries);
+
+	cache_block_t* find(deviceno_t device, block_device_t::blockno_t block_n) const;
+	void insert(cache_block_t* block);
+	void remove(cache_block_t* block);
+	size_t size() const { return count; }
+
+	template <typename F>
+	void for_each(F f) const
+	{
+		for (auto block : slots)
+			if (block)
+				f(block);
+	}
+};
+
 class block_device_mapper_t;
 
 class block_cache_t
 {
-	typedef std::pair<deviceno_t, block_device_t::blockno_t> block_id_t; //!< Pairs device number with block number.
-	typedef std::map<block_id_t, cache_block_t*> cache_map_t;
-	cache_map_t cache; //!< Map for quickly finding blocks given device and block number pair.
-	std::map<deviceno_t, size_t> max_device_blocks; //!< Maximum number of blocks in each opened device (for error checking).
-	std::map<deviceno_t, size_t> device_block_sizes; //!< Block sizes for registered devices.
+public:
+	static const size_t READAHEAD_MIN = 4;   //!< Initial readahead window, in blocks.
+	static const size_t READAHEAD_MAX = 256; //!< Readahead window limit, in blocks.
+	static const size_t CLUSTER_MAX = 256;   //!< Maximum number of blocks written out with one device write.
+	static const size_t SHARD_SHIFT = 8;     //!< Log2 of the number of blocks in a region mapped to one shard.
+	static const size_t SHARD_MIN_BLOCKS = 256; //!< Smallest shard size picked automatically.
+	static const size_t SHARDS_MAX = 16;     //!< Largest number of shards picked automatically.
+
+	struct stats_t
+	{
+		size_t hits;             //!< Blocks found in the cache.
+		size_t misses;           //!< Blocks read from the device on request.
+		size_t readahead_blocks; //!< Blocks read from the device ahead of request.
+		size_t device_reads;     //!< Read requests to the device.
+		size_t device_writes;    //!< Write requests to the device.
+		size_t blocks_written;   //!< Blocks successfully written to the device.
+		size_t io_errors;        //!< Failed asynchronous transfers.
+		size_t mapped_blocks;    //!< Blocks read or written directly through a device mapping.
+	};
+
+private:
+	/**
+	 * Sequential access detector, one per device.
+	 */
+	struct stream_t
+	{
+		block_device_t::blockno_t next; //!< Block after the end of last read.
+		size_t window; //!< Current readahead window, 0 if access is not sequential.
+	};
+
+	/**
+	 * Independently locked part of the cache, evicts only among its own blocks.
+	 */
+	struct shard_t
+	{
+		std::mutex lock;
+		block_index_t index; //!< Index for quickly finding blocks given device and block number pair.
+		cache_block_list_t clean; //!< LRU list of blocks that can be evicted right away.
+		cache_block_list_t dirty; //!< LRU list of blocks waiting to be written out.
+		std::vector<cache_block_t*> spare; //!< Allocated blocks not holding any data.
+		size_t max_blocks; //!< Maximum number of blocks stored in this shard.
+		size_t allocated_blocks; //!< Number of blocks currently allocated, cached or handed out by get_blocks().
+		size_t busy_blocks; //!< Blocks with I/O in flight, they are on neither list.
+		stats_t stats;
+
+		shard_t(size_t n_blocks);
+		cache_block_list_t* list_of(cache_block_t* block) { return block->dirty ? &dirty : &clean; }
+	};
+	typedef std::unique_lock<std::mutex> shard_lock_t;
+
+	/**
+	 * Completion of a group of transfers somebody waits for.
+	 */
+	struct io_waiter_t
+	{
+		std::atomic<size_t> remaining;   //!< Transfers not completed yet.
+		std::atomic<size_t> transferred; //!< Blocks transferred successfully.
+		std::atomic<size_t> errors;      //!< Failed transfers.
+
+		io_waiter_t() : remaining(0), transferred(0), errors(0) {}
+	};
+
+	/**
+	 * Asynchronous transfer of a run of adjacent blocks of one shard, straight from and to their data buffers.
+	 */
+	struct pending_io_t
+	{
+		io_request_t request;
+		shard_t* shard;
+		std::vector<cache_block_t*> blocks;
+		bool readahead;        //!< Read not asked for yet, counted in readahead_blocks.
+		cache_block_t* victim; //!< Block being evicted, goes to the LRU end of the clean list once written.
+		char* copy_to;         //!< Read data is also copied here on completion.
+		io_waiter_t* waiter;
+	};
+
+	std::vector<std::unique_ptr<shard_t>> shards;
 	size_t max_blocks; //!< Maximum number of blocks stored in this cache.
-	cache_block_list_t blocks; //!< LRU list of blocks.
 	block_device_mapper_t* device_mapper;
 
+	std::mutex state_lock; //!< Protects per-device state below.
+	std::map<deviceno_t, size_t> max_device_blocks; //!< Maximum number of blocks in each opened device (for error checking).
+	std::map<deviceno_t, size_t> device_block_sizes; //!< Block sizes for registered devices.
+	std::map<deviceno_t, stream_t> streams;
+
+	std::mutex io_lock; //!< Serialises device mapper queue access, whoever holds it may reap completions.
+	std::atomic<size_t> io_pending; //!< Transfers submitted and not completed yet.
+	std::mutex wait_lock;
+	std::condition_variable io_done; //!< Wait queue for busy blocks, woken whenever io_lock is released.
+	uint64_t io_generation; //!< Number of io_lock releases, protected by wait_lock.
+
+	shard_t& shard_for(deviceno_t device, block_device_t::blockno_t block_n);
+
+	/**
+	 * First block of the next shard region.
+	 */
+	static block_device_t::blockno_t region_end(block_device_t::blockno_t block_n)
+	{
+		return (block_n | ((block_device_t::blockno_t(1) << SHARD_SHIFT) - 1)) + 1;
+	}
+
 	/**
 	 * Perform actual read on physical blocks.
 	 * @return number of blocks successfully read or 0 on failure.
 	 */
 	size_t read_blocks(deviceno_t device, block_device_t::blockno_t block_n, char* data, size_t nblocks, size_t block_size);
+
+	/**
+	 * Find the block in the shard, waiting while it is busy. Shard must be locked with guard.
+	 */
+	cache_block_t* block_lookup(shard_t& shard, shard_lock_t& guard, deviceno_t device, block_device_t::blockno_t block_n);
+
+	/**
+	 * Take up to nblocks blocks without waiting: spare ones, newly allocated ones or the least recently used clean ones.
+	 * @return number of blocks in out.
+	 */
+	size_t grab_blocks(shard_t& shard, size_t nblocks, size_t block_size, std::vector<cache_block_t*>& out);
+
+	/**
+	 * Obtain a number of blocks, writing back dirty blocks and waiting for I/O as needed.
+	 * May drop the shard lock meanwhile, so cached blocks may have changed on return.
+	 */
+	std::vector<cache_block_t*> get_blocks(shard_t& shard, shard_lock_t& guard, size_t nblocks, size_t block_size);
+
+	/**
+	 * Return unused blocks obtained with get_blocks().
+	 */
+	void release_blocks(shard_t& shard, const std::vector<cache_block_t*>& blocks);
+
+	/**
+	 * Write out a dirty block together with the run of adjacent dirty blocks around it and wait for it.
+	 * The block moves to the LRU end of the clean list, the rest of the run to the MRU end.
+	 * Drops the shard lock while waiting.
+	 */
+	bool write_back(shard_t& shard, shard_lock_t& guard, cache_block_t* block);
+
 	/**
-	 * Perform actual write on physical blocks.
-	 * @return number of blocks successfully written or 0 on failure.
+	 * Collect the run of adjacent non-busy dirty blocks around block within its shard region, at most CLUSTER_MAX long.
 	 */
-	size_t write_blocks(deviceno_t device, block_device_t::blockno_t block_n, const char* data, size_t nblocks, size_t block_size);
+	std::vector<cache_block_t*> dirty_run(shard_t& shard, cache_block_t* block);
+
+	bool has_busy_blocks(shard_t& shard, deviceno_t device);
 
-	cache_block_t* block_lookup(deviceno_t device, block_device_t::blockno_t block_n);
+	/**
+	 * Write out the dirty blocks among nblocks blocks at block_n and wait for them and for transfers already in
+	 * flight there, so that the device holds everything cached for the range. Drops shard locks while waiting.
+	 */
+	void write_back_range(deviceno_t device, block_device_t::blockno_t block_n, size_t nblocks);
+
+	/**
+	 * Read up to nblocks uncached blocks starting at block_n in the background.
+	 */
+	void readahead(deviceno_t device, block_device_t::blockno_t block_n, size_t nblocks, size_t block_size);
 
 	/**
-	 * Obtain a number of blocks by evicting oldest blocks from the cache.
+	 * Mark blocks busy and queue a transfer of them to batch, submitted with submit_io() once the shard is unlocked.
 	 */
-	std::vector<cache_block_t*> get_blocks(size_t nblocks, size_t block_size);
+	pending_io_t* start_io(shard_t& shard, io_request_t::op_e op, const std::vector<cache_block_t*>& run,
+		std::vector<io_request_t*>& batch, io_waiter_t* waiter = NULL);
+	void submit_io(std::vector<io_request_t*>& batch);
+	void finish_io(pending_io_t* io);
+
+	/**
+	 * Process finished transfers, waiting for at least min_count of them. Requires io_lock.
+	 */
+	size_t reap_io(size_t min_count);
+	void release_io_lock();
+
+	/**
+	 * Reap whatever has completed, if nobody else is doing it.
+	 */
+	void complete_io();
+
+	/**
+	 * Wait for transfers to make progress since io_round() returned seen. Called without shard locks held.
+	 */
+	uint64_t io_round();
+	void wait_io(uint64_t seen);
+	void wait_for(io_waiter_t& waiter);
+
+	/**
+	 * Device content is memory mapped and is accessed without going through cache blocks.
+	 */
+	bool is_mapped(deviceno_t device);
+
+	/**
+	 * Update sequential access detector for device and return readahead window for this read.
+	 */
+	size_t readahead_window(deviceno_t device, block_device_t::blockno_t block_n, size_t nblocks);
 
 	/**
 	 * Get block size for a given device.
@@ -97,19 +318,33 @@ class block_cache_t
 
 public:
 	/**
-	 * Create a cache that can store maximum of n_blocks data blocks.
+	 * Create a cache that can store maximum of n_blocks data blocks split into n_shards shards (a power of two).
+	 * With n_shards 0 the number of shards is picked from the cache size.
 	 */
-	block_cache_t(size_t n_blocks) : max_blocks(n_blocks), device_mapper(NULL) { blocks.lru = blocks.mru = NULL; }
+	block_cache_t(size_t n_blocks, size_t n_shards = 0);
 	~block_cache_t();
 
 	void set_device_block_size(deviceno_t dev, size_t block_size);
 	void set_device_mapper(block_device_mapper_t& mapper);
 
+	/**
+	 * Obtain a number of blocks for caching blocks starting at block_n of device, evicting oldest blocks from the shard
+	 * they belong to.
+	 */
+	std::vector<cache_block_t*> get_blocks(deviceno_t device, block_device_t::blockno_t block_n, size_t nblocks, size_t block_size);
+
 	/**
 	 * Finish all remaining operations on cache for device dev.
+	 * Safe to run concurrently with readers, blocks written to meanwhile may stay dirty.
 	 */
 	bool flush(deviceno_t dev);
 
+	/**
+	 * Zero-copy read access to nblocks blocks of a memory mapped device.
+	 * @return pointer valid until the device is unmapped, or NULL if the device is not mapped or the range is outside it.
+	 */
+	const char* view(deviceno_t device, block_device_t::blockno_t block_n, size_t nblocks);
+
 	size_t cached_read(deviceno_t device, block_device_t::blockno_t block_n, void* data, size_t nblocks, size_t block_size);
 	size_t cached_write(deviceno_t device, block_device_t::blockno_t block_n, const void* data, size_t nblocks, size_t block_size);
 
@@ -119,4 +354,7 @@ public:
 
         // debug stuff
         size_t unwritten_blocks();
+        size_t allocated_size() const;
+        size_t shard_count() const { return shards.size(); }
+        stats_t statistics() const;
 };
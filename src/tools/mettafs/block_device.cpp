@@ -8,9 +8,16 @@
 //
 #include "block_device.h"
 #include "macros.h"
-#include <fstream>
 #include <iostream>
+#include <algorithm>
+#include <cstring>
+#include <stdexcept>
 #include <cassert>
+#include <errno.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
 
 using namespace std;
 
@@ -19,22 +26,22 @@ block_device_t::block_device_t(const std::string& name, bool create, blocksize_t
     , blockSize(bs)
     , numBlocks(numBlocks)
 {
-    storageFile = new fstream(storageFileName.c_str(), create ? ios::out|ios::trunc|ios::binary : ios::out|/*ios::nocreate|*/ios::binary);
+    storageFile = ::open(storageFileName.c_str(), create ? O_RDWR|O_CREAT|O_TRUNC : O_RDWR, 0644);
+    if (storageFile < 0)
+        throw std::runtime_error("Cannot open block device storage " + storageFileName);
 }
 
 block_device_t::~block_device_t()
 {
-    if (storageFile)
+    if (storageFile >= 0)
         close();
 }
 
 void block_device_t::close()
 {
-    assert(storageFile);
-    assert(storageFile->good());
-    storageFile->close();
-    delete storageFile; // TODO: no matching open()
-    storageFile = 0;
+    assert(storageFile >= 0);
+    ::close(storageFile); // TODO: no matching open()
+    storageFile = -1;
 }
 
 /**
@@ -68,9 +75,17 @@ block_device_t::blocksize_t block_device_t::read_block(block_device_t::blockno_t
         std::cerr << "block read of non-block size buffer" << std::endl;
         return 0;
     }
-    storageFile->seekg(block * blockSize);
-    storageFile->read(buffer, bytes);
-    return bytes;
+    blocksize_t done = 0;
+    while (done < bytes)
+    {
+        ssize_t n = pread(storageFile, buffer + done, bytes - done, block * blockSize + done);
+        if (n < 0 && errno == EINTR)
+            continue;
+        if (n <= 0)
+            break; // Short read at the end of the file, report whole blocks only.
+        done += n;
+    }
+    return done - done % blockSize;
 }
 
 void block_device_t::write_block(block_device_t::blockno_t block, const char* buffer, block_device_t::blocksize_t bytes)
@@ -80,6 +95,135 @@ void block_device_t::write_block(block_device_t::blockno_t block, const char* bu
         std::cerr << "block write of non-block size buffer" << std::endl;
         return;
     }
-    storageFile->seekp(block * blockSize);
-    storageFile->write(buffer, bytes);
+    blocksize_t done = 0;
+    while (done < bytes)
+    {
+        ssize_t n = pwrite(storageFile, buffer + done, bytes - done, block * blockSize + done);
+        if (n < 0 && errno == EINTR)
+            continue;
+        if (n <= 0)
+        {
+            std::cerr << "block write failed" << std::endl;
+            return;
+        }
+        done += n;
+    }
+}
+
+//=====================================================================================================================
+// mapped_block_device_t
+//=====================================================================================================================
+
+mapped_block_device_t::mapped_block_device_t(const std::string& name, bool create, blocksize_t bs, blockno_t nblocks)
+    : block_device_t(name, create, bs, nblocks)
+    , base(0)
+    , size(0)
+    , dirty_first(0)
+    , dirty_end(0)
+{
+    struct stat st;
+    if (fstat(storageFile, &st) != 0)
+        throw std::runtime_error("Cannot stat block device storage " + storageFileName);
+
+    // Grow the file to the requested size, otherwise use as much of it as there are whole blocks.
+    if (numBlocks > blockno_t(st.st_size) / blockSize)
+    {
+        if (ftruncate(storageFile, numBlocks * blockSize) != 0)
+            throw std::runtime_error("Cannot resize block device storage " + storageFileName);
+    }
+    else
+        numBlocks = st.st_size / blockSize;
+
+    size = numBlocks * blockSize;
+    if (size == 0)
+        throw std::runtime_error("Cannot map empty block device storage " + storageFileName);
+    void* addr = mmap(0, size, PROT_READ | PROT_WRITE, MAP_SHARED, storageFile, 0);
+    if (addr == MAP_FAILED)
+        throw std::runtime_error("Cannot map block device storage " + storageFileName);
+    base = static_cast<char*>(addr);
+}
+
+mapped_block_device_t::~mapped_block_device_t()
+{
+    unmap();
+}
+
+void mapped_block_device_t::unmap()
+{
+    if (!base)
+        return;
+    sync();
+    munmap(base, size);
+    base = 0;
+}
+
+void mapped_block_device_t::close()
+{
+    unmap();
+    block_device_t::close();
+}
+
+const char* mapped_block_device_t::mapping(blockno_t block, blockno_t nblocks) const
+{
+    if (!base || block >= numBlocks || nblocks > numBlocks - block)
+        return NULL;
+    return base + block * blockSize;
+}
+
+block_device_t::blocksize_t mapped_block_device_t::read_block(blockno_t block, char* buffer, blocksize_t bytes)
+{
+    if (bytes % blockSize)
+    {
+        std::cerr << "block read of non-block size buffer" << std::endl;
+        return 0;
+    }
+    if (block >= numBlocks)
+        return 0;
+    bytes = std::min<blocksize_t>(bytes, (numBlocks - block) * blockSize); // Reads past the end are cut short.
+    memcpy(buffer, base + block * blockSize, bytes);
+    return bytes;
+}
+
+void mapped_block_device_t::write_block(blockno_t block, const char* buffer, blocksize_t bytes)
+{
+    if (bytes % blockSize)
+    {
+        std::cerr << "block write of non-block size buffer" << std::endl;
+        return;
+    }
+    blockno_t end = block + bytes / blockSize;
+    if (end > numBlocks)
+    {
+        std::cerr << "block write past the end of mapped device" << std::endl;
+        return;
+    }
+    memcpy(base + block * blockSize, buffer, bytes);
+
+    std::lock_guard<std::mutex> guard(dirty_lock);
+    if (dirty_first == dirty_end)
+    {
+        dirty_first = block;
+        dirty_end = end;
+    }
+    else
+    {
+        dirty_first = std::min(dirty_first, block);
+        dirty_end = std::max(dirty_end, end);
+    }
+}
+
+bool mapped_block_device_t::sync()
+{
+    std::lock_guard<std::mutex> guard(dirty_lock);
+    if (dirty_first == dirty_end)
+        return true;
+
+    // msync wants a page aligned start, the mapping itself is page aligned.
+    size_t page = sysconf(_SC_PAGESIZE);
+    size_t start = dirty_first * blockSize / page * page;
+    size_t end = dirty_end * blockSize;
+    if (msync(base + start, end - start, MS_SYNC) != 0)
+        return false;
+    dirty_first = dirty_end = 0;
+    return true;
 }
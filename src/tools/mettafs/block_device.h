@@ -8,8 +8,8 @@
 //
 #pragma once
 
+#include <mutex>
 #include <string>
-#include <fstream>
 
 /**
  * The block device emulates a disk block device with configured block size and access times. It uses a regular file in
@@ -27,7 +27,7 @@ public:
     block_device_t(const std::string& storageFile, bool create = false, blocksize_t blockSize = 0, blockno_t numBlocks = 0);
     virtual ~block_device_t();
 
-    void close();
+    virtual void close();
 
     /**
      * Return time in nanoseconds it would take to seek from current block position to seekTo.
@@ -41,14 +41,61 @@ public:
 
     /**
      * Read and write functions operate on whole blocks of specific size.
+     * Reads past the end of the device are cut short, read_block() returns the number of bytes actually read.
      */
-    blocksize_t read_block(blockno_t block, char* buffer, blocksize_t bufSize);
-    void write_block(blockno_t block, const char* buffer, blocksize_t bytes);
+    virtual blocksize_t read_block(blockno_t block, char* buffer, blocksize_t bufSize);
+    virtual void write_block(blockno_t block, const char* buffer, blocksize_t bytes);
 
-private:
+    /**
+     * Address of nblocks blocks starting at block if the device content is directly addressable in memory, NULL otherwise.
+     */
+    virtual const char* mapping(blockno_t /*block*/, blockno_t /*nblocks*/) const { return NULL; }
+
+    /**
+     * Make all completed writes durable.
+     */
+    virtual bool sync() { return true; }
+
+    /**
+     * File descriptor of the backing file, for submitting asynchronous requests through an io_queue_t.
+     */
+    int handle() const { return storageFile; }
+
+protected:
     std::string storageFileName;
-    std::fstream* storageFile;
+    int storageFile;
     blocksize_t blockSize;
     blockno_t numBlocks;
 };
 
+
+/**
+ * Block device backed by a shared memory mapping of the storage file.
+ *
+ * Reads and writes are plain memory copies into the mapping, and mapping() gives zero-copy access to the blocks,
+ * so block_cache_t bypasses its own blocks for this device. Page cache does readahead and write-back, sync() msyncs
+ * the range touched by writes since the last sync. Writes to different blocks may run concurrently. The device has a fixed size - given on creation, or the file size.
+ */
+class mapped_block_device_t : public block_device_t
+{
+public:
+    mapped_block_device_t(const std::string& storageFile, bool create = false, blocksize_t blockSize = 0, blockno_t numBlocks = 0);
+    ~mapped_block_device_t();
+
+    void close();
+
+    blocksize_t read_block(blockno_t block, char* buffer, blocksize_t bufSize);
+    void write_block(blockno_t block, const char* buffer, blocksize_t bytes);
+    const char* mapping(blockno_t block, blockno_t nblocks) const;
+    bool sync();
+
+    blockno_t num_blocks() const { return numBlocks; }
+
+private:
+    char* base;
+    size_t size; //!< Mapped bytes.
+    std::mutex dirty_lock;
+    blockno_t dirty_first, dirty_end; //!< Blocks written since last sync, empty if equal.
+
+    void unmap();
+};
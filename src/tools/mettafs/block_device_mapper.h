@@ -9,11 +9,14 @@
 #pragma once
 
 #include <map>
+#include <mutex>
 #include <cassert>
 #include "block_cache.h"
+#include "block_io_queue.h"
 
 /**
  * Device mapper can convert between abstract device numbers and actual devices performing I/O.
+ * Device lookups are thread-safe, the I/O queue is not - block_cache_t serialises access to it.
  */
 class block_device_mapper_t
 {
@@ -21,25 +24,57 @@ class block_device_mapper_t
     static int next_device;
     std::map<const char*, deviceno_t> device_ids;
     std::map<deviceno_t, block_device_t*> devices;
+    io_queue_t* queue;
+    std::mutex lock; //!< Protects the device tables.
+
+    block_device_t* device(deviceno_t dev)
+    {
+        std::lock_guard<std::mutex> guard(lock);
+        block_device_t* device = devices[dev];
+        assert(device);
+        return device;
+    }
 
 public:
-    block_device_mapper_t() {}
+    static const size_t QUEUE_DEPTH = 64;
+
+    block_device_mapper_t() : cache(NULL), queue(io_queue_t::create(QUEUE_DEPTH)) {}
+    ~block_device_mapper_t() { delete queue; }
+
+    /**
+     * Replace the asynchronous I/O backend, e.g. to force the thread pool. Mapper takes ownership.
+     */
+    void set_queue(io_queue_t* q)
+    {
+        assert(queue->in_flight() == 0);
+        delete queue;
+        queue = q;
+    }
+    const io_queue_t& get_queue() const { return *queue; }
+
     void map_device(block_device_t& dev, const char* name)
     {
-        deviceno_t d = ++next_device;
-        device_ids[name] = d;
-        devices[d] = &dev;
+        deviceno_t d;
+        {
+            std::lock_guard<std::mutex> guard(lock);
+            d = ++next_device;
+            device_ids[name] = d;
+            devices[d] = &dev;
+        }
         cache->set_device_block_size(d, dev.block_size());
     }
     bool unmap_device(deviceno_t dev)
     {
-        block_device_t* device = devices[dev];
-        assert(device);
+        block_device_t* unmapped = device(dev);
         cache->flush(dev);
-        device->close();
+        unmapped->close();
         return true;
     }
-    deviceno_t resolve_device(const char* name) /*const*/ { return device_ids[name]; }
+    deviceno_t resolve_device(const char* name) /*const*/
+    {
+        std::lock_guard<std::mutex> guard(lock);
+        return device_ids[name];
+    }
     void set_cache(block_cache_t& c) { cache = &c; }
     block_cache_t& get_cache() const { return *cache; }
 
@@ -48,20 +83,45 @@ public:
      */
     size_t read(deviceno_t dev, off_t block_no, char* buffer, size_t size)
     {
-        // LOCK
-        block_device_t* device = devices[dev];
-        assert(device);
-        return device->read_block(block_no, buffer, size);
+        return device(dev)->read_block(block_no, buffer, size);
     }
     /**
      * Perform block write on actual device.
      */
     size_t write(deviceno_t dev, off_t block_no, const char* buffer, size_t size)
     {
-        // LOCK
-        block_device_t* device = devices[dev];
-        assert(device);
-        /*return*/ device->write_block(block_no, buffer, size);
+        /*return*/ device(dev)->write_block(block_no, buffer, size);
         return size;
     }
+
+    /**
+     * Zero-copy view of nblocks blocks at block_no, or NULL if the device is not memory mapped or the range is outside it.
+     */
+    const char* mapping(deviceno_t dev, off_t block_no, size_t nblocks)
+    {
+        return device(dev)->mapping(block_no, nblocks);
+    }
+    /**
+     * Make writes to device dev durable.
+     */
+    bool sync(deviceno_t dev)
+    {
+        return device(dev)->sync();
+    }
+
+    /**
+     * Point request at block_no of device dev, ready for submit().
+     */
+    void prepare(deviceno_t dev, off_t block_no, io_request_t* req)
+    {
+        block_device_t* prepared = device(dev);
+        req->fd = prepared->handle();
+        req->offset = block_no * prepared->block_size();
+    }
+    /**
+     * Start prepared requests, they complete asynchronously and are collected with reap().
+     */
+    void submit(io_request_t** requests, size_t count) { queue->submit(requests, count); }
+    size_t reap(io_request_t** completed, size_t max_count, size_t min_count) { return queue->reap(completed, max_count, min_count); }
+    size_t in_flight() const { return queue->in_flight(); }
 };
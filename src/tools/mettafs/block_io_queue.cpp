@@ -0,0 +1,359 @@
+//
+// Part of Metta OS. Check https://atta-metta.net for latest version.
+//
+// Copyright 2007 - 2017, Stanislav Karchebnyy <berkus@atta-metta.net>
+//
+// Distributed under the Boost Software License, Version 1.0.
+// (See file LICENSE_1_0.txt or a copy at http://www.boost.org/LICENSE_1_0.txt)
+//
+#include "block_io_queue.h"
+#include <errno.h>
+#include <string.h>
+#include <unistd.h>
+#include <algorithm>
+#include <condition_variable>
+#include <deque>
+#include <mutex>
+#include <thread>
+
+#if defined(__linux__) && defined(__has_include)
+#if __has_include(<linux/io_uring.h>)
+#define HAVE_IO_URING 1
+#include <linux/io_uring.h>
+#include <sys/mman.h>
+#include <sys/syscall.h>
+#endif
+#endif
+
+/**
+ * Perform a request synchronously, continuing after partial transfers until done, end of file or error.
+ */
+static ssize_t transfer(io_request_t* req)
+{
+    std::vector<iovec> iov(req->iov);
+    size_t first = 0;
+    ssize_t total = 0;
+
+    while (first < iov.size())
+    {
+        ssize_t n = req->op == io_request_t::read
+            ? preadv(req->fd, &iov[first], iov.size() - first, req->offset + total)
+            : pwritev(req->fd, &iov[first], iov.size() - first, req->offset + total);
+        if (n < 0)
+        {
+            if (errno == EINTR)
+                continue;
+            return total ? total : -errno;
+        }
+        if (n == 0)
+            break;
+        total += n;
+
+        // Skip fully transferred vectors, trim the partially transferred one.
+        while (first < iov.size() && size_t(n) >= iov[first].iov_len)
+            n -= iov[first++].iov_len;
+        if (first < iov.size())
+        {
+            iov[first].iov_base = static_cast<char*>(iov[first].iov_base) + n;
+            iov[first].iov_len -= n;
+        }
+    }
+    return total;
+}
+
+//=====================================================================================================================
+// Worker thread pool backend.
+//=====================================================================================================================
+
+class thread_pool_io_queue_t : public io_queue_t
+{
+    std::vector<std::thread> workers;
+    mutable std::mutex lock;
+    std::condition_variable work_ready; //!< Signalled when pending gets a request or on shutdown.
+    std::condition_variable work_done;  //!< Signalled when completed gets a request.
+    std::deque<io_request_t*> pending;
+    std::deque<io_request_t*> completed;
+    size_t outstanding; //!< Submitted but not reaped.
+    bool stopping;
+
+    void run()
+    {
+        std::unique_lock<std::mutex> guard(lock);
+        while (true)
+        {
+            work_ready.wait(guard, [this] { return stopping || !pending.empty(); });
+            if (pending.empty())
+                return;
+            io_request_t* req = pending.front();
+            pending.pop_front();
+
+            guard.unlock();
+            req->result = transfer(req);
+            guard.lock();
+
+            completed.push_back(req);
+            work_done.notify_all();
+        }
+    }
+
+public:
+    thread_pool_io_queue_t(size_t threads)
+        : outstanding(0)
+        , stopping(false)
+    {
+        for (size_t i = 0; i < std::max<size_t>(threads, 1); ++i)
+            workers.emplace_back([this] { run(); });
+    }
+
+    ~thread_pool_io_queue_t()
+    {
+        {
+            std::lock_guard<std::mutex> guard(lock);
+            stopping = true;
+        }
+        work_ready.notify_all();
+        for (auto& t : workers)
+            t.join();
+    }
+
+    const char* name() const { return "thread pool"; }
+
+    void submit(io_request_t** requests, size_t count)
+    {
+        {
+            std::lock_guard<std::mutex> guard(lock);
+            pending.insert(pending.end(), requests, requests + count);
+            outstanding += count;
+        }
+        work_ready.notify_all();
+    }
+
+    size_t reap(io_request_t** out, size_t max_count, size_t min_count)
+    {
+        std::unique_lock<std::mutex> guard(lock);
+        min_count = std::min(min_count, outstanding);
+        work_done.wait(guard, [this, min_count] { return completed.size() >= min_count; });
+
+        size_t n = std::min(max_count, completed.size());
+        std::copy(completed.begin(), completed.begin() + n, out);
+        completed.erase(completed.begin(), completed.begin() + n);
+        outstanding -= n;
+        return n;
+    }
+
+    size_t in_flight() const
+    {
+        std::lock_guard<std::mutex> guard(lock);
+        return outstanding;
+    }
+};
+
+//=====================================================================================================================
+// io_uring backend, talks to the kernel directly so that no liburing is required.
+//=====================================================================================================================
+
+#if HAVE_IO_URING
+
+class uring_io_queue_t : public io_queue_t
+{
+    int ring_fd;
+    io_uring_params params;
+
+    void* sq_ring;
+    size_t sq_ring_size;
+    void* cq_ring;
+    size_t cq_ring_size;
+    io_uring_sqe* sqes;
+
+    unsigned* sq_tail;
+    unsigned* sq_mask;
+    unsigned* sq_array;
+    unsigned* cq_head;
+    unsigned* cq_tail;
+    unsigned* cq_mask;
+    io_uring_cqe* cqes;
+
+    size_t outstanding; //!< Submitted but not reaped.
+    size_t in_kernel;   //!< Submitted, completion not yet taken off the completion ring.
+    unsigned unsubmitted; //!< Entries queued on the submission ring but not yet passed to io_uring_enter.
+    std::deque<io_request_t*> ready; //!< Completions taken off the ring but not yet reaped.
+
+    uring_io_queue_t()
+        : ring_fd(-1), sq_ring(MAP_FAILED), cq_ring(MAP_FAILED), sqes((io_uring_sqe*)MAP_FAILED)
+        , outstanding(0), in_kernel(0), unsubmitted(0)
+    {}
+
+    template <typename T>
+    T* ring_field(void* ring, unsigned offset) { return reinterpret_cast<T*>(static_cast<char*>(ring) + offset); }
+
+    int enter(unsigned to_submit, unsigned min_complete, unsigned flags)
+    {
+        int ret;
+        do {
+            ret = syscall(__NR_io_uring_enter, ring_fd, to_submit, min_complete, flags, NULL, 0);
+        } while (ret < 0 && errno == EINTR);
+        return ret;
+    }
+
+    void flush_submissions()
+    {
+        while (unsubmitted)
+        {
+            int ret = enter(unsubmitted, 0, 0);
+            if (ret <= 0)
+                break;
+            unsubmitted -= ret;
+        }
+    }
+
+    /**
+     * Move completions from the ring to ready, waiting until at least min_count were moved.
+     */
+    void take_completions(size_t min_count)
+    {
+        flush_submissions();
+        size_t taken = 0;
+        while (true)
+        {
+            unsigned head = *cq_head;
+            unsigned tail = __atomic_load_n(cq_tail, __ATOMIC_ACQUIRE);
+            for (; head != tail; ++head, ++taken, --in_kernel)
+            {
+                io_uring_cqe* cqe = &cqes[head & *cq_mask];
+                io_request_t* req = reinterpret_cast<io_request_t*>(cqe->user_data);
+                req->result = cqe->res;
+                ready.push_back(req);
+            }
+            __atomic_store_n(cq_head, head, __ATOMIC_RELEASE);
+
+            if (taken >= min_count || in_kernel == 0)
+                return;
+            enter(0, min_count - taken, IORING_ENTER_GETEVENTS);
+        }
+    }
+
+public:
+    static uring_io_queue_t* create(size_t depth)
+    {
+        uring_io_queue_t* q = new uring_io_queue_t;
+        memset(&q->params, 0, sizeof(q->params));
+        q->ring_fd = syscall(__NR_io_uring_setup, unsigned(depth), &q->params);
+        if (q->ring_fd < 0 || !q->map_rings())
+        {
+            delete q;
+            return 0;
+        }
+        return q;
+    }
+
+    bool map_rings()
+    {
+        sq_ring_size = params.sq_off.array + params.sq_entries * sizeof(unsigned);
+        cq_ring_size = params.cq_off.cqes + params.cq_entries * sizeof(io_uring_cqe);
+        if (params.features & IORING_FEAT_SINGLE_MMAP)
+            sq_ring_size = cq_ring_size = std::max(sq_ring_size, cq_ring_size);
+
+        sq_ring = mmap(0, sq_ring_size, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE, ring_fd, IORING_OFF_SQ_RING);
+        if (sq_ring == MAP_FAILED)
+            return false;
+        if (params.features & IORING_FEAT_SINGLE_MMAP)
+            cq_ring = sq_ring;
+        else
+            cq_ring = mmap(0, cq_ring_size, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE, ring_fd, IORING_OFF_CQ_RING);
+        if (cq_ring == MAP_FAILED)
+            return false;
+        sqes = static_cast<io_uring_sqe*>(mmap(0, params.sq_entries * sizeof(io_uring_sqe), PROT_READ | PROT_WRITE,
+                                               MAP_SHARED | MAP_POPULATE, ring_fd, IORING_OFF_SQES));
+        if (sqes == MAP_FAILED)
+            return false;
+
+        sq_tail = ring_field<unsigned>(sq_ring, params.sq_off.tail);
+        sq_mask = ring_field<unsigned>(sq_ring, params.sq_off.ring_mask);
+        sq_array = ring_field<unsigned>(sq_ring, params.sq_off.array);
+        cq_head = ring_field<unsigned>(cq_ring, params.cq_off.head);
+        cq_tail = ring_field<unsigned>(cq_ring, params.cq_off.tail);
+        cq_mask = ring_field<unsigned>(cq_ring, params.cq_off.ring_mask);
+        cqes = ring_field<io_uring_cqe>(cq_ring, params.cq_off.cqes);
+        return true;
+    }
+
+    ~uring_io_queue_t()
+    {
+        if (ring_fd >= 0 && sqes != MAP_FAILED)
+        {
+            while (in_kernel)
+                take_completions(1);
+        }
+        if (sqes != MAP_FAILED)
+            munmap(sqes, params.sq_entries * sizeof(io_uring_sqe));
+        if (cq_ring != MAP_FAILED && cq_ring != sq_ring)
+            munmap(cq_ring, cq_ring_size);
+        if (sq_ring != MAP_FAILED)
+            munmap(sq_ring, sq_ring_size);
+        if (ring_fd >= 0)
+            ::close(ring_fd);
+    }
+
+    const char* name() const { return "io_uring"; }
+
+    void submit(io_request_t** requests, size_t count)
+    {
+        for (size_t i = 0; i < count; ++i)
+        {
+            // Never have more requests in the kernel than the submission ring holds, so the completion ring
+            // (at least as large) cannot overflow.
+            if (in_kernel == params.sq_entries)
+                take_completions(1);
+
+            io_request_t* req = requests[i];
+            unsigned tail = *sq_tail;
+            unsigned index = tail & *sq_mask;
+            io_uring_sqe* sqe = &sqes[index];
+            memset(sqe, 0, sizeof(*sqe));
+            sqe->opcode = req->op == io_request_t::read ? IORING_OP_READV : IORING_OP_WRITEV;
+            sqe->fd = req->fd;
+            sqe->off = req->offset;
+            sqe->addr = reinterpret_cast<uint64_t>(req->iov.data());
+            sqe->len = req->iov.size();
+            sqe->user_data = reinterpret_cast<uint64_t>(req);
+            sq_array[index] = index;
+            __atomic_store_n(sq_tail, tail + 1, __ATOMIC_RELEASE);
+
+            ++unsubmitted;
+            ++in_kernel;
+            ++outstanding;
+        }
+        flush_submissions();
+    }
+
+    size_t reap(io_request_t** out, size_t max_count, size_t min_count)
+    {
+        min_count = std::min(min_count, outstanding);
+        take_completions(min_count > ready.size() ? min_count - ready.size() : 0);
+
+        size_t n = std::min(max_count, ready.size());
+        std::copy(ready.begin(), ready.begin() + n, out);
+        ready.erase(ready.begin(), ready.begin() + n);
+        outstanding -= n;
+        return n;
+    }
+
+    size_t in_flight() const { return outstanding; }
+};
+
+#endif // HAVE_IO_URING
+
+io_queue_t* io_queue_t::create(size_t depth)
+{
+#if HAVE_IO_URING
+    // Kernels without io_uring or with it disabled by policy fail the setup call.
+    if (io_queue_t* q = uring_io_queue_t::create(depth))
+        return q;
+#endif
+    return create_thread_pool(std::min<size_t>(depth, 4));
+}
+
+io_queue_t* io_queue_t::create_thread_pool(size_t threads)
+{
+    return new thread_pool_io_queue_t(threads);
+}
@@ -0,0 +1,74 @@
+//
+// Part of Metta OS. Check https://atta-metta.net for latest version.
+//
+// Copyright 2007 - 2017, Stanislav Karchebnyy <berkus@atta-metta.net>
+//
+// Distributed under the Boost Software License, Version 1.0.
+// (See file LICENSE_1_0.txt or a copy at http://www.boost.org/LICENSE_1_0.txt)
+//
+#pragma once
+
+#include <sys/types.h>
+#include <sys/uio.h>
+#include <vector>
+
+/**
+ * One asynchronous scatter/gather transfer between a file and memory.
+ * Owned by the submitter, the queue only keeps a pointer to it until it is reaped.
+ */
+struct io_request_t
+{
+    enum op_e { read, write } op;
+    int fd;
+    off_t offset;            //!< Byte offset in the file.
+    std::vector<iovec> iov;  //!< Memory ranges, filled in order.
+    void* cookie;            //!< Submitter's data, untouched by the queue.
+    ssize_t result;          //!< Bytes transferred or -errno, valid once reaped.
+
+    size_t bytes() const
+    {
+        size_t total = 0;
+        for (auto& v : iov)
+            total += v.iov_len;
+        return total;
+    }
+};
+
+/**
+ * Asynchronous I/O submission and completion queue.
+ * Requests are submitted in batches and complete in any order, reap() hands back finished ones.
+ */
+class io_queue_t
+{
+public:
+    virtual ~io_queue_t() {}
+
+    virtual const char* name() const = 0;
+
+    /**
+     * Start transfers of all given requests. May block if the queue is at its depth limit.
+     */
+    virtual void submit(io_request_t** requests, size_t count) = 0;
+
+    /**
+     * Store up to max_count finished requests into completed, waiting until at least min_count are available.
+     * @return number of requests stored.
+     */
+    virtual size_t reap(io_request_t** completed, size_t max_count, size_t min_count) = 0;
+
+    /**
+     * Number of requests submitted but not yet reaped.
+     */
+    virtual size_t in_flight() const = 0;
+
+    /**
+     * Create the best queue available on this host: io_uring on Linux if the kernel allows it,
+     * a pool of worker threads doing blocking preadv/pwritev otherwise.
+     */
+    static io_queue_t* create(size_t depth);
+
+    /**
+     * Create worker pool queue regardless of io_uring availability.
+     */
+    static io_queue_t* create_thread_pool(size_t threads);
+};
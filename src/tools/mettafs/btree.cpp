@@ -6,299 +6,779 @@
 // Distributed under the Boost Software License, Version 1.0.
 // (See file LICENSE_1_0.txt or a copy at http://www.boost.org/LICENSE_1_0.txt)
 //
-//B-trees C++ implement by Zhu Xinquan@2006-3-26
- 
-#include <iostream>
-#include <ctime>
-#include <vector>
-#define ___DEBUG
-using namespace std;
- 
- 
-//the class definition of the element stored in each node;
-template<typename T>
-class Element
-{
-public:
-    T data;
-    bool operator < (Element& e) const { return data < e.data;}
-    bool operator <= (Element& e) const { return data <= e.data;}
-    bool operator > (Element& e) const { return data > e.data;}
-    bool operator >= (Element& e) const { return data >= e.data;}
-    bool operator == (Element& e) const { return data == e.data;}
-    Element& operator = (const Element& e)
+#include "btree.h"
+#include "memutils.h"
+#include <cassert>
+#include <cstring>
+#include <stdexcept>
+#include <openssl/sha.h>
+
+int compare_keys(const fs_key_t& a, const fs_key_t& b)
+{
+    if (a.objectid != b.objectid)
+        return a.objectid < b.objectid ? -1 : 1;
+    if (a.type != b.type)
+        return a.type < b.type ? -1 : 1;
+    if (a.offset != b.offset)
+        return a.offset < b.offset ? -1 : 1;
+    return 0;
+}
+
+void calc_checksum(btree_header_common_t* node, size_t bytes)
+{
+    SHA256_CTX ctx;
+    memutils::fill_memory(node->checksum, 0, sizeof(node->checksum));
+    SHA256_Init(&ctx);
+    SHA256_Update(&ctx, node, bytes);
+    SHA256_Final(node->checksum, &ctx);
+}
+
+bool verify_checksum(const btree_header_common_t* node, size_t bytes)
+{
+    std::vector<char> copy(reinterpret_cast<const char*>(node), reinterpret_cast<const char*>(node) + bytes);
+    btree_header_common_t* header = reinterpret_cast<btree_header_common_t*>(&copy[0]);
+    calc_checksum(header, bytes);
+    return memcmp(header->checksum, node->checksum, sizeof(node->checksum)) == 0;
+}
+
+static fs_key_t from_disk(const fs_ondisk_key_t& key)
+{
+    return make_key(key.objectid, key.type, key.offset);
+}
+
+static fs_ondisk_key_t to_disk(const fs_key_t& key)
+{
+    fs_ondisk_key_t out;
+    out.objectid = key.objectid;
+    out.type = key.type;
+    out.offset = key.offset;
+    return out;
+}
+
+//=====================================================================================================================
+// range_block_allocator_t
+//=====================================================================================================================
+
+range_block_allocator_t::range_block_allocator_t(fs_location_t first, fs_location_t end_, size_t bs)
+    : next(first)
+    , end(end_)
+    , block_size(bs)
+{
+}
+
+fs_location_t range_block_allocator_t::allocate()
+{
+    if (!free_blocks.empty())
     {
-       data=e.data;
-       return *this;
+        fs_location_t block = free_blocks.back();
+        free_blocks.pop_back();
+        return block;
     }
-    Element(T& d) : data(d){}
-};
- 
-//An integer element.
-typedef Element<int> Elem;
- 
-class BTreeNode
-{
-public:
- 
-    vector<Elem> m_data;
-    //m_child[i] is the child whose keys are smaller than that of m_data[i];
-    //and the size of m_child is always one more than m_data
-    vector<BTreeNode*> m_child;
-//Here is my B-tree strcture representation
-//
-//                     m_data[0]  m_data[1] ... m_data[i] ...
-//      m_child[0]--> /         |          |             \ <--m_child[i+1]
-//                   /          |          |              \    
+    if (next + block_size > end)
+        throw std::runtime_error("No free blocks left for the tree.");
+    fs_location_t block = next;
+    next += block_size;
+    return block;
+}
+
+void range_block_allocator_t::release(fs_location_t block)
+{
+    free_blocks.push_back(block);
+}
+
+/**
+ * Extents always come from the never used part of the range, released blocks are handed out one by one.
+ */
+fs_location_t range_block_allocator_t::allocate_extent(size_t nblocks)
+{
+    if (nblocks == 1)
+        return allocate();
+    if (next + nblocks * block_size > end)
+        throw std::runtime_error("No free extent left.");
+    fs_location_t first = next;
+    next += nblocks * block_size;
+    return first;
+}
+
+//=====================================================================================================================
+// tree_block_t
+//=====================================================================================================================
+
+void tree_block_t::init(uint8_t level, uint64_t generation, const uint8_t fsid[btree_header_common_t::FS_UUID_SIZE], uint64_t owner)
+{
+    btree_block_header_t* h = header();
+    h->version = 1;
+    memutils::copy_memory(h->fsid, fsid, sizeof(h->fsid));
+    h->block_offset = location;
+    h->flags = 0;
+    h->level = level;
+    h->generation = generation;
+    h->owner = owner;
+    h->numItems = 0;
+}
+
+fs_key_t tree_block_t::key(int slot)
+{
+    if (level() == 0)
+        return from_disk(leaf()->items[slot].key);
+    return from_disk(node()->ptrs[slot].key);
+}
+
+void tree_block_t::set_key(int slot, const fs_key_t& key)
+{
+    if (level() == 0)
+        leaf()->items[slot].key = to_disk(key);
+    else
+        node()->ptrs[slot].key = to_disk(key);
+}
+
+/**
+ * Find slot of key in block, or the slot where it would be inserted.
+ */
+static bool bin_search(tree_block_t& block, const fs_key_t& key, int& slot)
+{
+    int lo = 0, hi = block.nritems();
+    while (lo < hi)
+    {
+        int mid = lo + (hi - lo) / 2;
+        int cmp = compare_keys(block.key(mid), key);
+        if (cmp < 0)
+            lo = mid + 1;
+        else if (cmp > 0)
+            hi = mid;
+        else
+        {
+            slot = mid;
+            return true;
+        }
+    }
+    slot = lo;
+    return false;
+}
+
+// Leaf layout helpers.
+// Item data is packed at the end of the block in reverse item order, item 0 data is last.
 //
-    BTreeNode* m_parent; // pointer to the parent BTreeNode
-    BTreeNode(BTreeNode* mp=NULL) : m_parent(mp){}
-};
- 
-class BTree
-{
-    typedef void (*v_func)(Elem &data);//visit function    
-protected:
-    int m_order; //maximum number of the elements stored a node
-    BTreeNode* m_root;//the root of the tree
-    v_func m_visit;
-    //return true if the insertion does not need split the current node
-    bool Normal_insert(Elem &);
-    //When the number of current node's element is overflow, perform split insertion.
-    bool Split_insert(Elem &);
-    //store the result of every search
-    BTreeNode* search_result;
- 
- 
-public:
-    BTree(v_func f, int n, BTreeNode* r=NULL):m_visit(f),m_order(n),m_root(r)
+// [header] [item0 item1 ... itemN] [free space] [dataN ... data1 data0]
+//          ^ offsets are relative to here                              ^ data_area
+
+static size_t leaf_data_area(size_t block_size)
+{
+    return block_size - sizeof(btree_block_header_t);
+}
+
+static uint32_t leaf_data_end(tree_block_t& leaf)
+{
+    uint32_t n = leaf.nritems();
+    return n ? leaf.leaf()->items[n - 1].offset : leaf_data_area(leaf.data.size());
+}
+
+static char* leaf_items_base(tree_block_t& leaf)
+{
+    return &leaf.data[sizeof(btree_block_header_t)];
+}
+
+static void leaf_insert_item(tree_block_t& leaf, int slot, const fs_key_t& key, const void* data, uint32_t size)
+{
+    fs_leaf_t* l = leaf.leaf();
+    int n = l->numItems;
+    char* base = leaf_items_base(leaf);
+    uint32_t data_end = leaf_data_end(leaf);
+    uint32_t slot_data_end = slot == 0 ? leaf_data_area(leaf.data.size()) : l->items[slot - 1].offset;
+
+    assert(data_end - (n + 1) * sizeof(fs_item_t) >= size);
+
+    // Data of items after slot moves down to make room, their headers move up by one.
+    memmove(base + data_end - size, base + data_end, slot_data_end - data_end);
+    for (int i = slot; i < n; ++i)
+        l->items[i].offset -= size;
+    memmove(&l->items[slot + 1], &l->items[slot], (n - slot) * sizeof(fs_item_t));
+
+    l->items[slot].key = to_disk(key);
+    l->items[slot].offset = slot_data_end - size;
+    l->items[slot].size = size;
+    memutils::copy_memory(base + slot_data_end - size, data, size);
+    l->numItems = n + 1;
+}
+
+static void leaf_remove_item(tree_block_t& leaf, int slot)
+{
+    fs_leaf_t* l = leaf.leaf();
+    int n = l->numItems;
+    char* base = leaf_items_base(leaf);
+    uint32_t data_end = leaf_data_end(leaf);
+    uint32_t size = l->items[slot].size;
+    uint32_t item_offset = l->items[slot].offset;
+
+    memmove(base + data_end + size, base + data_end, item_offset - data_end);
+    for (int i = slot + 1; i < n; ++i)
+        l->items[i].offset += size;
+    memmove(&l->items[slot], &l->items[slot + 1], (n - slot - 1) * sizeof(fs_item_t));
+    l->numItems = n - 1;
+}
+
+/**
+ * Append items [first, first + count) of src to the end of dst.
+ */
+static void leaf_append_items(tree_block_t& dst, tree_block_t& src, int first, int count)
+{
+    for (int i = first; i < first + count; ++i)
+        leaf_insert_item(dst, dst.nritems(), src.key(i), src.item_data(i), src.item_size(i));
+}
+
+static void node_insert_ptr(tree_block_t& node, int slot, const fs_key_t& key, fs_location_t block, uint64_t generation)
+{
+    fs_node_t* n = node.node();
+    memmove(&n->ptrs[slot + 1], &n->ptrs[slot], (n->numItems - slot) * sizeof(fs_key_ptr_t));
+    n->ptrs[slot].key = to_disk(key);
+    n->ptrs[slot].blockptr = block;
+    n->ptrs[slot].generation = generation;
+    ++n->numItems;
+}
+
+static void node_remove_ptr(tree_block_t& node, int slot)
+{
+    fs_node_t* n = node.node();
+    memmove(&n->ptrs[slot], &n->ptrs[slot + 1], (n->numItems - slot - 1) * sizeof(fs_key_ptr_t));
+    --n->numItems;
+}
+
+//=====================================================================================================================
+// btree_t
+//=====================================================================================================================
+
+btree_t::btree_t(block_cache_t& cache_, deviceno_t device_, fs_block_allocator_t& allocator_, size_t block_size_,
+    const uint8_t fsid_[btree_header_common_t::FS_UUID_SIZE], uint64_t owner_)
+    : cache(cache_)
+    , device(device_)
+    , allocator(allocator_)
+    , block_size(block_size_)
+    , owner(owner_)
+    , root_location(0)
+    , root_generation(0)
+    , transid(0)
+{
+    memutils::copy_memory(fsid, fsid_, sizeof(fsid));
+}
+
+size_t btree_t::max_ptrs() const
+{
+    return (block_size - sizeof(btree_block_header_t)) / sizeof(fs_key_ptr_t);
+}
+
+/**
+ * Any leaf holding a single item still has room for another one, so splitting always makes room for an insert.
+ */
+size_t btree_t::max_item_size() const
+{
+    return leaf_capacity() / 2 - sizeof(fs_item_t);
+}
+
+uint8_t btree_t::root_level()
+{
+    return read_block(root_location, root_generation)->level();
+}
+
+size_t btree_t::leaf_free_space(tree_block_t& leaf)
+{
+    return leaf_data_end(leaf) - leaf.nritems() * sizeof(fs_item_t);
+}
+
+void btree_t::create(uint64_t generation)
+{
+    dirty.clear();
+    pending_free.clear();
+    transid = generation;
+    tree_block_ref root = alloc_block(0);
+    root_location = root->location;
+    root_generation = transid;
+}
+
+void btree_t::open(fs_location_t root, uint64_t generation)
+{
+    dirty.clear();
+    pending_free.clear();
+    root_location = root;
+    root_generation = generation;
+    transid = generation + 1;
+    read_block(root_location, root_generation);
+}
+
+tree_block_ref btree_t::read_block(fs_location_t location, uint64_t generation)
+{
+    auto it = dirty.find(location);
+    if (it != dirty.end())
+        return it->second;
+
+    tree_block_ref block = std::make_shared<tree_block_t>(location, block_size);
+    if (cache.cached_read(device, location / block_size, &block->data[0], 1, block_size) != 1)
+        throw std::runtime_error("Cannot read tree block.");
+
+    btree_block_header_t* header = block->header();
+    if (header->block_offset != location || memcmp(header->fsid, fsid, sizeof(fsid)) != 0)
+        throw std::runtime_error("Misplaced tree block.");
+    if (header->generation != generation)
+        throw std::runtime_error("Tree block generation mismatch, lost or misdirected write.");
+    if (!verify_checksum(header, block_size))
+        throw std::runtime_error("Tree block checksum mismatch.");
+    return block;
+}
+
+tree_block_ref btree_t::read_child(tree_block_t& node, int slot)
+{
+    fs_key_ptr_t& ptr = node.node()->ptrs[slot];
+    tree_block_ref child = read_block(ptr.blockptr, ptr.generation);
+    if (child->level() != node.level() - 1)
+        throw std::runtime_error("Tree block at wrong level.");
+    return child;
+}
+
+tree_block_ref btree_t::alloc_block(uint8_t level)
+{
+    tree_block_ref block = std::make_shared<tree_block_t>(allocator.allocate(), block_size);
+    block->init(level, transid, fsid, owner);
+    dirty[block->location] = block;
+    return block;
+}
+
+/**
+ * Blocks allocated in this transaction are not referenced by any committed tree and can be reused right away,
+ * committed ones only after the commit.
+ */
+void btree_t::free_block(fs_location_t location)
+{
+    if (dirty.erase(location))
+        allocator.release(location);
+    else
+        pending_free.push_back(location);
+}
+
+/**
+ * Shadow block for modification in this transaction, relinking it in parent at parent_slot (or as the root).
+ */
+tree_block_ref btree_t::cow_block(tree_block_ref block, tree_block_t* parent, int parent_slot)
+{
+    if (block->generation() == transid && dirty.count(block->location))
+        return block;
+
+    fs_location_t old_location = block->location;
+    tree_block_ref copy = std::make_shared<tree_block_t>(*block);
+    copy->location = allocator.allocate();
+    copy->header()->block_offset = copy->location;
+    copy->header()->generation = transid;
+    dirty[copy->location] = copy;
+    free_block(old_location);
+
+    if (parent)
     {
-       search_result = NULL;
-    };
-    ~BTree();
-    bool Insertion(Elem&);//Insert a element to the B-tree.
-    bool Deletion(Elem&);
-    BTreeNode* Search(Elem&);//Search an Element in B-tree.
-    void travel(BTreeNode*) const; // travel the Btree
-    void print() const { travel(m_root); } // print the elements in a sorted order
-};
- 
-BTree::~BTree()
-{
-    //something to be added
-   
-}
-void BTree::travel(BTreeNode* p) const
-{
-    if(p==NULL)
-       return;
-    int i;
-    for(i=0;i < p->m_child.size()-1; i++)
+        fs_key_ptr_t& ptr = parent->node()->ptrs[parent_slot];
+        assert(ptr.blockptr == old_location);
+        ptr.blockptr = copy->location;
+        ptr.generation = transid;
+    }
+    else
     {
-       travel(p->m_child[i]);
-       m_visit(p->m_data[i]);
+        assert(root_location == old_location);
+        root_location = copy->location;
+        root_generation = transid;
     }
-    travel(p->m_child[i]);
-   
+    return copy;
+}
+
+void btree_t::cow_path(fs_path_t& path, int level)
+{
+    bool is_root = path.nodes[level]->location == root_location;
+    path.nodes[level] = cow_block(path.nodes[level], is_root ? NULL : path.nodes[level + 1].get(),
+        is_root ? 0 : path.slots[level + 1]);
 }
-//Search an Element in B-tree. Return the node pointer which contain the
-//desired element or return NULL if the element isn't found.
-BTreeNode* BTree::Search(Elem& t)
+
+int btree_t::search_slot(const fs_key_t& key, fs_path_t& path, int ins_len, bool cow)
 {
-    BTreeNode* p = m_root;
-    while (p)
+    assert(ins_len <= 0 || cow);
+
+again:
+    path.release();
+    tree_block_ref block = read_block(root_location, root_generation);
+    int level = block->level();
+    if (level >= BTREE_MAX_LEVEL)
+        throw std::runtime_error("Tree is too deep.");
+    path.nodes[level] = block;
+    if (cow)
+        cow_path(path, level);
+
+    while (true)
     {
-       //store the current search result.
-       search_result = p;
-       //perform binary search of the node
-       int first=0, last=p->m_data.size()-1, mid = (first+last)/2;
-       while (first<=last)
-       {
-           mid=(first+last)/2;
-           if (p->m_data[mid]==t) {
-              return p;
-           }
-           if (p->m_data[mid]>t) {
-              last=mid-1;
-           }
-           if (p->m_data[mid]<t) {
-              first=mid+1;
-           }
-       }
-       //continue search in the child.
-       if(p->m_data[mid]>t)
-           p = p->m_child[mid];
-       else
-           p = p->m_child[mid+1];
+        block = path.nodes[level];
+        int slot;
+        bool found = bin_search(*block, key, slot);
+
+        if (level == 0)
+        {
+            path.slots[0] = slot;
+            if (!found && ins_len > 0 && leaf_free_space(*block) < size_t(ins_len))
+            {
+                split_leaf(path);
+                goto again;
+            }
+            return found ? 0 : 1;
+        }
+
+        // Descend into the last subtree whose low key is not above the key.
+        if (!found && slot > 0)
+            --slot;
+        path.slots[level] = slot;
+
+        // Split full nodes on the way down, so that a split below always has room in its parent.
+        if (ins_len > 0 && block->nritems() >= max_ptrs())
+        {
+            split_node(path, level);
+            goto again;
+        }
+
+        path.nodes[level - 1] = read_child(*block, slot);
+        --level;
+        if (cow)
+            cow_path(path, level);
     }
-    return p;
 }
- 
-bool BTree::Insertion(Elem& t)
+
+int btree_t::next_leaf(fs_path_t& path)
 {
-    if(Search(t))//The element already exits in the tree
-       return false;
-    if(m_root==NULL)//The tree is empty
+    for (int level = 1; level < BTREE_MAX_LEVEL && path.nodes[level]; ++level)
     {
-       m_root = new BTreeNode;
-       m_root->m_data.push_back(t);
-       m_root->m_child.push_back(NULL);
-       m_root->m_child.push_back(NULL);
-       m_root->m_parent = NULL;
-       return true;
+        if (path.slots[level] + 1 >= int(path.nodes[level]->nritems()))
+            continue;
+
+        ++path.slots[level];
+        for (; level > 0; --level)
+        {
+            path.nodes[level - 1] = read_child(*path.nodes[level], path.slots[level]);
+            path.slots[level - 1] = 0;
+        }
+        return 0;
     }
-    else
+    return 1;
+}
+
+void btree_t::insert_new_root(fs_path_t& path, int level)
+{
+    if (level >= BTREE_MAX_LEVEL)
+        throw std::runtime_error("Tree is too deep.");
+
+    tree_block_t& child = *path.nodes[level - 1];
+    tree_block_ref root = alloc_block(level);
+    node_insert_ptr(*root, 0, child.nritems() ? child.key(0) : make_key(0, 0, 0), child.location, child.generation());
+    root_location = root->location;
+    root_generation = transid;
+    path.nodes[level] = root;
+    path.slots[level] = 0;
+}
+
+void btree_t::insert_ptr(fs_path_t& path, int level, int slot, tree_block_t& child)
+{
+    tree_block_t& node = *path.nodes[level];
+    assert(node.nritems() < max_ptrs());
+    node_insert_ptr(node, slot, child.key(0), child.location, child.generation());
+}
+
+void btree_t::del_ptr(fs_path_t& path, int level, int slot)
+{
+    tree_block_ref node = path.nodes[level];
+    node_remove_ptr(*node, slot);
+
+    if (node->location == root_location)
     {
-       if(search_result)
-       {
-           //If the element can fit into vector m_data, slide all the elements
-           //greater than the arguement forward one position and insert the newly
-           //vacated slot, then return true. Otherwise performan split.
-           vector<Elem> *p = &search_result->m_data;
-           vector<BTreeNode*> *pc = &search_result->m_child;
-           int i;
-           //locate the right position to insert
-           for(i=0;i<p->size() && (*p)[i]<t;i++);
-           p->insert(p->begin()+i,t);//insert the new Element
-           pc->insert(pc->begin()+i,NULL);//insert the new child.
-           if(p->size() < m_order)//dosen't need to split this node
-           {
-#ifdef ___DEBUG
-              cout<<"Needn't to split! "<<endl;
-              cout<<"Now the tree is ################  ";
-              print();
-              cout<<"\n\n\n";
-#endif
-              return true;
-           }
-           else
-              return Split_insert(t);
-       }
-       else
-           return false;
+        // A root with a single child is replaced by the child, the tree shrinks by one level.
+        if (node->nritems() == 1)
+        {
+            fs_key_ptr_t& ptr = node->node()->ptrs[0];
+            root_location = ptr.blockptr;
+            root_generation = ptr.generation;
+            free_block(node->location);
+        }
+        return;
     }
- 
+
+    if (node->nritems() == 0)
+    {
+        del_ptr(path, level + 1, path.slots[level + 1]);
+        free_block(node->location);
+        return;
+    }
+    if (slot == 0)
+        fixup_low_keys(path, node->key(0), level + 1);
+    if (node->nritems() < max_ptrs() / 4)
+        balance_node(path, level);
 }
- 
- 
-bool BTree::Split_insert(Elem &t)
+
+/**
+ * Lowest key of a block changed, update the pointers to it up the tree.
+ */
+void btree_t::fixup_low_keys(fs_path_t& path, const fs_key_t& key, int level)
 {
-    BTreeNode* sr = search_result;
-    if(sr)
+    for (; level < BTREE_MAX_LEVEL && path.nodes[level]; ++level)
     {
-       BTreeNode* sr = search_result;
-       vector<Elem> *p = &sr->m_data;
-       vector<BTreeNode*> *pc = &sr->m_child;
-       //begin to insert and split
-       while(p->size() >= m_order)
-       {     
-           int split_point = p->size()/2;
-           BTreeNode* new_node = new BTreeNode(sr->m_parent);
-           //new node recieve rightmost half of current node. And after copying
-           //data to new node, delete the righmost half of the current node
-           int i,total= p->size();
-           for(i=split_point+1;i<total;i++)
-           {
-              new_node->m_data.push_back((*p)[split_point+1]);
-              new_node->m_child.push_back((*pc)[split_point+1]);
-              //make the new node be the parent of the righmost half's children
-              if((*pc)[split_point+1])
-                  (*pc)[split_point+1]->m_parent = new_node;
-              p->erase(p->begin()+split_point+1);
-              pc->erase(pc->begin()+split_point+1);
-           }
-           //deal with the one more child
-           new_node->m_child.push_back((*pc)[split_point+1]);
-           //make the new node be the parent of the righmost half's children
-           if((*pc)[split_point+1])
-              (*pc)[split_point+1]->m_parent = new_node;
-           pc->erase(pc->begin()+split_point+1);
-           //delete the split_point
-           Elem upward = (*p)[split_point];
-           p->erase(p->begin()+split_point);
-           //make the current's parent to be new_node's parent
-           new_node->m_parent = sr->m_parent;
-           if(sr == m_root)  //reach the root
-           {
-              //make a new node to be root.
-              BTreeNode* new_node2 = new BTreeNode(NULL);
-              m_root = new_node2;
-              new_node2->m_data.push_back(upward);
-              //the new root's two children are the splited two from current node
-              new_node2->m_child.push_back(sr);
-               new_node2->m_child.push_back(new_node);
-              sr->m_parent = new_node2;
-              new_node->m_parent = new_node2;
-#ifdef ___DEBUG
-              cout<<"\nNeed to make a new node to be root.";
-              cout<<"The new node is "<<new_node2->m_data[0].data;
-              cout<<"\nNow the tree is ################  ";
-              print();
-              cout<<"\n\n\n";
-#endif
-              return true;
-           }
-          
-#ifdef ___DEBUG
-           cout<<"\n^^^^^^^^^^^^\n"<<upward.data;
-           cout<<" need to upward. The split node become the two:\n";
-           for(i=0;i<p->size();i++)
-              cout<<(*p)[i].data<<" ";
-           cout<<"===";
-           for(i=0;i<new_node->m_data.size();i++)
-              cout<<new_node->m_data[i].data<<" ";
-#endif
-           //add the upward element to the parent of current node            
-           p = &sr->m_parent->m_data;
-           pc = &sr->m_parent->m_child;
-           //locate the right position to insert
-           for(i=0;i<p->size() && (*p)[i]<upward;i++);
-           p->insert(p->begin()+i,upward);
-           //adjust the parent's child
-           pc->insert(pc->begin()+i+1,new_node);
-#ifdef ___DEBUG
-           cout<<"The new parent is: ";
-           for(i=0;i<p->size();i++)
-              cout<<(*p)[i].data<<" ";
-           cout<<"\n^^^^^^^^^^^^^^\n";
-#endif
- 
-           sr=sr->m_parent;    
-       }
-#ifdef ___DEBUG
-       cout<<"\nNow the tree is ################  ";
-       print();
-       cout<<"\n\n\n";
-#endif
-       return true;
+        int slot = path.slots[level];
+        path.nodes[level]->set_key(slot, key);
+        if (slot != 0)
+            break;
     }
-    return false;
 }
-static void dump(Elem& e)
+
+/**
+ * Move the upper half of a full leaf, by bytes used, into a new right sibling.
+ */
+void btree_t::split_leaf(fs_path_t& path)
 {
-    cout<<e.data<<" ";
+    if (path.nodes[0]->location == root_location)
+        insert_new_root(path, 1);
+
+    tree_block_t& left = *path.nodes[0];
+    int n = left.nritems();
+    assert(n >= 2);
+
+    size_t total = leaf_used(left), used = 0;
+    int mid = 0;
+    while (mid < n - 1 && used + left.item_size(mid) + sizeof(fs_item_t) <= total / 2)
+        used += left.item_size(mid++) + sizeof(fs_item_t);
+    mid = std::max(mid, 1);
+
+    tree_block_ref right = alloc_block(0);
+    leaf_append_items(*right, left, mid, n - mid);
+    for (int i = n - 1; i >= mid; --i)
+        leaf_remove_item(left, i);
+
+    insert_ptr(path, 1, path.slots[1] + 1, *right);
 }
 
-int main(int argc, char* argv[])
+void btree_t::split_node(fs_path_t& path, int level)
 {
-    BTree b(&dump,5);
-    srand( (unsigned) time(NULL));
-    int i,j;
-    for(i=0;i<=1000;i++)
+    if (path.nodes[level]->location == root_location)
+        insert_new_root(path, level + 1);
+
+    tree_block_t& left = *path.nodes[level];
+    int n = left.nritems();
+    int mid = n / 2;
+
+    tree_block_ref right = alloc_block(level);
+    memutils::copy_memory(right->node()->ptrs, &left.node()->ptrs[mid], (n - mid) * sizeof(fs_key_ptr_t));
+    right->header()->numItems = n - mid;
+    left.header()->numItems = mid;
+
+    insert_ptr(path, level + 1, path.slots[level + 1] + 1, *right);
+}
+
+/**
+ * Merge an underfull leaf with its right or left sibling if both fit into one block.
+ */
+void btree_t::balance_leaf(fs_path_t& path)
+{
+    tree_block_ref leaf = path.nodes[0];
+    tree_block_t& parent = *path.nodes[1];
+    int slot = path.slots[1];
+
+    if (slot + 1 < int(parent.nritems()))
     {
-       int num = rand()%100;
-       Elem e1(num);
-       cout<<"Insert "<<e1.data<<" ";
-       b.Insertion(e1);
-       BTreeNode* temp;
-       if(temp = b.Search(e1))
-       {
-           cout<<"\nOK! find in the memory: 0x"<<temp;
-           for(j=0;j<temp->m_data.size();j++)
-              cout<<" "<<temp->m_data[j].data<<" ";
-           cout<<endl;
-       }
+        tree_block_ref right = read_child(parent, slot + 1);
+        if (leaf_used(*leaf) + leaf_used(*right) <= leaf_capacity())
+        {
+            leaf_append_items(*leaf, *right, 0, right->nritems());
+            fs_location_t right_location = right->location;
+            del_ptr(path, 1, slot + 1);
+            free_block(right_location);
+            return;
+        }
     }
-   
-    return 0;
+    if (slot > 0)
+    {
+        tree_block_ref left = read_child(parent, slot - 1);
+        if (leaf_used(*leaf) + leaf_used(*left) <= leaf_capacity())
+        {
+            left = cow_block(left, &parent, slot - 1);
+            leaf_append_items(*left, *leaf, 0, leaf->nritems());
+            del_ptr(path, 1, slot);
+            free_block(leaf->location);
+        }
+    }
+}
+
+void btree_t::balance_node(fs_path_t& path, int level)
+{
+    tree_block_ref node = path.nodes[level];
+    tree_block_t& parent = *path.nodes[level + 1];
+    int slot = path.slots[level + 1];
+
+    auto append = [](tree_block_t& dst, tree_block_t& src) {
+        memutils::copy_memory(&dst.node()->ptrs[dst.nritems()], src.node()->ptrs, src.nritems() * sizeof(fs_key_ptr_t));
+        dst.header()->numItems += src.nritems();
+    };
+
+    if (slot + 1 < int(parent.nritems()))
+    {
+        tree_block_ref right = read_child(parent, slot + 1);
+        if (node->nritems() + right->nritems() <= max_ptrs())
+        {
+            append(*node, *right);
+            fs_location_t right_location = right->location;
+            del_ptr(path, level + 1, slot + 1);
+            free_block(right_location);
+            return;
+        }
+    }
+    if (slot > 0)
+    {
+        tree_block_ref left = read_child(parent, slot - 1);
+        if (node->nritems() + left->nritems() <= max_ptrs())
+        {
+            left = cow_block(left, &parent, slot - 1);
+            append(*left, *node);
+            del_ptr(path, level + 1, slot);
+            free_block(node->location);
+        }
+    }
+}
+
+bool btree_t::insert(const fs_key_t& key, const void* data, uint32_t size)
+{
+    if (size > max_item_size())
+        throw std::runtime_error("Tree item is too large.");
+
+    fs_path_t path;
+    if (search_slot(key, path, size + sizeof(fs_item_t), true) == 0)
+        return false;
+
+    leaf_insert_item(*path.nodes[0], path.slots[0], key, data, size);
+    if (path.slots[0] == 0)
+        fixup_low_keys(path, key, 1);
+    return true;
+}
+
+bool btree_t::lookup(const fs_key_t& key, std::vector<char>& data)
+{
+    fs_path_t path;
+    if (search_slot(key, path, 0, false) != 0)
+        return false;
+
+    tree_block_t& leaf = *path.nodes[0];
+    int slot = path.slots[0];
+    data.assign(leaf.item_data(slot), leaf.item_data(slot) + leaf.item_size(slot));
+    return true;
+}
+
+bool btree_t::update(const fs_key_t& key, const void* data, uint32_t size)
+{
+    fs_path_t path;
+    if (search_slot(key, path, 0, true) != 0)
+        return false;
+
+    tree_block_t& leaf = *path.nodes[0];
+    if (leaf.item_size(path.slots[0]) != size)
+        throw std::runtime_error("Tree item update changes its size.");
+    memutils::copy_memory(leaf.item_data(path.slots[0]), data, size);
+    return true;
+}
+
+bool btree_t::remove(const fs_key_t& key)
+{
+    fs_path_t path;
+    if (search_slot(key, path, -1, true) != 0)
+        return false;
+
+    tree_block_ref leaf = path.nodes[0];
+    leaf_remove_item(*leaf, path.slots[0]);
+    if (leaf->location == root_location)
+        return true;
+
+    if (leaf->nritems() == 0)
+    {
+        del_ptr(path, 1, path.slots[1]);
+        free_block(leaf->location);
+        return true;
+    }
+    if (path.slots[0] == 0)
+        fixup_low_keys(path, leaf->key(0), 1);
+    if (leaf_used(*leaf) < leaf_capacity() / 4)
+        balance_leaf(path);
+    return true;
+}
+
+void btree_t::scan(const fs_key_t& first, const fs_key_t& last, const std::function<bool (const fs_key_t&, const char*, uint32_t)>& visit)
+{
+    fs_path_t path;
+    search_slot(first, path, 0, false);
+    while (true)
+    {
+        tree_block_t& leaf = *path.nodes[0];
+        for (int slot = path.slots[0]; slot < int(leaf.nritems()); ++slot)
+        {
+            fs_key_t key = leaf.key(slot);
+            if (compare_keys(key, last) > 0)
+                return;
+            if (!visit(key, leaf.item_data(slot), leaf.item_size(slot)))
+                return;
+        }
+        if (next_leaf(path))
+            return;
+    }
+}
+
+fs_location_t btree_t::commit()
+{
+    for (auto& entry : dirty)
+    {
+        tree_block_t& block = *entry.second;
+        calc_checksum(block.header(), block_size);
+        if (cache.cached_write(device, block.location / block_size, &block.data[0], 1, block_size) != block_size)
+            throw std::runtime_error("Cannot write tree block.");
+    }
+    dirty.clear();
+
+    for (auto location : pending_free)
+        allocator.release(location);
+    pending_free.clear();
+
+    ++transid;
+    return root_location;
+}
+
+size_t btree_t::verify_block(tree_block_t& block, const fs_key_t* low_key, int expected_level)
+{
+    if (block.level() != expected_level)
+        throw std::runtime_error("Tree block at wrong level.");
+    if (low_key && block.nritems() && compare_keys(block.key(0), *low_key) != 0)
+        throw std::runtime_error("Parent key does not match lowest key of the block.");
+    for (int i = 1; i < int(block.nritems()); ++i)
+        if (compare_keys(block.key(i - 1), block.key(i)) >= 0)
+            throw std::runtime_error("Tree block keys out of order.");
+
+    if (block.level() == 0)
+    {
+        uint32_t data_end = leaf_data_area(block_size);
+        for (int i = 0; i < int(block.nritems()); ++i)
+        {
+            fs_item_t& item = block.leaf()->items[i];
+            if (item.offset + item.size != data_end)
+                throw std::runtime_error("Leaf item data is not packed.");
+            data_end = item.offset;
+        }
+        if (data_end < block.nritems() * sizeof(fs_item_t))
+            throw std::runtime_error("Leaf items overlap their data.");
+        return block.nritems();
+    }
+
+    if (block.nritems() == 0 || block.nritems() > max_ptrs())
+        throw std::runtime_error("Tree node pointer count out of range.");
+    size_t items = 0;
+    for (int i = 0; i < int(block.nritems()); ++i)
+    {
+        fs_key_t key = block.key(i);
+        items += verify_block(*read_child(block, i), &key, expected_level - 1);
+    }
+    return items;
+}
+
+size_t btree_t::verify()
+{
+    tree_block_ref root = read_block(root_location, root_generation);
+    return verify_block(*root, NULL, root->level());
 }
@@ -6,69 +6,259 @@
 // Distributed under the Boost Software License, Version 1.0.
 // (See file LICENSE_1_0.txt or a copy at http://www.boost.org/LICENSE_1_0.txt)
 //
+/**
+ * Copy-on-write B+tree over the block cache, using on-disk fs_node_t and fs_leaf_t blocks from superblock.h.
+ *
+ * Leaves hold items sorted by key, item headers grow from the front of the block and item data from the back.
+ * Nodes hold key pointers to the blocks below, the key of a pointer is the lowest key in that subtree and the pointer
+ * carries the generation of the block it points to, so misplaced or lost writes are detected on read.
+ *
+ * Modifications never overwrite committed blocks. A block is shadowed the first time a transaction modifies it: copied
+ * to a newly allocated location, stamped with the transaction generation and relinked in its (also shadowed) parent.
+ * Later changes in the same transaction modify the shadow in place. Shadowed blocks are kept in memory until commit(),
+ * which checksums and writes them out and only then releases the blocks they replaced, so the previous root stays
+ * a consistent tree until the new root is recorded in the superblock.
+ */
 #pragma once
 
-template<typename T>
-class Element
+#include "superblock.h"
+#include "block_cache.h"
+#include <functional>
+#include <map>
+#include <memory>
+#include <vector>
+
+static const int BTREE_MAX_LEVEL = 8;
+
+/**
+ * Keys are ordered by objectid, then type, then offset.
+ */
+int compare_keys(const fs_key_t& a, const fs_key_t& b);
+
+inline fs_key_t make_key(uint64_t objectid, uint8_t type, uint64_t offset)
+{
+    fs_key_t key;
+    key.objectid = objectid;
+    key.type = type;
+    key.offset = offset;
+    return key;
+}
+
+/**
+ * Compute SHA-256 checksum of a block into its header.
+ */
+void calc_checksum(btree_header_common_t* node, size_t bytes);
+bool verify_checksum(const btree_header_common_t* node, size_t bytes);
+
+/**
+ * Source of free blocks for tree blocks, addressed by byte offset.
+ */
+class fs_block_allocator_t
 {
 public:
-    T data;
-    bool operator < (Element& e) const { return data < e.data;}
-    bool operator <= (Element& e) const { return data <= e.data;}
-    bool operator > (Element& e) const { return data > e.data;}
-    bool operator >= (Element& e) const { return data >= e.data;}
-    bool operator == (Element& e) const { return data == e.data;}
-    Element& operator = (const Element& e)
-    {
-        data=e.data;
-        return *this;
-    }
-    Element(T& d) : data(d){}
+    virtual ~fs_block_allocator_t() {}
+    virtual fs_location_t allocate() = 0;
+    virtual void release(fs_location_t block) = 0;
+    /**
+     * Allocate nblocks consecutive blocks, for data extents.
+     */
+    virtual fs_location_t allocate_extent(size_t nblocks) = 0;
 };
 
-//An integer element.
-typedef Element<int> Elem;
+/**
+ * Allocates blocks from [first, end) in order, reusing released blocks first.
+ */
+class range_block_allocator_t : public fs_block_allocator_t
+{
+    fs_location_t next;
+    fs_location_t end;
+    size_t block_size;
+    std::vector<fs_location_t> free_blocks;
+
+public:
+    range_block_allocator_t(fs_location_t first, fs_location_t end, size_t block_size);
+
+    fs_location_t allocate();
+    void release(fs_location_t block);
+    fs_location_t allocate_extent(size_t nblocks);
+
+    /**
+     * First block never handed out, everything below it is in use or on the free list.
+     */
+    fs_location_t high_water() const { return next; }
+};
 
-class BTreeNode
+/**
+ * In-memory copy of one tree block, either a node or a leaf.
+ */
+class tree_block_t
 {
 public:
-    vector<Elem> m_data;
-    //m_child[i] is the child whose keys are smaller than that of m_data[i];
-    //and the size of m_child is always one more than m_data
-    vector<BTreeNode*> m_child;
-    //Here is my B-tree strcture representation
-    //
-    //                     m_data[0]  m_data[1] ... m_data[i] ...
-    //      m_child[0]--> /         |          |             \ <--m_child[i+1]
-    //                   /          |          |              \     
-    //
-    BTreeNode* m_parent; // pointer to the parent BTreeNode
-    BTreeNode(BTreeNode* mp=NULL) : m_parent(mp){}
+    fs_location_t location;
+    std::vector<char> data;
+
+    tree_block_t(fs_location_t loc, size_t size) : location(loc), data(size, 0) {}
+
+    /**
+     * Fill in the header of an empty block living at location.
+     */
+    void init(uint8_t level, uint64_t generation, const uint8_t fsid[btree_header_common_t::FS_UUID_SIZE], uint64_t owner);
+
+    btree_block_header_t* header() { return reinterpret_cast<btree_block_header_t*>(&data[0]); }
+    fs_node_t* node() { return reinterpret_cast<fs_node_t*>(&data[0]); }
+    fs_leaf_t* leaf() { return reinterpret_cast<fs_leaf_t*>(&data[0]); }
+
+    uint8_t level() { return header()->level; }
+    uint32_t nritems() { return header()->numItems; }
+    uint64_t generation() { return header()->generation; }
+
+    /**
+     * Key of item or pointer at slot.
+     */
+    fs_key_t key(int slot);
+    void set_key(int slot, const fs_key_t& key);
+
+    /**
+     * Leaf item data, offsets are relative to the end of the block header.
+     */
+    char* item_data(int slot) { return &data[sizeof(btree_block_header_t) + leaf()->items[slot].offset]; }
+    uint32_t item_size(int slot) { return leaf()->items[slot].size; }
 };
 
-class BTree
+typedef std::shared_ptr<tree_block_t> tree_block_ref;
+
+/**
+ * Path taken from the root down to a leaf: nodes[0] is the leaf, slots[] are the item or pointer used at each level.
+ */
+class fs_path_t
 {
-    typedef void (*v_func)(Elem &data);//visit function     
-protected:
-    int m_order; //maximum number of the elements stored a node
-    BTreeNode* m_root;//the root of the tree
-    v_func m_visit;
-    //return true if the insertion does not need split the current node
-    bool Normal_insert(Elem &);
-    //When the number of current node's element is overflow, perform split insertion
-    bool Split_insert(Elem &);
-    //store the result of every search
-    BTreeNode* search_result;
 public:
-    BTree(v_func f, int n, BTreeNode* r=NULL):m_visit(f),m_order(n),m_root(r)
+    tree_block_ref nodes[BTREE_MAX_LEVEL];
+    int slots[BTREE_MAX_LEVEL];
+
+    fs_path_t() { release(); }
+    void release()
     {
-        search_result = NULL;
-    };
-    ~BTree();
-    bool Insertion(Elem&);//Insert a element to the B-tree.
-    bool Deletion(Elem&);
-    BTreeNode* Search(Elem&);//Search an Element in B-tree.
-    void travel(BTreeNode*) const; // travel the Btree
-    void print() const { travel(m_root); } // print the elements in a sorted order
+        for (int i = 0; i < BTREE_MAX_LEVEL; ++i)
+        {
+            nodes[i].reset();
+            slots[i] = 0;
+        }
+    }
 };
 
+class btree_t
+{
+public:
+    /**
+     * Tree stored on device in blocks of block_size bytes, which must match the device block size in the cache.
+     */
+    btree_t(block_cache_t& cache, deviceno_t device, fs_block_allocator_t& allocator, size_t block_size,
+        const uint8_t fsid[btree_header_common_t::FS_UUID_SIZE], uint64_t owner);
+
+    /**
+     * Start a new empty tree, its first transaction has the given generation.
+     */
+    void create(uint64_t generation);
+
+    /**
+     * Use an existing tree whose root was committed at the given generation.
+     */
+    void open(fs_location_t root, uint64_t generation);
+
+    /**
+     * Look for key in the tree, filling path with blocks along the way.
+     *
+     * @return 0 if the key is found at path.slots[0] of leaf path.nodes[0], 1 if it is not found and the slot is where
+     * it should be inserted.
+     *
+     * With cow all blocks on the path are shadowed for modification. If ins_len > 0 nodes and leaves on the path are
+     * split so that ins_len more bytes fit in the leaf, ins_len < 0 announces a deletion.
+     * Throws std::runtime_error on corrupt or unreadable blocks.
+     */
+    int search_slot(const fs_key_t& key, fs_path_t& path, int ins_len, bool cow);
+
+    /**
+     * Move path to the first item of the next leaf.
+     * @return 0 on success, 1 if there are no more leaves.
+     */
+    int next_leaf(fs_path_t& path);
+
+    /**
+     * @return false if the key is already present.
+     */
+    bool insert(const fs_key_t& key, const void* data, uint32_t size);
+    bool lookup(const fs_key_t& key, std::vector<char>& data);
+    /**
+     * Overwrite data of an existing item of the same size.
+     * @return false if the key is not present.
+     */
+    bool update(const fs_key_t& key, const void* data, uint32_t size);
+    /**
+     * @return false if the key is not present.
+     */
+    bool remove(const fs_key_t& key);
+
+    /**
+     * Call visit for every item with key in [first, last] in key order, until it returns false.
+     */
+    void scan(const fs_key_t& first, const fs_key_t& last, const std::function<bool (const fs_key_t&, const char*, uint32_t)>& visit);
+
+    /**
+     * Write out all blocks modified in this transaction and start a new one.
+     * Blocks go through the block cache, the caller flushes the device and records the returned root.
+     */
+    fs_location_t commit();
+
+    /**
+     * Walk the whole tree checking block headers, levels, key order and parent keys.
+     * @return number of items in the tree. Throws std::runtime_error on inconsistency.
+     */
+    size_t verify();
+
+    fs_location_t root() const { return root_location; }
+    uint64_t generation() const { return root_generation; }
+    uint64_t transaction() const { return transid; }
+    size_t dirty_blocks() const { return dirty.size(); }
+    size_t max_item_size() const;
+    uint8_t root_level();
+
+private:
+    block_cache_t& cache;
+    deviceno_t device;
+    fs_block_allocator_t& allocator;
+    size_t block_size;
+    uint8_t fsid[btree_header_common_t::FS_UUID_SIZE];
+    uint64_t owner;
+
+    fs_location_t root_location;
+    uint64_t root_generation; //!< Generation of the root block, equals transid once the root is shadowed.
+    uint64_t transid;         //!< Generation of the running transaction.
+    std::map<fs_location_t, tree_block_ref> dirty; //!< Blocks shadowed or allocated in this transaction.
+    std::vector<fs_location_t> pending_free;       //!< Committed blocks replaced in this transaction.
+
+    size_t max_ptrs() const;
+    size_t leaf_capacity() const { return block_size - sizeof(btree_block_header_t); }
+    size_t leaf_free_space(tree_block_t& leaf);
+    size_t leaf_used(tree_block_t& leaf) { return leaf_capacity() - leaf_free_space(leaf); }
+
+    tree_block_ref read_block(fs_location_t location, uint64_t generation);
+    tree_block_ref read_child(tree_block_t& node, int slot);
+    tree_block_ref alloc_block(uint8_t level);
+    void free_block(fs_location_t location);
+
+    tree_block_ref cow_block(tree_block_ref block, tree_block_t* parent, int parent_slot);
+    void cow_path(fs_path_t& path, int level);
+
+    void insert_new_root(fs_path_t& path, int level);
+    void insert_ptr(fs_path_t& path, int level, int slot, tree_block_t& child);
+    void del_ptr(fs_path_t& path, int level, int slot);
+    void fixup_low_keys(fs_path_t& path, const fs_key_t& key, int level);
+
+    void split_leaf(fs_path_t& path);
+    void split_node(fs_path_t& path, int level);
+    void balance_leaf(fs_path_t& path);
+    void balance_node(fs_path_t& path, int level);
+
+    size_t verify_block(tree_block_t& block, const fs_key_t* low_key, int expected_level);
+};
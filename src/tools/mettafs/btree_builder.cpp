@@ -0,0 +1,268 @@
+//
+// Part of Metta OS. Check https://atta-metta.net for latest version.
+//
+// Copyright 2007 - 2017, Stanislav Karchebnyy <berkus@atta-metta.net>
+//
+// Distributed under the Boost Software License, Version 1.0.
+// (See file LICENSE_1_0.txt or a copy at http://www.boost.org/LICENSE_1_0.txt)
+//
+#include "btree_builder.h"
+#include "memutils.h"
+#include <algorithm>
+#include <queue>
+#include <stdexcept>
+
+//=====================================================================================================================
+// btree_builder_t
+//=====================================================================================================================
+
+btree_builder_t::btree_builder_t(block_cache_t& cache_, deviceno_t device_, fs_block_allocator_t& allocator_,
+    size_t block_size_, const uint8_t fsid_[btree_header_common_t::FS_UUID_SIZE], uint64_t owner_,
+    uint64_t generation, unsigned fill_percent)
+    : cache(cache_)
+    , device(device_)
+    , allocator(allocator_)
+    , block_size(block_size_)
+    , owner(owner_)
+    , transid(generation)
+    , levels(0)
+    , item_count(0)
+    , block_count(0)
+{
+    memutils::copy_memory(fsid, fsid_, sizeof(fsid));
+    fill_percent = std::min(std::max(fill_percent, 50u), 100u);
+    size_t capacity = block_size - sizeof(btree_block_header_t);
+    leaf_limit = capacity * fill_percent / 100;
+    node_limit = std::max<size_t>(capacity / sizeof(fs_key_ptr_t) * fill_percent / 100, 2);
+    for (int i = 0; i < BTREE_MAX_LEVEL; ++i)
+        started[i] = 0;
+}
+
+void btree_builder_t::start_block(int level)
+{
+    if (level >= BTREE_MAX_LEVEL)
+        throw std::runtime_error("Tree is too deep.");
+    open_blocks[level] = std::make_shared<tree_block_t>(allocator.allocate(), block_size);
+    open_blocks[level]->init(level, transid, fsid, owner);
+    ++started[level];
+    levels = std::max(levels, level + 1);
+}
+
+/**
+ * Write out the open block at level and link it into the level above.
+ */
+void btree_builder_t::write_block(int level)
+{
+    tree_block_ref block = open_blocks[level];
+    open_blocks[level].reset();
+
+    calc_checksum(block->header(), block_size);
+    if (cache.cached_write(device, block->location / block_size, &block->data[0], 1, block_size) != block_size)
+        throw std::runtime_error("Cannot write tree block.");
+    ++block_count;
+
+    add_ptr(level + 1, block->key(0), block->location);
+}
+
+void btree_builder_t::add_ptr(int level, const fs_key_t& key, fs_location_t location)
+{
+    if (open_blocks[level] && open_blocks[level]->nritems() >= node_limit)
+        write_block(level);
+    if (!open_blocks[level])
+        start_block(level);
+
+    fs_node_t* node = open_blocks[level]->node();
+    fs_key_ptr_t& ptr = node->ptrs[node->numItems++];
+    ptr.key.objectid = key.objectid;
+    ptr.key.type = key.type;
+    ptr.key.offset = key.offset;
+    ptr.blockptr = location;
+    ptr.generation = transid;
+}
+
+void btree_builder_t::add(const fs_key_t& key, const void* data, uint32_t size)
+{
+    if (item_count && compare_keys(last_key, key) >= 0)
+        throw std::runtime_error("Bulk loaded keys are not strictly increasing.");
+    if (size > (block_size - sizeof(btree_block_header_t)) / 2 - sizeof(fs_item_t))
+        throw std::runtime_error("Tree item is too large.");
+
+    // Items are appended, so data grows down from the end of the data area right below the previous item's data.
+    tree_block_ref leaf = open_blocks[0];
+    size_t capacity = block_size - sizeof(btree_block_header_t);
+    if (leaf)
+    {
+        uint32_t n = leaf->nritems();
+        size_t used = capacity - leaf->leaf()->items[n - 1].offset + n * sizeof(fs_item_t);
+        if (used + size + sizeof(fs_item_t) > leaf_limit)
+            write_block(0);
+    }
+    if (!open_blocks[0])
+        start_block(0);
+
+    leaf = open_blocks[0];
+    fs_leaf_t* l = leaf->leaf();
+    uint32_t n = l->numItems;
+    uint32_t data_end = n ? l->items[n - 1].offset : capacity;
+    fs_item_t& item = l->items[n];
+    item.key.objectid = key.objectid;
+    item.key.type = key.type;
+    item.key.offset = key.offset;
+    item.offset = data_end - size;
+    item.size = size;
+    memutils::copy_memory(leaf->item_data(n), data, size);
+    l->numItems = n + 1;
+
+    last_key = key;
+    ++item_count;
+}
+
+fs_location_t btree_builder_t::finish()
+{
+    if (!open_blocks[0])
+        start_block(0);
+
+    // Write the right edge bottom up, the first level with a single block is the root.
+    for (int level = 0; ; ++level)
+    {
+        if (started[level] == 1 && !open_blocks[level + 1])
+        {
+            tree_block_ref root = open_blocks[level];
+            open_blocks[level].reset();
+            calc_checksum(root->header(), block_size);
+            if (cache.cached_write(device, root->location / block_size, &root->data[0], 1, block_size) != block_size)
+                throw std::runtime_error("Cannot write tree block.");
+            ++block_count;
+            return root->location;
+        }
+        write_block(level);
+    }
+}
+
+//=====================================================================================================================
+// external_sorter_t
+//=====================================================================================================================
+
+// Run record: objectid, type, offset, size, data.
+static const size_t RUN_RECORD_HEADER = sizeof(uint64_t) + sizeof(uint8_t) + sizeof(uint64_t) + sizeof(uint32_t);
+
+/**
+ * Sequential reader of one spilled run.
+ */
+struct run_reader_t
+{
+    FILE* file;
+    fs_key_t key;
+    std::vector<char> data;
+
+    run_reader_t(FILE* f) : file(f) { rewind(file); }
+
+    bool next()
+    {
+        char header[RUN_RECORD_HEADER];
+        if (fread(header, sizeof(header), 1, file) != 1)
+            return false;
+        uint32_t size;
+        memutils::copy_memory(&key.objectid, header, sizeof(uint64_t));
+        memutils::copy_memory(&key.type, header + 8, sizeof(uint8_t));
+        memutils::copy_memory(&key.offset, header + 9, sizeof(uint64_t));
+        memutils::copy_memory(&size, header + 17, sizeof(uint32_t));
+        data.resize(size);
+        if (size && fread(&data[0], size, 1, file) != 1)
+            throw std::runtime_error("Truncated sort run.");
+        return true;
+    }
+};
+
+external_sorter_t::external_sorter_t(size_t limit)
+    : memory_limit(limit)
+{
+}
+
+external_sorter_t::~external_sorter_t()
+{
+    for (auto f : run_files)
+        fclose(f);
+}
+
+void external_sorter_t::add(const fs_key_t& key, const void* item, uint32_t size)
+{
+    if (!entries.empty() && data.size() + entries.size() * sizeof(entry_t) + size + sizeof(entry_t) > memory_limit)
+        spill();
+
+    entry_t e;
+    e.key = key;
+    e.offset = data.size();
+    e.size = size;
+    entries.push_back(e);
+    data.insert(data.end(), static_cast<const char*>(item), static_cast<const char*>(item) + size);
+}
+
+void external_sorter_t::sort()
+{
+    std::stable_sort(entries.begin(), entries.end(), [](const entry_t& a, const entry_t& b) {
+        return compare_keys(a.key, b.key) < 0;
+    });
+}
+
+void external_sorter_t::spill()
+{
+    FILE* f = tmpfile();
+    if (!f)
+        throw std::runtime_error("Cannot create temporary file for sort run.");
+    run_files.push_back(f);
+
+    sort();
+    for (auto& e : entries)
+    {
+        char header[RUN_RECORD_HEADER];
+        memutils::copy_memory(header, &e.key.objectid, sizeof(uint64_t));
+        memutils::copy_memory(header + 8, &e.key.type, sizeof(uint8_t));
+        memutils::copy_memory(header + 9, &e.key.offset, sizeof(uint64_t));
+        memutils::copy_memory(header + 17, &e.size, sizeof(uint32_t));
+        if (fwrite(header, sizeof(header), 1, f) != 1 || (e.size && fwrite(&data[e.offset], e.size, 1, f) != 1))
+            throw std::runtime_error("Cannot write sort run.");
+    }
+    entries.clear();
+    data.clear();
+}
+
+void external_sorter_t::merge(const std::function<void (const fs_key_t&, const char*, uint32_t)>& out)
+{
+    if (run_files.empty())
+    {
+        sort();
+        for (auto& e : entries)
+            out(e.key, data.data() + e.offset, e.size);
+        entries.clear();
+        data.clear();
+        return;
+    }
+
+    if (!entries.empty())
+        spill();
+
+    std::vector<run_reader_t> readers(run_files.begin(), run_files.end());
+    // Smallest key on top, ties go to the earlier run to keep the merge stable.
+    auto later = [&readers](size_t a, size_t b) {
+        int cmp = compare_keys(readers[a].key, readers[b].key);
+        return cmp > 0 || (cmp == 0 && a > b);
+    };
+    std::priority_queue<size_t, std::vector<size_t>, decltype(later)> heap(later);
+    for (size_t i = 0; i < readers.size(); ++i)
+        if (readers[i].next())
+            heap.push(i);
+
+    while (!heap.empty())
+    {
+        size_t i = heap.top();
+        heap.pop();
+        out(readers[i].key, readers[i].data.data(), readers[i].data.size());
+        if (readers[i].next())
+            heap.push(i);
+    }
+
+    for (auto f : run_files)
+        fclose(f);
+    run_files.clear();
+}
@@ -0,0 +1,110 @@
+//
+// Part of Metta OS. Check https://atta-metta.net for latest version.
+//
+// Copyright 2007 - 2017, Stanislav Karchebnyy <berkus@atta-metta.net>
+//
+// Distributed under the Boost Software License, Version 1.0.
+// (See file LICENSE_1_0.txt or a copy at http://www.boost.org/LICENSE_1_0.txt)
+//
+/**
+ * Bottom-up bulk loading of a B+tree from items in key order.
+ *
+ * Instead of inserting items one by one, with a search, splits and shadowing per item, the builder fills leaves
+ * left to right, writes each one out as soon as it is full and adds its pointer to the rightmost node of the level
+ * above, which is written out the same way when it fills. Blocks come from the allocator in order, so on an empty
+ * filesystem the tree is written in a single sequential pass with every block touched once.
+ *
+ * The result is a regular btree_t tree, open it with the returned root and generation.
+ */
+#pragma once
+
+#include "btree.h"
+#include <cstdio>
+#include <functional>
+
+class btree_builder_t
+{
+public:
+    /**
+     * Blocks are filled to fill_percent of their capacity, leave some room if the tree will be modified soon.
+     */
+    btree_builder_t(block_cache_t& cache, deviceno_t device, fs_block_allocator_t& allocator, size_t block_size,
+        const uint8_t fsid[btree_header_common_t::FS_UUID_SIZE], uint64_t owner, uint64_t generation,
+        unsigned fill_percent = 100);
+
+    /**
+     * Append an item, keys must be strictly increasing. Throws std::runtime_error otherwise.
+     */
+    void add(const fs_key_t& key, const void* data, uint32_t size);
+
+    /**
+     * Write out the partially filled blocks on the right edge of the tree.
+     * @return location of the root block.
+     */
+    fs_location_t finish();
+
+    uint8_t root_level() const { return levels - 1; }
+    uint64_t generation() const { return transid; }
+    uint64_t items() const { return item_count; }
+    uint64_t blocks_written() const { return block_count; }
+
+private:
+    block_cache_t& cache;
+    deviceno_t device;
+    fs_block_allocator_t& allocator;
+    size_t block_size;
+    uint8_t fsid[btree_header_common_t::FS_UUID_SIZE];
+    uint64_t owner;
+    uint64_t transid;
+    size_t leaf_limit; //!< Bytes of items and data per leaf.
+    size_t node_limit; //!< Pointers per node.
+
+    tree_block_ref open_blocks[BTREE_MAX_LEVEL]; //!< Rightmost, not yet written block of each level.
+    uint64_t started[BTREE_MAX_LEVEL];           //!< Blocks started at each level.
+    int levels;
+    fs_key_t last_key;
+    uint64_t item_count;
+    uint64_t block_count;
+
+    void start_block(int level);
+    void write_block(int level);
+    void add_ptr(int level, const fs_key_t& key, fs_location_t location);
+};
+
+/**
+ * Sorts items by key using bounded memory.
+ *
+ * Items are collected in memory until memory_limit bytes are used, then sorted and spilled to a temporary file
+ * as a run. merge() merges all runs into one stream in key order, equal keys come out in the order they were added.
+ */
+class external_sorter_t
+{
+public:
+    external_sorter_t(size_t memory_limit = 64 * 1024 * 1024);
+    ~external_sorter_t();
+
+    void add(const fs_key_t& key, const void* data, uint32_t size);
+
+    /**
+     * Call out for every item in key order, the sorter is empty afterwards.
+     */
+    void merge(const std::function<void (const fs_key_t&, const char*, uint32_t)>& out);
+
+    size_t runs() const { return run_files.size(); }
+
+private:
+    struct entry_t
+    {
+        fs_key_t key;
+        size_t offset;
+        uint32_t size;
+    };
+
+    size_t memory_limit;
+    std::vector<entry_t> entries;
+    std::vector<char> data;
+    std::vector<FILE*> run_files;
+
+    void sort();
+    void spill();
+};
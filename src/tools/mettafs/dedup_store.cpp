@@ -0,0 +1,290 @@
+//
+// Part of Metta OS. Check https://atta-metta.net for latest version.
+//
+// Copyright 2007 - 2017, Stanislav Karchebnyy <berkus@atta-metta.net>
+//
+// Distributed under the Boost Software License, Version 1.0.
+// (See file LICENSE_1_0.txt or a copy at http://www.boost.org/LICENSE_1_0.txt)
+//
+#include "dedup_store.h"
+#include "memutils.h"
+#include <algorithm>
+#include <cstring>
+#include <stdexcept>
+#include <openssl/sha.h>
+
+//=====================================================================================================================
+// bloom_filter_t
+//=====================================================================================================================
+
+bloom_filter_t::bloom_filter_t(uint64_t expected_items)
+    : bits((std::max<uint64_t>(expected_items, 64) * 10 + 63) / 64, 0)
+    , nbits(bits.size() * 64)
+    , nhashes(7) // optimal for 10 bits per item
+{
+}
+
+/**
+ * Bit positions come from two 64-bit words of the hash by double hashing.
+ */
+void bloom_filter_t::add(const uint8_t* hash)
+{
+    uint64_t h1, h2;
+    memcpy(&h1, hash, sizeof(h1));
+    memcpy(&h2, hash + 8, sizeof(h2));
+    h2 |= 1;
+    for (unsigned i = 0; i < nhashes; ++i)
+    {
+        uint64_t bit = (h1 + i * h2) % nbits;
+        bits[bit / 64] |= 1ULL << (bit % 64);
+    }
+}
+
+bool bloom_filter_t::may_contain(const uint8_t* hash) const
+{
+    uint64_t h1, h2;
+    memcpy(&h1, hash, sizeof(h1));
+    memcpy(&h2, hash + 8, sizeof(h2));
+    h2 |= 1;
+    for (unsigned i = 0; i < nhashes; ++i)
+    {
+        uint64_t bit = (h1 + i * h2) % nbits;
+        if (!(bits[bit / 64] & (1ULL << (bit % 64))))
+            return false;
+    }
+    return true;
+}
+
+void bloom_filter_t::clear()
+{
+    std::fill(bits.begin(), bits.end(), 0);
+}
+
+//=====================================================================================================================
+// content_chunker_t
+//=====================================================================================================================
+
+const size_t content_chunker_t::MIN_CHUNK;
+const size_t content_chunker_t::AVG_CHUNK;
+const size_t content_chunker_t::MAX_CHUNK;
+
+/**
+ * Random value for every byte, fixed so that chunk boundaries are the same from run to run.
+ */
+static const uint64_t* gear_table()
+{
+    static struct table_t
+    {
+        uint64_t gear[256];
+        table_t()
+        {
+            uint64_t x = 0x6d65747461667331ULL; // splitmix64
+            for (auto& g : gear)
+            {
+                uint64_t z = (x += 0x9e3779b97f4a7c15ULL);
+                z = (z ^ (z >> 30)) * 0xbf58476d1ce4e5b9ULL;
+                z = (z ^ (z >> 27)) * 0x94d049bb133111ebULL;
+                g = z ^ (z >> 31);
+            }
+        }
+    } table;
+    return table.gear;
+}
+
+size_t content_chunker_t::cut(const uint8_t* data, size_t size)
+{
+    // The gear hash only depends on the last 64 bytes, a boundary is where its top 13 bits are all zero,
+    // one in AVG_CHUNK positions past the minimum.
+    static const uint64_t mask = uint64_t(AVG_CHUNK - 1) << (64 - 13);
+    const uint64_t* gear = gear_table();
+
+    size_t limit = std::min(size, MAX_CHUNK);
+    if (limit <= MIN_CHUNK)
+        return limit;
+
+    uint64_t hash = 0;
+    for (size_t i = MIN_CHUNK - 64; i < limit; ++i)
+    {
+        hash = (hash << 1) + gear[data[i]];
+        if (i >= MIN_CHUNK && !(hash & mask))
+            return i + 1;
+    }
+    return limit;
+}
+
+//=====================================================================================================================
+// dedup_store_t
+//=====================================================================================================================
+
+static const size_t READ_SIZE = 1024 * 1024;
+
+static fs_key_t fingerprint_key(const uint8_t* digest)
+{
+    fs_key_t key;
+    memcpy(&key.objectid, digest, sizeof(key.objectid));
+    key.type = FINGERPRINT_ITEM_KEY;
+    memcpy(&key.offset, digest + 8, sizeof(key.offset));
+    return key;
+}
+
+dedup_store_t::dedup_store_t(block_cache_t& cache_, deviceno_t device_, fs_block_allocator_t& allocator_, btree_t& index_,
+    size_t block_size_, uint64_t expected_chunks)
+    : cache(cache_)
+    , device(device_)
+    , allocator(allocator_)
+    , index(index_)
+    , block_size(block_size_)
+    , filter(expected_chunks)
+{
+    memutils::fill_memory(&stats, 0, sizeof(stats));
+}
+
+void dedup_store_t::load_filter()
+{
+    filter.clear();
+    index.scan(make_key(0, 0, 0), make_key(~0ULL, 0xff, ~0ULL), [this](const fs_key_t& key, const char*, uint32_t) {
+        if (key.type == FINGERPRINT_ITEM_KEY)
+        {
+            uint8_t hash[16];
+            memcpy(hash, &key.objectid, 8);
+            memcpy(hash + 8, &key.offset, 8);
+            filter.add(hash);
+        }
+        return true;
+    });
+}
+
+bool dedup_store_t::find(const dedup_extent_t& extent, fs_fingerprint_item_t& item)
+{
+    std::vector<char> data;
+    if (!index.lookup(fingerprint_key(extent.digest), data))
+        return false;
+    if (data.size() != sizeof(item))
+        throw std::runtime_error("Corrupt fingerprint index item.");
+    memutils::copy_memory(&item, &data[0], sizeof(item));
+    if (memcmp(item.digest_tail, extent.digest + 16, sizeof(item.digest_tail)) != 0)
+        throw std::runtime_error("Fingerprint index collision on 128-bit digest prefix.");
+    return true;
+}
+
+dedup_extent_t dedup_store_t::write(const void* data, uint32_t size)
+{
+    dedup_extent_t extent;
+    extent.length = size;
+    SHA256(static_cast<const unsigned char*>(data), size, extent.digest);
+    ++stats.chunks;
+
+    fs_fingerprint_item_t item;
+    if (filter.may_contain(extent.digest))
+    {
+        if (find(extent, item))
+        {
+            ++item.refcount;
+            index.update(fingerprint_key(extent.digest), &item, sizeof(item));
+            ++stats.duplicates;
+            stats.bytes_deduplicated += size;
+            extent.location = item.location;
+            return extent;
+        }
+        ++stats.filter_false_positives;
+    }
+    else
+        ++stats.filter_negatives;
+
+    size_t nblocks = std::max<size_t>((size + block_size - 1) / block_size, 1);
+    extent.location = allocator.allocate_extent(nblocks);
+    item.location = extent.location;
+    item.length = size;
+    item.refcount = 1;
+    memutils::copy_memory(item.digest_tail, extent.digest + 16, sizeof(item.digest_tail));
+    if (!index.insert(fingerprint_key(extent.digest), &item, sizeof(item)))
+    {
+        for (size_t i = 0; i < nblocks; ++i)
+            allocator.release(extent.location + i * block_size);
+        throw std::runtime_error("Chunk is indexed but not in the Bloom filter, load_filter() was not called.");
+    }
+    filter.add(extent.digest);
+
+    buffer.assign(nblocks * block_size, 0);
+    memutils::copy_memory(&buffer[0], data, size);
+    if (cache.cached_write(device, extent.location / block_size, &buffer[0], nblocks, block_size) != nblocks * block_size)
+        throw std::runtime_error("Cannot write data chunk.");
+    stats.bytes_written += size;
+    return extent;
+}
+
+uint64_t dedup_store_t::write_stream(std::istream& in, bool content_defined, const std::function<void (const dedup_extent_t&)>& out)
+{
+    size_t chunk_max = content_defined ? content_chunker_t::MAX_CHUNK : block_size;
+    std::vector<char> data;
+    size_t begin = 0;
+    uint64_t total = 0;
+    bool eof = false;
+
+    while (true)
+    {
+        // Keep a whole maximum chunk ahead, so boundaries do not depend on read sizes.
+        if (!eof && data.size() - begin < chunk_max)
+        {
+            data.erase(data.begin(), data.begin() + begin);
+            begin = 0;
+            size_t have = data.size();
+            data.resize(have + READ_SIZE);
+            in.read(&data[have], READ_SIZE);
+            size_t got = in.gcount();
+            data.resize(have + got);
+            total += got;
+            eof = got < READ_SIZE;
+            continue;
+        }
+
+        size_t available = data.size() - begin;
+        if (available == 0)
+            return total;
+        const uint8_t* p = reinterpret_cast<const uint8_t*>(&data[begin]);
+        size_t length = content_defined ? content_chunker_t::cut(p, available) : std::min(available, block_size);
+        out(write(p, length));
+        begin += length;
+    }
+}
+
+bool dedup_store_t::read(const dedup_extent_t& extent, void* data)
+{
+    size_t nblocks = std::max<size_t>((extent.length + block_size - 1) / block_size, 1);
+    buffer.resize(nblocks * block_size);
+    if (cache.cached_read(device, extent.location / block_size, &buffer[0], nblocks, block_size) != nblocks)
+        return false;
+
+    uint8_t digest[SHA256_DIGEST_LENGTH];
+    SHA256(reinterpret_cast<const unsigned char*>(&buffer[0]), extent.length, digest);
+    if (memcmp(digest, extent.digest, sizeof(digest)) != 0)
+        return false;
+    memutils::copy_memory(data, &buffer[0], extent.length);
+    return true;
+}
+
+bool dedup_store_t::release(const dedup_extent_t& extent)
+{
+    fs_fingerprint_item_t item;
+    if (!find(extent, item))
+        return false;
+
+    // The filter keeps the released fingerprint, costing a false positive if it is ever written again.
+    if (--item.refcount > 0)
+        return index.update(fingerprint_key(extent.digest), &item, sizeof(item));
+
+    index.remove(fingerprint_key(extent.digest));
+    size_t nblocks = std::max<size_t>((item.length + block_size - 1) / block_size, 1);
+    for (size_t i = 0; i < nblocks; ++i)
+        pending_free.push_back(item.location + i * block_size);
+    return true;
+}
+
+fs_location_t dedup_store_t::commit()
+{
+    fs_location_t root = index.commit();
+    for (auto location : pending_free)
+        allocator.release(location);
+    pending_free.clear();
+    return root;
+}
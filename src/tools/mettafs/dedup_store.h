@@ -0,0 +1,142 @@
+//
+// Part of Metta OS. Check https://atta-metta.net for latest version.
+//
+// Copyright 2007 - 2017, Stanislav Karchebnyy <berkus@atta-metta.net>
+//
+// Distributed under the Boost Software License, Version 1.0.
+// (See file LICENSE_1_0.txt or a copy at http://www.boost.org/LICENSE_1_0.txt)
+//
+/**
+ * Content addressed storage of file data.
+ *
+ * Data is cut into chunks, either of fixed block size or content defined (boundaries where a rolling gear hash
+ * of the last bytes matches a mask, so an insertion only changes the chunks around it). Every chunk is fingerprinted
+ * with SHA-256 and looked up in the fingerprint index tree; a chunk already stored gains a reference instead of
+ * being written again.
+ *
+ * Most chunks written to a fresh store are new, so an in-memory Bloom filter over all indexed fingerprints sits
+ * in front of the index: a negative answer skips the tree lookup altogether.
+ */
+#pragma once
+
+#include "btree.h"
+#include <functional>
+#include <istream>
+#include <vector>
+
+/**
+ * Fixed size Bloom filter keyed by uniformly distributed 128-bit hashes, such as digest bytes.
+ */
+class bloom_filter_t
+{
+    std::vector<uint64_t> bits;
+    uint64_t nbits;
+    unsigned nhashes;
+
+public:
+    /**
+     * Sized for expected_items at about 1% false positives.
+     */
+    bloom_filter_t(uint64_t expected_items);
+
+    void add(const uint8_t* hash);
+    bool may_contain(const uint8_t* hash) const;
+    void clear();
+};
+
+/**
+ * Finds content defined chunk boundaries with a gear hash.
+ */
+class content_chunker_t
+{
+public:
+    static const size_t MIN_CHUNK = 2048;
+    static const size_t AVG_CHUNK = 8192; //!< Mean distance to a boundary past MIN_CHUNK.
+    static const size_t MAX_CHUNK = 65536;
+
+    /**
+     * Length of the chunk at the start of data, size bytes are available.
+     * Returns size if no boundary is found and size is less than MAX_CHUNK, at the end of the stream that is the
+     * last chunk.
+     */
+    static size_t cut(const uint8_t* data, size_t size);
+};
+
+struct dedup_extent_t
+{
+    fs_location_t location;
+    uint32_t length;
+    uint8_t digest[32];
+};
+
+class dedup_store_t
+{
+public:
+    struct stats_t
+    {
+        uint64_t chunks;              //!< Chunks written by callers.
+        uint64_t duplicates;          //!< Of those, already stored.
+        uint64_t filter_negatives;    //!< Index lookups skipped thanks to the Bloom filter.
+        uint64_t filter_false_positives;
+        uint64_t bytes_written;       //!< Data bytes written to the device.
+        uint64_t bytes_deduplicated;  //!< Data bytes not written because they were already stored.
+    };
+
+    /**
+     * Store chunks in blocks from allocator, indexing them in index. Index transactions that release chunks must be
+     * committed through commit().
+     */
+    dedup_store_t(block_cache_t& cache, deviceno_t device, fs_block_allocator_t& allocator, btree_t& index,
+        size_t block_size, uint64_t expected_chunks = 1 << 20);
+
+    /**
+     * Populate the Bloom filter from an existing index, required before writing to a non-empty one.
+     */
+    void load_filter();
+
+    /**
+     * Store one chunk, or add a reference to an identical stored one.
+     */
+    dedup_extent_t write(const void* data, uint32_t size);
+
+    /**
+     * Cut a stream into chunks and store them, calling out for every chunk in stream order.
+     * With content_defined false chunks are block sized.
+     * @return bytes read from in.
+     */
+    uint64_t write_stream(std::istream& in, bool content_defined, const std::function<void (const dedup_extent_t&)>& out);
+
+    /**
+     * Read chunk contents into data, extent.length bytes.
+     * @return false if the data does not match the extent digest.
+     */
+    bool read(const dedup_extent_t& extent, void* data);
+
+    /**
+     * Drop a reference, releasing the chunk blocks with the last one.
+     * @return false if the chunk is not in the index.
+     */
+    bool release(const dedup_extent_t& extent);
+
+    /**
+     * Commit the index transaction, then give back the blocks of chunks released in it.
+     * Until then the last committed index still refers to them, so they must not be overwritten.
+     * @return root of the committed index.
+     */
+    fs_location_t commit();
+
+    const stats_t& statistics() const { return stats; }
+
+private:
+    block_cache_t& cache;
+    deviceno_t device;
+    fs_block_allocator_t& allocator;
+    btree_t& index;
+    size_t block_size;
+    bloom_filter_t filter;
+    stats_t stats;
+    std::vector<char> buffer;
+    std::vector<fs_location_t> pending_free; //!< Blocks of chunks released in this index transaction.
+
+    bool find(const dedup_extent_t& extent, fs_fingerprint_item_t& item);
+};
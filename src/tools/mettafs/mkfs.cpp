@@ -11,14 +11,21 @@
 #include "block_cache.h"
 #include <uuid/uuid.h> // @todo Use boost::uuid and remove libossp-uuid dependency
 #include "superblock.h"
+#include "btree.h"
+#include "btree_builder.h"
+#include "dedup_store.h"
+#include "posting_list.h"
+#include "tag_trie.h"
 #include "memutils.h"
 #include "fourcc.h"
 #include "macros.h"
 #include <iostream>
 #include <cassert>
-
-// SHA256 from openssl
-#include <openssl/sha.h>
+#include <cstring>
+#include <fstream>
+#include <memory>
+#include <stdexcept>
+#include <string>
 
 //raiser/btrfs style blocks:
 
@@ -29,7 +36,7 @@
 // keys are fixed-size, hash id plus a block offset and size of the value
 //
 
-// block_cache_t calls block device by a given id (via read_blocks and write_blocks)
+// block_cache_t calls block device by a given id (via read_blocks and the asynchronous io_queue_t)
 // block_device_mapper_t transforms I/O requests from block_cache_t into calls on appropriate device
 // block_device_t is uncached
 // VFS layer can then read and write device blocks via the cache layer,
@@ -59,6 +66,11 @@ public:
         return device_mapper.unmap_device(mounted(name));
     }
 
+    block_cache_t& cache()
+    {
+        return device_mapper.get_cache();
+    }
+
     deviceno_t mounted(const char* name)
     {
         return device_mapper.resolve_device(name);
@@ -106,22 +118,70 @@ static const int BLOCK_SIZE = 4096; // logical sector size
  *   in a list together with the hashes/ids.
  */
 
-void calc_checksum(btree_header_common_t* node, size_t bytes)
-{
-    SHA256_CTX ctx;
-    memutils::fill_memory(node->checksum, 0, sizeof(node->checksum));
-    SHA256_Init(&ctx);
-    SHA256_Update(&ctx, node, bytes);
-    SHA256_Final(node->checksum, &ctx);
-}
-
 extern "C" void panic(const char* message, const char* file, uint32_t line)
 {
     printf("%s (%s:%d)\n", message, file, line);
     exit(-1);
 }
 
-int create_fs(deviceno_t device, size_t num_bytes, const char* label)
+/**
+ * Read file list, one file per line with optional tab separated, comma separated tags:
+ * path[<TAB>tag,tag,...]
+ * Name and tag items of each file go to sorter, files get consecutive objids and tags get ids from the dictionary.
+ * (tag, objid) pairs for the tag posting lists go to postings as keys without data.
+ * Contents of listed files readable on the host are stored in content defined chunks, with an extent item per chunk
+ * keyed by file offset.
+ * @return number of files.
+ */
+static size_t read_file_list(const char* list, tag_trie_t& dictionary, external_sorter_t& sorter, external_sorter_t& postings,
+    dedup_store_t& store)
+{
+    std::ifstream in(list);
+    if (!in)
+        throw std::runtime_error(std::string("Cannot open file list ") + list);
+
+    uint64_t objid = FIRST_FREE_OBJECTID;
+    std::string line;
+    while (std::getline(in, line))
+    {
+        if (line.empty())
+            continue;
+        size_t tab = line.find('\t');
+        std::string name = line.substr(0, tab);
+        sorter.add(make_key(objid, NAME_ITEM_KEY, 0), name.data(), name.size());
+
+        std::ifstream file(name, std::ios::binary);
+        if (file)
+        {
+            uint64_t offset = 0;
+            store.write_stream(file, true, [&sorter, &offset, objid](const dedup_extent_t& extent) {
+                fs_extent_item_t item;
+                item.location = extent.location;
+                item.length = extent.length;
+                memutils::copy_memory(item.digest, extent.digest, sizeof(item.digest));
+                sorter.add(make_key(objid, EXTENT_ITEM_KEY, offset), &item, sizeof(item));
+                offset += extent.length;
+            });
+        }
+
+        while (tab != std::string::npos && tab < line.size())
+        {
+            size_t comma = line.find(',', tab + 1);
+            std::string tag = line.substr(tab + 1, comma == std::string::npos ? std::string::npos : comma - tab - 1);
+            if (!tag.empty())
+            {
+                uint64_t id = dictionary.insert(tag);
+                sorter.add(make_key(objid, TAG_ITEM_KEY, id), tag.data(), tag.size());
+                postings.add(make_key(id, POSTING_ITEM_KEY, objid), NULL, 0);
+            }
+            tab = comma;
+        }
+        ++objid;
+    }
+    return objid - FIRST_FREE_OBJECTID;
+}
+
+int create_fs(deviceno_t device, size_t num_bytes, const char* label, const char* file_list)
 {
     char buffer[BLOCK_SIZE];
     uint8_t fsid[btree_header_common_t::FS_UUID_SIZE];
@@ -130,6 +190,73 @@ int create_fs(deviceno_t device, size_t num_bytes, const char* label)
 
     uuid_generate(fsid);
 
+    // Tree blocks are allocated right after the superblock, the objid tree is bulk loaded first
+    // so it is laid out sequentially.
+    range_block_allocator_t allocator(1 * sectorsize, num_bytes, nodesize);
+
+    btree_builder_t objids(vfs.cache(), device, allocator, nodesize, fsid, OBJID_TREE_OBJECTID, 1);
+    btree_builder_t tags(vfs.cache(), device, allocator, nodesize, fsid, TAGS_TREE_OBJECTID, 1);
+    tag_trie_t dictionary;
+    btree_t dedup_index(vfs.cache(), device, allocator, nodesize, fsid, DEDUP_TREE_OBJECTID);
+    dedup_index.create(1);
+    if (file_list)
+    {
+        external_sorter_t sorter, postings;
+        dedup_store_t store(vfs.cache(), device, allocator, dedup_index, nodesize);
+        size_t files = read_file_list(file_list, dictionary, sorter, postings, store);
+        fs_key_t last = make_key(0, 0, 0);
+        sorter.merge([&objids, &last](const fs_key_t& key, const char* data, uint32_t size) {
+            if (objids.items() && compare_keys(key, last) == 0)
+                return; // File tagged twice with the same tag.
+            objids.add(key, data, size);
+            last = key;
+        });
+
+        posting_list_builder_t lists([&tags](const fs_key_t& key, const char* data, uint32_t size) {
+            tags.add(key, data, size);
+        });
+        postings.merge([&lists](const fs_key_t& key, const char*, uint32_t) {
+            lists.add(key.objectid, key.offset);
+        });
+        lists.finish();
+        std::cerr << "Loaded " << files << " files, " << objids.items() << " items, " << dictionary.size() << " tags, "
+                  << tags.items() << " posting list containers" << std::endl;
+        const dedup_store_t::stats_t& stats = store.statistics();
+        std::cerr << "Stored " << stats.chunks << " data chunks, " << stats.duplicates << " duplicates, "
+                  << stats.bytes_written << " bytes written, " << stats.bytes_deduplicated << " bytes deduplicated, "
+                  << stats.filter_negatives << " index lookups skipped" << std::endl;
+    }
+
+    fs_root_item_t objid_root;
+    objid_root.root = objids.finish();
+    objid_root.generation = objids.generation();
+    objid_root.level = objids.root_level();
+
+    fs_root_item_t tags_root;
+    tags_root.root = tags.finish();
+    tags_root.generation = tags.generation();
+    tags_root.level = tags.root_level();
+
+    dedup_index.commit();
+    fs_root_item_t dedup_root;
+    dedup_root.root = dedup_index.root();
+    dedup_root.generation = dedup_index.generation();
+    dedup_root.level = dedup_index.root_level();
+
+    fs_root_item_t dictionary_root;
+    dictionary_root.root = dictionary.store(vfs.cache(), device, allocator, nodesize, fsid, 1);
+    dictionary_root.generation = 1;
+    dictionary_root.level = 0;
+
+    // Generate first root of roots tree.
+    btree_t root_tree(vfs.cache(), device, allocator, nodesize, fsid, 0);
+    root_tree.create(1);
+    root_tree.insert(make_key(OBJID_TREE_OBJECTID, ROOT_ITEM_KEY, 0), &objid_root, sizeof(objid_root));
+    root_tree.insert(make_key(TAGS_TREE_OBJECTID, ROOT_ITEM_KEY, 0), &tags_root, sizeof(tags_root));
+    root_tree.insert(make_key(TAG_TRIE_OBJECTID, ROOT_ITEM_KEY, 0), &dictionary_root, sizeof(dictionary_root));
+    root_tree.insert(make_key(DEDUP_TREE_OBJECTID, ROOT_ITEM_KEY, 0), &dedup_root, sizeof(dedup_root));
+    root_tree.commit();
+
     fs_superblock_t* super = reinterpret_cast<fs_superblock_t*>(buffer);
     memutils::fill_memory(buffer, 0, sizeof(buffer));
 
@@ -138,62 +265,49 @@ int create_fs(deviceno_t device, size_t num_bytes, const char* label)
     super->block_offset = 0;             // which block this node is supposed to live in
     super->flags = 0;                    // [ 60] not related to validity, but matches generic header format for different trees.
     super->magic = Magic64BE<'M','e','T','T','a','F','S','1'>::value;
-    super->generation = 1;
-    super->root = 1 * sectorsize;              // [ 84] location of "root of roots" tree
+    super->generation = root_tree.generation();
+    super->root = root_tree.root();      // [ 84] location of "root of roots" tree
     super->total_bytes = num_bytes;
-    super->bytes_used = 0;
+    super->bytes_used = allocator.high_water();
     super->sector_size = sectorsize;
     super->node_size = nodesize;
     super->leaf_size = leafsize;
     super->checksum_type = CHECKSUM_TYPE_SHA256;
-    super->root_level = 1;
+    super->root_level = 0;
 //     dev_item_t dev_item;        // [123]
     memutils::copy_string(super->label, label, sizeof(super->label));
     calc_checksum(super, BLOCK_SIZE);
 
     vfs.write(device, 0, buffer, BLOCK_SIZE);
 
-    // generate first root of roots tree
-    fs_node_t* root_node = reinterpret_cast<fs_node_t*>(buffer);
-    memutils::fill_memory(buffer, 0, sizeof(buffer));
-
-    root_node->version = 1;
-    memutils::copy_memory(root_node->fsid, fsid, sizeof(root_node->fsid));
-    root_node->block_offset = 1*sectorsize;             // which block this node is supposed to live in
-    root_node->level = 1;
-    root_node->generation = 1;
-    uuid_generate(root_node->chunk_tree_uuid);
-    root_node->owner = 0;
-    root_node->numItems = 0;
-    calc_checksum(root_node, BLOCK_SIZE);
-
-    // stuff some nodes right next to the root node to make it load faster.
-
-    vfs.write(device, BLOCK_SIZE, buffer, BLOCK_SIZE);
-
     return 1;
 }
 
 int main(int argc, char** argv)
 {
-    if (argc != 4)
+    if (argc < 4 || argc > 6 || (argc == 6 && strcmp(argv[4], "mmap") != 0))
     {
-        std::cerr << "mkfs deviceName <create 1 or 0> <byte size>" << std::endl;
+        std::cerr << "mkfs deviceName <create 1 or 0> <byte size> [mmap] [file list]" << std::endl;
         return 111;
     }
 
     const char* fname = argv[1];
     int create = atoi(argv[2]);
     size_t size = atoi(argv[3]);
+    bool mapped = argc > 4 && strcmp(argv[4], "mmap") == 0;
+    const char* file_list = argc > 4 + mapped ? argv[4 + mapped] : NULL;
     block_cache_t cache(256);
-    block_device_t dev(fname, create, BLOCK_SIZE);
+    // Mapped image is sized up front and bypasses the cache blocks.
+    std::unique_ptr<block_device_t> dev(mapped
+        ? new mapped_block_device_t(fname, create, BLOCK_SIZE, (size + BLOCK_SIZE - 1) / BLOCK_SIZE)
+        : new block_device_t(fname, create, BLOCK_SIZE));
 
     vfs.set_cache(cache);
-    deviceno_t device = vfs.mount(dev, "arbitrary_name");
+    deviceno_t device = vfs.mount(*dev, "arbitrary_name");
 
     std::cerr << "Unwritten blocks before: " << cache.unwritten_blocks() << std::endl;
 
-    create_fs(device, size, "test_fs");
+    create_fs(device, size, "test_fs", file_list);
 
     std::cerr << "Unwritten blocks after: " << cache.unwritten_blocks() << std::endl;
 
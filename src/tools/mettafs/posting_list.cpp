@@ -0,0 +1,599 @@
+//
+// Part of Metta OS. Check https://atta-metta.net for latest version.
+//
+// Copyright 2007 - 2017, Stanislav Karchebnyy <berkus@atta-metta.net>
+//
+// Distributed under the Boost Software License, Version 1.0.
+// (See file LICENSE_1_0.txt or a copy at http://www.boost.org/LICENSE_1_0.txt)
+//
+#include "posting_list.h"
+#include <algorithm>
+#include <cassert>
+#include <stdexcept>
+#ifdef __SSE2__
+#include <emmintrin.h>
+#endif
+
+const unsigned posting_list_t::CONTAINER_BITS;
+const uint32_t posting_list_t::CONTAINER_SIZE;
+const size_t posting_list_t::BITMAP_WORDS;
+const uint32_t posting_list_t::ARRAY_MAX;
+
+// On-disk container header: kind, bit width, cardinality.
+static const uint8_t CONTAINER_PACKED = 1;
+static const uint8_t CONTAINER_BITMAP = 2;
+static const size_t CONTAINER_HEADER = 4;
+
+// Above this length ratio arrays are intersected by galloping through the longer one.
+static const size_t GALLOP_RATIO = 32;
+
+static uint32_t bitmap_cardinality(const std::vector<uint64_t>& bitmap)
+{
+    uint32_t n = 0;
+    for (auto word : bitmap)
+        n += __builtin_popcountll(word);
+    return n;
+}
+
+/**
+ * Call f for every low value of the container in increasing order.
+ */
+template <typename F>
+static void for_each_low(const posting_list_t::container_t& c, F f)
+{
+    if (!c.is_bitmap())
+    {
+        for (auto low : c.array)
+            f(low);
+        return;
+    }
+    for (size_t w = 0; w < c.bitmap.size(); ++w)
+    {
+        for (uint64_t word = c.bitmap[w]; word; word &= word - 1)
+            f(uint16_t(w * 64 + __builtin_ctzll(word)));
+    }
+}
+
+/**
+ * First position at or after from with value not less than x, searching exponentially growing steps first.
+ */
+template <typename T, typename Less>
+static size_t gallop(const T* values, size_t from, size_t n, const Less& less)
+{
+    size_t lo = from, hi = from, step = 1;
+    while (hi < n && less(values[hi]))
+    {
+        lo = hi + 1;
+        hi += step;
+        step <<= 1;
+    }
+    hi = std::min(hi, n);
+    while (lo < hi)
+    {
+        size_t mid = lo + (hi - lo) / 2;
+        if (less(values[mid]))
+            lo = mid + 1;
+        else
+            hi = mid;
+    }
+    return lo;
+}
+
+//=====================================================================================================================
+// Array intersection
+//=====================================================================================================================
+
+static size_t intersect_scalar(const uint16_t* a, size_t na, const uint16_t* b, size_t nb, uint16_t* out)
+{
+    size_t i = 0, j = 0, k = 0;
+    while (i < na && j < nb)
+    {
+        if (a[i] < b[j])
+            ++i;
+        else if (b[j] < a[i])
+            ++j;
+        else
+        {
+            out[k++] = a[i];
+            ++i;
+            ++j;
+        }
+    }
+    return k;
+}
+
+static size_t intersect_gallop(const uint16_t* small, size_t ns, const uint16_t* large, size_t nl, uint16_t* out)
+{
+    size_t k = 0, pos = 0;
+    for (size_t i = 0; i < ns && pos < nl; ++i)
+    {
+        uint16_t x = small[i];
+        pos = gallop(large, pos, nl, [x](uint16_t v) { return v < x; });
+        if (pos < nl && large[pos] == x)
+            out[k++] = x;
+    }
+    return k;
+}
+
+size_t intersect_arrays(const uint16_t* a, size_t na, const uint16_t* b, size_t nb, uint16_t* out)
+{
+    if (na > nb)
+    {
+        std::swap(a, b);
+        std::swap(na, nb);
+    }
+    if (na * GALLOP_RATIO < nb)
+        return intersect_gallop(a, na, b, nb, out);
+
+    size_t i = 0, j = 0, k = 0;
+#ifdef __SSE2__
+    // Compare a block of 8 values of a against all 8 rotations of a block of b, then advance the block
+    // with the smaller maximum. Values are distinct, so each one of a matches at most once.
+    while (i + 8 <= na && j + 8 <= nb)
+    {
+        __m128i va = _mm_loadu_si128(reinterpret_cast<const __m128i*>(a + i));
+        __m128i vb = _mm_loadu_si128(reinterpret_cast<const __m128i*>(b + j));
+        __m128i eq = _mm_cmpeq_epi16(va, vb);
+        for (int r = 1; r < 8; ++r)
+        {
+            vb = _mm_or_si128(_mm_srli_si128(vb, 2), _mm_slli_si128(vb, 14));
+            eq = _mm_or_si128(eq, _mm_cmpeq_epi16(va, vb));
+        }
+        unsigned mask = _mm_movemask_epi8(eq) & 0x5555; // one bit per 16-bit lane
+        for (; mask; mask &= mask - 1)
+            out[k++] = a[i + __builtin_ctz(mask) / 2];
+
+        uint16_t amax = a[i + 7], bmax = b[j + 7];
+        if (amax <= bmax)
+            i += 8;
+        if (bmax <= amax)
+            j += 8;
+    }
+#endif
+    return k + intersect_scalar(a + i, na - i, b + j, nb - j, out + k);
+}
+
+//=====================================================================================================================
+// Containers
+//=====================================================================================================================
+
+bool posting_list_t::container_t::contains(uint16_t low) const
+{
+    if (is_bitmap())
+        return (bitmap[low / 64] >> (low % 64)) & 1;
+    return std::binary_search(array.begin(), array.end(), low);
+}
+
+void posting_list_t::container_t::normalize()
+{
+    if (is_bitmap() && cardinality <= ARRAY_MAX)
+    {
+        std::vector<uint16_t> values;
+        values.reserve(cardinality);
+        for_each_low(*this, [&values](uint16_t low) { values.push_back(low); });
+        array.swap(values);
+        bitmap.clear();
+    }
+    else if (!is_bitmap() && cardinality > ARRAY_MAX)
+    {
+        bitmap.assign(BITMAP_WORDS, 0);
+        for (auto low : array)
+            bitmap[low / 64] |= 1ULL << (low % 64);
+        array.clear();
+        array.shrink_to_fit();
+    }
+}
+
+static bool container_add(posting_list_t::container_t& c, uint16_t low)
+{
+    if (c.is_bitmap())
+    {
+        uint64_t bit = 1ULL << (low % 64);
+        if (c.bitmap[low / 64] & bit)
+            return false;
+        c.bitmap[low / 64] |= bit;
+    }
+    else
+    {
+        auto it = std::lower_bound(c.array.begin(), c.array.end(), low);
+        if (it != c.array.end() && *it == low)
+            return false;
+        c.array.insert(it, low);
+    }
+    ++c.cardinality;
+    c.normalize();
+    return true;
+}
+
+static bool container_remove(posting_list_t::container_t& c, uint16_t low)
+{
+    if (c.is_bitmap())
+    {
+        uint64_t bit = 1ULL << (low % 64);
+        if (!(c.bitmap[low / 64] & bit))
+            return false;
+        c.bitmap[low / 64] &= ~bit;
+    }
+    else
+    {
+        auto it = std::lower_bound(c.array.begin(), c.array.end(), low);
+        if (it == c.array.end() || *it != low)
+            return false;
+        c.array.erase(it);
+    }
+    --c.cardinality;
+    c.normalize();
+    return true;
+}
+
+static posting_list_t::container_t container_intersect(const posting_list_t::container_t& a, const posting_list_t::container_t& b)
+{
+    posting_list_t::container_t r(a.high);
+    if (!a.is_bitmap() && !b.is_bitmap())
+    {
+        r.array.resize(std::min(a.array.size(), b.array.size()));
+        r.array.resize(intersect_arrays(a.array.data(), a.array.size(), b.array.data(), b.array.size(), r.array.data()));
+        r.cardinality = r.array.size();
+    }
+    else if (a.is_bitmap() && b.is_bitmap())
+    {
+        r.bitmap.resize(posting_list_t::BITMAP_WORDS);
+        for (size_t w = 0; w < posting_list_t::BITMAP_WORDS; ++w)
+            r.bitmap[w] = a.bitmap[w] & b.bitmap[w];
+        r.cardinality = bitmap_cardinality(r.bitmap);
+        r.normalize();
+    }
+    else
+    {
+        const posting_list_t::container_t& arr = a.is_bitmap() ? b : a;
+        const posting_list_t::container_t& bmp = a.is_bitmap() ? a : b;
+        for (auto low : arr.array)
+            if ((bmp.bitmap[low / 64] >> (low % 64)) & 1)
+                r.array.push_back(low);
+        r.cardinality = r.array.size();
+    }
+    return r;
+}
+
+static posting_list_t::container_t container_unite(const posting_list_t::container_t& a, const posting_list_t::container_t& b)
+{
+    posting_list_t::container_t r(a.high);
+    if (!a.is_bitmap() && !b.is_bitmap())
+    {
+        r.array.resize(a.array.size() + b.array.size());
+        r.array.erase(std::set_union(a.array.begin(), a.array.end(), b.array.begin(), b.array.end(), r.array.begin()), r.array.end());
+        r.cardinality = r.array.size();
+        r.normalize();
+        return r;
+    }
+
+    const posting_list_t::container_t& other = a.is_bitmap() ? b : a;
+    r.bitmap = a.is_bitmap() ? a.bitmap : b.bitmap;
+    if (other.is_bitmap())
+    {
+        for (size_t w = 0; w < posting_list_t::BITMAP_WORDS; ++w)
+            r.bitmap[w] |= other.bitmap[w];
+    }
+    else
+    {
+        for (auto low : other.array)
+            r.bitmap[low / 64] |= 1ULL << (low % 64);
+    }
+    r.cardinality = bitmap_cardinality(r.bitmap);
+    return r;
+}
+
+//=====================================================================================================================
+// posting_list_t
+//=====================================================================================================================
+
+std::vector<posting_list_t::container_t>::iterator posting_list_t::find(uint64_t high)
+{
+    return std::lower_bound(containers.begin(), containers.end(), high,
+        [](const container_t& c, uint64_t h) { return c.high < h; });
+}
+
+void posting_list_t::add(uint64_t objid)
+{
+    uint64_t high = objid >> CONTAINER_BITS;
+    uint16_t low = objid & (CONTAINER_SIZE - 1);
+
+    // Objids are mostly added in increasing order, try the last container first.
+    auto it = !containers.empty() && containers.back().high <= high ? containers.end() - 1 : find(high);
+    if (it == containers.end() || it->high != high)
+        it = containers.insert(it == containers.end() || it->high > high ? it : it + 1, container_t(high));
+    container_add(*it, low);
+}
+
+bool posting_list_t::remove(uint64_t objid)
+{
+    auto it = find(objid >> CONTAINER_BITS);
+    if (it == containers.end() || it->high != objid >> CONTAINER_BITS)
+        return false;
+    if (!container_remove(*it, objid & (CONTAINER_SIZE - 1)))
+        return false;
+    if (it->cardinality == 0)
+        containers.erase(it);
+    return true;
+}
+
+bool posting_list_t::contains(uint64_t objid) const
+{
+    auto it = std::lower_bound(containers.begin(), containers.end(), objid >> CONTAINER_BITS,
+        [](const container_t& c, uint64_t h) { return c.high < h; });
+    return it != containers.end() && it->high == objid >> CONTAINER_BITS && it->contains(objid & (CONTAINER_SIZE - 1));
+}
+
+uint64_t posting_list_t::size() const
+{
+    uint64_t n = 0;
+    for (auto& c : containers)
+        n += c.cardinality;
+    return n;
+}
+
+std::vector<uint64_t> posting_list_t::to_vector() const
+{
+    std::vector<uint64_t> out;
+    out.reserve(size());
+    for (auto& c : containers)
+        for_each_low(c, [&out, &c](uint16_t low) { out.push_back((c.high << CONTAINER_BITS) | low); });
+    return out;
+}
+
+void posting_list_t::append(container_t&& c)
+{
+    assert(containers.empty() || containers.back().high < c.high);
+    if (c.cardinality)
+        containers.push_back(std::move(c));
+}
+
+void posting_list_t::encode(const container_t& c, std::vector<char>& out)
+{
+    // Deltas are stored minus one, consecutive objids take no bits at all.
+    uint32_t max_delta = 0;
+    int prev = -1;
+    for_each_low(c, [&max_delta, &prev](uint16_t low) {
+        max_delta = std::max<uint32_t>(max_delta, low - prev - 1);
+        prev = low;
+    });
+    uint8_t bits = max_delta ? 32 - __builtin_clz(max_delta) : 0;
+    size_t packed = (size_t(c.cardinality) * bits + 7) / 8;
+
+    out.assign(CONTAINER_HEADER, 0);
+    out[2] = char(c.cardinality & 0xff);
+    out[3] = char(c.cardinality >> 8);
+    if (packed >= BITMAP_WORDS * 8)
+    {
+        out[0] = CONTAINER_BITMAP;
+        out.resize(CONTAINER_HEADER + BITMAP_WORDS * 8);
+        for_each_low(c, [&out](uint16_t low) { out[CONTAINER_HEADER + low / 8] |= char(1 << (low % 8)); });
+        return;
+    }
+
+    out[0] = CONTAINER_PACKED;
+    out[1] = bits;
+    out.resize(CONTAINER_HEADER + packed);
+    uint64_t acc = 0;
+    unsigned acc_bits = 0;
+    size_t pos = CONTAINER_HEADER;
+    prev = -1;
+    for_each_low(c, [&](uint16_t low) {
+        acc |= uint64_t(low - prev - 1) << acc_bits;
+        acc_bits += bits;
+        prev = low;
+        for (; acc_bits >= 8; acc_bits -= 8, acc >>= 8)
+            out[pos++] = char(acc & 0xff);
+    });
+    if (acc_bits)
+        out[pos++] = char(acc & 0xff);
+    assert(pos == out.size());
+}
+
+bool posting_list_t::decode(uint64_t high, const char* data, uint32_t size, container_t& out)
+{
+    const uint8_t* p = reinterpret_cast<const uint8_t*>(data);
+    if (size < CONTAINER_HEADER)
+        return false;
+    uint32_t count = p[2] | (uint32_t(p[3]) << 8);
+    if (count == 0 || count > CONTAINER_SIZE)
+        return false;
+
+    out = container_t(high);
+    if (p[0] == CONTAINER_BITMAP)
+    {
+        if (size != CONTAINER_HEADER + BITMAP_WORDS * 8)
+            return false;
+        out.bitmap.assign(BITMAP_WORDS, 0);
+        for (size_t i = 0; i < BITMAP_WORDS * 8; ++i)
+            out.bitmap[i / 8] |= uint64_t(p[CONTAINER_HEADER + i]) << (i % 8 * 8);
+        out.cardinality = bitmap_cardinality(out.bitmap);
+        if (out.cardinality != count)
+            return false;
+        out.normalize();
+        return true;
+    }
+
+    unsigned bits = p[1];
+    if (p[0] != CONTAINER_PACKED || bits > CONTAINER_BITS || size != CONTAINER_HEADER + (size_t(count) * bits + 7) / 8)
+        return false;
+    out.array.reserve(count);
+    uint64_t acc = 0;
+    unsigned acc_bits = 0;
+    size_t pos = CONTAINER_HEADER;
+    uint32_t mask = (1u << bits) - 1;
+    int value = -1;
+    for (uint32_t i = 0; i < count; ++i)
+    {
+        while (acc_bits < bits)
+        {
+            acc |= uint64_t(p[pos++]) << acc_bits;
+            acc_bits += 8;
+        }
+        value += (acc & mask) + 1;
+        acc >>= bits;
+        acc_bits -= bits;
+        if (value >= int(CONTAINER_SIZE))
+            return false;
+        out.array.push_back(value);
+    }
+    out.cardinality = count;
+    out.normalize();
+    return true;
+}
+
+posting_list_t posting_list_t::intersect(const posting_list_t& a, const posting_list_t& b)
+{
+    posting_list_t r;
+    const container_t* ca = a.containers.data();
+    const container_t* cb = b.containers.data();
+    size_t na = a.containers.size(), nb = b.containers.size();
+    size_t i = 0, j = 0;
+
+    // Skip over containers missing from the other list by galloping through the directory.
+    while (i < na && j < nb)
+    {
+        if (ca[i].high < cb[j].high)
+        {
+            uint64_t h = cb[j].high;
+            i = gallop(ca, i, na, [h](const container_t& c) { return c.high < h; });
+        }
+        else if (cb[j].high < ca[i].high)
+        {
+            uint64_t h = ca[i].high;
+            j = gallop(cb, j, nb, [h](const container_t& c) { return c.high < h; });
+        }
+        else
+        {
+            r.append(container_intersect(ca[i++], cb[j++]));
+        }
+    }
+    return r;
+}
+
+posting_list_t posting_list_t::unite(const posting_list_t& a, const posting_list_t& b)
+{
+    posting_list_t r;
+    size_t i = 0, j = 0;
+    while (i < a.containers.size() || j < b.containers.size())
+    {
+        if (j == b.containers.size() || (i < a.containers.size() && a.containers[i].high < b.containers[j].high))
+            r.containers.push_back(a.containers[i++]);
+        else if (i == a.containers.size() || b.containers[j].high < a.containers[i].high)
+            r.containers.push_back(b.containers[j++]);
+        else
+            r.containers.push_back(container_unite(a.containers[i++], b.containers[j++]));
+    }
+    return r;
+}
+
+posting_list_t posting_list_t::intersect(std::vector<const posting_list_t*> lists)
+{
+    if (lists.empty())
+        return posting_list_t();
+
+    std::sort(lists.begin(), lists.end(), [](const posting_list_t* a, const posting_list_t* b) {
+        return a->size() < b->size();
+    });
+    posting_list_t r = *lists[0];
+    for (size_t i = 1; i < lists.size() && !r.empty(); ++i)
+        r = intersect(r, *lists[i]);
+    return r;
+}
+
+posting_list_t posting_list_t::unite(std::vector<const posting_list_t*> lists)
+{
+    posting_list_t r;
+    for (auto list : lists)
+        r = unite(r, *list);
+    return r;
+}
+
+//=====================================================================================================================
+// Tags tree storage
+//=====================================================================================================================
+
+posting_list_builder_t::posting_list_builder_t(const output_t& out_)
+    : out(out_)
+    , tag(0)
+{
+}
+
+void posting_list_builder_t::flush()
+{
+    if (!current.cardinality)
+        return;
+    posting_list_t::encode(current, buffer);
+    out(make_key(tag, POSTING_ITEM_KEY, current.high), buffer.data(), buffer.size());
+    current = posting_list_t::container_t();
+}
+
+void posting_list_builder_t::add(uint64_t tag_, uint64_t objid)
+{
+    uint64_t high = objid >> posting_list_t::CONTAINER_BITS;
+    uint16_t low = objid & (posting_list_t::CONTAINER_SIZE - 1);
+    if (tag_ != tag || high != current.high)
+    {
+        flush();
+        tag = tag_;
+        current.high = high;
+    }
+
+    if (current.is_bitmap())
+    {
+        uint64_t bit = 1ULL << (low % 64);
+        if (current.bitmap[low / 64] & bit)
+            return;
+        current.bitmap[low / 64] |= bit;
+    }
+    else
+    {
+        if (!current.array.empty() && low <= current.array.back())
+        {
+            if (low == current.array.back())
+                return;
+            throw std::runtime_error("Posting list objids are not sorted.");
+        }
+        current.array.push_back(low);
+    }
+    ++current.cardinality;
+    current.normalize();
+}
+
+void posting_list_builder_t::finish()
+{
+    flush();
+}
+
+bool load_posting_list(btree_t& tree, uint64_t tag, posting_list_t& list)
+{
+    list.clear();
+    tree.scan(make_key(tag, POSTING_ITEM_KEY, 0), make_key(tag, POSTING_ITEM_KEY, ~0ULL),
+        [&list](const fs_key_t& key, const char* data, uint32_t size) {
+            posting_list_t::container_t c;
+            if (!posting_list_t::decode(key.offset, data, size, c))
+                throw std::runtime_error("Corrupt posting list container.");
+            list.append(std::move(c));
+            return true;
+        });
+    return !list.empty();
+}
+
+void store_posting_list(btree_t& tree, uint64_t tag, const posting_list_t& list)
+{
+    std::vector<fs_key_t> old;
+    tree.scan(make_key(tag, POSTING_ITEM_KEY, 0), make_key(tag, POSTING_ITEM_KEY, ~0ULL),
+        [&old](const fs_key_t& key, const char*, uint32_t) {
+            old.push_back(key);
+            return true;
+        });
+    for (auto& key : old)
+        tree.remove(key);
+
+    std::vector<char> buffer;
+    for (auto& c : list.get_containers())
+    {
+        posting_list_t::encode(c, buffer);
+        tree.insert(make_key(tag, POSTING_ITEM_KEY, c.high), buffer.data(), buffer.size());
+    }
+}
@@ -0,0 +1,126 @@
+//
+// Part of Metta OS. Check https://atta-metta.net for latest version.
+//
+// Copyright 2007 - 2017, Stanislav Karchebnyy <berkus@atta-metta.net>
+//
+// Distributed under the Boost Software License, Version 1.0.
+// (See file LICENSE_1_0.txt or a copy at http://www.boost.org/LICENSE_1_0.txt)
+//
+/**
+ * Compressed lists of objids having a tag, and set operations on them for tag queries.
+ *
+ * A posting list is split into containers of CONTAINER_SIZE consecutive objids, keyed by the high bits of the objid.
+ * In memory a sparse container is a sorted array of the low bits and a dense one is a bitmap. On disk each container
+ * is one item in the tags tree under (tag, POSTING_ITEM_KEY, high bits), holding either the delta coded array bit
+ * packed to the width of the largest delta, or the raw bitmap, whichever is smaller.
+ *
+ * The container directory sorted by high bits doubles as the skip index: intersections gallop over it and only
+ * look inside containers present in all lists. Array containers are intersected with SSE2 block compares or,
+ * when one is much shorter, by galloping; bitmaps are combined word by word.
+ */
+#pragma once
+
+#include "btree.h"
+#include <functional>
+#include <vector>
+
+class posting_list_t
+{
+public:
+    static const unsigned CONTAINER_BITS = 12;
+    static const uint32_t CONTAINER_SIZE = 1 << CONTAINER_BITS;
+    static const size_t BITMAP_WORDS = CONTAINER_SIZE / 64;
+    static const uint32_t ARRAY_MAX = 256; //!< Larger containers are bitmaps, an array this size is as big as a bitmap.
+
+    struct container_t
+    {
+        uint64_t high;                //!< objid >> CONTAINER_BITS
+        uint32_t cardinality;
+        std::vector<uint16_t> array;  //!< Sorted low bits, if cardinality <= ARRAY_MAX.
+        std::vector<uint64_t> bitmap; //!< BITMAP_WORDS words otherwise.
+
+        container_t(uint64_t h = 0) : high(h), cardinality(0) {}
+        bool is_bitmap() const { return !bitmap.empty(); }
+        bool contains(uint16_t low) const;
+        /**
+         * Switch between array and bitmap form to match the cardinality.
+         */
+        void normalize();
+    };
+
+    void add(uint64_t objid);
+    bool remove(uint64_t objid);
+    bool contains(uint64_t objid) const;
+
+    uint64_t size() const;
+    bool empty() const { return containers.empty(); }
+    void clear() { containers.clear(); }
+    std::vector<uint64_t> to_vector() const;
+    const std::vector<container_t>& get_containers() const { return containers; }
+
+    /**
+     * Append a container with a higher key than all present, used when loading.
+     */
+    void append(container_t&& c);
+
+    /**
+     * On-disk form of a container.
+     */
+    static void encode(const container_t& c, std::vector<char>& out);
+    /**
+     * @return false if data is not a valid container.
+     */
+    static bool decode(uint64_t high, const char* data, uint32_t size, container_t& out);
+
+    static posting_list_t intersect(const posting_list_t& a, const posting_list_t& b);
+    static posting_list_t unite(const posting_list_t& a, const posting_list_t& b);
+    /**
+     * Multi-way operations, intersection starts from the shortest list and stops as soon as the result is empty.
+     */
+    static posting_list_t intersect(std::vector<const posting_list_t*> lists);
+    static posting_list_t unite(std::vector<const posting_list_t*> lists);
+
+private:
+    std::vector<container_t> containers; //!< Sorted by high, none empty.
+
+    std::vector<container_t>::iterator find(uint64_t high);
+};
+
+/**
+ * Intersect sorted arrays of distinct values into out, which must have room for min(na, nb) values.
+ * @return number of values in out.
+ */
+size_t intersect_arrays(const uint16_t* a, size_t na, const uint16_t* b, size_t nb, uint16_t* out);
+
+/**
+ * Streams (tag, objid) pairs sorted by tag and then objid into encoded posting list container items.
+ */
+class posting_list_builder_t
+{
+public:
+    typedef std::function<void (const fs_key_t&, const char*, uint32_t)> output_t;
+
+    posting_list_builder_t(const output_t& out);
+
+    void add(uint64_t tag, uint64_t objid);
+    void finish();
+
+private:
+    output_t out;
+    uint64_t tag;
+    posting_list_t::container_t current;
+    std::vector<char> buffer;
+
+    void flush();
+};
+
+/**
+ * Read all containers of tag from the tags tree.
+ * @return false if the tag has no objids. Throws std::runtime_error on corrupt containers.
+ */
+bool load_posting_list(btree_t& tree, uint64_t tag, posting_list_t& list);
+
+/**
+ * Replace the posting list of tag in the tags tree.
+ */
+void store_posting_list(btree_t& tree, uint64_t tag, const posting_list_t& list);
@@ -143,3 +143,75 @@ struct fs_key_ptr_t {
 struct fs_node_t : public btree_block_header_t {
 	fs_key_ptr_t ptrs[];
 } PACKED;
+
+/*
+ * Well-known objectids and item types.
+ */
+static const uint64_t OBJID_TREE_OBJECTID = 1;   // root of roots item pointing to the objid tree
+static const uint64_t TAGS_TREE_OBJECTID = 2;    // root of roots item pointing to the tags tree
+static const uint64_t TAG_TRIE_OBJECTID = 3;     // root of roots item pointing to the tag dictionary
+static const uint64_t DEDUP_TREE_OBJECTID = 4;   // root of roots item pointing to the fingerprint index
+static const uint64_t FIRST_FREE_OBJECTID = 256; // file objids start here
+
+static const uint8_t ROOT_ITEM_KEY = 1; // fs_root_item_t, in the root of roots tree
+static const uint8_t NAME_ITEM_KEY = 2; // file name, offset 0
+static const uint8_t TAG_ITEM_KEY  = 3; // tag name, offset is the tag id
+static const uint8_t POSTING_ITEM_KEY = 4; // tags tree, objectid is the tag id, offset is the container (posting_list.h)
+static const uint8_t FINGERPRINT_ITEM_KEY = 5; // fingerprint index, key is the first 16 bytes of the SHA-256 digest
+static const uint8_t EXTENT_ITEM_KEY = 6; // file data, offset is the byte offset in the file
+
+/*
+ * Location of a tree root, stored in the root of roots tree.
+ */
+struct fs_root_item_t {
+	fs_location_t root;
+	uint64_t generation;
+	uint8_t level;
+} PACKED;
+
+/*
+ * Content addressed data chunk (dedup_store.h), shared by all extents with the same contents.
+ */
+struct fs_fingerprint_item_t {
+	fs_location_t location;
+	uint32_t length;        // bytes, the chunk occupies whole blocks
+	uint64_t refcount;
+	uint8_t digest_tail[16]; // rest of the SHA-256 digest not in the key
+} PACKED;
+
+/*
+ * Piece of file data, points to a chunk.
+ */
+struct fs_extent_item_t {
+	fs_location_t location;
+	uint32_t length;
+	uint8_t digest[32];
+} PACKED;
+
+/*
+ * Tag dictionary trie nodes (tag_trie.h), packed back to back into blocks after a btree_block_header_t.
+ * Nodes are addressed by their byte offset on the device.
+ */
+struct fs_tag_trie_node_t {
+	uint8_t label_length;
+	uint8_t flags;
+	uint16_t child_count;
+	uint64_t tag_id;        // if TAG_TRIE_TERMINAL
+	char label[];           // followed by child_count fs_tag_trie_child_t sorted by first
+} PACKED;
+
+struct fs_tag_trie_child_t {
+	uint8_t first;          // first byte of the child label
+	fs_location_t node;
+} PACKED;
+
+static const uint8_t TAG_TRIE_TERMINAL = 1; // node ends a tag
+
+/*
+ * Tag dictionary root record, stored like a node.
+ */
+struct fs_tag_trie_root_t {
+	fs_location_t root_node;
+	uint64_t tag_count;
+	uint64_t next_id;
+} PACKED;
@@ -0,0 +1,340 @@
+//
+// Part of Metta OS. Check https://atta-metta.net for latest version.
+//
+// Copyright 2007 - 2017, Stanislav Karchebnyy <berkus@atta-metta.net>
+//
+// Distributed under the Boost Software License, Version 1.0.
+// (See file LICENSE_1_0.txt or a copy at http://www.boost.org/LICENSE_1_0.txt)
+//
+#include "tag_trie.h"
+#include "memutils.h"
+#include <algorithm>
+#include <cstring>
+#include <stdexcept>
+
+const size_t tag_trie_t::MAX_TAG_LENGTH;
+
+// Largest node: full length label and a child for every byte value.
+static const size_t MAX_NODE_SIZE = sizeof(fs_tag_trie_node_t) + tag_trie_t::MAX_TAG_LENGTH + 256 * sizeof(fs_tag_trie_child_t);
+
+tag_trie_t::tag_trie_t(uint64_t first_id)
+    : root(new node_t)
+    , tag_count(0)
+    , next_free_id(first_id)
+    , loaded_count(0)
+    , cache(NULL)
+    , device(0)
+    , block_size(0)
+    , generation(0)
+    , cached_block_location(~0ULL)
+{
+}
+
+tag_trie_t::~tag_trie_t()
+{
+}
+
+void tag_trie_t::open(block_cache_t& cache_, deviceno_t device_, size_t block_size_, fs_location_t root_location, uint64_t generation_)
+{
+    cache = &cache_;
+    device = device_;
+    block_size = block_size_;
+    generation = generation_;
+    cached_block_location = ~0ULL;
+    loaded_count = 0;
+
+    const char* block = read_block(root_location / block_size * block_size);
+    size_t offset = root_location % block_size;
+    if (offset < sizeof(btree_block_header_t) || offset + sizeof(fs_tag_trie_root_t) > block_size)
+        throw std::runtime_error("Misplaced tag dictionary root.");
+    fs_tag_trie_root_t record;
+    memutils::copy_memory(&record, block + offset, sizeof(record));
+
+    tag_count = record.tag_count;
+    next_free_id = record.next_id;
+    root = read_node(record.root_node);
+}
+
+/**
+ * Read and verify the block at location, keeping the last one around since nodes of a subtree are mostly
+ * in the same block.
+ */
+const char* tag_trie_t::read_block(fs_location_t location)
+{
+    if (location == cached_block_location)
+        return &cached_block[0];
+
+    cached_block_location = ~0ULL;
+    cached_block.resize(block_size);
+    if (cache->cached_read(device, location / block_size, &cached_block[0], 1, block_size) != 1)
+        throw std::runtime_error("Cannot read tag dictionary block.");
+
+    const btree_block_header_t* header = reinterpret_cast<const btree_block_header_t*>(&cached_block[0]);
+    if (header->block_offset != location)
+        throw std::runtime_error("Misplaced tag dictionary block.");
+    if (header->generation != generation)
+        throw std::runtime_error("Tag dictionary block generation mismatch, lost or misdirected write.");
+    if (!verify_checksum(header, block_size))
+        throw std::runtime_error("Tag dictionary block checksum mismatch.");
+
+    cached_block_location = location;
+    return &cached_block[0];
+}
+
+std::unique_ptr<tag_trie_t::node_t> tag_trie_t::read_node(fs_location_t location)
+{
+    if (!cache)
+        throw std::runtime_error("Tag dictionary node is not loaded.");
+
+    const char* block = read_block(location / block_size * block_size);
+    size_t offset = location % block_size;
+    if (offset < sizeof(btree_block_header_t) || offset + sizeof(fs_tag_trie_node_t) > block_size)
+        throw std::runtime_error("Misplaced tag dictionary node.");
+
+    const fs_tag_trie_node_t* disk = reinterpret_cast<const fs_tag_trie_node_t*>(block + offset);
+    size_t size = sizeof(fs_tag_trie_node_t) + disk->label_length + disk->child_count * sizeof(fs_tag_trie_child_t);
+    if (offset + size > block_size || disk->child_count > 256)
+        throw std::runtime_error("Corrupt tag dictionary node.");
+
+    std::unique_ptr<node_t> node(new node_t);
+    node->label.assign(disk->label, disk->label_length);
+    node->terminal = disk->flags & TAG_TRIE_TERMINAL;
+    node->id = disk->tag_id;
+    const fs_tag_trie_child_t* children = reinterpret_cast<const fs_tag_trie_child_t*>(disk->label + disk->label_length);
+    node->children.resize(disk->child_count);
+    for (size_t i = 0; i < node->children.size(); ++i)
+    {
+        node->children[i].first = children[i].first;
+        node->children[i].location = children[i].node;
+    }
+    ++loaded_count;
+    return node;
+}
+
+tag_trie_t::node_t* tag_trie_t::child(child_t& c)
+{
+    if (!c.node)
+    {
+        c.node = read_node(c.location);
+        if (c.node->label.empty() || uint8_t(c.node->label[0]) != c.first)
+            throw std::runtime_error("Corrupt tag dictionary node label.");
+    }
+    return c.node.get();
+}
+
+tag_trie_t::child_t* tag_trie_t::find_child(node_t* node, uint8_t first)
+{
+    auto it = std::lower_bound(node->children.begin(), node->children.end(), first,
+        [](const child_t& c, uint8_t f) { return c.first < f; });
+    return it != node->children.end() && it->first == first ? &*it : NULL;
+}
+
+uint64_t tag_trie_t::insert(const std::string& tag)
+{
+    if (tag.empty() || tag.size() > MAX_TAG_LENGTH)
+        throw std::runtime_error("Tag name is empty or too long.");
+
+    node_t* node = root.get();
+    size_t pos = 0;
+    while (pos < tag.size())
+    {
+        uint8_t first = tag[pos];
+        child_t* c = find_child(node, first);
+        if (!c)
+        {
+            auto it = std::lower_bound(node->children.begin(), node->children.end(), first,
+                [](const child_t& c, uint8_t f) { return c.first < f; });
+            child_t leaf;
+            leaf.first = first;
+            leaf.location = 0;
+            leaf.node.reset(new node_t);
+            leaf.node->label = tag.substr(pos);
+            leaf.node->terminal = true;
+            leaf.node->id = next_free_id++;
+            ++tag_count;
+            return node->children.insert(it, std::move(leaf))->node->id;
+        }
+
+        node_t* next = child(*c);
+        size_t common = 0;
+        while (common < next->label.size() && pos + common < tag.size() && next->label[common] == tag[pos + common])
+            ++common;
+
+        if (common < next->label.size())
+        {
+            // Tag diverges inside the edge label, split the edge at the divergence point.
+            std::unique_ptr<node_t> mid(new node_t);
+            mid->label = next->label.substr(0, common);
+            next->label.erase(0, common);
+            child_t lower;
+            lower.first = next->label[0];
+            lower.location = c->location;
+            lower.node = std::move(c->node);
+            mid->children.push_back(std::move(lower));
+            c->node = std::move(mid);
+            next = c->node.get();
+        }
+        node = next;
+        pos += common;
+    }
+
+    if (!node->terminal)
+    {
+        node->terminal = true;
+        node->id = next_free_id++;
+        ++tag_count;
+    }
+    return node->id;
+}
+
+bool tag_trie_t::lookup(const std::string& tag, uint64_t& id)
+{
+    node_t* node = root.get();
+    size_t pos = 0;
+    while (pos < tag.size())
+    {
+        child_t* c = find_child(node, tag[pos]);
+        if (!c)
+            return false;
+        node = child(*c);
+        if (tag.compare(pos, node->label.size(), node->label) != 0)
+            return false;
+        pos += node->label.size();
+    }
+    if (!node->terminal)
+        return false;
+    id = node->id;
+    return true;
+}
+
+bool tag_trie_t::walk(node_t* node, std::string& name, const std::function<bool (const std::string&, uint64_t)>& visit)
+{
+    if (node->terminal && !visit(name, node->id))
+        return false;
+    for (auto& c : node->children)
+    {
+        node_t* n = child(c);
+        size_t length = name.size();
+        name.append(n->label);
+        bool more = walk(n, name, visit);
+        name.resize(length);
+        if (!more)
+            return false;
+    }
+    return true;
+}
+
+void tag_trie_t::for_each_prefix(const std::string& prefix, const std::function<bool (const std::string&, uint64_t)>& visit)
+{
+    // Descend along the prefix, the node reached (whose label may extend past the prefix) roots all matching tags.
+    node_t* node = root.get();
+    std::string name;
+    while (name.size() < prefix.size())
+    {
+        child_t* c = find_child(node, prefix[name.size()]);
+        if (!c)
+            return;
+        node = child(*c);
+        size_t length = std::min(node->label.size(), prefix.size() - name.size());
+        if (node->label.compare(0, length, prefix, name.size(), length) != 0)
+            return;
+        name.append(node->label);
+    }
+    walk(node, name, visit);
+}
+
+//=====================================================================================================================
+// Writing out
+//=====================================================================================================================
+
+/**
+ * Packs nodes into blocks in post-order, children are written before their parent so their addresses are known.
+ */
+class tag_trie_t::writer_t
+{
+    tag_trie_t& trie;
+    block_cache_t& cache;
+    deviceno_t device;
+    fs_block_allocator_t& allocator;
+    size_t block_size;
+    const uint8_t* fsid;
+    uint64_t generation;
+    tree_block_ref block;
+    size_t used;
+    std::vector<char> buffer;
+
+public:
+    writer_t(tag_trie_t& t, block_cache_t& c, deviceno_t dev, fs_block_allocator_t& a, size_t bs, const uint8_t* id, uint64_t gen)
+        : trie(t), cache(c), device(dev), allocator(a), block_size(bs), fsid(id), generation(gen), used(0)
+    {}
+
+    fs_location_t put(const char* data, size_t size)
+    {
+        if (!block || used + size > block_size)
+        {
+            flush();
+            block = std::make_shared<tree_block_t>(allocator.allocate(), block_size);
+            block->init(0, generation, fsid, TAG_TRIE_OBJECTID);
+            used = sizeof(btree_block_header_t);
+        }
+        memutils::copy_memory(&block->data[used], data, size);
+        ++block->header()->numItems;
+        fs_location_t location = block->location + used;
+        used += size;
+        return location;
+    }
+
+    void flush()
+    {
+        if (!block)
+            return;
+        calc_checksum(block->header(), block_size);
+        if (cache.cached_write(device, block->location / block_size, &block->data[0], 1, block_size) != block_size)
+            throw std::runtime_error("Cannot write tag dictionary block.");
+        block.reset();
+    }
+
+    fs_location_t write(node_t* node)
+    {
+        for (auto& c : node->children)
+            c.location = write(trie.child(c));
+
+        buffer.assign(sizeof(fs_tag_trie_node_t) + node->label.size() + node->children.size() * sizeof(fs_tag_trie_child_t), 0);
+        fs_tag_trie_node_t* disk = reinterpret_cast<fs_tag_trie_node_t*>(&buffer[0]);
+        disk->label_length = node->label.size();
+        disk->flags = node->terminal ? TAG_TRIE_TERMINAL : 0;
+        disk->child_count = node->children.size();
+        disk->tag_id = node->id;
+        memutils::copy_memory(disk->label, node->label.data(), node->label.size());
+        fs_tag_trie_child_t* children = reinterpret_cast<fs_tag_trie_child_t*>(disk->label + node->label.size());
+        for (size_t i = 0; i < node->children.size(); ++i)
+        {
+            children[i].first = node->children[i].first;
+            children[i].node = node->children[i].location;
+        }
+        return put(&buffer[0], buffer.size());
+    }
+};
+
+fs_location_t tag_trie_t::store(block_cache_t& cache_, deviceno_t device_, fs_block_allocator_t& allocator,
+    size_t block_size_, const uint8_t fsid[btree_header_common_t::FS_UUID_SIZE], uint64_t generation_)
+{
+    if (block_size_ < sizeof(btree_block_header_t) + MAX_NODE_SIZE)
+        throw std::runtime_error("Block size is too small for tag dictionary nodes.");
+
+    writer_t writer(*this, cache_, device_, allocator, block_size_, fsid, generation_);
+    fs_tag_trie_root_t record;
+    record.root_node = writer.write(root.get());
+    record.tag_count = tag_count;
+    record.next_id = next_free_id;
+    fs_location_t location = writer.put(reinterpret_cast<const char*>(&record), sizeof(record));
+    writer.flush();
+
+    // Everything is in memory now, further lazy loads would come from the new copy.
+    cache = &cache_;
+    device = device_;
+    block_size = block_size_;
+    generation = generation_;
+    cached_block_location = ~0ULL;
+    return location;
+}
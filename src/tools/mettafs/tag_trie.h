@@ -0,0 +1,115 @@
+//
+// Part of Metta OS. Check https://atta-metta.net for latest version.
+//
+// Copyright 2007 - 2017, Stanislav Karchebnyy <berkus@atta-metta.net>
+//
+// Distributed under the Boost Software License, Version 1.0.
+// (See file LICENSE_1_0.txt or a copy at http://www.boost.org/LICENSE_1_0.txt)
+//
+/**
+ * Tag dictionary: a patricia trie mapping tag names to integer tag ids.
+ *
+ * Every node holds the part of the tag name on the edge leading to it, so tags like project.metta.fs and
+ * project.metta.kernel share the project.metta. node. Children are kept sorted by their first byte, a depth first
+ * walk visits tags in lexicographic order and a prefix query descends along the prefix and walks only the subtree
+ * below it.
+ *
+ * On disk nodes are addressed by their byte offset on the device and packed into blocks with a
+ * btree_block_header_t, written in post-order so that small subtrees share a block with their parent. The
+ * dictionary root record holds the root node address, tag count and next free tag id.
+ *
+ * An opened trie reads nodes from disk only when a lookup or walk reaches them. store() writes the whole
+ * trie out to freshly allocated blocks.
+ */
+#pragma once
+
+#include "btree.h"
+#include <functional>
+#include <memory>
+#include <string>
+#include <vector>
+
+class tag_trie_t
+{
+public:
+    static const size_t MAX_TAG_LENGTH = 255;
+
+    /**
+     * Empty dictionary, tag ids are assigned from first_id on.
+     */
+    tag_trie_t(uint64_t first_id = 1);
+    ~tag_trie_t();
+
+    /**
+     * Use a dictionary stored at root in the given generation, nodes are read through cache when needed.
+     */
+    void open(block_cache_t& cache, deviceno_t device, size_t block_size, fs_location_t root, uint64_t generation);
+
+    /**
+     * Find tag id, assigning the next free id to a new tag.
+     * Throws std::runtime_error for empty or too long tags.
+     */
+    uint64_t insert(const std::string& tag);
+    bool lookup(const std::string& tag, uint64_t& id);
+
+    /**
+     * Call visit for every tag starting with prefix in lexicographic order, until it returns false.
+     */
+    void for_each_prefix(const std::string& prefix, const std::function<bool (const std::string&, uint64_t)>& visit);
+    void for_each(const std::function<bool (const std::string&, uint64_t)>& visit) { for_each_prefix("", visit); }
+
+    uint64_t size() const { return tag_count; }
+    uint64_t next_id() const { return next_free_id; }
+
+    /**
+     * Write the whole trie to blocks from allocator, stamped with generation.
+     * @return location of the root record, to be recorded in the root of roots tree.
+     */
+    fs_location_t store(block_cache_t& cache, deviceno_t device, fs_block_allocator_t& allocator, size_t block_size,
+        const uint8_t fsid[btree_header_common_t::FS_UUID_SIZE], uint64_t generation);
+
+    /**
+     * Nodes read from disk so far, for checking that queries stay within their subtree.
+     */
+    uint64_t nodes_loaded() const { return loaded_count; }
+
+private:
+    struct node_t;
+    struct child_t
+    {
+        uint8_t first;                //!< First byte of the child label.
+        fs_location_t location;       //!< On disk, if not loaded yet.
+        std::unique_ptr<node_t> node;
+    };
+    struct node_t
+    {
+        std::string label;
+        bool terminal;
+        uint64_t id;
+        std::vector<child_t> children; //!< Sorted by first.
+
+        node_t() : terminal(false), id(0) {}
+    };
+
+    std::unique_ptr<node_t> root;
+    uint64_t tag_count;
+    uint64_t next_free_id;
+    uint64_t loaded_count;
+
+    // Source of nodes not loaded yet.
+    block_cache_t* cache;
+    deviceno_t device;
+    size_t block_size;
+    uint64_t generation;
+    fs_location_t cached_block_location;
+    std::vector<char> cached_block;
+
+    const char* read_block(fs_location_t location);
+    std::unique_ptr<node_t> read_node(fs_location_t location);
+    node_t* child(child_t& c);
+    child_t* find_child(node_t* node, uint8_t first);
+
+    bool walk(node_t* node, std::string& name, const std::function<bool (const std::string&, uint64_t)>& visit);
+
+    class writer_t;
+};
@@ -0,0 +1,124 @@
+//
+// Part of Metta OS. Check https://atta-metta.net for latest version.
+//
+// Copyright 2007 - 2017, Stanislav Karchebnyy <berkus@atta-metta.net>
+//
+// Distributed under the Boost Software License, Version 1.0.
+// (See file LICENSE_1_0.txt or a copy at http://www.boost.org/LICENSE_1_0.txt)
+//
+/**
+ * @brief block_cache_t lookup and eviction benchmark.
+ *
+ * For several cache sizes reads single blocks through the cache from a sparse image file:
+ * - fill:  first touch of every block, miss without eviction,
+ * - hit:   random reads of resident blocks,
+ * - evict: sweep over twice the cache size, every read misses and evicts the LRU block.
+ * Fill and evict sweep block numbers downwards, so that sequential readahead does not turn misses into hits
+ * or prefetch past the blocks meant to be resident.
+ * - scan:  ascending sweep over the whole device, served mostly by readahead.
+ * - par:   random reads of resident blocks from one thread per CPU, shards let them proceed in parallel.
+ * Prints operations per second for each phase.
+ */
+#include <stdio.h>
+#include <stdlib.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <chrono>
+#include <thread>
+#include <vector>
+#include "block_device.h"
+#include "block_device_mapper.h"
+#include "block_cache.h"
+
+static const size_t BLOCK_SIZE = 512;
+static const char* IMAGE = "bench_block_cache.img";
+
+static double seconds_since(std::chrono::steady_clock::time_point start)
+{
+    return std::chrono::duration<double>(std::chrono::steady_clock::now() - start).count();
+}
+
+static void bench(size_t cache_blocks)
+{
+    size_t device_blocks = 2 * cache_blocks;
+    int fd = open(IMAGE, O_CREAT | O_TRUNC | O_RDWR, 0644);
+    if (fd < 0 || ftruncate(fd, device_blocks * BLOCK_SIZE) != 0)
+    {
+        perror(IMAGE);
+        exit(1);
+    }
+    close(fd);
+
+    block_cache_t cache(cache_blocks);
+    block_device_mapper_t mapper;
+    cache.set_device_mapper(mapper);
+    mapper.set_cache(cache);
+
+    block_device_t dev(IMAGE, false, BLOCK_SIZE);
+    mapper.map_device(dev, "bench");
+    deviceno_t device = mapper.resolve_device("bench");
+
+    char buf[BLOCK_SIZE];
+
+    auto start = std::chrono::steady_clock::now();
+    for (size_t b = 0; b < cache_blocks; ++b)
+        cache.cached_read(device, cache_blocks - 1 - b, buf, 1, BLOCK_SIZE);
+    double fill = cache_blocks / seconds_since(start);
+
+    size_t hits = 4 * cache_blocks;
+    uint32_t seed = 2463534242u;
+    start = std::chrono::steady_clock::now();
+    for (size_t i = 0; i < hits; ++i)
+    {
+        seed ^= seed << 13; seed ^= seed >> 17; seed ^= seed << 5;
+        cache.cached_read(device, seed % cache_blocks, buf, 1, BLOCK_SIZE);
+    }
+    double hit = hits / seconds_since(start);
+
+    start = std::chrono::steady_clock::now();
+    for (size_t b = 0; b < device_blocks; ++b)
+        cache.cached_read(device, device_blocks - 1 - b, buf, 1, BLOCK_SIZE);
+    double evict = device_blocks / seconds_since(start);
+
+    start = std::chrono::steady_clock::now();
+    for (size_t b = 0; b < device_blocks; ++b)
+        cache.cached_read(device, b, buf, 1, BLOCK_SIZE);
+    double scan = device_blocks / seconds_since(start);
+
+    // Bring the hit set back in before the parallel phase.
+    for (size_t b = 0; b < cache_blocks; ++b)
+        cache.cached_read(device, cache_blocks - 1 - b, buf, 1, BLOCK_SIZE);
+
+    size_t n_threads = std::max(1u, std::thread::hardware_concurrency());
+    std::vector<std::thread> threads;
+    start = std::chrono::steady_clock::now();
+    for (size_t t = 0; t < n_threads; ++t)
+    {
+        threads.emplace_back([&cache, device, cache_blocks, hits, t] {
+            char buf[BLOCK_SIZE];
+            uint32_t seed = 2463534242u + t;
+            for (size_t i = 0; i < hits; ++i)
+            {
+                seed ^= seed << 13; seed ^= seed >> 17; seed ^= seed << 5;
+                cache.cached_read(device, seed % cache_blocks, buf, 1, BLOCK_SIZE);
+            }
+        });
+    }
+    for (auto& t : threads)
+        t.join();
+    double par = n_threads * hits / seconds_since(start);
+
+    printf("%8zu blocks, %2zu shards: fill %10.0f ops/s, hit %10.0f ops/s, evict %10.0f ops/s, scan %10.0f ops/s, par(%zu) %10.0f ops/s\n",
+        cache_blocks, cache.shard_count(), fill, hit, evict, scan, n_threads, par);
+
+    mapper.unmap_device(device);
+    unlink(IMAGE);
+}
+
+int main()
+{
+    size_t sizes[] = { 1 << 10, 1 << 14, 1 << 18, 1 << 20 };
+    for (auto size : sizes)
+        bench(size);
+    return 0;
+}
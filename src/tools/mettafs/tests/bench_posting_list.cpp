@@ -0,0 +1,114 @@
+//
+// Part of Metta OS. Check https://atta-metta.net for latest version.
+//
+// Copyright 2007 - 2017, Stanislav Karchebnyy <berkus@atta-metta.net>
+//
+// Distributed under the Boost Software License, Version 1.0.
+// (See file LICENSE_1_0.txt or a copy at http://www.boost.org/LICENSE_1_0.txt)
+//
+/**
+ * @brief posting_list_t tag intersection benchmark.
+ *
+ * Intersects pairs and triples of random tag posting lists over 1M objids, from rare tags (1K objids) to common ones
+ * (500K objids), and compares with std::set_intersection over plain sorted objid vectors.
+ * Prints microseconds per query and encoded size per objid.
+ */
+#include <stdio.h>
+#include <algorithm>
+#include <chrono>
+#include <iterator>
+#include <random>
+#include <set>
+#include <vector>
+#include "posting_list.h"
+
+static const uint64_t OBJIDS = 1000000;
+
+static double seconds_since(std::chrono::steady_clock::time_point start)
+{
+    return std::chrono::duration<double>(std::chrono::steady_clock::now() - start).count();
+}
+
+struct tag_t
+{
+    std::vector<uint64_t> objids;
+    posting_list_t list;
+};
+
+static tag_t make_tag(std::mt19937& rng, size_t count)
+{
+    tag_t t;
+    std::set<uint64_t> values;
+    std::uniform_int_distribution<uint64_t> dist(0, OBJIDS - 1);
+    while (values.size() < count)
+        values.insert(dist(rng));
+    t.objids.assign(values.begin(), values.end());
+    for (auto v : t.objids)
+        t.list.add(v);
+    return t;
+}
+
+static size_t encoded_size(const posting_list_t& list)
+{
+    size_t bytes = 0;
+    std::vector<char> data;
+    for (auto& c : list.get_containers())
+    {
+        posting_list_t::encode(c, data);
+        bytes += data.size() + sizeof(fs_item_t);
+    }
+    return bytes;
+}
+
+static void bench(std::vector<tag_t*> tags)
+{
+    const int rounds = 50;
+    size_t result = 0;
+
+    auto start = std::chrono::steady_clock::now();
+    for (int r = 0; r < rounds; ++r)
+    {
+        std::vector<const posting_list_t*> lists;
+        for (auto t : tags)
+            lists.push_back(&t->list);
+        result = posting_list_t::intersect(lists).size();
+    }
+    double compressed = seconds_since(start) / rounds;
+
+    start = std::chrono::steady_clock::now();
+    for (int r = 0; r < rounds; ++r)
+    {
+        std::vector<uint64_t> acc = tags[0]->objids, next;
+        for (size_t i = 1; i < tags.size(); ++i)
+        {
+            next.clear();
+            std::set_intersection(acc.begin(), acc.end(), tags[i]->objids.begin(), tags[i]->objids.end(), std::back_inserter(next));
+            acc.swap(next);
+        }
+        if (acc.size() != result)
+            printf("MISMATCH %zu != %zu\n", acc.size(), result);
+    }
+    double plain = seconds_since(start) / rounds;
+
+    printf("%zu-way", tags.size());
+    for (auto t : tags)
+        printf(" %7zu", t->objids.size());
+    printf(": %7zu hits, posting lists %8.1f us, sorted vectors %8.1f us\n", result, compressed * 1e6, plain * 1e6);
+}
+
+int main()
+{
+    std::mt19937 rng(1);
+    tag_t rare = make_tag(rng, 1000), few = make_tag(rng, 10000), some = make_tag(rng, 100000), common = make_tag(rng, 500000);
+
+    for (auto t : { &rare, &few, &some, &common })
+        printf("%7zu objids: %.2f bytes/objid encoded\n", t->objids.size(), double(encoded_size(t->list)) / t->objids.size());
+
+    bench({ &rare, &common });
+    bench({ &few, &some });
+    bench({ &some, &common });
+    bench({ &common, &common });
+    bench({ &rare, &some, &common });
+    bench({ &few, &some, &common });
+    return 0;
+}
@@ -13,10 +13,56 @@
 /*============================================================================*/
 
 #include <string.h>
+#include <unistd.h>
+#include <atomic>
+#include <thread>
+#include <vector>
+#include "block_device.h"
+#include "block_device_mapper.h"
+#include "block_cache.h"
 
 #define BOOST_TEST_DYN_LINK
 #include <boost/test/unit_test.hpp>
 
+static const size_t BLOCK_SIZE = 512;
+
+/**
+ * Image file of nblocks blocks, each filled with its block number, mounted through a device mapper.
+ */
+struct test_image_t
+{
+	const char* name;
+	block_device_t* device;
+	block_device_mapper_t mapper;
+	deviceno_t dev;
+
+	test_image_t(block_cache_t& cache, size_t nblocks, const char* file_name = "test_block_cache.img")
+		: name(file_name)
+	{
+		{
+			block_device_t init(name, true, BLOCK_SIZE);
+			std::vector<char> block(BLOCK_SIZE);
+			for (size_t b = 0; b < nblocks; ++b)
+			{
+				memset(&block[0], b & 0xff, BLOCK_SIZE);
+				init.write_block(b, &block[0], BLOCK_SIZE);
+			}
+		}
+		device = new block_device_t(name, false, BLOCK_SIZE);
+		cache.set_device_mapper(mapper);
+		mapper.set_cache(cache);
+		mapper.map_device(*device, name);
+		dev = mapper.resolve_device(name);
+	}
+
+	~test_image_t()
+	{
+		mapper.unmap_device(dev);
+		delete device;
+		unlink(name);
+	}
+};
+
 BOOST_AUTO_TEST_SUITE( mettafs )
 
 BOOST_AUTO_TEST_CASE(block_cache_empty_on_start)
@@ -27,18 +73,309 @@ BOOST_AUTO_TEST_CASE(block_cache_empty_on_start)
 
 BOOST_AUTO_TEST_CASE(block_cache_readahead_stripe)
 {
-	block_device_t device(100);
-	block_cache_t cache(device, 200);
+	block_cache_t cache(200);
+	test_image_t image(cache, 100);
+	char block[BLOCK_SIZE];
+
+	// Sequential single block reads are served mostly from readahead.
+	for (size_t b = 0; b < 100; ++b)
+	{
+		BOOST_CHECK_EQUAL(cache.cached_read(image.dev, b, block, 1, BLOCK_SIZE), 1);
+		BOOST_CHECK_EQUAL(block[0], char(b));
+		BOOST_CHECK_EQUAL(block[BLOCK_SIZE - 1], char(b));
+	}
+	BOOST_CHECK_LT(cache.statistics().device_reads, 10);
+	BOOST_CHECK_EQUAL(cache.statistics().misses + cache.statistics().hits, 100);
+
+	// Random access does not read ahead.
+	block_cache_t random_cache(200);
+	test_image_t random_image(random_cache, 100, "test_block_cache_random.img");
+	for (size_t b = 0; b < 100; b += 7)
+		random_cache.cached_read(random_image.dev, 99 - b, block, 1, BLOCK_SIZE);
+	BOOST_CHECK_EQUAL(random_cache.statistics().readahead_blocks, 0);
 }
 
 BOOST_AUTO_TEST_CASE(block_cache_readahead_at_device_end)
 {
+	block_cache_t cache(200);
+	test_image_t image(cache, 10);
+	char block[BLOCK_SIZE];
+
+	for (size_t b = 0; b < 10; ++b)
+	{
+		BOOST_CHECK_EQUAL(cache.cached_read(image.dev, b, block, 1, BLOCK_SIZE), 1);
+		BOOST_CHECK_EQUAL(block[0], char(b));
+	}
+	BOOST_CHECK_EQUAL(cache.allocated_size(), 10);
+	BOOST_CHECK_THROW(cache.cached_read(image.dev, 10, block, 1, BLOCK_SIZE), std::runtime_error);
 }
 
 BOOST_AUTO_TEST_CASE(block_cache_get_blocks_fails_for_too_large_request)
 {
 	block_cache_t cache(1);
-	BOOST_CHECK_EQUAL(cache.get_blocks(2), 0);
+	BOOST_CHECK_THROW(cache.get_blocks(1, 0, 2, BLOCK_SIZE), std::runtime_error);
+}
+
+BOOST_AUTO_TEST_CASE(block_cache_flush_clusters_adjacent_writes)
+{
+	block_cache_t cache(200);
+	test_image_t image(cache, 64);
+	std::vector<char> data(16 * BLOCK_SIZE, 'x');
+
+	cache.cached_write(image.dev, 8, &data[0], 16, BLOCK_SIZE);
+	cache.cached_write(image.dev, 40, &data[0], 4, BLOCK_SIZE);
+	BOOST_CHECK_EQUAL(cache.unwritten_blocks(), 20);
+	BOOST_CHECK(cache.flush(image.dev));
+	BOOST_CHECK_EQUAL(cache.unwritten_blocks(), 0);
+	BOOST_CHECK_EQUAL(cache.statistics().device_writes, 2);
+	BOOST_CHECK_EQUAL(cache.statistics().blocks_written, 20);
+
+	char block[BLOCK_SIZE];
+	BOOST_CHECK_EQUAL(cache.cached_read(image.dev, 23, block, 1, BLOCK_SIZE), 1);
+	BOOST_CHECK_EQUAL(block[0], 'x');
+	BOOST_CHECK_EQUAL(cache.cached_read(image.dev, 24, block, 1, BLOCK_SIZE), 1);
+	BOOST_CHECK_EQUAL(block[0], char(24));
+}
+
+BOOST_AUTO_TEST_CASE(block_cache_eviction_writes_back_dirty_clusters)
+{
+	block_cache_t cache(8);
+	test_image_t image(cache, 64);
+	std::vector<char> data(8 * BLOCK_SIZE, 'y');
+
+	cache.cached_write(image.dev, 0, &data[0], 8, BLOCK_SIZE);
+	BOOST_CHECK_EQUAL(cache.statistics().device_writes, 0);
+
+	// Cache is full of dirty blocks, the next write pushes them out in one go.
+	cache.cached_write(image.dev, 32, &data[0], 1, BLOCK_SIZE);
+	BOOST_CHECK_EQUAL(cache.statistics().device_writes, 1);
+	BOOST_CHECK_EQUAL(cache.statistics().blocks_written, 8);
+	BOOST_CHECK_EQUAL(cache.allocated_size(), 8);
+}
+
+/**
+ * Sequential reads with readahead and clustered writes give the same data with either queue backend.
+ */
+static void check_queue_backend(io_queue_t* queue)
+{
+	block_cache_t cache(64);
+	test_image_t image(cache, 256, "test_block_cache_queue.img");
+	image.mapper.set_queue(queue);
+	std::vector<char> data(4 * BLOCK_SIZE, 'z');
+	char block[BLOCK_SIZE];
+
+	for (size_t b = 0; b < 256; b += 8)
+		cache.cached_write(image.dev, b, &data[0], 4, BLOCK_SIZE);
+	BOOST_CHECK(cache.flush(image.dev));
+	BOOST_CHECK_EQUAL(cache.unwritten_blocks(), 0);
+
+	for (size_t b = 0; b < 256; ++b)
+	{
+		BOOST_CHECK_EQUAL(cache.cached_read(image.dev, b, block, 1, BLOCK_SIZE), 1);
+		BOOST_CHECK_EQUAL(block[BLOCK_SIZE - 1], b % 8 < 4 ? 'z' : char(b));
+	}
+	BOOST_CHECK_GT(cache.statistics().readahead_blocks, 0);
+	BOOST_CHECK_EQUAL(cache.statistics().io_errors, 0);
+	BOOST_CHECK_EQUAL(image.mapper.get_queue().in_flight(), 0);
+}
+
+BOOST_AUTO_TEST_CASE(block_cache_thread_pool_queue)
+{
+	check_queue_backend(io_queue_t::create_thread_pool(2));
+}
+
+BOOST_AUTO_TEST_CASE(block_cache_default_queue)
+{
+	io_queue_t* queue = io_queue_t::create(block_device_mapper_t::QUEUE_DEPTH);
+	BOOST_TEST_MESSAGE("Using " << queue->name() << " queue");
+	check_queue_backend(queue);
+}
+
+BOOST_AUTO_TEST_CASE(block_cache_mapped_device)
+{
+	const char* name = "test_block_cache_mapped.img";
+	block_cache_t cache(16);
+	block_device_mapper_t mapper;
+	cache.set_device_mapper(mapper);
+	mapper.set_cache(cache);
+	{
+		mapped_block_device_t device(name, true, BLOCK_SIZE, 64);
+		mapper.map_device(device, name);
+		deviceno_t dev = mapper.resolve_device(name);
+
+		std::vector<char> data(4 * BLOCK_SIZE, 'm');
+		cache.cached_write(dev, 60, &data[0], 4, BLOCK_SIZE);
+		BOOST_CHECK_THROW(cache.cached_write(dev, 62, &data[0], 4, BLOCK_SIZE), std::runtime_error);
+
+		// Reads and views see the write without going through cache blocks.
+		char block[BLOCK_SIZE];
+		BOOST_CHECK_EQUAL(cache.cached_read(dev, 63, block, 1, BLOCK_SIZE), 1);
+		BOOST_CHECK_EQUAL(block[0], 'm');
+		const char* view = cache.view(dev, 59, 5);
+		BOOST_REQUIRE(view);
+		BOOST_CHECK_EQUAL(view[0], 0);
+		BOOST_CHECK_EQUAL(view[BLOCK_SIZE], 'm');
+		BOOST_CHECK(!cache.view(dev, 60, 5));
+		BOOST_CHECK_EQUAL(cache.allocated_size(), 0);
+		BOOST_CHECK_EQUAL(cache.statistics().mapped_blocks, 5);
+
+		BOOST_CHECK(cache.flush(dev));
+		mapper.unmap_device(dev);
+	}
+
+	// Data reached the file and its size is kept when reopened.
+	block_device_t plain(name, false, BLOCK_SIZE);
+	char block[BLOCK_SIZE];
+	BOOST_CHECK_EQUAL(plain.read_block(61, block, BLOCK_SIZE), BLOCK_SIZE);
+	BOOST_CHECK_EQUAL(block[BLOCK_SIZE - 1], 'm');
+	BOOST_CHECK_EQUAL(plain.read_block(64, block, BLOCK_SIZE), 0);
+	mapped_block_device_t reopened(name, false, BLOCK_SIZE);
+	BOOST_CHECK_EQUAL(reopened.num_blocks(), 64);
+	unlink(name);
+}
+
+/**
+ * Readers over the whole image, writers over their own parts of it and a flush all run at once.
+ * Every block read must be either its original content or the written one.
+ */
+static void check_concurrent_access(io_queue_t* queue)
+{
+	const size_t NBLOCKS = 2048;
+	block_cache_t cache(512, 4);
+	BOOST_CHECK_EQUAL(cache.shard_count(), 4);
+	test_image_t image(cache, NBLOCKS, "test_block_cache_concurrent.img");
+	image.mapper.set_queue(queue);
+	std::atomic<size_t> bad_reads(0);
+	std::atomic<bool> flush_failed(false);
+
+	auto written = [](size_t b) { return char(~b & 0xff); };
+	std::vector<std::thread> threads;
+	for (size_t t = 0; t < 4; ++t)
+	{
+		threads.emplace_back([&, t] {
+			char block[4 * BLOCK_SIZE];
+			uint32_t seed = 2463534242u + t;
+			for (size_t i = 0; i < 2000; ++i)
+			{
+				seed ^= seed << 13; seed ^= seed >> 17; seed ^= seed << 5;
+				// Mix of random single block reads and short sequential runs that trigger readahead.
+				size_t n = i % 8 ? 1 : 4;
+				size_t b = seed % (NBLOCKS - n);
+				cache.cached_read(image.dev, b, block, n, BLOCK_SIZE);
+				for (size_t k = 0; k < n; ++k)
+				{
+					char first = block[k * BLOCK_SIZE], last = block[(k + 1) * BLOCK_SIZE - 1];
+					if (first != last || (first != char(b + k) && first != written(b + k)))
+						++bad_reads;
+				}
+			}
+		});
+	}
+	for (size_t t = 0; t < 2; ++t)
+	{
+		threads.emplace_back([&, t] {
+			std::vector<char> block(BLOCK_SIZE);
+			for (size_t b = t; b < NBLOCKS; b += 2 * 3)
+			{
+				memset(&block[0], written(b), BLOCK_SIZE);
+				cache.cached_write(image.dev, b, &block[0], 1, BLOCK_SIZE);
+			}
+		});
+	}
+	threads.emplace_back([&] {
+		for (size_t i = 0; i < 3; ++i)
+			if (!cache.flush(image.dev))
+				flush_failed = true;
+	});
+	for (auto& t : threads)
+		t.join();
+
+	BOOST_CHECK_EQUAL(bad_reads, 0);
+	BOOST_CHECK(!flush_failed);
+	BOOST_CHECK(cache.flush(image.dev));
+	BOOST_CHECK_EQUAL(cache.unwritten_blocks(), 0);
+	BOOST_CHECK_EQUAL(cache.statistics().io_errors, 0);
+
+	block_device_t check(image.name, false, BLOCK_SIZE);
+	char block[BLOCK_SIZE];
+	size_t mismatches = 0;
+	for (size_t b = 0; b < NBLOCKS; ++b)
+	{
+		check.read_block(b, block, BLOCK_SIZE);
+		if (block[0] != (b % 6 < 2 ? written(b) : char(b)))
+			++mismatches;
+	}
+	BOOST_CHECK_EQUAL(mismatches, 0);
+}
+
+BOOST_AUTO_TEST_CASE(block_cache_concurrent_access_thread_pool_queue)
+{
+	check_concurrent_access(io_queue_t::create_thread_pool(2));
+}
+
+BOOST_AUTO_TEST_CASE(block_cache_concurrent_access_default_queue)
+{
+	check_concurrent_access(io_queue_t::create(block_device_mapper_t::QUEUE_DEPTH));
+}
+
+/**
+ * Large reads bypass the cache blocks while a writer rewrites the range and flushes keep writing it back.
+ * A large read must not see a block older than the last round written before it started.
+ */
+static void check_large_read_during_write_back(io_queue_t* queue)
+{
+	const size_t NBLOCKS = 256, ROUNDS = 60; // 128K per read, past the size cached_read() reads directly.
+	block_cache_t cache(1024, 4);
+	test_image_t image(cache, NBLOCKS, "test_block_cache_large_read.img");
+	image.mapper.set_queue(queue);
+	std::atomic<size_t> done_round(0), stale_reads(0);
+	std::atomic<bool> stop(false);
+
+	std::thread writer([&] {
+		std::vector<char> block(BLOCK_SIZE);
+		for (size_t round = 1; round <= ROUNDS; ++round)
+		{
+			memset(&block[0], char(round), BLOCK_SIZE);
+			for (size_t b = 0; b < NBLOCKS; ++b)
+				cache.cached_write(image.dev, b, &block[0], 1, BLOCK_SIZE);
+			done_round = round;
+		}
+		stop = true;
+	});
+	std::thread flusher([&] {
+		while (!stop)
+			cache.flush(image.dev);
+	});
+	std::thread reader([&] {
+		std::vector<char> data(NBLOCKS * BLOCK_SIZE);
+		while (!stop)
+		{
+			size_t since = done_round;
+			cache.cached_read(image.dev, 0, &data[0], NBLOCKS, BLOCK_SIZE);
+			if (!since)
+				continue;
+			for (size_t b = 0; b < NBLOCKS; ++b)
+				if (size_t(data[b * BLOCK_SIZE]) < since)
+					++stale_reads;
+		}
+	});
+	writer.join();
+	flusher.join();
+	reader.join();
+
+	BOOST_CHECK_EQUAL(stale_reads, 0);
+	BOOST_CHECK(cache.flush(image.dev));
+	BOOST_CHECK_EQUAL(cache.statistics().io_errors, 0);
+}
+
+BOOST_AUTO_TEST_CASE(block_cache_large_read_during_write_back_thread_pool_queue)
+{
+	check_large_read_during_write_back(io_queue_t::create_thread_pool(2));
+}
+
+BOOST_AUTO_TEST_CASE(block_cache_large_read_during_write_back_default_queue)
+{
+	check_large_read_during_write_back(io_queue_t::create(block_device_mapper_t::QUEUE_DEPTH));
 }
 
 BOOST_AUTO_TEST_SUITE_END()
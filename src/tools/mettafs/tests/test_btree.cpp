@@ -0,0 +1,293 @@
+//
+// Part of Metta OS. Check https://atta-metta.net for latest version.
+//
+// Copyright 2007 - 2017, Stanislav Karchebnyy <berkus@atta-metta.net>
+//
+// Distributed under the Boost Software License, Version 1.0.
+// (See file LICENSE_1_0.txt or a copy at http://www.boost.org/LICENSE_1_0.txt)
+//
+/**
+ * @brief Test btree_t functionality.
+ */
+
+/*============================================================================*/
+
+#include <string.h>
+#include <algorithm>
+#include <random>
+#include <stdexcept>
+#include <vector>
+#include "btree_builder.h"
+#include "test_image.h"
+
+#define BOOST_TEST_DYN_LINK
+#include <boost/test/unit_test.hpp>
+
+// Small blocks make for deep trees with few items.
+static const size_t BLOCK_SIZE = 512;
+static const size_t IMAGE_BLOCKS = 8192;
+static const uint8_t FSID[btree_header_common_t::FS_UUID_SIZE] = { 'm', 'e', 't', 't', 'a', 'f', 's' };
+
+/**
+ * Empty image with a tree allocating blocks from all of it but the first one.
+ */
+struct small_tree_t : test_tree_t
+{
+	small_tree_t() : test_tree_t("test_btree.img", BLOCK_SIZE, IMAGE_BLOCKS, FSID, 1, 1024) {}
+};
+
+static std::vector<char> value_for(uint64_t id, size_t size = 8)
+{
+	std::vector<char> value(size);
+	for (size_t i = 0; i < size; ++i)
+		value[i] = char(id * 31 + i);
+	return value;
+}
+
+static bool insert_value(btree_t& tree, uint64_t id, size_t size = 8)
+{
+	std::vector<char> value = value_for(id, size);
+	return tree.insert(make_key(id, 1, id * 4096), value.data(), value.size());
+}
+
+static bool check_value(btree_t& tree, uint64_t id, size_t size = 8)
+{
+	std::vector<char> value;
+	return tree.lookup(make_key(id, 1, id * 4096), value) && value == value_for(id, size);
+}
+
+BOOST_AUTO_TEST_SUITE( mettafs )
+
+BOOST_AUTO_TEST_CASE(btree_empty_tree)
+{
+	small_tree_t t;
+	std::vector<char> value;
+	BOOST_CHECK_EQUAL(t.tree.verify(), 0);
+	BOOST_CHECK(!t.tree.lookup(make_key(1, 1, 0), value));
+	BOOST_CHECK(!t.tree.remove(make_key(1, 1, 0)));
+}
+
+BOOST_AUTO_TEST_CASE(btree_random_insert_lookup_remove)
+{
+	small_tree_t t;
+	std::mt19937 rng(42);
+	std::vector<uint64_t> ids;
+	for (uint64_t i = 1; i <= 2000; ++i)
+		ids.push_back(i);
+	std::shuffle(ids.begin(), ids.end(), rng);
+
+	for (auto id : ids)
+		BOOST_REQUIRE(insert_value(t.tree, id));
+	BOOST_CHECK(!insert_value(t.tree, ids[0]));
+	BOOST_CHECK_EQUAL(t.tree.verify(), ids.size());
+	for (auto id : ids)
+		BOOST_CHECK(check_value(t.tree, id));
+
+	std::shuffle(ids.begin(), ids.end(), rng);
+	for (size_t i = 0; i < ids.size() / 2; ++i)
+		BOOST_REQUIRE(t.tree.remove(make_key(ids[i], 1, ids[i] * 4096)));
+	BOOST_CHECK_EQUAL(t.tree.verify(), ids.size() - ids.size() / 2);
+	for (size_t i = 0; i < ids.size(); ++i)
+		BOOST_CHECK_EQUAL(check_value(t.tree, ids[i]), i >= ids.size() / 2);
+
+	// Removing everything merges the tree back into a single empty leaf.
+	for (size_t i = ids.size() / 2; i < ids.size(); ++i)
+		BOOST_REQUIRE(t.tree.remove(make_key(ids[i], 1, ids[i] * 4096)));
+	BOOST_CHECK_EQUAL(t.tree.verify(), 0);
+	BOOST_CHECK_EQUAL(t.tree.dirty_blocks(), 1);
+}
+
+BOOST_AUTO_TEST_CASE(btree_variable_item_sizes)
+{
+	small_tree_t t;
+	std::mt19937 rng(7);
+	std::uniform_int_distribution<size_t> sizes(0, t.tree.max_item_size());
+	std::vector<size_t> item_size(500);
+
+	for (auto& size : item_size)
+		size = sizes(rng);
+	for (uint64_t i = 0; i < item_size.size(); ++i)
+	{
+		uint64_t id = i * 7919 % item_size.size();
+		BOOST_REQUIRE(insert_value(t.tree, id, item_size[id]));
+	}
+	BOOST_CHECK_EQUAL(t.tree.verify(), item_size.size());
+	for (uint64_t id = 0; id < item_size.size(); ++id)
+		BOOST_CHECK(check_value(t.tree, id, item_size[id]));
+
+	BOOST_CHECK_THROW(insert_value(t.tree, 10000, t.tree.max_item_size() + 1), std::runtime_error);
+}
+
+BOOST_AUTO_TEST_CASE(btree_commit_and_reopen)
+{
+	small_tree_t t;
+	for (uint64_t id = 0; id < 1000; ++id)
+		insert_value(t.tree, id);
+	fs_location_t root = t.tree.commit();
+	uint64_t generation = t.tree.generation();
+	BOOST_CHECK_EQUAL(t.tree.dirty_blocks(), 0);
+	BOOST_CHECK_EQUAL(t.tree.transaction(), 2);
+	BOOST_CHECK_EQUAL(t.cache.flush(t.dev), true);
+
+	btree_t reopened(t.cache, t.dev, t.allocator, BLOCK_SIZE, FSID, 1);
+	reopened.open(root, generation);
+	BOOST_CHECK_EQUAL(reopened.verify(), 1000);
+	for (uint64_t id = 0; id < 1000; ++id)
+		BOOST_CHECK(check_value(reopened, id));
+
+	// Wrong generation means a lost write and is refused.
+	btree_t stale(t.cache, t.dev, t.allocator, BLOCK_SIZE, FSID, 1);
+	BOOST_CHECK_THROW(stale.open(root, generation + 1), std::runtime_error);
+}
+
+BOOST_AUTO_TEST_CASE(btree_cow_keeps_committed_tree)
+{
+	small_tree_t t;
+	for (uint64_t id = 0; id < 1000; ++id)
+		insert_value(t.tree, id);
+	fs_location_t old_root = t.tree.commit();
+	uint64_t old_generation = t.tree.generation();
+
+	for (uint64_t id = 0; id < 1000; id += 2)
+		t.tree.remove(make_key(id, 1, id * 4096));
+	for (uint64_t id = 1000; id < 1500; ++id)
+		insert_value(t.tree, id);
+	BOOST_CHECK(t.tree.root() != old_root);
+	BOOST_CHECK_EQUAL(t.tree.generation(), t.tree.transaction());
+
+	// Uncommitted changes do not touch the committed tree.
+	btree_t old_tree(t.cache, t.dev, t.allocator, BLOCK_SIZE, FSID, 1);
+	old_tree.open(old_root, old_generation);
+	BOOST_CHECK_EQUAL(old_tree.verify(), 1000);
+	for (uint64_t id = 0; id < 1000; ++id)
+		BOOST_CHECK(check_value(old_tree, id));
+
+	t.tree.commit();
+	BOOST_CHECK_EQUAL(t.tree.verify(), 1000);
+	for (uint64_t id = 0; id < 1500; ++id)
+		BOOST_CHECK_EQUAL(check_value(t.tree, id), id >= 1000 || id % 2);
+}
+
+BOOST_AUTO_TEST_CASE(btree_freed_blocks_are_reused)
+{
+	small_tree_t t;
+	for (int round = 0; round < 20; ++round)
+	{
+		for (uint64_t id = 0; id < 300; ++id)
+			insert_value(t.tree, id);
+		for (uint64_t id = 0; id < 300; ++id)
+			t.tree.remove(make_key(id, 1, id * 4096));
+		t.tree.commit();
+	}
+	BOOST_CHECK_EQUAL(t.tree.verify(), 0);
+	// Without reuse twenty rounds would need several times more blocks.
+	BOOST_CHECK_LT(t.allocator.high_water(), 200 * BLOCK_SIZE);
+}
+
+BOOST_AUTO_TEST_CASE(btree_range_scan)
+{
+	small_tree_t t;
+	for (uint64_t id = 0; id < 1000; id += 3)
+		insert_value(t.tree, id);
+
+	std::vector<uint64_t> seen;
+	t.tree.scan(make_key(100, 0, 0), make_key(400, 0, 0), [&seen](const fs_key_t& key, const char* data, uint32_t size) {
+		BOOST_CHECK(std::vector<char>(data, data + size) == value_for(key.objectid));
+		seen.push_back(key.objectid);
+		return true;
+	});
+	BOOST_REQUIRE_EQUAL(seen.size(), 100);
+	for (size_t i = 0; i < seen.size(); ++i)
+		BOOST_CHECK_EQUAL(seen[i], 102 + 3 * i);
+
+	size_t count = 0;
+	t.tree.scan(make_key(0, 0, 0), make_key(~0ULL, 0xff, ~0ULL), [&count](const fs_key_t&, const char*, uint32_t) {
+		return ++count < 10;
+	});
+	BOOST_CHECK_EQUAL(count, 10);
+}
+
+BOOST_AUTO_TEST_CASE(btree_bulk_load)
+{
+	small_tree_t t;
+	std::mt19937 rng(3);
+	std::uniform_int_distribution<size_t> sizes(0, 40);
+	std::vector<size_t> item_size(20000);
+
+	// Small memory limit forces the sorter to merge several runs.
+	external_sorter_t sorter(64 * 1024);
+	std::vector<uint64_t> ids;
+	for (uint64_t id = 0; id < item_size.size(); ++id)
+		ids.push_back(id);
+	std::shuffle(ids.begin(), ids.end(), rng);
+	for (auto id : ids)
+	{
+		item_size[id] = sizes(rng);
+		std::vector<char> value = value_for(id, item_size[id]);
+		sorter.add(make_key(id, 1, id * 4096), value.data(), value.size());
+	}
+	BOOST_CHECK_GT(sorter.runs(), 1);
+
+	btree_builder_t builder(t.cache, t.dev, t.allocator, BLOCK_SIZE, FSID, 1, 5);
+	sorter.merge([&builder](const fs_key_t& key, const char* data, uint32_t size) {
+		builder.add(key, data, size);
+	});
+	fs_location_t root = builder.finish();
+	BOOST_CHECK_EQUAL(builder.items(), item_size.size());
+	BOOST_CHECK_GT(builder.root_level(), 1);
+	// Written once: every block allocated after the superblock and the empty root of t.tree is a bulk loaded block.
+	BOOST_CHECK_EQUAL(t.allocator.high_water(), (2 + builder.blocks_written()) * BLOCK_SIZE);
+
+	btree_t tree(t.cache, t.dev, t.allocator, BLOCK_SIZE, FSID, 1);
+	tree.open(root, builder.generation());
+	BOOST_CHECK_EQUAL(tree.verify(), item_size.size());
+	for (uint64_t id = 0; id < item_size.size(); ++id)
+		BOOST_CHECK(check_value(tree, id, item_size[id]));
+
+	// The bulk loaded tree is a regular tree, modifications shadow its full blocks.
+	for (uint64_t id = 0; id < item_size.size(); id += 10)
+		BOOST_REQUIRE(tree.remove(make_key(id, 1, id * 4096)));
+	for (uint64_t id = item_size.size(); id < item_size.size() + 500; ++id)
+		BOOST_REQUIRE(insert_value(tree, id));
+	tree.commit();
+	BOOST_CHECK_EQUAL(tree.verify(), item_size.size() - item_size.size() / 10 + 500);
+}
+
+BOOST_AUTO_TEST_CASE(btree_bulk_load_small)
+{
+	small_tree_t t;
+	btree_builder_t empty(t.cache, t.dev, t.allocator, BLOCK_SIZE, FSID, 1, 1);
+	fs_location_t root = empty.finish();
+	BOOST_CHECK_EQUAL(empty.root_level(), 0);
+
+	btree_t tree(t.cache, t.dev, t.allocator, BLOCK_SIZE, FSID, 1);
+	tree.open(root, 1);
+	BOOST_CHECK_EQUAL(tree.verify(), 0);
+
+	btree_builder_t builder(t.cache, t.dev, t.allocator, BLOCK_SIZE, FSID, 1, 1, 75);
+	std::vector<char> value = value_for(5);
+	builder.add(make_key(5, 1, 0), value.data(), value.size());
+	BOOST_CHECK_THROW(builder.add(make_key(5, 1, 0), value.data(), value.size()), std::runtime_error);
+	BOOST_CHECK_THROW(builder.add(make_key(4, 1, 0), value.data(), value.size()), std::runtime_error);
+	tree.open(builder.finish(), 1);
+	BOOST_CHECK_EQUAL(tree.verify(), 1);
+}
+
+BOOST_AUTO_TEST_CASE(btree_external_sort_is_stable)
+{
+	external_sorter_t sorter(256);
+	for (uint8_t i = 0; i < 100; ++i)
+		sorter.add(make_key(i % 3, 0, 0), &i, 1);
+
+	std::vector<std::pair<uint64_t, uint8_t>> out;
+	sorter.merge([&out](const fs_key_t& key, const char* data, uint32_t size) {
+		BOOST_REQUIRE_EQUAL(size, 1);
+		out.push_back(std::make_pair(key.objectid, uint8_t(*data)));
+	});
+	BOOST_REQUIRE_EQUAL(out.size(), 100);
+	for (size_t i = 1; i < out.size(); ++i)
+		BOOST_CHECK(out[i - 1] < out[i]);
+	BOOST_CHECK_EQUAL(sorter.runs(), 0);
+}
+
+BOOST_AUTO_TEST_SUITE_END()
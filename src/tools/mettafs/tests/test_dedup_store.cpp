@@ -0,0 +1,230 @@
+//
+// Part of Metta OS. Check https://atta-metta.net for latest version.
+//
+// Copyright 2007 - 2017, Stanislav Karchebnyy <berkus@atta-metta.net>
+//
+// Distributed under the Boost Software License, Version 1.0.
+// (See file LICENSE_1_0.txt or a copy at http://www.boost.org/LICENSE_1_0.txt)
+//
+/**
+ * @brief Test dedup_store_t functionality.
+ */
+
+/*============================================================================*/
+
+#include <cstring>
+#include <random>
+#include <set>
+#include <sstream>
+#include <stdexcept>
+#include <string>
+#include <vector>
+#include "dedup_store.h"
+#include "test_image.h"
+
+#define BOOST_TEST_DYN_LINK
+#include <boost/test/unit_test.hpp>
+
+static const size_t BLOCK_SIZE = 4096;
+static const uint8_t FSID[btree_header_common_t::FS_UUID_SIZE] = { 'd', 'e', 'd', 'u', 'p' };
+
+/**
+ * Image with an empty dedup index tree.
+ */
+struct test_store_t : mounted_image_t
+{
+	btree_t index;
+
+	test_store_t()
+		: mounted_image_t("test_dedup_store.img", BLOCK_SIZE, 16384)
+		, index(cache, dev, allocator, BLOCK_SIZE, FSID, DEDUP_TREE_OBJECTID)
+	{
+		index.create(1);
+	}
+};
+
+static std::string random_data(std::mt19937& rng, size_t size)
+{
+	std::string data(size, 0);
+	for (auto& c : data)
+		c = rng();
+	return data;
+}
+
+static std::vector<dedup_extent_t> store_stream(dedup_store_t& store, const std::string& data, bool content_defined)
+{
+	std::vector<dedup_extent_t> extents;
+	std::istringstream in(data);
+	BOOST_CHECK_EQUAL(store.write_stream(in, content_defined, [&extents](const dedup_extent_t& extent) {
+		extents.push_back(extent);
+	}), data.size());
+	return extents;
+}
+
+static std::string load_stream(dedup_store_t& store, const std::vector<dedup_extent_t>& extents)
+{
+	std::string data;
+	std::vector<char> chunk;
+	for (auto& extent : extents)
+	{
+		chunk.resize(extent.length);
+		BOOST_REQUIRE(store.read(extent, chunk.data()));
+		data.append(chunk.begin(), chunk.end());
+	}
+	return data;
+}
+
+BOOST_AUTO_TEST_SUITE( mettafs )
+
+BOOST_AUTO_TEST_CASE(bloom_filter_false_positives)
+{
+	std::mt19937_64 rng(1);
+	bloom_filter_t filter(10000);
+	std::vector<uint64_t> added;
+	for (int i = 0; i < 10000; ++i)
+	{
+		uint64_t hash[2] = { rng(), rng() };
+		filter.add(reinterpret_cast<uint8_t*>(hash));
+		added.push_back(hash[0]);
+		added.push_back(hash[1]);
+	}
+	for (size_t i = 0; i < added.size(); i += 2)
+		BOOST_CHECK(filter.may_contain(reinterpret_cast<uint8_t*>(&added[i])));
+
+	size_t positives = 0;
+	for (int i = 0; i < 100000; ++i)
+	{
+		uint64_t hash[2] = { rng(), rng() };
+		positives += filter.may_contain(reinterpret_cast<uint8_t*>(hash));
+	}
+	BOOST_CHECK_LT(positives, 2000);
+
+	filter.clear();
+	BOOST_CHECK(!filter.may_contain(reinterpret_cast<uint8_t*>(&added[0])));
+}
+
+BOOST_FIXTURE_TEST_CASE(dedup_store_duplicate_chunks, test_store_t)
+{
+	dedup_store_t store(cache, dev, allocator, index, BLOCK_SIZE, 1000);
+	std::mt19937 rng(2);
+	std::string a = random_data(rng, 10000), b = random_data(rng, 100);
+
+	dedup_extent_t ea = store.write(a.data(), a.size());
+	dedup_extent_t eb = store.write(b.data(), b.size());
+	fs_location_t used = allocator.high_water();
+	dedup_extent_t ea2 = store.write(a.data(), a.size());
+
+	BOOST_CHECK_EQUAL(ea2.location, ea.location);
+	BOOST_CHECK_NE(eb.location, ea.location);
+	BOOST_CHECK_EQUAL(allocator.high_water(), used);
+	BOOST_CHECK_EQUAL(store.statistics().chunks, 3);
+	BOOST_CHECK_EQUAL(store.statistics().duplicates, 1);
+	BOOST_CHECK_EQUAL(store.statistics().filter_negatives, 2);
+	BOOST_CHECK_EQUAL(store.statistics().bytes_written, a.size() + b.size());
+	BOOST_CHECK_EQUAL(store.statistics().bytes_deduplicated, a.size());
+
+	std::vector<char> data(a.size());
+	BOOST_REQUIRE(store.read(ea2, data.data()));
+	BOOST_CHECK(std::string(data.begin(), data.end()) == a);
+
+	// Corrupt data fails the digest check.
+	std::vector<char> block(BLOCK_SIZE);
+	cache.cached_read(dev, eb.location / BLOCK_SIZE, block.data(), 1, BLOCK_SIZE);
+	block[10] ^= 1;
+	cache.cached_write(dev, eb.location / BLOCK_SIZE, block.data(), 1, BLOCK_SIZE);
+	BOOST_CHECK(!store.read(eb, data.data()));
+}
+
+BOOST_FIXTURE_TEST_CASE(dedup_store_release, test_store_t)
+{
+	dedup_store_t store(cache, dev, allocator, index, BLOCK_SIZE, 1000);
+	std::mt19937 rng(3);
+	std::string a = random_data(rng, 3 * BLOCK_SIZE);
+
+	dedup_extent_t e1 = store.write(a.data(), a.size());
+	dedup_extent_t e2 = store.write(a.data(), a.size());
+	BOOST_CHECK(store.release(e1));
+	std::vector<char> data(a.size());
+	BOOST_CHECK(store.read(e2, data.data()));
+
+	// Last reference frees the blocks, which get reused once the index transaction has committed.
+	BOOST_CHECK(store.release(e2));
+	BOOST_CHECK(!store.release(e2));
+	std::set<fs_location_t> chunk_blocks{ e1.location, e1.location + BLOCK_SIZE, e1.location + 2 * BLOCK_SIZE };
+	BOOST_CHECK_EQUAL(chunk_blocks.count(allocator.allocate()), 0);
+	store.commit();
+	std::set<fs_location_t> freed;
+	for (int i = 0; i < 3; ++i)
+		freed.insert(allocator.allocate());
+	BOOST_CHECK(freed == chunk_blocks);
+
+	// Writing it again passes the filter, which does not forget, but misses the index.
+	store.write(a.data(), a.size());
+	BOOST_CHECK_EQUAL(store.statistics().filter_false_positives, 1);
+	BOOST_CHECK_EQUAL(store.statistics().duplicates, 1);
+}
+
+BOOST_FIXTURE_TEST_CASE(dedup_store_content_defined_chunks, test_store_t)
+{
+	dedup_store_t store(cache, dev, allocator, index, BLOCK_SIZE, 10000);
+	std::mt19937 rng(4);
+	std::string original = random_data(rng, 2 * 1024 * 1024);
+
+	std::vector<dedup_extent_t> first = store_stream(store, original, true);
+	BOOST_CHECK(load_stream(store, first) == original);
+	for (size_t i = 0; i + 1 < first.size(); ++i)
+	{
+		BOOST_CHECK_GE(first[i].length, content_chunker_t::MIN_CHUNK);
+		BOOST_CHECK_LE(first[i].length, content_chunker_t::MAX_CHUNK);
+	}
+	size_t average = original.size() / first.size();
+	BOOST_CHECK_GT(average, content_chunker_t::AVG_CHUNK / 2);
+	BOOST_CHECK_LT(average, content_chunker_t::AVG_CHUNK * 2);
+
+	// A few bytes inserted near the start only change the chunks around them.
+	std::string edited = original;
+	edited.insert(100000, "inserted");
+	uint64_t written = store.statistics().bytes_written;
+	std::vector<dedup_extent_t> second = store_stream(store, edited, true);
+	BOOST_CHECK(load_stream(store, second) == edited);
+	BOOST_CHECK_LT(store.statistics().bytes_written - written, 4 * content_chunker_t::MAX_CHUNK);
+
+	// Fixed size chunks all shift and nothing is shared after the insertion point.
+	written = store.statistics().bytes_written;
+	std::vector<dedup_extent_t> fixed = store_stream(store, original, false);
+	BOOST_CHECK_EQUAL(fixed.size(), original.size() / BLOCK_SIZE);
+	store_stream(store, edited, false);
+	BOOST_CHECK_GT(store.statistics().bytes_written - written, original.size() + original.size() / 2);
+}
+
+BOOST_FIXTURE_TEST_CASE(dedup_store_reopen, test_store_t)
+{
+	std::mt19937 rng(5);
+	std::vector<std::string> chunks;
+	std::vector<dedup_extent_t> extents;
+	{
+		dedup_store_t store(cache, dev, allocator, index, BLOCK_SIZE, 1000);
+		for (int i = 0; i < 300; ++i)
+		{
+			chunks.push_back(random_data(rng, 1000 + i));
+			extents.push_back(store.write(chunks.back().data(), chunks.back().size()));
+		}
+	}
+	fs_location_t root = index.commit();
+
+	btree_t reopened(cache, dev, allocator, BLOCK_SIZE, FSID, DEDUP_TREE_OBJECTID);
+	reopened.open(root, index.generation());
+	dedup_store_t store(cache, dev, allocator, reopened, BLOCK_SIZE, 1000);
+
+	// Without the filter loaded a stored chunk looks new, the index refuses it and the stored copy stays intact.
+	BOOST_CHECK_THROW(store.write(chunks[0].data(), chunks[0].size()), std::runtime_error);
+	std::vector<char> data(chunks[0].size());
+	BOOST_CHECK(store.read(extents[0], data.data()));
+
+	store.load_filter();
+	for (size_t i = 0; i < chunks.size(); ++i)
+		BOOST_CHECK_EQUAL(store.write(chunks[i].data(), chunks[i].size()).location, extents[i].location);
+	BOOST_CHECK_EQUAL(store.statistics().duplicates, chunks.size());
+}
+
+BOOST_AUTO_TEST_SUITE_END()
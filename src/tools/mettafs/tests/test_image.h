@@ -0,0 +1,71 @@
+//
+// Part of Metta OS. Check https://atta-metta.net for latest version.
+//
+// Copyright 2007 - 2017, Stanislav Karchebnyy <berkus@atta-metta.net>
+//
+// Distributed under the Boost Software License, Version 1.0.
+// (See file LICENSE_1_0.txt or a copy at http://www.boost.org/LICENSE_1_0.txt)
+//
+/**
+ * @brief Image and tree fixtures shared by the mettafs tests.
+ */
+#pragma once
+
+#include <unistd.h>
+#include "block_device.h"
+#include "block_device_mapper.h"
+#include "block_cache.h"
+#include "btree.h"
+
+/**
+ * Empty image file mounted through its own cache, with an allocator handing out all of it but the first block.
+ * The file is removed again on destruction.
+ */
+struct mounted_image_t
+{
+	const char* name;
+	block_cache_t cache;
+	block_device_t device;
+	block_device_mapper_t mapper;
+	deviceno_t dev;
+	range_block_allocator_t allocator;
+
+	mounted_image_t(const char* file_name, size_t block_size, size_t image_blocks, size_t cache_blocks = 256)
+		: name(file_name)
+		, cache(cache_blocks)
+		, device(name, true, block_size)
+		, dev(mount())
+		, allocator(block_size, image_blocks * block_size, block_size)
+	{
+	}
+
+	~mounted_image_t()
+	{
+		mapper.unmap_device(dev);
+		unlink(name);
+	}
+
+	deviceno_t mount()
+	{
+		cache.set_device_mapper(mapper);
+		mapper.set_cache(cache);
+		mapper.map_device(device, name);
+		return mapper.resolve_device(name);
+	}
+};
+
+/**
+ * Mounted image holding a new empty tree of the given owner.
+ */
+struct test_tree_t : mounted_image_t
+{
+	btree_t tree;
+
+	test_tree_t(const char* file_name, size_t block_size, size_t image_blocks,
+		const uint8_t fsid[btree_header_common_t::FS_UUID_SIZE], uint64_t owner, size_t cache_blocks = 256)
+		: mounted_image_t(file_name, block_size, image_blocks, cache_blocks)
+		, tree(cache, dev, allocator, block_size, fsid, owner)
+	{
+		tree.create(1);
+	}
+};
@@ -0,0 +1,222 @@
+//
+// Part of Metta OS. Check https://atta-metta.net for latest version.
+//
+// Copyright 2007 - 2017, Stanislav Karchebnyy <berkus@atta-metta.net>
+//
+// Distributed under the Boost Software License, Version 1.0.
+// (See file LICENSE_1_0.txt or a copy at http://www.boost.org/LICENSE_1_0.txt)
+//
+/**
+ * @brief Test posting_list_t functionality.
+ */
+
+/*============================================================================*/
+
+#include <algorithm>
+#include <iterator>
+#include <random>
+#include <set>
+#include <stdexcept>
+#include <vector>
+#include "btree_builder.h"
+#include "posting_list.h"
+#include "test_image.h"
+
+#define BOOST_TEST_DYN_LINK
+#include <boost/test/unit_test.hpp>
+
+/**
+ * Random set of count objids below range, with its posting list.
+ */
+struct test_set_t
+{
+	std::set<uint64_t> values;
+	posting_list_t list;
+
+	test_set_t(std::mt19937& rng, size_t count, uint64_t range, uint64_t base = 0)
+	{
+		std::uniform_int_distribution<uint64_t> dist(base, base + range - 1);
+		while (values.size() < count)
+			values.insert(dist(rng));
+		for (auto v : values)
+			list.add(v);
+	}
+};
+
+static std::vector<uint64_t> as_vector(const std::set<uint64_t>& s)
+{
+	return std::vector<uint64_t>(s.begin(), s.end());
+}
+
+BOOST_AUTO_TEST_SUITE( mettafs )
+
+BOOST_AUTO_TEST_CASE(posting_list_add_remove)
+{
+	posting_list_t list;
+	BOOST_CHECK(list.empty());
+
+	// Enough objids in one container to turn it into a bitmap, and back into an array on removal.
+	for (uint64_t id = 8192 + 1000; id > 8192; id -= 2)
+		list.add(id);
+	list.add(5);
+	list.add(5);
+	BOOST_CHECK_EQUAL(list.size(), 501);
+	BOOST_REQUIRE_EQUAL(list.get_containers().size(), 2);
+	BOOST_CHECK(!list.get_containers()[0].is_bitmap());
+	BOOST_CHECK(list.get_containers()[1].is_bitmap());
+	BOOST_CHECK(list.contains(5));
+	BOOST_CHECK(list.contains(9192));
+	BOOST_CHECK(!list.contains(9191));
+
+	for (uint64_t id = 8192 + 1000; id > 8192 + 400; id -= 2)
+		BOOST_CHECK(list.remove(id));
+	BOOST_CHECK(!list.remove(9192));
+	BOOST_CHECK(!list.get_containers()[1].is_bitmap());
+	BOOST_CHECK(list.remove(5));
+	BOOST_CHECK_EQUAL(list.get_containers().size(), 1);
+
+	std::vector<uint64_t> values = list.to_vector();
+	BOOST_REQUIRE_EQUAL(values.size(), 200);
+	for (size_t i = 0; i < values.size(); ++i)
+		BOOST_CHECK_EQUAL(values[i], 8194 + 2 * i);
+}
+
+BOOST_AUTO_TEST_CASE(posting_list_intersect_arrays)
+{
+	std::mt19937 rng(1);
+	const size_t sizes[] = { 0, 1, 7, 8, 9, 50, 200, 1000, 4000 };
+	for (auto na : sizes)
+		for (auto nb : sizes)
+		{
+			std::vector<uint16_t> a, b;
+			std::uniform_int_distribution<uint16_t> dist(0, 4095);
+			std::set<uint16_t> sa, sb;
+			while (sa.size() < na)
+				sa.insert(dist(rng));
+			while (sb.size() < nb)
+				sb.insert(dist(rng));
+			a.assign(sa.begin(), sa.end());
+			b.assign(sb.begin(), sb.end());
+
+			std::vector<uint16_t> expected, out(std::min(na, nb));
+			std::set_intersection(a.begin(), a.end(), b.begin(), b.end(), std::back_inserter(expected));
+			out.resize(intersect_arrays(a.data(), a.size(), b.data(), b.size(), out.data()));
+			BOOST_CHECK(out == expected);
+		}
+}
+
+BOOST_AUTO_TEST_CASE(posting_list_set_operations)
+{
+	std::mt19937 rng(2);
+	// Sparse, medium and dense lists over the same range exercise all container combinations.
+	test_set_t sparse(rng, 300, 1 << 20), medium(rng, 20000, 1 << 20), dense(rng, 200000, 1 << 20);
+	test_set_t* sets[] = { &sparse, &medium, &dense };
+
+	for (auto a : sets)
+		for (auto b : sets)
+		{
+			std::vector<uint64_t> expected;
+			std::set_intersection(a->values.begin(), a->values.end(), b->values.begin(), b->values.end(), std::back_inserter(expected));
+			BOOST_CHECK(posting_list_t::intersect(a->list, b->list).to_vector() == expected);
+
+			expected.clear();
+			std::set_union(a->values.begin(), a->values.end(), b->values.begin(), b->values.end(), std::back_inserter(expected));
+			BOOST_CHECK(posting_list_t::unite(a->list, b->list).to_vector() == expected);
+		}
+
+	std::set<uint64_t> all3;
+	for (auto v : sparse.values)
+		if (medium.values.count(v) && dense.values.count(v))
+			all3.insert(v);
+	BOOST_CHECK(posting_list_t::intersect({ &dense.list, &sparse.list, &medium.list }).to_vector() == as_vector(all3));
+
+	std::set<uint64_t> any3(sparse.values);
+	any3.insert(medium.values.begin(), medium.values.end());
+	any3.insert(dense.values.begin(), dense.values.end());
+	BOOST_CHECK(posting_list_t::unite({ &dense.list, &sparse.list, &medium.list }).to_vector() == as_vector(any3));
+
+	// Disjoint ranges skip every container.
+	test_set_t far(rng, 1000, 1 << 16, 1ULL << 40);
+	BOOST_CHECK(posting_list_t::intersect({ &far.list, &dense.list }).empty());
+	BOOST_CHECK(posting_list_t::intersect(std::vector<const posting_list_t*>()).empty());
+}
+
+BOOST_AUTO_TEST_CASE(posting_list_encode_decode)
+{
+	std::mt19937 rng(3);
+	test_set_t sparse(rng, 100, 1 << 16), dense(rng, 30000, 1 << 16);
+	posting_list_t consecutive;
+	for (uint64_t id = 4096; id < 4096 + 300; ++id)
+		consecutive.add(id);
+
+	for (auto list : { &sparse.list, &dense.list, &consecutive })
+		for (auto& c : list->get_containers())
+		{
+			std::vector<char> data;
+			posting_list_t::encode(c, data);
+			BOOST_CHECK_LE(data.size(), 4 + posting_list_t::BITMAP_WORDS * 8);
+
+			posting_list_t::container_t d;
+			BOOST_REQUIRE(posting_list_t::decode(c.high, data.data(), data.size(), d));
+			BOOST_CHECK_EQUAL(d.cardinality, c.cardinality);
+			BOOST_CHECK(d.array == c.array);
+			BOOST_CHECK(d.bitmap == c.bitmap);
+
+			BOOST_CHECK(!posting_list_t::decode(c.high, data.data(), data.size() - 1, d));
+		}
+
+	// Runs of consecutive objids need no delta bits.
+	std::vector<char> data;
+	posting_list_t::encode(consecutive.get_containers()[0], data);
+	BOOST_CHECK_EQUAL(data.size(), 4);
+}
+
+BOOST_AUTO_TEST_CASE(posting_list_tags_tree)
+{
+	static const size_t BLOCK_SIZE = 4096;
+	static const uint8_t FSID[btree_header_common_t::FS_UUID_SIZE] = { 't', 'a', 'g', 's' };
+
+	mounted_image_t image("test_posting_list.img", BLOCK_SIZE, 4096);
+	block_cache_t& cache = image.cache;
+	deviceno_t dev = image.dev;
+	range_block_allocator_t& allocator = image.allocator;
+
+	std::mt19937 rng(4);
+	test_set_t red(rng, 50000, 1 << 20), blue(rng, 500, 1 << 20);
+	uint64_t red_tag = 2, blue_tag = 1;
+
+	// Bulk load both lists, tags in key order.
+	btree_builder_t builder(cache, dev, allocator, BLOCK_SIZE, FSID, TAGS_TREE_OBJECTID, 1);
+	posting_list_builder_t lists([&builder](const fs_key_t& key, const char* data, uint32_t size) {
+		builder.add(key, data, size);
+	});
+	std::pair<uint64_t, test_set_t*> tags[] = { { red_tag, &red }, { blue_tag, &blue } };
+	std::sort(std::begin(tags), std::end(tags));
+	for (auto& tag : tags)
+		for (auto v : tag.second->values)
+			lists.add(tag.first, v);
+	lists.finish();
+
+	btree_t tree(cache, dev, allocator, BLOCK_SIZE, FSID, TAGS_TREE_OBJECTID);
+	tree.open(builder.finish(), builder.generation());
+
+	posting_list_t loaded_red, loaded_blue, none;
+	BOOST_REQUIRE(load_posting_list(tree, red_tag, loaded_red));
+	BOOST_REQUIRE(load_posting_list(tree, blue_tag, loaded_blue));
+	BOOST_CHECK(!load_posting_list(tree, 3, none));
+	BOOST_CHECK(loaded_red.to_vector() == as_vector(red.values));
+	BOOST_CHECK(loaded_blue.to_vector() == as_vector(blue.values));
+
+	// Rewrite a list in place, the other one stays.
+	loaded_blue.add(7);
+	loaded_blue.remove(*blue.values.begin());
+	store_posting_list(tree, blue_tag, loaded_blue);
+	tree.commit();
+	posting_list_t reloaded;
+	BOOST_REQUIRE(load_posting_list(tree, blue_tag, reloaded));
+	BOOST_CHECK(reloaded.to_vector() == loaded_blue.to_vector());
+	BOOST_REQUIRE(load_posting_list(tree, red_tag, reloaded));
+	BOOST_CHECK_EQUAL(reloaded.size(), red.values.size());
+}
+
+BOOST_AUTO_TEST_SUITE_END()
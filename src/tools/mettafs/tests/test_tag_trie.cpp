@@ -0,0 +1,157 @@
+//
+// Part of Metta OS. Check https://atta-metta.net for latest version.
+//
+// Copyright 2007 - 2017, Stanislav Karchebnyy <berkus@atta-metta.net>
+//
+// Distributed under the Boost Software License, Version 1.0.
+// (See file LICENSE_1_0.txt or a copy at http://www.boost.org/LICENSE_1_0.txt)
+//
+/**
+ * @brief Test tag_trie_t functionality.
+ */
+
+/*============================================================================*/
+
+#include <map>
+#include <random>
+#include <stdexcept>
+#include <string>
+#include <vector>
+#include "tag_trie.h"
+#include "test_image.h"
+
+#define BOOST_TEST_DYN_LINK
+#include <boost/test/unit_test.hpp>
+
+typedef std::vector<std::pair<std::string, uint64_t>> tag_list_t;
+
+static tag_list_t collect(tag_trie_t& trie, const std::string& prefix)
+{
+	tag_list_t tags;
+	trie.for_each_prefix(prefix, [&tags](const std::string& tag, uint64_t id) {
+		tags.push_back(std::make_pair(tag, id));
+		return true;
+	});
+	return tags;
+}
+
+static tag_list_t expected_prefix(const std::map<std::string, uint64_t>& tags, const std::string& prefix)
+{
+	tag_list_t out;
+	for (auto it = tags.lower_bound(prefix); it != tags.end() && it->first.compare(0, prefix.size(), prefix) == 0; ++it)
+		out.push_back(*it);
+	return out;
+}
+
+/**
+ * Hierarchical tag names like project.3.module.17 with shared prefixes.
+ */
+static std::map<std::string, uint64_t> make_tags(tag_trie_t& trie, size_t count)
+{
+	std::mt19937 rng(1);
+	const char* roots[] = { "project", "person", "place", "media.photo", "media.music", "year" };
+	std::map<std::string, uint64_t> tags;
+	while (tags.size() < count)
+	{
+		std::string tag = roots[rng() % 6];
+		for (int depth = rng() % 3 + 1; depth > 0; --depth)
+			tag += "." + std::to_string(rng() % 20);
+		tags[tag] = trie.insert(tag);
+	}
+	return tags;
+}
+
+BOOST_AUTO_TEST_SUITE( mettafs )
+
+BOOST_AUTO_TEST_CASE(tag_trie_insert_lookup)
+{
+	tag_trie_t trie;
+	BOOST_CHECK_EQUAL(trie.insert("project.metta.fs"), 1);
+	BOOST_CHECK_EQUAL(trie.insert("project.metta.kernel"), 2);
+	BOOST_CHECK_EQUAL(trie.insert("project"), 3);
+	BOOST_CHECK_EQUAL(trie.insert("project.metta.fs"), 1);
+	BOOST_CHECK_EQUAL(trie.insert("p"), 4);
+	BOOST_CHECK_EQUAL(trie.size(), 4);
+	BOOST_CHECK_EQUAL(trie.next_id(), 5);
+
+	uint64_t id = 0;
+	BOOST_CHECK(trie.lookup("project.metta.kernel", id));
+	BOOST_CHECK_EQUAL(id, 2);
+	BOOST_CHECK(trie.lookup("project", id));
+	BOOST_CHECK_EQUAL(id, 3);
+	BOOST_CHECK(!trie.lookup("project.metta", id));
+	BOOST_CHECK(!trie.lookup("project.metta.fsx", id));
+	BOOST_CHECK(!trie.lookup("proj", id));
+	BOOST_CHECK(!trie.lookup("", id));
+
+	BOOST_CHECK_THROW(trie.insert(""), std::runtime_error);
+	BOOST_CHECK_THROW(trie.insert(std::string(tag_trie_t::MAX_TAG_LENGTH + 1, 'x')), std::runtime_error);
+	BOOST_CHECK_EQUAL(trie.insert(std::string(tag_trie_t::MAX_TAG_LENGTH, 'x')), 5);
+}
+
+BOOST_AUTO_TEST_CASE(tag_trie_prefix_iteration)
+{
+	tag_trie_t trie;
+	std::map<std::string, uint64_t> tags = make_tags(trie, 2000);
+	BOOST_CHECK_EQUAL(trie.size(), tags.size());
+
+	// Whole dictionary comes out in lexicographic order.
+	BOOST_CHECK(collect(trie, "") == tag_list_t(tags.begin(), tags.end()));
+
+	// Prefixes ending at nodes, inside edge labels and matching nothing.
+	for (auto prefix : { "project.", "project.1", "project.1.", "media.", "media.m", "pe", "year.19.3", "z", "project.1.2.3.4" })
+		BOOST_CHECK(collect(trie, prefix) == expected_prefix(tags, prefix));
+
+	size_t count = 0;
+	trie.for_each([&count](const std::string&, uint64_t) { return ++count < 5; });
+	BOOST_CHECK_EQUAL(count, 5);
+}
+
+BOOST_AUTO_TEST_CASE(tag_trie_store_and_open)
+{
+	static const size_t BLOCK_SIZE = 4096;
+	static const uint8_t FSID[btree_header_common_t::FS_UUID_SIZE] = { 't', 'r', 'i', 'e' };
+
+	mounted_image_t image("test_tag_trie.img", BLOCK_SIZE, 4096);
+	block_cache_t& cache = image.cache;
+	deviceno_t dev = image.dev;
+	range_block_allocator_t& allocator = image.allocator;
+
+	tag_trie_t trie;
+	std::map<std::string, uint64_t> tags = make_tags(trie, 5000);
+	fs_location_t root = trie.store(cache, dev, allocator, BLOCK_SIZE, FSID, 7);
+
+	{
+		// Lookups and prefix queries read only the nodes on their path.
+		tag_trie_t opened;
+		opened.open(cache, dev, BLOCK_SIZE, root, 7);
+		BOOST_CHECK_EQUAL(opened.size(), tags.size());
+		uint64_t id;
+		BOOST_CHECK(opened.lookup("media.photo.3", id) == tags.count("media.photo.3"));
+		BOOST_CHECK_LT(opened.nodes_loaded(), 10);
+
+		BOOST_CHECK(collect(opened, "person.4.") == expected_prefix(tags, "person.4."));
+		BOOST_CHECK_LT(opened.nodes_loaded(), tags.size() / 10);
+
+		BOOST_CHECK(collect(opened, "") == tag_list_t(tags.begin(), tags.end()));
+	}
+
+	// New tags continue the id sequence, storing again writes a new copy.
+	tag_trie_t opened;
+	opened.open(cache, dev, BLOCK_SIZE, root, 7);
+	uint64_t id = opened.insert("project.new");
+	BOOST_CHECK_EQUAL(id, tags.size() + 1);
+	tags["project.new"] = id;
+	fs_location_t new_root = opened.store(cache, dev, allocator, BLOCK_SIZE, FSID, 8);
+
+	tag_trie_t reopened;
+	reopened.open(cache, dev, BLOCK_SIZE, new_root, 8);
+	BOOST_CHECK(collect(reopened, "") == tag_list_t(tags.begin(), tags.end()));
+	BOOST_CHECK_EQUAL(reopened.next_id(), tags.size() + 1);
+
+	// Stale generation is refused.
+	tag_trie_t stale;
+	BOOST_CHECK_THROW(stale.open(cache, dev, BLOCK_SIZE, new_root, 7), std::runtime_error);
+}
+
+BOOST_AUTO_TEST_SUITE_END()
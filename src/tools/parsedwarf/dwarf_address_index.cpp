@@ -0,0 +1,299 @@
+//
+// Part of Metta OS. Check https://atta-metta.net for latest version.
+//
+// Copyright 2010 - 2017, Stanislav Karchebnyy <berkus@atta-metta.net>
+//
+// Distributed under the Boost Software License, Version 1.0.
+// (See file LICENSE_1_0.txt or a copy at http://www.boost.org/LICENSE_1_0.txt)
+//
+#include "dwarf_address_index.h"
+#include "dwarf_abbrev.h"
+#include "dwarf_lines.h"
+#include "dwarf_info.h"
+#include "datarepr.h"
+#include "form_reader.h"
+#include "dwarf_debug.h"
+#include <algorithm>
+#include <cstring>
+#include <atomic>
+#include <memory>
+#include <thread>
+
+namespace {
+
+struct function_range_t
+{
+    address_t low;
+    address_t high;
+    uint32_t  name; // unit local string index
+
+    bool operator < (const function_range_t& other) const { return low < other.low; }
+};
+
+/**
+ * Unit local string table, merged into the index string table afterwards.
+ */
+class unit_strings_t
+{
+    std::vector<std::string>& strings;
+    std::unordered_map<std::string, uint32_t> ids;
+
+public:
+    unit_strings_t(std::vector<std::string>& s) : strings(s)
+    {
+        strings.push_back(std::string());
+        ids[std::string()] = 0;
+    }
+
+    uint32_t intern(const std::string& str)
+    {
+        auto it = ids.find(str);
+        if (it != ids.end())
+            return it->second;
+        strings.push_back(str);
+        return ids[str] = strings.size() - 1;
+    }
+};
+
+/**
+ * Address range of a subprogram DIE, both DWARF2 (high_pc is an address)
+ * and DWARF4 (high_pc is an offset from low_pc) styles.
+ */
+bool subprogram_range(die_t* node, address_t& low, address_t& high)
+{
+    auto lo = dynamic_cast<addr_form_reader_t*>(node->node_attributes[DW_AT_low_pc]);
+    if (!lo)
+        return false;
+    low = lo->data;
+
+    form_reader_t* hi = node->node_attributes[DW_AT_high_pc];
+    if (auto a = dynamic_cast<addr_form_reader_t*>(hi))
+        high = a->data;
+    else if (auto d = dynamic_cast<data4_form_reader_t*>(hi))
+        high = low + d->data;
+    else if (auto d = dynamic_cast<data2_form_reader_t*>(hi))
+        high = low + d->data;
+    else if (auto d = dynamic_cast<data1_form_reader_t*>(hi))
+        high = low + d->data;
+    else
+        return false;
+
+    return low < high;
+}
+
+void collect_functions(dwarf_parser_t& dwarf, die_t* node, size_t cuh_offset, unit_strings_t& strings, std::vector<function_range_t>& out)
+{
+    function_range_t f;
+    if (node->is_subprogram() && subprogram_range(node, f.low, f.high))
+    {
+        die_t* named = dwarf.find_named_node(node, cuh_offset);
+        const char* name = named ? named->string_attr(DW_AT_name) : 0;
+        f.name = name ? strings.intern(name) : 0;
+        out.push_back(f);
+    }
+
+    for (size_t i = 0; i < node->children.size(); ++i)
+        collect_functions(dwarf, node->children[i], cuh_offset, strings, out);
+}
+
+} // anonymous namespace
+
+dwarf_address_index_t::dwarf_address_index_t()
+{
+    intern(std::string());
+}
+
+uint32_t dwarf_address_index_t::intern(const std::string& str)
+{
+    auto it = string_ids.find(str);
+    if (it != string_ids.end())
+        return it->second;
+    strings.push_back(str);
+    return string_ids[str] = strings.size() - 1;
+}
+
+/**
+ * Turn line table rows of one compilation unit into address ranges, attributing each
+ * to the subprogram whose range contains its start address.
+ */
+void dwarf_address_index_t::index_unit(dwarf_parser_t& dwarf, size_t cuh_offset, unit_t& unit)
+{
+    unit_strings_t strings(unit.strings);
+    size_t offset = cuh_offset;
+    cuh_t cuh = dwarf.debug_info->get_cuh(offset);
+
+    size_t abbr_offset = cuh.debug_abbrev_offset;
+    dwarf.debug_abbrev->load_abbrev_set(abbr_offset);
+
+    die_t* root = dwarf.build_tree(offset);
+    if (!root)
+        return;
+    dwarf.root = root; // find_named_node() resolves references against the current tree
+
+    std::vector<function_range_t> functions;
+    collect_functions(dwarf, root, cuh_offset, strings, functions);
+    std::sort(functions.begin(), functions.end());
+
+    auto stmt = dynamic_cast<data4_form_reader_t*>(root->node_attributes[DW_AT_stmt_list]);
+    size_t ofs = stmt ? stmt->data : 0;
+    if (stmt && dwarf.debug_lines && dwarf.debug_lines->execute(ofs))
+    {
+        const std::vector<lineprogram_regs_t>& rows = dwarf.debug_lines->rows();
+        for (size_t i = 0; i + 1 < rows.size(); ++i)
+        {
+            if (rows[i].end_sequence || rows[i+1].address <= rows[i].address)
+                continue;
+
+            address_entry_t e;
+            e.low = rows[i].address;
+            e.high = rows[i+1].address;
+            e.file = strings.intern(dwarf.debug_lines->file_name(rows[i].file));
+            e.line = rows[i].line;
+            e.function = 0;
+
+            function_range_t key = { e.low, 0, 0 };
+            auto f = std::upper_bound(functions.begin(), functions.end(), key);
+            if (f != functions.begin() && e.low < (--f)->high)
+                e.function = f->name;
+
+            unit.entries.push_back(e);
+        }
+    }
+
+    dwarf.free_tree(root);
+    dwarf.root = 0;
+}
+
+void dwarf_address_index_t::merge(unit_t& unit)
+{
+    std::vector<uint32_t> remap(unit.strings.size());
+    for (size_t i = 0; i < unit.strings.size(); ++i)
+        remap[i] = intern(unit.strings[i]);
+
+    for (auto e : unit.entries)
+    {
+        e.file = remap[e.file];
+        e.function = remap[e.function];
+        entries.push_back(e);
+    }
+}
+
+void dwarf_address_index_t::build(elf_parser_t& elf, unsigned threads)
+{
+    // Parsers keep per unit state (abbreviation set, line program, DIE tree), so each worker gets its own.
+    std::vector<std::unique_ptr<dwarf_parser_t>> parsers;
+    parsers.emplace_back(new dwarf_parser_t(elf));
+    if (!parsers[0]->debug_info)
+        return;
+
+    std::vector<size_t> units = parsers[0]->compilation_units();
+    std::vector<unit_t> results(units.size());
+
+    threads = std::max(1U, std::min<unsigned>(threads, units.size()));
+    while (parsers.size() < threads)
+        parsers.emplace_back(new dwarf_parser_t(elf));
+
+    std::atomic<size_t> next_unit(0);
+    auto worker = [&](dwarf_parser_t* dwarf) {
+        for (size_t i = next_unit++; i < units.size(); i = next_unit++)
+            index_unit(*dwarf, units[i], results[i]);
+    };
+
+    std::vector<std::thread> pool;
+    for (unsigned t = 1; t < threads; ++t)
+        pool.emplace_back(worker, parsers[t].get());
+    worker(parsers[0].get());
+    for (auto& t : pool)
+        t.join();
+
+    for (auto& unit : results)
+        merge(unit);
+
+    std::sort(entries.begin(), entries.end(), [](const address_entry_t& a, const address_entry_t& b) {
+        return a.low < b.low;
+    });
+}
+
+bool dwarf_address_index_t::lookup(address_t addr, location_t& loc) const
+{
+    auto it = std::upper_bound(entries.begin(), entries.end(), addr, [](address_t a, const address_entry_t& e) {
+        return a < e.low;
+    });
+    if (it == entries.begin() || addr >= (--it)->high)
+        return false;
+
+    loc.function = it->function ? strings[it->function].c_str() : 0;
+    loc.file = strings[it->file].c_str();
+    loc.line = it->line;
+    return true;
+}
+
+std::vector<char> dwarf_address_index_t::serialise(const uint8_t* key, size_t key_size) const
+{
+    // Pack strings back to back, offset 0 is the empty string.
+    std::vector<uint32_t> offsets(strings.size());
+    std::vector<char> blob;
+    for (size_t i = 0; i < strings.size(); ++i)
+    {
+        offsets[i] = blob.size();
+        blob.insert(blob.end(), strings[i].begin(), strings[i].end());
+        blob.push_back(0);
+    }
+
+    // Adjacent rows differing only in address (e.g. several is_stmt rows of one line) collapse into one entry.
+    std::vector<line_cache::entry_t> packed;
+    for (auto& e : entries)
+    {
+        if (!packed.empty())
+        {
+            line_cache::entry_t& last = packed.back();
+            if (last.high == e.low && last.file == offsets[e.file] && last.function == offsets[e.function] && last.line == e.line)
+            {
+                last.high = e.high;
+                continue;
+            }
+        }
+        line_cache::entry_t out = { uint32_t(e.low), uint32_t(e.high), offsets[e.file], offsets[e.function], e.line };
+        packed.push_back(out);
+    }
+
+    line_cache::header_t header;
+    memset(&header, 0, sizeof(header));
+    header.magic = line_cache::MAGIC;
+    header.version = line_cache::VERSION;
+    header.key_size = std::min<size_t>(key_size, line_cache::MAX_KEY_SIZE);
+    memcpy(header.key, key, header.key_size);
+    header.entry_count = packed.size();
+    header.entries_offset = sizeof(header);
+    header.strings_size = blob.size();
+    header.strings_offset = header.entries_offset + packed.size() * sizeof(line_cache::entry_t);
+
+    std::vector<char> image(header.strings_offset + blob.size());
+    memcpy(&image[0], &header, sizeof(header));
+    if (!packed.empty())
+        memcpy(&image[header.entries_offset], &packed[0], packed.size() * sizeof(line_cache::entry_t));
+    memcpy(&image[header.strings_offset], &blob[0], blob.size());
+    return image;
+}
+
+size_t dwarf_address_index_t::cache_key(const elf_parser_t& elf, const char* data, size_t size, uint8_t (&key)[line_cache::MAX_KEY_SIZE])
+{
+    size_t id_size = 0;
+    const uint8_t* id = elf.build_id(&id_size);
+    if (id && id_size > 0)
+    {
+        id_size = std::min<size_t>(id_size, line_cache::MAX_KEY_SIZE);
+        memcpy(key, id, id_size);
+        return id_size;
+    }
+
+    // No build id, FNV-1a of the file contents.
+    uint64_t hash = 14695981039346656037ULL;
+    for (size_t i = 0; i < size; ++i)
+    {
+        hash ^= uint8_t(data[i]);
+        hash *= 1099511628211ULL;
+    }
+    memcpy(key, &hash, sizeof(hash));
+    return sizeof(hash);
+}
@@ -0,0 +1,72 @@
+//
+// Part of Metta OS. Check https://atta-metta.net for latest version.
+//
+// Copyright 2010 - 2017, Stanislav Karchebnyy <berkus@atta-metta.net>
+//
+// Distributed under the Boost Software License, Version 1.0.
+// (See file LICENSE_1_0.txt or a copy at http://www.boost.org/LICENSE_1_0.txt)
+//
+// Address to source location table built once from the whole of .debug_info and .debug_line,
+// so that any number of addresses can be resolved with a binary search each.
+//
+#pragma once
+
+#include "types.h"
+#include "elf_parser.h"
+#include "dwarf_parser.h"
+#include "line_cache.h"
+#include <vector>
+#include <string>
+#include <unordered_map>
+
+// One row of the line table: addresses [low, high) come from the given source line.
+struct address_entry_t
+{
+    address_t low;
+    address_t high;
+    uint32_t  file;     // index into string table
+    uint32_t  line;
+    uint32_t  function; // index into string table, 0 if no enclosing subprogram is known
+};
+
+class dwarf_address_index_t
+{
+public:
+    struct location_t
+    {
+        const char* function;
+        const char* file;
+        int line;
+    };
+
+    dwarf_address_index_t();
+
+    // Parse all compilation units of @a elf using up to @a threads worker threads.
+    void build(elf_parser_t& elf, unsigned threads);
+
+    bool lookup(address_t addr, location_t& loc) const;
+
+    inline size_t size() const { return entries.size(); }
+
+    // Produce a line cache image (see line_cache.h) tagged with @a key.
+    std::vector<char> serialise(const uint8_t* key, size_t key_size) const;
+
+    // Key identifying @a elf contents: its build id if present, otherwise a hash of the whole file.
+    static size_t cache_key(const elf_parser_t& elf, const char* data, size_t size, uint8_t (&key)[line_cache::MAX_KEY_SIZE]);
+
+private:
+    // Result of parsing one compilation unit, file and function fields index unit local strings.
+    struct unit_t
+    {
+        std::vector<address_entry_t> entries;
+        std::vector<std::string> strings;
+    };
+
+    static void index_unit(dwarf_parser_t& dwarf, size_t cuh_offset, unit_t& unit);
+    uint32_t intern(const std::string& str);
+    void merge(unit_t& unit);
+
+    std::vector<address_entry_t> entries; // sorted by low address
+    std::vector<std::string> strings;     // index 0 is the empty string
+    std::unordered_map<std::string, uint32_t> string_ids;
+};
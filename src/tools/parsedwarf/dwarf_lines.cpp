@@ -330,6 +330,13 @@ std::string dwarf_debug_lines_t::file_name(address_t address, address_t low_pc,
     return std::string();
 }
 
+std::string dwarf_debug_lines_t::file_name(int file) const
+{
+    if (file < 1 || size_t(file) > header.file_names.size())
+        return std::string();
+    return header.file_names[file-1].filename;
+}
+
 int dwarf_debug_lines_t::line_number(address_t address, address_t low_pc, address_t high_pc)
 {
     for (size_t i = 0; i < state_matrix.size()-1; ++i)
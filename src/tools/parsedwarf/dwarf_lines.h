@@ -157,4 +157,8 @@ public:
 
     std::string file_name(address_t address, address_t low_pc, address_t high_pc);
     int line_number(address_t address, address_t low_pc, address_t high_pc);
+
+    // Rows of the state matrix populated by the last execute().
+    inline const std::vector<lineprogram_regs_t>& rows() const { return state_matrix; }
+    std::string file_name(int file) const;
 };
@@ -17,7 +17,8 @@
 
 using namespace elf32; // FIXME: only elf32 is supported, will fail on x86-64
 
-dwarf_parser_t::dwarf_parser_t(elf_parser_t& elf) : elf_parser(elf), root(0)
+dwarf_parser_t::dwarf_parser_t(elf_parser_t& elf)
+    : elf_parser(elf), debug_info(0), debug_aranges(0), debug_abbrev(0), debug_lines(0), root(0)
 {
     section_header_t* h = elf_parser.section_header(".debug_aranges");
     section_header_t* b = elf_parser.section_header(".debug_abbrev");
@@ -28,7 +29,8 @@ dwarf_parser_t::dwarf_parser_t(elf_parser_t& elf) : elf_parser(elf), root(0)
     {
         debug_abbrev = new dwarf_debug_abbrev_t(elf_parser.start() + b->offset, b->size);
         debug_aranges = new dwarf_debug_aranges_t(elf_parser.start() + h->offset, h->size);
-        debug_lines = new dwarf_debug_lines_t(elf_parser.start() + l->offset, l->size);
+        if (l)
+            debug_lines = new dwarf_debug_lines_t(elf_parser.start() + l->offset, l->size);
         debug_info = new dwarf_debug_info_t(elf_parser.start() + g->offset, g->size, *debug_abbrev);
     }
 #if DWARF_DEBUG
@@ -77,6 +79,34 @@ die_t* dwarf_parser_t::build_tree(size_t& offset)
     return rootnode;
 }
 
+void dwarf_parser_t::free_tree(die_t* node)
+{
+    if (!node)
+        return;
+    for (size_t i = 0; i < node->children.size(); ++i)
+        free_tree(node->children[i]);
+    for (auto attr : node->node_attributes)
+        delete attr.second;
+    delete node;
+}
+
+std::vector<size_t> dwarf_parser_t::compilation_units()
+{
+    std::vector<size_t> units;
+    if (!debug_info)
+        return units;
+
+    size_t offset = 0;
+    while (offset < debug_info->size)
+    {
+        units.push_back(offset);
+        size_t next = offset;
+        cuh_t cuh = debug_info->get_cuh(next);
+        offset += cuh.unit_length + sizeof(cuh.unit_length);
+    }
+    return units;
+}
+
 void dwarf_parser_t::build_tree_recurse(die_t* thisnode, size_t& offset)
 {
     while (1)
@@ -175,8 +205,7 @@ bool dwarf_parser_t::lookup(address_t addr)
 
 die_t* dwarf_parser_t::find_named_node(die_t* node, size_t cuh_offset)
 {
-    auto name = dynamic_cast<strp_form_reader_t*>(node->node_attributes[DW_AT_name]);
-    if (name)
+    if (node->string_attr(DW_AT_name))
         return node;
 
     auto ref = dynamic_cast<ref4_form_reader_t*>(node->node_attributes[DW_AT_specification]);
@@ -38,8 +38,12 @@ public:
     bool lookup(address_t addr);
 
     die_t* build_tree(size_t& offset);
+    void free_tree(die_t* node);
     die_t* find_named_node(die_t* node, size_t cuh_offset);
 
+    // Offsets of all compilation unit headers in .debug_info.
+    std::vector<size_t> compilation_units();
+
 private:
     void build_tree_recurse(die_t* thisnode, size_t& offset);
 };
@@ -18,6 +18,7 @@ public:
     static form_reader_t* create(dwarf_parser_t& parser, uint32_t form); // factory
 
     form_reader_t(dwarf_parser_t& p) : parser(p) {}
+    virtual ~form_reader_t() {}
     virtual bool decode(address_t from, size_t& offset) = 0;
     virtual void print() = 0;
 
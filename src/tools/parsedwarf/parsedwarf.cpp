@@ -8,6 +8,9 @@
 //
 #include <stdlib.h>
 #include <stdexcept>
+#include <memory>
+#include <thread>
+#include <vector>
 #include "raiifile.h"
 #include "elf_parser.h"
 #include "leb128.h"
@@ -15,6 +18,8 @@
 #include "dwarf_aranges.h"
 #include "dwarf_abbrev.h"
 #include "dwarf_info.h"
+#include "dwarf_address_index.h"
+#include "line_cache.h"
 
 using namespace std;
 using namespace raii_wrapper;
@@ -36,69 +41,144 @@ void panic(const char* s)
     exit(-1);
 }
 
-int main(int argc, char** argv)
+/**
+ * Resolve every backtrace address found in metta format log @a logname.
+ */
+static void symbolise_log(const char* logname, const line_cache_t& cache)
 {
-    if (argc < 4)
-        throw runtime_error("usage: parsedwarf format logfile elf_with_debug\nformat = metta");
-
-    string format(argv[1]);
-
-    // Load binary file with debug info.
-    // TODO: use some sort of mmap()ed access to reduce memory usage.
-    file f(argv[3], fstream::in);
-    size_t fsize = f.size();
-    char* buffer = new char [fsize];
-    f.read(buffer, fsize);
-    address_t start = reinterpret_cast<address_t>(buffer);
-    elf_parser_t elf(start);
-    dwarf_parser_t dwarf(elf);
-
-    // start parsing the log file
-    if (format == string("metta"))
+    /*
+    *** Backtrace *** Tracing all stack frames:
+    | 0x0010380f
+    | 0x00103898
+    | 0x0010398e
+    | 0x00103ae1
+    | 0x0010343f
+    | 0x00103627
+    | 0x0010347b
+    | 0x001033d7
+    | 0x001032b6
+    | 0x001030b6
+    | 0x00102d7e
+    | 0x001029fe
+    */
+    string str;
+    ifstream input(logname, ios::in);
+    bool in_stack_dump = false;
+
+    while (getline(input, str))
     {
-        /*
-        *** Backtrace *** Tracing all stack frames:
-        | 0x0010380f
-        | 0x00103898
-        | 0x0010398e
-        | 0x00103ae1
-        | 0x0010343f
-        | 0x00103627
-        | 0x0010347b
-        | 0x001033d7
-        | 0x001032b6
-        | 0x001030b6
-        | 0x00102d7e // dwarf_parser_t bugs out on this and next line, FIXME
-        | 0x001029fe
-        */
-        string str;
-        ifstream input(argv[2], ios::in);
-        int line = 0;
-        bool in_stack_dump = false;
-
-        while (getline(input, str))
+        if (in_stack_dump)
         {
-            line++;
-
-            if (in_stack_dump)
+            if (str.find("| ") == 0)
             {
-                if (str.find("| ") == 0)
-                {
-                    address_t addr = strtoul(strmid(str, 2, 10).c_str(), NULL, 0);
-                    dwarf.lookup(addr);
-                }
+                address_t addr = strtoul(strmid(str, 2, 10).c_str(), NULL, 0);
+                const line_cache::entry_t* e = cache.find(addr);
+                if (e)
+                    printf("0x%08x %s (%s:%d)\n", (uint32_t)addr, *cache.string(e->function) ? cache.string(e->function) : "<unknown>", cache.string(e->file), e->line);
                 else
-                    in_stack_dump = false;
+                    printf("0x%08x <unresolved>\n", (uint32_t)addr);
             }
+            else
+                in_stack_dump = false;
+        }
+
+        if (str.find("*** Backtrace ***") == 0)
+        {
+            in_stack_dump = true;
+        }
+    }
+}
+
+/**
+ * Returns true if @a fname holds a line cache for ELF file with the given key.
+ */
+static bool cache_is_current(const char* fname, const uint8_t* key, size_t key_size)
+{
+    try {
+        mapped_file f(fname);
+        line_cache_t cache(f.data(), f.size());
+        return cache.is_valid() and cache.matches(key, key_size);
+    } catch(file_error&) {
+        return false;
+    }
+}
+
+int main(int argc, char** argv)
+{
+    unsigned threads = thread::hardware_concurrency();
+    const char* cache_name = 0;
+    int arg = 1;
+
+    while (argc - arg > 1 && argv[arg][0] == '-')
+    {
+        if (string(argv[arg]) == "-j")
+            threads = strtoul(argv[arg + 1], NULL, 0);
+        else if (string(argv[arg]) == "-c")
+            cache_name = argv[arg + 1];
+        else
+            break;
+        arg += 2;
+    }
+
+    if (argc - arg < 3)
+        throw runtime_error("usage: parsedwarf [-j threads] [-c cachefile] format logfile elf_with_debug [logfile...]\nformat = metta");
+
+    string format(argv[arg]);
+    if (format != string("metta"))
+        throw runtime_error("Invalid log format specified!");
+
+    // Map binary file with debug info, only the debug sections are ever touched.
+    mapped_file f(argv[arg + 2]);
+    elf_parser_t elf(reinterpret_cast<address_t>(f.data()));
+
+    uint8_t key[line_cache::MAX_KEY_SIZE];
+    size_t key_size = dwarf_address_index_t::cache_key(elf, f.data(), f.size(), key);
+
+    // Reuse the cache file if it was built from this very ELF, otherwise parse DWARF and (re)write it.
+    vector<char> image;
+    if (!cache_name || !cache_is_current(cache_name, key, key_size))
+    {
+        dwarf_address_index_t index;
+        index.build(elf, threads ? threads : 1);
+        image = index.serialise(key, key_size);
 
-            if (str.find("*** Backtrace ***") == 0)
+        if (cache_name)
+        {
+            string tmp_name = string(cache_name) + ".tmp";
             {
-                in_stack_dump = true;
+                file out(tmp_name, fstream::out | fstream::binary | fstream::trunc);
+                out.write(&image[0], image.size());
             }
+            if (rename(tmp_name.c_str(), cache_name) != 0)
+                throw runtime_error("Cannot write cache file!");
         }
     }
-    else
-        throw runtime_error("Invalid log format specified!");
+
+    // Either the freshly built image or the mapped cache file, lookups are the same binary search.
+    unique_ptr<mapped_file> cache_file;
+    const char* cache_data = image.empty() ? 0 : &image[0];
+    size_t cache_size = image.size();
+    if (image.empty())
+    {
+        cache_file.reset(new mapped_file(cache_name));
+        cache_data = cache_file->data();
+        cache_size = cache_file->size();
+    }
+    line_cache_t cache(cache_data, cache_size);
+    if (!cache.is_valid())
+        throw runtime_error("Invalid line cache!");
+
+    vector<const char*> logs;
+    logs.push_back(argv[arg + 1]);
+    for (int i = arg + 3; i < argc; ++i)
+        logs.push_back(argv[i]);
+
+    for (auto log : logs)
+    {
+        if (logs.size() > 1)
+            printf("==> %s <==\n", log);
+        symbolise_log(log, cache);
+    }
 
     return 0;
 }